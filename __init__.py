@@ -4,6 +4,10 @@ from .core import Compute
 from .core import SourceFile
 from .core import BuildStrategy
 from .core import BuildSpec
+from .core import BuildCache
+from .core import profiler
+from .scheduler import BuildScheduler
+from .scheduler import BuildTask
 
 from .core import UnsatisfiedDependencies
 from .core import BuildFailure
@@ -0,0 +1,221 @@
+/*
+Cache of parsed Gemfiles
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <pthread.h>
+
+#include "extension.h"
+#include "gemfile.h"
+
+/*
+ * Many of the Gemfiles we come across are byte-for-byte identical. We
+ * remember each parsed Gemfile, keyed on its content and on the context
+ * it was parsed in (ruby version, platforms and groups), because the
+ * context decides which gems get ignored.
+ *
+ * Entries keep a copy of the file content, so that a hash collision can
+ * never hand out the wrong Gemfile. Parsed Gemfiles are shared, and
+ * reference counted; both the cache and the reference counts may be
+ * used from several threads at once.
+ */
+#define BUNDLER_CACHE_BUCKETS	256
+#define BUNDLER_CACHE_MAX	1024
+
+struct bundler_cache_entry {
+	struct bundler_cache_entry *next;
+	unsigned long		hash;
+
+	char *			ctx_key;
+	char *			data;
+	size_t			len;
+
+	bundler_gemfile_t *	gemfile;
+};
+
+static pthread_mutex_t			bundler_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bundler_cache_entry *	bundler_cache[BUNDLER_CACHE_BUCKETS];
+static unsigned int			bundler_cache_count;
+
+/* FNV-1a */
+static unsigned long
+__bundler_cache_hash(unsigned long hash, const char *data, size_t len)
+{
+	while (len--) {
+		hash ^= (unsigned char) *data++;
+		hash *= 0x100000001b3UL;
+	}
+	return hash;
+}
+
+static unsigned long
+bundler_cache_hash(const char *ctx_key, const char *data, size_t len)
+{
+	unsigned long hash = 0xcbf29ce484222325UL;
+
+	hash = __bundler_cache_hash(hash, ctx_key, strlen(ctx_key));
+	return __bundler_cache_hash(hash, data, len);
+}
+
+static inline bool
+bundler_cache_entry_match(const struct bundler_cache_entry *entry, unsigned long hash,
+			const char *ctx_key, const char *data, size_t len)
+{
+	return entry->hash == hash
+	    && entry->len == len
+	    && !strcmp(entry->ctx_key, ctx_key)
+	    && !memcmp(entry->data, data, len);
+}
+
+static void
+bundler_cache_entry_free(struct bundler_cache_entry *entry)
+{
+	bundler_gemfile_release(entry->gemfile);
+	free(entry->ctx_key);
+	free(entry->data);
+	free(entry);
+}
+
+/*
+ * Unlink all entries from the cache. Must be called with the lock held.
+ */
+static struct bundler_cache_entry *
+__bundler_cache_detach(void)
+{
+	struct bundler_cache_entry *list = NULL, *entry;
+	unsigned int i;
+
+	for (i = 0; i < BUNDLER_CACHE_BUCKETS; ++i) {
+		while ((entry = bundler_cache[i]) != NULL) {
+			bundler_cache[i] = entry->next;
+			entry->next = list;
+			list = entry;
+		}
+	}
+	bundler_cache_count = 0;
+	return list;
+}
+
+/*
+ * Releasing the Gemfiles takes the lock, so this must be called without it
+ */
+static void
+__bundler_cache_free_list(struct bundler_cache_entry *list)
+{
+	struct bundler_cache_entry *entry;
+
+	while ((entry = list) != NULL) {
+		list = entry->next;
+		bundler_cache_entry_free(entry);
+	}
+}
+
+/*
+ * Returns a new reference to the Gemfile, or NULL
+ */
+bundler_gemfile_t *
+bundler_gemfile_cache_lookup(const char *ctx_key, const char *data, size_t len)
+{
+	unsigned long hash = bundler_cache_hash(ctx_key, data, len);
+	struct bundler_cache_entry *entry;
+	bundler_gemfile_t *gemf = NULL;
+
+	pthread_mutex_lock(&bundler_cache_lock);
+	for (entry = bundler_cache[hash % BUNDLER_CACHE_BUCKETS]; entry; entry = entry->next) {
+		if (bundler_cache_entry_match(entry, hash, ctx_key, data, len)) {
+			gemf = entry->gemfile;
+			gemf->refcount++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bundler_cache_lock);
+
+	return gemf;
+}
+
+void
+bundler_gemfile_cache_insert(const char *ctx_key, const char *data, size_t len, bundler_gemfile_t *gemf)
+{
+	unsigned long hash = bundler_cache_hash(ctx_key, data, len);
+	struct bundler_cache_entry *entry, **pos, *evicted = NULL;
+
+	pthread_mutex_lock(&bundler_cache_lock);
+
+	/* No need to be smart about this; just start over */
+	if (bundler_cache_count >= BUNDLER_CACHE_MAX)
+		evicted = __bundler_cache_detach();
+
+	/* Another thread may have parsed the same file in the meantime */
+	pos = &bundler_cache[hash % BUNDLER_CACHE_BUCKETS];
+	for (entry = *pos; entry; entry = entry->next) {
+		if (bundler_cache_entry_match(entry, hash, ctx_key, data, len))
+			goto out;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	entry->hash = hash;
+	entry->ctx_key = strdup(ctx_key);
+	entry->data = malloc(len + 1);
+	memcpy(entry->data, data, len);
+	entry->len = len;
+
+	entry->gemfile = gemf;
+	gemf->refcount++;
+
+	entry->next = *pos;
+	*pos = entry;
+	bundler_cache_count++;
+
+out:
+	pthread_mutex_unlock(&bundler_cache_lock);
+	__bundler_cache_free_list(evicted);
+}
+
+void
+bundler_gemfile_cache_clear(void)
+{
+	struct bundler_cache_entry *list;
+
+	pthread_mutex_lock(&bundler_cache_lock);
+	list = __bundler_cache_detach();
+	pthread_mutex_unlock(&bundler_cache_lock);
+
+	__bundler_cache_free_list(list);
+}
+
+bundler_gemfile_t *
+bundler_gemfile_hold(bundler_gemfile_t *gemf)
+{
+	pthread_mutex_lock(&bundler_cache_lock);
+	gemf->refcount++;
+	pthread_mutex_unlock(&bundler_cache_lock);
+	return gemf;
+}
+
+void
+bundler_gemfile_release(bundler_gemfile_t *gemf)
+{
+	unsigned int refcount;
+
+	pthread_mutex_lock(&bundler_cache_lock);
+	assert(gemf->refcount);
+	refcount = --(gemf->refcount);
+	pthread_mutex_unlock(&bundler_cache_lock);
+
+	if (refcount == 0)
+		bundler_gemfile_free(gemf);
+}
@@ -27,6 +27,13 @@ static PyObject	*	theModule = NULL;
  * Methods belonging to the module itself.
  */
 static PyMethodDef bundler_methods[] = {
+      {	"parse_many", (PyCFunction) bundler_ParseMany, METH_VARARGS | METH_KEYWORDS,
+	"Parse many Gemfiles in parallel"
+      },
+      {	"clear_cache", (PyCFunction) bundler_ClearCache, METH_VARARGS | METH_KEYWORDS,
+	"Discard all cached Gemfiles"
+      },
+
 	{ NULL }
 };
 
@@ -100,6 +107,7 @@ PyInit_bundler(void)
 
 	bundler_registerType(m, "Gemfile", &bundler_GemfileType);
 	bundler_registerType(m, "Context", &bundler_ContextType);
+	bundler_registerType(m, "Lockfile", &bundler_LockfileType);
 
 	theModule = m;
 	return m;
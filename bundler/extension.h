@@ -27,7 +27,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 extern PyTypeObject	bundler_GemfileType;
 extern PyTypeObject	bundler_ContextType;
+extern PyTypeObject	bundler_LockfileType;
 extern PyObject *       bundler_Exception(const char *fmt, ...);
+extern PyObject *	bundler_ParseMany(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *	bundler_ClearCache(PyObject *self, PyObject *args, PyObject *kwds);
 
 static inline void
 assign_string(char **var, const char *str)
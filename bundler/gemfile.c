@@ -16,6 +16,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "extension.h"
 #include "gemfile.h"
 
@@ -31,6 +34,12 @@ typedef struct bundler_Gemfile {
 	bundler_gemfile_t *	handle;
 } bundler_Gemfile;
 
+typedef struct bundler_Lockfile {
+	PyObject_HEAD
+
+	bundler_lockfile_t *	handle;
+} bundler_Lockfile;
+
 static void		Gemfile_dealloc(bundler_Gemfile *self);
 static PyObject *	Gemfile_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
 static int		Gemfile_init(bundler_Gemfile *self, PyObject *args, PyObject *kwds);
@@ -46,6 +55,16 @@ static int		Context_setattr(bundler_Context *self, char *name, PyObject *value);
 static PyObject *	Context_with_group(bundler_Context *self, PyObject *args, PyObject *kwds);
 static PyObject *	Context_without_group(bundler_Context *self, PyObject *args, PyObject *kwds);
 
+static void		Lockfile_dealloc(bundler_Lockfile *self);
+static int		Lockfile_init(bundler_Lockfile *self, PyObject *args, PyObject *kwds);
+static PyObject *	Lockfile_getattr(bundler_Lockfile *self, char *name);
+static PyObject *	Lockfile_sections(bundler_Lockfile *self, PyObject *args, PyObject *kwds);
+static PyObject *	Lockfile_specs(bundler_Lockfile *self, PyObject *args, PyObject *kwds);
+static PyObject *	Lockfile_spec(bundler_Lockfile *self, PyObject *args, PyObject *kwds);
+static PyObject *	Lockfile_dependencies(bundler_Lockfile *self, PyObject *args, PyObject *kwds);
+static PyObject *	Lockfile_entries(bundler_Lockfile *self, PyObject *args, PyObject *kwds);
+static PyObject *	Lockfile_attribute(bundler_Lockfile *self, PyObject *args, PyObject *kwds);
+
 
 /*
  * Define the python bindings of class "Gemfile"
@@ -141,7 +160,7 @@ static void
 Gemfile_dealloc(bundler_Gemfile *self)
 {
 	if (self->handle)
-		bundler_gemfile_free(self->handle);
+		bundler_gemfile_release(self->handle);
 	self->handle = NULL;
 }
 
@@ -334,3 +353,463 @@ Context_without_group(bundler_Context *self, PyObject *args, PyObject *kwds)
 	Py_RETURN_NONE;
 }
 
+/*
+ * Define the python bindings of class "Lockfile"
+ *
+ * Create objects using
+ *   lock = bundler.Lockfile(path)
+ *
+ * Specs are returned as (name, version, dependencies) tuples, where
+ * dependencies is a tuple of (name, requirement) pairs. version and
+ * requirement are the text inside the parentheses, or None.
+ */
+static PyMethodDef bundler_lockfileMethods[] = {
+      {	"sections", (PyCFunction) Lockfile_sections, METH_VARARGS | METH_KEYWORDS,
+	"Return the names of all sections"
+      },
+      {	"specs", (PyCFunction) Lockfile_specs, METH_VARARGS | METH_KEYWORDS,
+	"Return the specs of all sections of the given name (default: all sections)"
+      },
+      {	"spec", (PyCFunction) Lockfile_spec, METH_VARARGS | METH_KEYWORDS,
+	"Look up a spec by name"
+      },
+      {	"dependencies", (PyCFunction) Lockfile_dependencies, METH_VARARGS | METH_KEYWORDS,
+	"Return the entries of the DEPENDENCIES section"
+      },
+      {	"entries", (PyCFunction) Lockfile_entries, METH_VARARGS | METH_KEYWORDS,
+	"Return the entries of a section, like PLATFORMS"
+      },
+      {	"attribute", (PyCFunction) Lockfile_attribute, METH_VARARGS | METH_KEYWORDS,
+	"Return an attribute of a section, like GEM remote"
+      },
+
+      {	NULL }
+};
+
+PyTypeObject bundler_LockfileType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+
+	.tp_name	= "bundler.Lockfile",
+	.tp_basicsize	= sizeof(bundler_Lockfile),
+	.tp_flags	= Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc		= "Bundler Gemfile.lock",
+
+	.tp_methods	= bundler_lockfileMethods,
+	.tp_init	= (initproc) Lockfile_init,
+	.tp_new		= PyType_GenericNew,
+	.tp_dealloc	= (destructor) Lockfile_dealloc,
+
+	.tp_getattr	= (getattrfunc) Lockfile_getattr,
+};
+
+static int
+Lockfile_init(bundler_Lockfile *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"path", NULL};
+	gemfile_parse_error_t *parse_err = NULL;
+	char *path;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path))
+		return -1;
+
+	if (self->handle)
+		bundler_lockfile_free(self->handle);
+
+	self->handle = bundler_lockfile_parse(path, &parse_err);
+	if (self->handle == NULL) {
+		if (parse_err == NULL) {
+			PyErr_SetString(PyExc_ValueError, "Failed to parse Gemfile.lock");
+		} else {
+			PyErr_Format(PyExc_SyntaxError,
+					"Failed to parse Gemfile.lock: %s", parse_err->lines[0]);
+			PyErr_SyntaxLocation(parse_err->filename, parse_err->lineno);
+
+			gemfile_parse_error_free(parse_err);
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+Lockfile_dealloc(bundler_Lockfile *self)
+{
+	if (self->handle)
+		bundler_lockfile_free(self->handle);
+	self->handle = NULL;
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static inline bool
+__Lockfile_check(bundler_Lockfile *self)
+{
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Lockfile object not initialized");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *
+__Lockfile_deps_to_python(const bundler_lock_dep_t *deps, unsigned int count)
+{
+	PyObject *result;
+	unsigned int i;
+
+	if (!(result = PyTuple_New(count)))
+		return NULL;
+
+	for (i = 0; i < count; ++i) {
+		PyObject *item;
+
+		item = Py_BuildValue("(sz)", deps[i].name, deps[i].requirement);
+		if (item == NULL) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(result, i, item);
+	}
+
+	return result;
+}
+
+static PyObject *
+__Lockfile_spec_to_python(const bundler_lockfile_t *lock, const bundler_lock_spec_t *spec)
+{
+	PyObject *deps;
+
+	if (!(deps = __Lockfile_deps_to_python(lock->deps.value + spec->first_dep, spec->ndeps)))
+		return NULL;
+	return Py_BuildValue("(szN)", spec->name, spec->version, deps);
+}
+
+static PyObject *
+Lockfile_getattr(bundler_Lockfile *self, char *name)
+{
+	if (self->handle && !strcmp(name, "bundler_version")) {
+		const bundler_lock_section_t *section;
+		const bundler_lockfile_t *lock = self->handle;
+
+		section = bundler_lockfile_find_section(lock, "BUNDLED WITH");
+		if (section == NULL || section->nentries == 0)
+			Py_RETURN_NONE;
+		return PyUnicode_FromString(lock->entries.value[section->first_entry].name);
+	}
+
+	return PyObject_GenericGetAttr((PyObject *) self, PyUnicode_FromString(name));
+}
+
+static PyObject *
+Lockfile_sections(bundler_Lockfile *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {NULL};
+	const bundler_lockfile_t *lock;
+	PyObject *result;
+	unsigned int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist) || !__Lockfile_check(self))
+		return NULL;
+
+	lock = self->handle;
+	result = PyTuple_New(lock->sections.count);
+	for (i = 0; result && i < lock->sections.count; ++i)
+		PyTuple_SET_ITEM(result, i, PyUnicode_FromString(lock->sections.value[i].name));
+	return result;
+}
+
+static PyObject *
+Lockfile_specs(bundler_Lockfile *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"section", NULL};
+	const bundler_lockfile_t *lock;
+	const char *name = NULL;
+	PyObject *result;
+	unsigned int i, j;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z", kwlist, &name) || !__Lockfile_check(self))
+		return NULL;
+
+	lock = self->handle;
+	if (!(result = PyList_New(0)))
+		return NULL;
+
+	for (i = 0; i < lock->sections.count; ++i) {
+		const bundler_lock_section_t *section = &lock->sections.value[i];
+
+		if (name && strcmp(section->name, name))
+			continue;
+
+		for (j = 0; j < section->nspecs; ++j) {
+			PyObject *item;
+			int rv;
+
+			if (!(item = __Lockfile_spec_to_python(lock, &lock->specs.value[section->first_spec + j]))) {
+				Py_DECREF(result);
+				return NULL;
+			}
+			rv = PyList_Append(result, item);
+			Py_DECREF(item);
+			if (rv < 0) {
+				Py_DECREF(result);
+				return NULL;
+			}
+		}
+	}
+
+	return result;
+}
+
+static PyObject *
+Lockfile_spec(bundler_Lockfile *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"name", NULL};
+	const bundler_lock_spec_t *spec;
+	const char *name;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name) || !__Lockfile_check(self))
+		return NULL;
+
+	if (!(spec = bundler_lockfile_find_spec(self->handle, name)))
+		Py_RETURN_NONE;
+	return __Lockfile_spec_to_python(self->handle, spec);
+}
+
+static PyObject *
+__Lockfile_section_entries(bundler_Lockfile *self, const char *name)
+{
+	const bundler_lock_section_t *section;
+	const bundler_lockfile_t *lock = self->handle;
+
+	if (!(section = bundler_lockfile_find_section(lock, name)))
+		return PyTuple_New(0);
+	return __Lockfile_deps_to_python(lock->entries.value + section->first_entry, section->nentries);
+}
+
+static PyObject *
+Lockfile_dependencies(bundler_Lockfile *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist) || !__Lockfile_check(self))
+		return NULL;
+
+	return __Lockfile_section_entries(self, "DEPENDENCIES");
+}
+
+static PyObject *
+Lockfile_entries(bundler_Lockfile *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"section", NULL};
+	const char *name;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name) || !__Lockfile_check(self))
+		return NULL;
+
+	return __Lockfile_section_entries(self, name);
+}
+
+static PyObject *
+Lockfile_attribute(bundler_Lockfile *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"section", "key", NULL};
+	const bundler_lock_section_t *section;
+	const char *name, *key;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss", kwlist, &name, &key) || !__Lockfile_check(self))
+		return NULL;
+
+	if (!(section = bundler_lockfile_find_section(self->handle, name)))
+		Py_RETURN_NONE;
+	return return_string_or_none(bundler_lockfile_get_attr(self->handle, section, key));
+}
+
+
+/*
+ * bundler.parse_many(paths, context = None, threads = 0) -> list
+ *
+ * Parse many Gemfiles on a pool of threads, without holding the GIL.
+ * Without a context, a default one (any ruby version, default group
+ * only) is used.
+ * Returns a list of Gemfile objects, in the order of the paths given.
+ * Gemfiles that cannot be parsed show up as None; the reason is printed
+ * to stderr. threads=0 uses one thread per CPU.
+ */
+#define BUNDLER_PARSE_MAX_THREADS	64
+
+struct bundler_parse_item {
+	char *			path;
+	bundler_gemfile_t *	gemfile;
+	gemfile_parse_error_t *	error;
+};
+
+typedef struct {
+	pthread_mutex_t		mutex;
+	bundler_context_t *	ctx;
+
+	unsigned int		next;
+	unsigned int		nitems;
+	struct bundler_parse_item *items;
+} bundler_parse_batch_t;
+
+static void *
+__bundler_parse_worker(void *arg)
+{
+	bundler_parse_batch_t *batch = arg;
+
+	while (true) {
+		struct bundler_parse_item *item;
+
+		pthread_mutex_lock(&batch->mutex);
+		if (batch->next >= batch->nitems) {
+			pthread_mutex_unlock(&batch->mutex);
+			break;
+		}
+		item = &batch->items[batch->next++];
+		pthread_mutex_unlock(&batch->mutex);
+
+		item->gemfile = bundler_gemfile_parse(item->path, batch->ctx, &item->error);
+	}
+
+	return NULL;
+}
+
+static PyObject *
+__bundler_parse_item_to_python(struct bundler_parse_item *item)
+{
+	bundler_Gemfile *gemObj;
+
+	if (item->gemfile == NULL) {
+		gemfile_parse_error_t *perr = item->error;
+
+		if (perr != NULL && perr->nlines)
+			fprintf(stderr, "%s:%u: %s", perr->filename, perr->lineno, perr->lines[0]);
+		else
+			fprintf(stderr, "%s: failed to parse gemfile\n", item->path);
+		Py_RETURN_NONE;
+	}
+
+	gemObj = (bundler_Gemfile *) Gemfile_new(&bundler_GemfileType, NULL, NULL);
+	if (gemObj == NULL)
+		return NULL;
+
+	gemObj->handle = item->gemfile;
+	item->gemfile = NULL;
+	return (PyObject *) gemObj;
+}
+
+PyObject *
+bundler_ParseMany(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"paths", "context", "threads", NULL};
+	PyObject *paths, *contextObj = NULL, *seq, *result = NULL;
+	pthread_t workers[BUNDLER_PARSE_MAX_THREADS];
+	unsigned int threads = 0, nthreads, i;
+	bundler_context_t *default_ctx = NULL;
+	bundler_parse_batch_t batch;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OI", kwlist, &paths, &contextObj, &threads))
+		return NULL;
+
+	memset(&batch, 0, sizeof(batch));
+	if (contextObj == NULL || contextObj == Py_None) {
+		batch.ctx = default_ctx = bundler_context_new(NULL);
+	} else if (contextObj->ob_type == &bundler_ContextType) {
+		batch.ctx = ((bundler_Context *) contextObj)->handle;
+	} else {
+		PyErr_SetString(PyExc_TypeError, "bundler: context must be a bundler.Context");
+		return NULL;
+	}
+
+	if (!(seq = PySequence_Fast(paths, "bundler: paths must be a sequence of strings"))) {
+		if (default_ctx)
+			bundler_context_free(default_ctx);
+		return NULL;
+	}
+
+	batch.nitems = PySequence_Fast_GET_SIZE(seq);
+	batch.items = calloc(batch.nitems + 1, sizeof(batch.items[0]));
+	for (i = 0; i < batch.nitems; ++i) {
+		const char *path;
+
+		if (!(path = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i))))
+			goto out;
+		batch.items[i].path = strdup(path);
+	}
+
+	if (threads == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = (ncpus > 0)? ncpus : 1;
+	}
+	nthreads = threads;
+	if (nthreads > BUNDLER_PARSE_MAX_THREADS)
+		nthreads = BUNDLER_PARSE_MAX_THREADS;
+	if (nthreads > batch.nitems)
+		nthreads = batch.nitems;
+
+	pthread_mutex_init(&batch.mutex, NULL);
+
+	Py_BEGIN_ALLOW_THREADS
+	/* The calling thread parses, too, so we need one worker less */
+	for (i = 0; i + 1 < nthreads; ++i) {
+		if (pthread_create(&workers[i], NULL, __bundler_parse_worker, &batch) != 0)
+			break;
+	}
+	nthreads = i;
+
+	__bundler_parse_worker(&batch);
+
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(workers[i], NULL);
+	Py_END_ALLOW_THREADS
+
+	pthread_mutex_destroy(&batch.mutex);
+
+	if (!(result = PyList_New(batch.nitems)))
+		goto out;
+
+	for (i = 0; i < batch.nitems; ++i) {
+		PyObject *obj;
+
+		if (!(obj = __bundler_parse_item_to_python(&batch.items[i]))) {
+			drop_object(&result);
+			break;
+		}
+		PyList_SET_ITEM(result, i, obj);
+	}
+
+out:
+	for (i = 0; i < batch.nitems; ++i) {
+		struct bundler_parse_item *item = &batch.items[i];
+
+		if (item->gemfile)
+			bundler_gemfile_release(item->gemfile);
+		if (item->error)
+			gemfile_parse_error_free(item->error);
+		drop_string(&item->path);
+	}
+	free(batch.items);
+	Py_DECREF(seq);
+	if (default_ctx)
+		bundler_context_free(default_ctx);
+	return result;
+}
+
+/*
+ * bundler.clear_cache()
+ *
+ * Forget about all Gemfiles parsed so far.
+ */
+PyObject *
+bundler_ClearCache(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	bundler_gemfile_cache_clear();
+	Py_RETURN_NONE;
+}
@@ -20,12 +20,38 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 typedef struct bundler_context		bundler_context_t;
 
-#define STRING_ARRAY_MAX		16
+/*
+ * All arrays below grow on demand; count is the number of elements
+ * in use, size the number of elements allocated.
+ */
 typedef struct {
-	unsigned int			count;
-	char *				value[STRING_ARRAY_MAX];
+	unsigned int			count, size;
+	char **				value;
 } string_array_t;
 
+/*
+ * Make room for one more element in any of these arrays
+ */
+#define bundler_array_tailroom(array) \
+	((array)->value = __bundler_array_tailroom((array)->value, &(array)->size, (array)->count, sizeof((array)->value[0])))
+
+extern void *		__bundler_array_tailroom(void *values, unsigned int *size, unsigned int count, size_t elem_size);
+extern void		string_array_append(string_array_t *array, const char *value);
+extern void		string_array_destroy(string_array_t *array);
+
+/*
+ * The content of a file, mapped or read into memory. There is always
+ * a NUL byte at data[len].
+ */
+typedef struct {
+	const char *			data;
+	size_t				len;
+	bool				mapped;
+} bundler_file_t;
+
+extern bool		bundler_file_load(bundler_file_t *file, const char *path);
+extern void		bundler_file_unload(bundler_file_t *file);
+
 enum {
 	VALUE_T_BOOL,
 	VALUE_T_SYMBOL,
@@ -36,10 +62,9 @@ enum {
 
 typedef struct bundler_value  bundler_value_t;
 
-#define VALUE_ARRAY_MAX			64
 typedef struct {
-	unsigned int			count;
-	bundler_value_t *		value[VALUE_ARRAY_MAX];
+	unsigned int			count, size;
+	bundler_value_t **		value;
 } bundler_value_array_t;
 
 
@@ -59,10 +84,9 @@ typedef struct {
 	bundler_value_t *		value;
 } bundler_ivar_t;
 
-#define BUNDLER_IVAR_ARRAY_MAX		16
 typedef struct {
-	unsigned int			count;
-	bundler_ivar_t			value[BUNDLER_IVAR_ARRAY_MAX];
+	unsigned int			count, size;
+	bundler_ivar_t *		value;
 } bundler_ivar_array_t;
 
 typedef struct bundler_object_vtable	bundler_object_vtable_t;
@@ -77,10 +101,9 @@ struct bundler_object_vtable {
 	void				(*string_argument)(bundler_object_instance_t *, const char *);
 };
 
-#define BUNDLER_INSTANCE_ARRAY_MAX	64
 typedef struct {
-	unsigned int			count;
-	bundler_object_instance_t *	value[BUNDLER_INSTANCE_ARRAY_MAX];
+	unsigned int			count, size;
+	bundler_object_instance_t **	value;
 } bundler_instance_array_t;
 
 typedef struct {
@@ -97,19 +120,74 @@ typedef struct {
 	bundler_object_instance_t	base;
 } bundler_gemspec_t;
 
-#define BUNDLER_GEM_ARRAY_MAX		64
 typedef struct {
-	unsigned int			count;
-	bundler_gem_t			value[BUNDLER_GEM_ARRAY_MAX];
-} bundler_gem_array_t;
+	unsigned int			refcount;
 
-typedef struct {
 	char *				source;
 	char *				ruby_version;
 	bundler_instance_array_t	gems;
 	bundler_instance_array_t	gemspecs;
+
+	/* Set if the result depends on more than the Gemfile itself
+	 * (eg because of eval_gemfile) */
+	bool				nocache;
 } bundler_gemfile_t;
 
+/*
+ * Gemfile.lock, as parsed by bundler_lockfile_parse(). All specs and
+ * dependencies live in flat arrays; sections and specs refer to them
+ * by index range.
+ */
+typedef struct {
+	char *				name;
+	char *				requirement;	/* text inside the parentheses, or NULL */
+} bundler_lock_dep_t;
+
+typedef struct {
+	char *				name;
+	char *				version;	/* text inside the parentheses, or NULL */
+	unsigned int			section;
+	unsigned int			first_dep, ndeps;
+	int				next_same_name;	/* next spec of the same name, or -1 */
+} bundler_lock_spec_t;
+
+typedef struct {
+	char *				key;
+	char *				value;
+} bundler_lock_attr_t;
+
+typedef struct {
+	char *				name;		/* GEM, PATH, DEPENDENCIES, BUNDLED WITH, ... */
+	unsigned int			first_attr, nattrs;	/* remote:, revision:, ... */
+	unsigned int			first_spec, nspecs;
+	unsigned int			first_entry, nentries;	/* any other lines */
+} bundler_lock_section_t;
+
+typedef struct {
+	char *				filename;
+
+	struct {
+		unsigned int		count, size;
+		bundler_lock_section_t *value;
+	} sections;
+	struct {
+		unsigned int		count, size;
+		bundler_lock_attr_t *	value;
+	} attrs;
+	struct {
+		unsigned int		count, size;
+		bundler_lock_spec_t *	value;
+	} specs;
+	struct {
+		unsigned int		count, size;
+		bundler_lock_dep_t *	value;
+	} deps, entries;
+
+	/* Open addressing table of spec indices + 1, hashed by name */
+	unsigned int			index_size;
+	unsigned int *			index;
+} bundler_lockfile_t;
+
 typedef struct {
 	char *				filename;
 	unsigned int			lineno;
@@ -131,6 +209,12 @@ extern bundler_gemfile_t *bundler_gemfile_parse(const char *path, bundler_contex
 extern void		bundler_gemfile_set_source(bundler_gemfile_t *gemf, const char *value);
 extern bundler_gemspec_t *bundler_gemfile_add_gemspec(bundler_gemfile_t *gemf);
 extern void		bundler_gemfile_free(bundler_gemfile_t *);
+extern bundler_gemfile_t *bundler_gemfile_hold(bundler_gemfile_t *);
+extern void		bundler_gemfile_release(bundler_gemfile_t *);
+extern bundler_gemfile_t *bundler_gemfile_cache_lookup(const char *ctx_key, const char *data, size_t len);
+extern void		bundler_gemfile_cache_insert(const char *ctx_key, const char *data, size_t len,
+					bundler_gemfile_t *);
+extern void		bundler_gemfile_cache_clear(void);
 extern void		bundler_gemfile_show(bundler_gemfile_t *);
 extern const char *	bundler_value_print(const bundler_value_t *v);
 extern void		bundler_value_release(bundler_value_t *v);
@@ -138,6 +222,18 @@ extern const char *	bundler_gem_as_requirement(bundler_gem_t *gem);
 
 extern const char *	string_array_print(const string_array_t *array);
 
+extern bundler_lockfile_t *bundler_lockfile_parse(const char *path, gemfile_parse_error_t **err_ret);
+extern void		bundler_lockfile_free(bundler_lockfile_t *);
+extern const bundler_lock_section_t *bundler_lockfile_find_section(const bundler_lockfile_t *, const char *name);
+extern const bundler_lock_spec_t *bundler_lockfile_find_spec(const bundler_lockfile_t *, const char *name);
+extern const char *	bundler_lockfile_get_attr(const bundler_lockfile_t *, const bundler_lock_section_t *,
+					const char *key);
+
+extern gemfile_parse_error_t *gemfile_parse_error_new(const char *filename, unsigned int lineno, unsigned int nlines);
+extern void		gemfile_parse_error_vprintf(gemfile_parse_error_t *perr, const char *fmt, va_list ap);
+extern void		gemfile_parse_error_printf(gemfile_parse_error_t *perr, const char *fmt, ...);
+extern void		gemfile_parse_error_show_line(gemfile_parse_error_t *perr, const char *line,
+					unsigned int len, unsigned int column);
 extern void		gemfile_parse_error_free(gemfile_parse_error_t *);
 
 #endif /* GEMFILE_H */
@@ -0,0 +1,424 @@
+/*
+A parser for Gemfile.lock
+
+The format is line based, and structured by indentation:
+
+GEM
+  remote: https://rubygems.org/
+  specs:
+    actionpack (7.0.4)
+      rack (~> 2.0, >= 2.2.0)
+
+DEPENDENCIES
+  rails (~> 7.0)
+
+BUNDLED WITH
+   2.3.26
+
+Unindented lines start a section. Indented lines are "key: value"
+attributes of the section, or plain entries. An attribute named specs:
+starts a list of specs, which in turn may have dependencies indented
+below them.
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "extension.h"
+#include "gemfile.h"
+
+typedef struct {
+	const char *		filename;
+	bundler_file_t		file;
+	const char *		pos;		/* start of the next line */
+
+	unsigned int		lineno;
+	const char *		line;
+	const char *		line_end;
+
+	gemfile_parse_error_t *	error;
+} lockfile_parser_state;
+
+static void
+lockfile_parser_error(lockfile_parser_state *ps, const char *where, const char *fmt, ...)
+{
+	gemfile_parse_error_t *perr;
+	va_list ap;
+
+	if (ps->error != NULL)
+		return;
+
+	perr = gemfile_parse_error_new(ps->filename, ps->lineno, 8);
+
+	va_start(ap, fmt);
+	gemfile_parse_error_vprintf(perr, fmt, ap);
+	va_end(ap);
+
+	gemfile_parse_error_show_line(perr, ps->line, ps->line_end - ps->line, where - ps->line);
+	ps->error = perr;
+}
+
+static bool
+lockfile_parser_next_line(lockfile_parser_state *ps)
+{
+	const char *buffer_end = ps->file.data + ps->file.len;
+
+	if (ps->pos >= buffer_end)
+		return false;
+
+	ps->line = ps->pos;
+	ps->line_end = ps->line + strcspn(ps->line, "\r\n");
+
+	ps->pos = memchr(ps->line_end, '\n', buffer_end - ps->line_end);
+	if (ps->pos == NULL)
+		ps->pos = buffer_end;
+	else
+		ps->pos += 1;
+
+	ps->lineno += 1;
+	return true;
+}
+
+/*
+ * Parse "name (requirement)" into name and requirement. The requirement
+ * may be missing.
+ */
+static bool
+lockfile_parser_dep(lockfile_parser_state *ps, const char *s, const char *end, bundler_lock_dep_t *dep)
+{
+	const char *paren, *name_end;
+
+	paren = memchr(s, '(', end - s);
+	if (paren == NULL) {
+		dep->name = strndup(s, end - s);
+		dep->requirement = NULL;
+		return true;
+	}
+
+	if (end[-1] != ')') {
+		lockfile_parser_error(ps, end, "Missing closing parenthesis\n");
+		return false;
+	}
+
+	for (name_end = paren; name_end > s && name_end[-1] == ' '; --name_end)
+		;
+	if (name_end == s) {
+		lockfile_parser_error(ps, s, "Missing name\n");
+		return false;
+	}
+
+	dep->name = strndup(s, name_end - s);
+	dep->requirement = strndup(paren + 1, end - paren - 2);
+	return true;
+}
+
+/*
+ * Returns the length of the "key:" prefix, or 0 if the line is not an attribute.
+ */
+static unsigned int
+lockfile_parser_attr_key(const char *s, const char *end)
+{
+	const char *p;
+
+	for (p = s; p < end && (islower(*p) || *p == '_'); ++p)
+		;
+
+	if (p == s || p >= end || *p != ':')
+		return 0;
+	if (p + 1 < end && p[1] != ' ')
+		return 0;
+	return p - s;
+}
+
+static unsigned int
+bundler_lockfile_hash(const char *name)
+{
+	unsigned int hash = 5381;
+	int c;
+
+	while ((c = *name++) != '\0')
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash;
+}
+
+static void
+bundler_lockfile_build_index(bundler_lockfile_t *lock)
+{
+	unsigned int i;
+
+	lock->index_size = 16;
+	while (lock->index_size < 2 * lock->specs.count)
+		lock->index_size *= 2;
+	lock->index = calloc(lock->index_size, sizeof(lock->index[0]));
+
+	for (i = 0; i < lock->specs.count; ++i) {
+		bundler_lock_spec_t *spec = &lock->specs.value[i];
+		unsigned int slot;
+
+		slot = bundler_lockfile_hash(spec->name) & (lock->index_size - 1);
+		while (lock->index[slot]) {
+			bundler_lock_spec_t *other = &lock->specs.value[lock->index[slot] - 1];
+
+			if (!strcmp(other->name, spec->name)) {
+				while (other->next_same_name >= 0)
+					other = &lock->specs.value[other->next_same_name];
+				other->next_same_name = i;
+				break;
+			}
+			slot = (slot + 1) & (lock->index_size - 1);
+		}
+
+		if (lock->index[slot] == 0)
+			lock->index[slot] = i + 1;
+	}
+}
+
+static bool
+lockfile_parser_process(bundler_lockfile_t *lock, lockfile_parser_state *ps)
+{
+	bundler_lock_section_t *section = NULL;
+	bundler_lock_spec_t *spec = NULL;
+	unsigned int specs_indent = 0, spec_indent = 0;
+	bool in_specs = false;
+
+	while (lockfile_parser_next_line(ps)) {
+		const char *s = ps->line, *end = ps->line_end;
+		unsigned int indent, keylen;
+
+		while (s < end && *s == ' ')
+			++s;
+		while (end > s && end[-1] == ' ')
+			--end;
+		if (s == end)
+			continue;
+
+		indent = s - ps->line;
+		if (indent == 0) {
+			bundler_array_tailroom(&lock->sections);
+			section = &lock->sections.value[lock->sections.count++];
+			memset(section, 0, sizeof(*section));
+			section->name = strndup(s, end - s);
+			section->first_attr = lock->attrs.count;
+			section->first_spec = lock->specs.count;
+			section->first_entry = lock->entries.count;
+
+			in_specs = false;
+			spec = NULL;
+			continue;
+		}
+
+		if (section == NULL) {
+			lockfile_parser_error(ps, s, "Indented line outside of any section\n");
+			return false;
+		}
+
+		if (in_specs && indent > specs_indent) {
+			if (spec_indent == 0)
+				spec_indent = indent;
+
+			if (indent <= spec_indent) {
+				bundler_lock_dep_t parsed;
+
+				if (!lockfile_parser_dep(ps, s, end, &parsed))
+					return false;
+
+				bundler_array_tailroom(&lock->specs);
+				spec = &lock->specs.value[lock->specs.count++];
+				spec->name = parsed.name;
+				spec->version = parsed.requirement;
+				spec->section = lock->sections.count - 1;
+				spec->first_dep = lock->deps.count;
+				spec->ndeps = 0;
+				spec->next_same_name = -1;
+				section->nspecs++;
+			} else {
+				bundler_lock_dep_t *dep;
+
+				if (spec == NULL) {
+					lockfile_parser_error(ps, s, "Dependency without a spec\n");
+					return false;
+				}
+
+				bundler_array_tailroom(&lock->deps);
+				dep = &lock->deps.value[lock->deps.count];
+				if (!lockfile_parser_dep(ps, s, end, dep))
+					return false;
+				lock->deps.count++;
+				spec->ndeps++;
+			}
+			continue;
+		}
+
+		in_specs = false;
+		spec = NULL;
+
+		if ((keylen = lockfile_parser_attr_key(s, end)) != 0) {
+			bundler_lock_attr_t *attr;
+			const char *value = s + keylen + 1;
+
+			if (keylen == 5 && !strncmp(s, "specs", 5)) {
+				in_specs = true;
+				specs_indent = indent;
+				spec_indent = 0;
+				continue;
+			}
+
+			while (value < end && *value == ' ')
+				++value;
+
+			bundler_array_tailroom(&lock->attrs);
+			attr = &lock->attrs.value[lock->attrs.count++];
+			attr->key = strndup(s, keylen);
+			attr->value = strndup(value, end - value);
+			section->nattrs++;
+		} else {
+			bundler_lock_dep_t *entry;
+
+			bundler_array_tailroom(&lock->entries);
+			entry = &lock->entries.value[lock->entries.count];
+			if (!lockfile_parser_dep(ps, s, end, entry))
+				return false;
+			lock->entries.count++;
+			section->nentries++;
+		}
+	}
+
+	return true;
+}
+
+bundler_lockfile_t *
+bundler_lockfile_parse(const char *path, gemfile_parse_error_t **err_ret)
+{
+	lockfile_parser_state parser;
+	bundler_lockfile_t *lock;
+
+	memset(&parser, 0, sizeof(parser));
+	parser.filename = path;
+	if (!bundler_file_load(&parser.file, path))
+		return NULL;
+	parser.pos = parser.file.data;
+
+	lock = calloc(1, sizeof(*lock));
+	lock->filename = strdup(path);
+
+	if (!lockfile_parser_process(lock, &parser)) {
+		if (err_ret) {
+			*err_ret = parser.error;
+			parser.error = NULL;
+		}
+		bundler_lockfile_free(lock);
+		lock = NULL;
+	} else {
+		bundler_lockfile_build_index(lock);
+	}
+
+	if (parser.error)
+		gemfile_parse_error_free(parser.error);
+	bundler_file_unload(&parser.file);
+	return lock;
+}
+
+static void
+bundler_lock_dep_destroy(bundler_lock_dep_t *dep)
+{
+	drop_string(&dep->name);
+	drop_string(&dep->requirement);
+}
+
+void
+bundler_lockfile_free(bundler_lockfile_t *lock)
+{
+	unsigned int i;
+
+	for (i = 0; i < lock->sections.count; ++i)
+		drop_string(&lock->sections.value[i].name);
+	free(lock->sections.value);
+
+	for (i = 0; i < lock->attrs.count; ++i) {
+		drop_string(&lock->attrs.value[i].key);
+		drop_string(&lock->attrs.value[i].value);
+	}
+	free(lock->attrs.value);
+
+	for (i = 0; i < lock->specs.count; ++i) {
+		drop_string(&lock->specs.value[i].name);
+		drop_string(&lock->specs.value[i].version);
+	}
+	free(lock->specs.value);
+
+	for (i = 0; i < lock->deps.count; ++i)
+		bundler_lock_dep_destroy(&lock->deps.value[i]);
+	free(lock->deps.value);
+
+	for (i = 0; i < lock->entries.count; ++i)
+		bundler_lock_dep_destroy(&lock->entries.value[i]);
+	free(lock->entries.value);
+
+	free(lock->index);
+	drop_string(&lock->filename);
+	free(lock);
+}
+
+/*
+ * Returns the first section of the given name
+ */
+const bundler_lock_section_t *
+bundler_lockfile_find_section(const bundler_lockfile_t *lock, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < lock->sections.count; ++i) {
+		if (!strcmp(lock->sections.value[i].name, name))
+			return &lock->sections.value[i];
+	}
+	return NULL;
+}
+
+/*
+ * Returns the first spec of the given name. Use next_same_name to
+ * find others (eg for different platforms).
+ */
+const bundler_lock_spec_t *
+bundler_lockfile_find_spec(const bundler_lockfile_t *lock, const char *name)
+{
+	unsigned int slot;
+
+	if (lock->index == NULL)
+		return NULL;
+
+	slot = bundler_lockfile_hash(name) & (lock->index_size - 1);
+	while (lock->index[slot]) {
+		const bundler_lock_spec_t *spec = &lock->specs.value[lock->index[slot] - 1];
+
+		if (!strcmp(spec->name, name))
+			return spec;
+		slot = (slot + 1) & (lock->index_size - 1);
+	}
+	return NULL;
+}
+
+const char *
+bundler_lockfile_get_attr(const bundler_lockfile_t *lock, const bundler_lock_section_t *section, const char *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < section->nattrs; ++i) {
+		const bundler_lock_attr_t *attr = &lock->attrs.value[section->first_attr + i];
+
+		if (!strcmp(attr->key, key))
+			return attr->value;
+	}
+	return NULL;
+}
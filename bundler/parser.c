@@ -25,7 +25,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libgen.h>	// for dirname
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "extension.h"
 #include "gemfile.h"
@@ -115,21 +119,30 @@ typedef struct gemfile_context_attrs {
 
 typedef struct {
 	const char *	filename;
-	FILE *		file;
 	unsigned int	lineno;
 	bundler_context_t *bundler_ctx;
 
 	gemfile_parse_error_t *error;
 
-	char		linebuf[1024];
-	char *		next;
+	/* The entire file, either mapped or read into memory. There is
+	 * always a NUL byte at buffer_end. We never modify the buffer;
+	 * lines are delimited by line and line_end */
+	bundler_file_t	file;
+	const char *	buffer;
+	const char *	buffer_end;
+
+	const char *	pos;			/* start of the next line */
+	const char *	line;			/* current line */
+	const char *	line_end;
+	const char *	next;			/* current position in line */
 
 	int		next_token;		/* for token pushback */
 
 	int		current_token;		/* the token we just returned */
 	int		previous_token;		/* the token we returned before */
 
-	char		token_value[1024];
+	char *		token_value;
+	unsigned int	token_len, token_size;
 
 	bool		debug;
 
@@ -150,7 +163,7 @@ struct block_context;
 static inline bool
 __gemfile_parser_at_eol(gemfile_parser_state *ps)
 {
-	return ps->next && *(ps->next) == '\0';
+	return ps->next && ps->next >= ps->line_end;
 }
 
 static unsigned int	gemfile_parser_skip_whitespace(gemfile_parser_state *ps);
@@ -169,19 +182,127 @@ static bool		__bundler_gemfile_eval(bundler_gemfile_t *gemf, const char *path,
 				gemfile_parse_error_t **err_ret);
 
 static void
-gemfile_parser_init(gemfile_parser_state *ps, const char *filename, FILE *fp, bundler_context_t *ctx)
+gemfile_parser_init(gemfile_parser_state *ps, const char *filename, bundler_context_t *ctx)
 {
 	memset(ps, 0, sizeof(*ps));
 	ps->filename = filename;
-	ps->file = fp;
 	ps->next_token = -1;
 	ps->bundler_ctx = ctx;
 }
 
+static char *
+__bundler_file_read(int fd, size_t size, size_t *len_ret)
+{
+	size_t len = 0;
+	char *buffer;
+	ssize_t n;
+
+	/* size is just a hint; fstat reports 0 for pipes etc */
+	size += 1;
+	buffer = malloc(size);
+
+	while (buffer != NULL) {
+		if (len + 1 >= size) {
+			size *= 2;
+			buffer = realloc(buffer, size);
+			continue;
+		}
+
+		n = read(fd, buffer + len, size - len - 1);
+		if (n < 0) {
+			free(buffer);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	if (buffer != NULL)
+		buffer[len] = '\0';
+	*len_ret = len;
+	return buffer;
+}
+
+/*
+ * Load the entire file into memory. If the file size is not a multiple
+ * of the page size, we can simply map it, because the kernel zero-fills
+ * the remainder of the last page, which gives us a terminating NUL byte
+ * for free. Otherwise, read it.
+ */
+bool
+bundler_file_load(bundler_file_t *file, const char *path)
+{
+	struct stat stb;
+	int fd;
+
+	memset(file, 0, sizeof(*file));
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Unable to open %s: %m\n", path);
+		return false;
+	}
+
+	if (fstat(fd, &stb) < 0) {
+		fprintf(stderr, "Unable to stat %s: %m\n", path);
+		close(fd);
+		return false;
+	}
+
+	if (S_ISREG(stb.st_mode) && stb.st_size % sysconf(_SC_PAGESIZE)) {
+		void *addr;
+
+		addr = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+			file->data = addr;
+			file->len = stb.st_size;
+			file->mapped = true;
+		}
+	}
+
+	if (file->data == NULL) {
+		file->data = __bundler_file_read(fd, stb.st_size, &file->len);
+		if (file->data == NULL) {
+			fprintf(stderr, "Unable to read %s: %m\n", path);
+			close(fd);
+			return false;
+		}
+	}
+
+	close(fd);
+	return true;
+}
+
+void
+bundler_file_unload(bundler_file_t *file)
+{
+	if (file->mapped)
+		munmap((void *) file->data, file->len);
+	else
+		free((void *) file->data);
+	memset(file, 0, sizeof(*file));
+}
+
+static bool
+gemfile_parser_open(gemfile_parser_state *ps, const char *path)
+{
+	if (!bundler_file_load(&ps->file, path))
+		return false;
+
+	ps->buffer = ps->file.data;
+	ps->buffer_end = ps->buffer + ps->file.len;
+	ps->pos = ps->buffer;
+	return true;
+}
+
 static void
 gemfile_parser_destroy(gemfile_parser_state *ps)
 {
-	fclose(ps->file);
+	bundler_file_unload(&ps->file);
+	ps->buffer = ps->buffer_end = NULL;
+
+	drop_string(&ps->token_value);
+
 	if (ps->error) {
 		gemfile_parse_error_free(ps->error);
 		ps->error = NULL;
@@ -214,7 +335,7 @@ gemfile_parser_debug(gemfile_parser_state *ps, const char *fmt, ...)
 	va_end(ap);
 }
 
-static gemfile_parse_error_t *
+gemfile_parse_error_t *
 gemfile_parse_error_new(const char *filename, unsigned int lineno, unsigned int nlines)
 {
 	gemfile_parse_error_t *perr;
@@ -235,7 +356,7 @@ gemfile_parse_error_free(gemfile_parse_error_t *perr)
 	free(perr);
 }
 
-static void
+void
 gemfile_parse_error_vprintf(gemfile_parse_error_t *perr, const char *fmt, va_list ap)
 {
 	char buffer[1024];
@@ -245,7 +366,7 @@ gemfile_parse_error_vprintf(gemfile_parse_error_t *perr, const char *fmt, va_lis
 	perr->lines[perr->nlines++] = strdup(buffer);
 }
 
-static void
+void
 gemfile_parse_error_printf(gemfile_parse_error_t *perr, const char *fmt, ...)
 {
 	va_list ap;
@@ -255,6 +376,21 @@ gemfile_parse_error_printf(gemfile_parse_error_t *perr, const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * Quote the offending line, and point at the column where things went wrong
+ */
+void
+gemfile_parse_error_show_line(gemfile_parse_error_t *perr, const char *line, unsigned int len, unsigned int column)
+{
+	if (column > len)
+		column = len;
+
+	gemfile_parse_error_printf(perr, "%.*s\n", len, line);
+	gemfile_parse_error_printf(perr, "%*.*s^--- here\n",
+			column, column,
+			"");
+}
+
 static void
 gemfile_parser_error(gemfile_parser_state *ps, const char *fmt, ...)
 {
@@ -272,32 +408,49 @@ gemfile_parser_error(gemfile_parser_state *ps, const char *fmt, ...)
 	gemfile_parse_error_vprintf(perr, fmt, ap);
 	va_end(ap);
 
-	if (ps->linebuf[0]) {
-		unsigned int len, max_len;
+	if (ps->line != NULL) {
+		unsigned int column = ps->line_end - ps->line;
 
-		if (ps->next == NULL)
-			len = sizeof(ps->linebuf);
-		else
-			len = ps->next - ps->linebuf;
+		if (ps->next != NULL && ps->next < ps->line_end)
+			column = ps->next - ps->line;
+		gemfile_parse_error_show_line(perr, ps->line, ps->line_end - ps->line, column);
+	}
 
-		max_len = strlen(ps->linebuf);
-		if (len > max_len)
-			len = max_len;
+	ps->error = perr;
+}
 
-		gemfile_parse_error_printf(perr, "%s\n", ps->linebuf);
-		gemfile_parse_error_printf(perr, "%*.*s^--- here\n",
-				len, len,
-				"");
+static void
+__gemfile_parser_token_reserve(gemfile_parser_state *ps, unsigned int len)
+{
+	if (len + 1 <= ps->token_size)
+		return;
+
+	if (ps->token_size == 0)
+		ps->token_size = 64;
+	while (len + 1 > ps->token_size)
+		ps->token_size *= 2;
+
+	ps->token_value = realloc(ps->token_value, ps->token_size);
+	if (ps->token_value == NULL) {
+		fprintf(stderr, "bundler: out of memory\n");
+		abort();
 	}
+}
 
-	ps->error = perr;
+static void
+__gemfile_parser_token_set(gemfile_parser_state *ps, const char *s, unsigned int len)
+{
+	__gemfile_parser_token_reserve(ps, len);
+	memcpy(ps->token_value, s, len);
+	ps->token_value[len] = '\0';
+	ps->token_len = len;
 }
 
 static int
 gemfile_parser_next_token(gemfile_parser_state *ps, char **value_p)
 {
+	const char *s, *start;
 	int token;
-	char *s;
 
 	ps->previous_token = ps->current_token;
 	ps->current_token = -1;
@@ -311,7 +464,7 @@ gemfile_parser_next_token(gemfile_parser_state *ps, char **value_p)
 
 	gemfile_parser_skip_whitespace(ps);
 
-	memset(ps->token_value, 0, sizeof(ps->token_value));
+	__gemfile_parser_token_set(ps, "", 0);
 	if (__gemfile_parser_at_eol(ps)) {
 		ps->next = NULL;
 		if (!ps->ignore_eol) {
@@ -324,16 +477,22 @@ gemfile_parser_next_token(gemfile_parser_state *ps, char **value_p)
 	while (ps->next == NULL) {
 		unsigned int indent;
 
-		ps->linebuf[0] = '\0';
-
-		if (fgets(ps->linebuf, sizeof(ps->linebuf), ps->file) == NULL) {
+		if (ps->pos >= ps->buffer_end) {
+			ps->line = NULL;
 			ps->current_token = GEMFILE_T_EOF;
 			return GEMFILE_T_EOF;
 		}
 
-		ps->linebuf[strcspn(ps->linebuf, "\r\n")] = '\0';
+		ps->line = ps->pos;
+		ps->line_end = ps->line + strcspn(ps->line, "\r\n");
 
-		ps->next = ps->linebuf;
+		ps->pos = memchr(ps->line_end, '\n', ps->buffer_end - ps->line_end);
+		if (ps->pos == NULL)
+			ps->pos = ps->buffer_end;
+		else
+			ps->pos += 1;
+
+		ps->next = ps->line;
 		ps->lineno += 1;
 
 		indent = gemfile_parser_skip_whitespace(ps);
@@ -353,36 +512,32 @@ gemfile_parser_next_token(gemfile_parser_state *ps, char **value_p)
 
 	s = ps->next;
 	if (isalpha(*s)) {
-		unsigned int i = 0;
-
-		while (isalnum(*s) || *s == '_' || *s == '.')
-			ps->token_value[i++] = *s++;
+		for (start = s; isalnum(*s) || *s == '_' || *s == '.'; ++s)
+			;
+		__gemfile_parser_token_set(ps, start, s - start);
 
 		token = GEMFILE_T_IDENTIFIER;
 		ps->next = s;
 	} else
 	if (*s == '\'' || *s == '"') {
-		char cc, quote_cc = *s++;
-		unsigned int i = 0;
+		char quote_cc = *s++;
 
-		while ((cc = *s++) != quote_cc) {
-			if (cc == '\0') {
+		for (start = s; *s != quote_cc; ++s) {
+			if (s >= ps->line_end) {
 				gemfile_parser_error(ps, "Premature end of string\n");
 				ps->current_token = GEMFILE_T_ERROR;
 				return GEMFILE_T_ERROR;
 			}
-			ps->token_value[i++] = cc;
 		}
+		__gemfile_parser_token_set(ps, start, s - start);
 
 		token = GEMFILE_T_STRING;
-		ps->next = s;
+		ps->next = s + 1;
 	} else
 	if (*s == ':' && isalpha(s[1])) {
-		unsigned int i = 0;
-
-		s += 1;
-		while (isalnum(*s) || *s == '_')
-			ps->token_value[i++] = *s++;
+		for (start = ++s; isalnum(*s) || *s == '_'; ++s)
+			;
+		__gemfile_parser_token_set(ps, start, s - start);
 
 		token = GEMFILE_T_SYMBOL;
 		ps->next = s;
@@ -417,9 +572,9 @@ gemfile_parser_next_character(gemfile_parser_state *ps)
 static inline void
 __gemfile_parser_consume(gemfile_parser_state *ps)
 {
-	int i = strlen(ps->token_value); /* ugly */
-
-	ps->token_value[i] = *(ps->next)++;
+	__gemfile_parser_token_reserve(ps, ps->token_len + 1);
+	ps->token_value[ps->token_len++] = *(ps->next)++;
+	ps->token_value[ps->token_len] = '\0';
 }
 
 int
@@ -468,16 +623,17 @@ unsigned int
 gemfile_parser_skip_whitespace(gemfile_parser_state *ps)
 {
 	unsigned int count = 0;
-	char *s;
+	const char *s;
 
 	if (ps->next == NULL)
 		return 0;
 
-	for (s = ps->next; *s && isspace(*s); ++s, ++count)
+	for (s = ps->next; s < ps->line_end && isspace(*s); ++s, ++count)
 		;
 
-	if (*s == '#')
-		*s = '\0';
+	/* Skip comments */
+	if (s < ps->line_end && *s == '#')
+		s = ps->line_end;
 
 	ps->next = s;
 	return count;
@@ -506,20 +662,44 @@ gemfile_parser_get_attr(gemfile_parser_state *ps, const char *key)
 	return NULL;
 }
 
-static void
+/*
+ * Make room for one more element in one of our arrays.
+ * Usage: array->value = __bundler_array_tailroom(array->value, &array->size, array->count, sizeof(array->value[0]))
+ */
+void *
+__bundler_array_tailroom(void *values, unsigned int *size, unsigned int count, size_t elem_size)
+{
+	if (count < *size)
+		return values;
+
+	if (*size == 0)
+		*size = 4;
+	else
+		*size *= 2;
+
+	values = realloc(values, *size * elem_size);
+	if (values == NULL) {
+		fprintf(stderr, "bundler: out of memory\n");
+		abort();
+	}
+	return values;
+}
+
+void
 string_array_destroy(string_array_t *array)
 {
 	unsigned int i;
 
 	for (i = 0; i < array->count; ++i)
 		drop_string(&array->value[i]);
+	free(array->value);
 	memset(array, 0, sizeof(*array));
 }
 
-static void
+void
 string_array_append(string_array_t *array, const char *value)
 {
-	assert(array->count < STRING_ARRAY_MAX);
+	bundler_array_tailroom(array);
 	array->value[array->count++] = strdup(value);
 }
 
@@ -575,7 +755,7 @@ __string_array_print(const string_array_t *array, char *buffer, size_t buffer_si
 const char *
 string_array_print(const string_array_t *array)
 {
-	static char buffer[256];
+	static __thread char buffer[256];
 
 	memset(buffer, 0, sizeof(buffer));
 	return __string_array_print(array, buffer, sizeof(buffer));
@@ -598,17 +778,22 @@ bundler_ivar_array_destroy(bundler_ivar_array_t *array)
 
 	for (i = 0; i < array->count; ++i)
 		bundler_ivar_destroy(&array->value[i]);
+	free(array->value);
 	memset(array, 0, sizeof(*array));
 }
 
+/*
+ * Note that the pointer returned is only good until the next call
+ */
 static bundler_ivar_t *
 bundler_ivar_array_extend(bundler_ivar_array_t *array)
 {
-	assert(array->count < BUNDLER_IVAR_ARRAY_MAX);
+	bundler_ivar_t *ivar;
 
-	if (array->count >= BUNDLER_IVAR_ARRAY_MAX)
-		return NULL;
-	return &array->value[array->count++];
+	bundler_array_tailroom(array);
+	ivar = &array->value[array->count++];
+	memset(ivar, 0, sizeof(*ivar));
+	return ivar;
 }
 
 static void
@@ -649,8 +834,7 @@ bundler_object_instance_free(bundler_object_instance_t *obj)
 static void
 bundler_instance_array_append(bundler_instance_array_t *array, bundler_object_instance_t *item)
 {
-	assert(array->count < BUNDLER_INSTANCE_ARRAY_MAX);
-
+	bundler_array_tailroom(array);
 	array->value[array->count++] = item;
 }
 
@@ -663,7 +847,8 @@ bundler_instance_array_destroy(bundler_instance_array_t *array)
 		bundler_object_instance_free(array->value[i]);
 		array->value[i] = NULL;
 	}
-	array->count = 0;
+	free(array->value);
+	memset(array, 0, sizeof(*array));
 }
 
 static void
@@ -713,7 +898,7 @@ bundler_gem_set_source(bundler_gem_t *gem, const char *source)
 const char *
 bundler_gem_as_requirement(bundler_gem_t *gem)
 {
-	static char buffer[256];
+	static __thread char buffer[256];
 	const char *req_string;
 
 	req_string = string_array_print(&gem->dependency);
@@ -829,7 +1014,11 @@ bundler_gem_apply_context(bundler_gem_t *gem, bundler_context_t *ctx)
 static bundler_gemfile_t *
 bundler_gemfile_new(void)
 {
-	return calloc(1, sizeof(bundler_gemfile_t));
+	bundler_gemfile_t *gemf;
+
+	gemf = calloc(1, sizeof(*gemf));
+	gemf->refcount = 1;
+	return gemf;
 }
 
 void
@@ -1075,6 +1264,9 @@ gemfile_parser_process_include(bundler_gemfile_t *gemf, gemfile_parser_state *ps
 
 	gemfile_parser_debug(ps, "Including gemfile \"%s\"\n", string);
 
+	/* The cache only knows about the content of the toplevel Gemfile */
+	gemf->nocache = true;
+
 	if (string[0] != '/') {
 		char *orig_filename;
 
@@ -1199,7 +1391,7 @@ gemfile_parser_process_platform(bundler_gemfile_t *gemf, gemfile_parser_state *p
 static bool
 bundler_value_array_append(bundler_value_array_t *array, bundler_value_t *v)
 {
-	assert(array->count < VALUE_ARRAY_MAX);
+	bundler_array_tailroom(array);
 	array->value[array->count++] = v;
 	return true;
 }
@@ -1247,6 +1439,7 @@ bundler_value_array_destroy(bundler_value_array_t *array)
 
 	for (i = 0; i < array->count; ++i)
 		bundler_value_release(array->value[i]);
+	free(array->value);
 	memset(array, 0, sizeof(*array));
 }
 
@@ -1314,7 +1507,7 @@ __bundler_value_print(const bundler_value_t *v, char *buffer, size_t size)
 const char *
 bundler_value_print(const bundler_value_t *v)
 {
-	static char buffer[1024];
+	static __thread char buffer[1024];
 
 	return __bundler_value_print(v, buffer, sizeof(buffer));
 }
@@ -1658,12 +1851,12 @@ bundler_context_new(const char *ruby_version)
 void
 bundler_context_set_ruby_version(bundler_context_t *ctx, const char *ruby_version)
 {
-	char short_version[128];
+	char short_version[64];
 	char platform[128];
 	unsigned int i = 0;
 	const char *s;
 
-	assert(strlen(ruby_version) < 64);
+	assert(ruby_version == NULL || strlen(ruby_version) < 64);
 
 	assign_string(&ctx->ruby_version, ruby_version);
 	string_array_destroy(&ctx->platforms);
@@ -1770,49 +1963,122 @@ bundler_context_free(bundler_context_t *ctx)
 	free(ctx);
 }
 
-bool
-__bundler_gemfile_eval(bundler_gemfile_t *gemf, const char *path, bundler_context_t *ctx,
-				unsigned int nesting, gemfile_parse_error_t **err_ret)
+/*
+ * Everything in the context that affects the outcome of a parse,
+ * as a string to be used as (part of) the cache key.
+ */
+static char *
+bundler_context_cache_key(const bundler_context_t *ctx)
 {
-	gemfile_parser_state parser;
-	FILE *fp;
-	bool rv;
+	const string_array_t *arrays[3];
+	unsigned int i, j;
+	size_t len = 0, pos;
+	char *key;
 
-	if ((fp = fopen(path, "r")) == NULL) {
-		// return bundler_parse_error(error_msg_p, "Unable to open %s: %m", path);
-		fprintf(stderr, "Unable to open %s: %m\n", path);
-		return false;
+	if (ctx == NULL)
+		return strdup("");
+
+	arrays[0] = &ctx->platforms;
+	arrays[1] = &ctx->with_groups;
+	arrays[2] = &ctx->without_groups;
+
+	len = (ctx->ruby_version? strlen(ctx->ruby_version) : 0) + 2;
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < arrays[i]->count; ++j)
+			len += strlen(arrays[i]->value[j]) + 1;
+		len += 1;
+	}
+
+	key = malloc(len);
+	pos = snprintf(key, len, "%s\n", ctx->ruby_version? : "");
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < arrays[i]->count; ++j)
+			pos += snprintf(key + pos, len - pos, "%s,", arrays[i]->value[j]);
+		pos += snprintf(key + pos, len - pos, "\n");
 	}
 
-	gemfile_parser_init(&parser, path, fp, ctx);
-	parser.nesting = nesting;
-	parser.debug = ctx->debug;
+	return key;
+}
+
+static bool
+__bundler_gemfile_process(bundler_gemfile_t *gemf, gemfile_parser_state *ps,
+				unsigned int nesting, gemfile_parse_error_t **err_ret)
+{
+	bool rv;
+
+	ps->nesting = nesting;
+	ps->debug = ps->bundler_ctx && ps->bundler_ctx->debug;
 
-	rv = gemfile_parser_process_toplevel(gemf, &parser);
+	rv = gemfile_parser_process_toplevel(gemf, ps);
 
-	gemfile_parser_debug(&parser, "Successfully parsed file\n");
+	gemfile_parser_debug(ps, "Successfully parsed file\n");
 
 	if (!rv && err_ret)
-		*err_ret = gemfile_parser_get_error(&parser);
+		*err_ret = gemfile_parser_get_error(ps);
+
+	return rv;
+}
 
+bool
+__bundler_gemfile_eval(bundler_gemfile_t *gemf, const char *path, bundler_context_t *ctx,
+				unsigned int nesting, gemfile_parse_error_t **err_ret)
+{
+	gemfile_parser_state parser;
+	bool rv;
+
+	gemfile_parser_init(&parser, path, ctx);
+	if (!gemfile_parser_open(&parser, path))
+		return false;
+
+	rv = __bundler_gemfile_process(gemf, &parser, nesting, err_ret);
 	gemfile_parser_destroy(&parser);
 
 	return rv;
 }
 
+/*
+ * Parse the Gemfile, or return the result of an earlier parse of
+ * the same content in an equivalent context. Either way, the caller
+ * must drop the Gemfile with bundler_gemfile_release().
+ */
 bundler_gemfile_t *
 bundler_gemfile_parse(const char *path, bundler_context_t *ctx, gemfile_parse_error_t **err_ret)
 {
+	gemfile_parser_state parser;
 	bundler_gemfile_t *gemf;
+	char *ctx_key = NULL;
+	size_t len;
+
+	gemfile_parser_init(&parser, path, ctx);
+	if (!gemfile_parser_open(&parser, path))
+		return NULL;
+
+	len = parser.buffer_end - parser.buffer;
+
+	/* Do not hide the debug output */
+	if (ctx == NULL || !ctx->debug) {
+		ctx_key = bundler_context_cache_key(ctx);
+
+		gemf = bundler_gemfile_cache_lookup(ctx_key, parser.buffer, len);
+		if (gemf != NULL)
+			goto out;
+	}
 
 	gemf = bundler_gemfile_new();
 
-	if (!__bundler_gemfile_eval(gemf, path, ctx, 0, err_ret)) {
+	if (!__bundler_gemfile_process(gemf, &parser, 0, err_ret)) {
 		/* set error_msg_p to something useful */
-		bundler_gemfile_free(gemf);
-		return NULL;
+		bundler_gemfile_release(gemf);
+		gemf = NULL;
+		goto out;
 	}
 
+	if (ctx_key && !gemf->nocache)
+		bundler_gemfile_cache_insert(ctx_key, parser.buffer, len, gemf);
+
+out:
+	gemfile_parser_destroy(&parser);
+	free(ctx_key);
 	return gemf;
 }
 
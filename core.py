@@ -53,6 +53,205 @@ def popen(cmd, mode = 'r'):
 	__pre_command()
 	return os.popen(cmd, mode)
 
+# Wall clock time spent in the interesting phases of a run, for --profile.
+# Unless enabled, phase() hands out a context manager that does nothing,
+# so the call sites can stay in place.
+class ProfilerPhase(object):
+	def __init__(self, profiler, name):
+		self.profiler = profiler
+		self.name = name
+		self.start = None
+
+	def __enter__(self):
+		import time
+
+		self.start = time.time()
+		return self
+
+	def __exit__(self, *exc):
+		import time
+
+		self.profiler.add(self.name, self.start, time.time())
+		return False
+
+class NullProfilerPhase(object):
+	def __enter__(self):
+		return self
+
+	def __exit__(self, *exc):
+		return False
+
+class Profiler(object):
+	_null_phase = NullProfilerPhase()
+
+	def __init__(self):
+		self.enabled = False
+		self.start = None
+
+		# Each event is (phase, start, end, build_id)
+		self.events = []
+		self.builds = dict()
+		self.build_id = None
+
+		# marshal48.stats() of the child processes
+		self.child_stats = []
+
+	def enable(self):
+		import time
+
+		self.enabled = True
+		self.start = time.time()
+
+	def phase(self, name):
+		if not self.enabled:
+			return self._null_phase
+		return ProfilerPhase(self, name)
+
+	def add(self, name, start, end):
+		self.events.append((name, start, end, self.build_id))
+
+	# The scheduler calls these for every build it runs. Unless the build
+	# runs in a child process, phases recorded in between are attributed
+	# to that build.
+	def build_started(self, build_id, pid = None):
+		import time
+
+		if not self.enabled:
+			return
+
+		self.builds[build_id] = {"pid": pid or os.getpid(), "start": time.time(), "end": None, "exit_code": None}
+		if pid is None:
+			self.build_id = build_id
+
+	def build_finished(self, build_id, exit_code):
+		import time
+
+		if not self.enabled:
+			return
+
+		self.builds[build_id].update(end = time.time(), exit_code = exit_code)
+		self.build_id = None
+
+	# Builds that run in a child process write their events to a file,
+	# which the parent picks up once the child is gone. The parent has
+	# everything up to the fork already, and tracks start and end of the
+	# build itself.
+	def forked(self, build_id):
+		if not self.enabled:
+			return
+
+		self.events = []
+		self.child_stats = []
+		self.build_id = build_id
+
+		try:
+			import minibuild.marshal48
+
+			minibuild.marshal48.stats(reset = True)
+		except ImportError:
+			pass
+
+	def save_events(self, path):
+		import json
+
+		if not self.enabled:
+			return
+
+		with open(path, "w") as f:
+			json.dump({"events": self.events, "marshal48": self._marshal48_stats()}, f)
+
+	def merge_events(self, path):
+		import json
+
+		if not self.enabled or not os.path.exists(path):
+			return
+
+		with open(path) as f:
+			d = json.load(f)
+		os.remove(path)
+
+		self.events += [tuple(ev) for ev in d["events"]]
+		self.child_stats.append(d["marshal48"])
+
+	def _marshal48_stats(self):
+		try:
+			import minibuild.marshal48
+
+			return minibuild.marshal48.stats()
+		except ImportError:
+			return None
+
+	# Add up the numbers in two dicts of the shape marshal48.stats() returns
+	@staticmethod
+	def _add_stats(a, b):
+		if a is None:
+			return b
+		if b is None:
+			return a
+
+		result = dict(a)
+		for key, value in b.items():
+			if key not in result:
+				result[key] = value
+			elif isinstance(value, dict):
+				result[key] = Profiler._add_stats(result[key], value)
+			elif key != "hit_rate":
+				result[key] += value
+
+		if "lookups" in result:
+			result["hit_rate"] = result["hits"] / result["lookups"] if result["lookups"] else 0
+		return result
+
+	def report(self, command):
+		import time
+
+		now = time.time()
+
+		def rel(t):
+			if t is None:
+				return None
+			return round(t - self.start, 6)
+
+		phases = dict()
+		for name, start, end, build_id in self.events:
+			ph = phases.setdefault(name, {"count": 0, "time": 0})
+			ph["count"] += 1
+			ph["time"] += end - start
+
+		builds = []
+		for build_id, b in self.builds.items():
+			events = sorted((ev for ev in self.events if ev[3] == build_id), key = lambda ev: ev[1])
+			builds.append({
+				"id": build_id,
+				"pid": b["pid"],
+				"start": rel(b["start"]),
+				"end": rel(b["end"]),
+				"exit_code": b["exit_code"],
+				"phases": [{"phase": ev[0], "start": rel(ev[1]), "end": rel(ev[2])} for ev in events],
+			})
+		builds.sort(key = lambda b: b["start"])
+
+		stats = self._marshal48_stats()
+		for child in self.child_stats:
+			stats = self._add_stats(stats, child)
+
+		return {
+			"command": command,
+			"wall_time": round(now - self.start, 6),
+			"phases": phases,
+			"builds": builds,
+			"marshal48": stats,
+		}
+
+	def write(self, path, command):
+		import json
+
+		with open(path, "w") as f:
+			json.dump(self.report(command), f, indent = 2)
+			f.write("\n")
+
+profiler = Profiler()
+
 class Object(object):
 	def mni(self):
 		import sys
@@ -377,11 +576,101 @@ class HTTPPackageIndex(PackageIndex):
 	def process_package_info(self, name, http_resp):
 		self.mni()
 
-# For now, this is a very trivial downloader.
-# This could be something much more complex that uses caches, OBS, yadda yadda
+# Keep-alive HTTP(S) connections, pooled per host, for use by several
+# threads at once. Proxies are taken from the environment, as urllib
+# would do.
+class HTTPConnectionPool(object):
+	def __init__(self, timeout = 60):
+		import threading
+		import urllib.request
+
+		self.timeout = timeout
+		self.proxies = urllib.request.getproxies()
+		self.idle = dict()
+		self.lock = threading.Lock()
+
+	def _connect(self, parsed_url):
+		import http.client
+		import urllib.parse
+		import urllib.request
+
+		conn_class = http.client.HTTPConnection
+		if parsed_url.scheme == 'https':
+			conn_class = http.client.HTTPSConnection
+
+		proxy = self.proxies.get(parsed_url.scheme)
+		if proxy and not urllib.request.proxy_bypass(parsed_url.hostname):
+			proxy = urllib.parse.urlparse(proxy)
+			if parsed_url.scheme == 'https':
+				conn = conn_class(proxy.hostname, proxy.port, timeout = self.timeout)
+				conn.set_tunnel(parsed_url.hostname, parsed_url.port)
+				return conn, False
+
+			# Plain http requests go to the proxy, with the full URL
+			conn = http.client.HTTPConnection(proxy.hostname, proxy.port, timeout = self.timeout)
+			return conn, True
+
+		return conn_class(parsed_url.hostname, parsed_url.port, timeout = self.timeout), False
+
+	# Returns the response, and the connection to hand back to release()
+	# once the response has been read completely. fresh forces a new
+	# connection; use it to retry after an idle connection went stale.
+	def request(self, url, headers = {}, fresh = False):
+		import urllib.parse
+
+		parsed_url = urllib.parse.urlparse(url)
+		if parsed_url.scheme not in ('http', 'https'):
+			raise ValueError("Unable to download %s: unsupported URL scheme" % url)
+
+		key = (parsed_url.scheme, parsed_url.netloc)
+
+		conn = None
+		if not fresh:
+			with self.lock:
+				idle = self.idle.get(key)
+				if idle:
+					conn, full_url = idle.pop()
+
+		if conn is None:
+			conn, full_url = self._connect(parsed_url)
+
+		path = url
+		if not full_url:
+			path = urllib.parse.urlunparse(parsed_url._replace(scheme = '', netloc = '', fragment = '')) or '/'
+
+		try:
+			conn.request('GET', path, headers = headers)
+			resp = conn.getresponse()
+		except:
+			conn.close()
+			raise
+
+		return resp, (key, conn, full_url)
+
+	def release(self, resp, handle, reusable = True):
+		key, conn, full_url = handle
+
+		if not reusable or resp.will_close:
+			conn.close()
+			return
+
+		with self.lock:
+			self.idle.setdefault(key, []).append((conn, full_url))
+
+# Download artefacts from their URLs into their cache.
+# Downloads are streamed to a partial file next to the cache entry, and are
+# resumed with a Range request if the connection drops halfway through.
+# If the artefact comes with hashes, the file is checked against them
+# before it is moved into place. download_many() fetches a batch of
+# artefacts concurrently.
 class Downloader(object):
-	def __init__(self):
-		pass
+	MAX_ATTEMPTS = 3
+	MAX_REDIRECTS = 5
+	CHUNK_SIZE = 65536
+
+	def __init__(self, jobs = 4):
+		self.jobs = jobs
+		self.pool = HTTPConnectionPool()
 
 	def download_to(self, build, destdir, quiet = False):
 		filename = os.path.join(destdir, build.filename)
@@ -401,11 +690,42 @@ class Downloader(object):
 
 		return self._download(build, filename, quiet)
 
-	def _download(self, build, path, quiet = False):
-		import urllib.request
+	# Returns the list of paths, in the order of builds. If any of the
+	# downloads fail, the first error is raised once all others are done.
+	def download_many(self, builds, quiet = False):
+		import concurrent.futures
+
+		# The same file may be in the list more than once
+		pending = dict()
+		for build in builds:
+			if build.cache and not build.local_path:
+				build.local_path = build.cache.get(build)
+			if build.local_path:
+				continue
+
+			key = build.url
+			if build.cache:
+				key = build.cache.create(build)
+			pending.setdefault(key, []).append(build)
+
+		if pending:
+			with profiler.phase("download"), concurrent.futures.ThreadPoolExecutor(max_workers = self.jobs) as executor:
+				futures = [executor.submit(self.download, same[0], quiet) for same in pending.values()]
+				concurrent.futures.wait(futures)
+
+			for same, future in zip(pending.values(), futures):
+				if future.exception() is None:
+					for build in same[1:]:
+						build.local_path = same[0].local_path
+
+			for future in futures:
+				future.result()
 
+		return [build.local_path for build in builds]
+
+	def _download(self, build, path, quiet = False):
 		if build.cache and not build.local_path:
-			build.local_path = build.cache.get(build.filename)
+			build.local_path = build.cache.get(build)
 
 		if build.local_path:
 			return build.local_path
@@ -413,28 +733,111 @@ class Downloader(object):
 		assert(build.url)
 		assert(build.filename)
 
-		url = build.url
-		resp = urllib.request.urlopen(url)
-		if resp.status != 200:
-			raise ValueError("Unable to download %s from %s (HTTP status %s %s)" % (
-					build.filename, url, resp.status, resp.reason))
-
 		filename = build.filename
 		if path:
 			filename = path
 
 		if build.cache:
-			filename = build.cache.create(build.filename)
+			filename = build.cache.create(build)
 
-		with open(filename, "wb") as f:
-			f.write(resp.read())
+		self._fetch(build, filename)
 
 		if not quiet:
-			print("Downloaded %s from %s" % (filename, url))
+			print("Downloaded %s from %s" % (filename, build.url))
 
 		build.local_path = filename
 		return filename
 
+	def _fetch(self, build, path):
+		import http.client
+
+		# Several build jobs may share the cache directory
+		part_path = "%s.part-%d" % (path, os.getpid())
+
+		attempt = 1
+		while True:
+			try:
+				self._fetch_part(build.url, part_path, fresh = attempt > 1)
+				break
+			except (http.client.HTTPException, OSError) as e:
+				if attempt >= self.MAX_ATTEMPTS:
+					raise ValueError("Unable to download %s from %s: %s" % (build.filename, build.url, e))
+
+				print("Download of %s interrupted (%s), retrying" % (build.filename, e))
+				attempt += 1
+
+		self._verify(build, part_path)
+		os.replace(part_path, path)
+
+	# Download url to part_path, continuing where we left off last time
+	def _fetch_part(self, url, part_path, fresh = False):
+		import http.client
+		import urllib.parse
+
+		for redirect in range(self.MAX_REDIRECTS + 1):
+			offset = 0
+			if os.path.exists(part_path):
+				offset = os.path.getsize(part_path)
+
+			headers = {}
+			if offset:
+				headers['Range'] = 'bytes=%d-' % offset
+
+			resp, handle = self.pool.request(url, headers, fresh)
+			try:
+				if resp.status in (301, 302, 303, 307, 308):
+					location = resp.getheader('Location')
+					if not location:
+						raise ValueError("Unable to download %s: redirect without a location" % url)
+
+					resp.read()
+					self.pool.release(resp, handle)
+					url = urllib.parse.urljoin(url, location)
+					continue
+
+				if offset and resp.status in (206, 416) and \
+				   not resp.getheader('Content-Range', '').startswith('bytes %d-' % offset):
+					# Whatever we have does not match what the server has now
+					resp.read()
+					self.pool.release(resp, handle)
+					os.remove(part_path)
+					continue
+
+				if resp.status == 206:
+					mode = "ab"
+				elif resp.status == 200:
+					mode = "wb"
+				else:
+					raise ValueError("Unable to download %s (HTTP status %s %s)" % (url, resp.status, resp.reason))
+
+				received = 0
+				with open(part_path, mode) as f:
+					while True:
+						chunk = resp.read(self.CHUNK_SIZE)
+						if not chunk:
+							break
+						f.write(chunk)
+						received += len(chunk)
+
+				# read() just returns nothing if the connection drops early
+				expected = resp.getheader('Content-Length')
+				if expected is not None and received < int(expected):
+					raise http.client.IncompleteRead(b'', int(expected) - received)
+			except:
+				self.pool.release(resp, handle, reusable = False)
+				raise
+
+			self.pool.release(resp, handle)
+			return
+
+		raise ValueError("Unable to download %s: too many redirects" % url)
+
+	def _verify(self, build, path):
+		algo = DownloadCache.hash_mismatch(build, path)
+		if algo is not None:
+			os.remove(path)
+			raise ValueError("Download of %s from %s does not match its %s hash" % (build.filename, build.url, algo))
+
 class DownloadCache(object):
 	def __init__(self, path = None):
 		self.tempdir = None
@@ -445,25 +848,177 @@ class DownloadCache(object):
 
 		self.path = path
 
+		# Entries we have checked already, and the hashes they did and
+		# did not match
+		self.verified = dict()
+
 	def zap(self):
 		# for now
 		pass
 
-	def get(self, filename):
-		filename = os.path.basename(filename)
+	# Entries are keyed on the URL only. The hashes of an artefact are
+	# not a good key: which ones we know changes over its lifetime, and
+	# between build-info and index. They are checked on every hit instead.
+	# The file itself keeps its name, because some tools care about it.
+	def _entry_path(self, build):
+		import hashlib
+
+		filename = os.path.basename(build.filename)
 		assert(filename)
 
-		path = os.path.join(self.path, filename)
-		if os.path.isfile(path):
-			return path
+		key = hashlib.sha256((build.url or filename).encode('utf-8')).hexdigest()[:32]
+		return os.path.join(self.path, key, filename)
+
+	# Return the first hash of build that the file at path does not
+	# match, or None if they all do
+	@staticmethod
+	def hash_mismatch(build, path):
+		import hashlib
+
+		digests = []
+		for algo, md in sorted(build.hash.items()):
+			try:
+				digests.append((algo, md, hashlib.new(algo)))
+			except ValueError:
+				continue
+
+		if not digests:
+			return None
+
+		with open(path, "rb") as f:
+			for chunk in iter(lambda: f.read(Downloader.CHUNK_SIZE), b""):
+				for algo, md, m in digests:
+					m.update(chunk)
 
+		for algo, md, m in digests:
+			if m.hexdigest() != md:
+				return algo
 		return None
 
-	def create(self, filename):
-		filename = os.path.basename(filename)
-		assert(filename)
+	def get(self, build):
+		path = self._entry_path(build)
+		if not os.path.isfile(path):
+			return None
+
+		st = os.stat(path)
+		stamp = (st.st_size, st.st_mtime_ns)
+
+		seen = self.verified.get(path)
+		if seen is None or seen[0] != stamp:
+			seen = (stamp, set(), set())
+			self.verified[path] = seen
+
+		stamp, good, bad = seen
+		hashes = frozenset(build.hash.items())
+		if hashes in bad:
+			return None
 
-		return os.path.join(self.path, filename)
+		if not hashes <= good:
+			algo = self.hash_mismatch(build, path)
+			if algo is not None:
+				print("Cached copy of %s does not match its %s hash, downloading it again" % (build.filename, algo))
+				bad.add(hashes)
+				return None
+			good.update(hashes)
+
+		return path
+
+	def create(self, build):
+		path = self._entry_path(build)
+
+		os.makedirs(os.path.dirname(path), exist_ok = True)
+		return path
+
+# Persistent cache for package indices that are expensive to parse.
+# Each upstream URL is stored in a converted form, along with the ETag and
+# Last-Modified headers of the response it was created from. Whenever we
+# are asked for the index, the upstream copy is revalidated with a
+# conditional GET, and only converted again if it has changed.
+class IndexCache(object):
+	def __init__(self, path = None):
+		if path is None:
+			path = os.environ.get("XDG_CACHE_HOME") or os.path.expanduser("~/.cache")
+			path = os.path.join(path, "minibuild", "index")
+
+		self.path = path
+
+	def _cache_paths(self, url):
+		import hashlib
+
+		key = hashlib.sha256(url.encode('utf-8')).hexdigest()[:32]
+		path = os.path.join(self.path, key)
+		return path, path + ".meta"
+
+	def _load_meta(self, meta_path):
+		import json
+
+		try:
+			with open(meta_path) as f:
+				return json.load(f)
+		except (OSError, ValueError):
+			return None
+
+	# Return the path of an up-to-date converted copy of url.
+	# convert_fn(resp, f) is called to write the converted copy of the
+	# HTTP response resp to the file object f.
+	def get(self, url, convert_fn, quiet = False):
+		import urllib.request
+		import json
+		from urllib.error import HTTPError, URLError
+
+		path, meta_path = self._cache_paths(url)
+
+		meta = None
+		if os.path.isfile(path):
+			meta = self._load_meta(meta_path)
+
+		req = urllib.request.Request(url)
+		if meta:
+			if meta.get('etag'):
+				req.add_header('If-None-Match', meta['etag'])
+			if meta.get('last-modified'):
+				req.add_header('If-Modified-Since', meta['last-modified'])
+
+		try:
+			resp = urllib.request.urlopen(req)
+		except HTTPError as e:
+			if e.code == 304 and meta:
+				return path
+			raise ValueError("Unable to download %s: HTTP response %s (%s)" % (url, e.code, e.reason))
+		except URLError as e:
+			if meta:
+				print("Unable to revalidate %s (%s), using cached copy" % (url, e.reason))
+				return path
+			raise
+
+		if resp.status != 200:
+			raise ValueError("Unable to download %s: HTTP response %s (%s)" % (
+					url, resp.status, resp.reason))
+
+		if not quiet:
+			print("Downloading index at %s" % url)
+
+		os.makedirs(self.path, exist_ok = True)
+
+		# Write to a temp file and rename, so that concurrent runs
+		# never see a partially written cache file
+		with tempfile.NamedTemporaryFile(dir = self.path, delete = False) as f:
+			try:
+				convert_fn(resp, f)
+			except:
+				os.unlink(f.name)
+				raise
+		os.replace(f.name, path)
+
+		meta = {
+			'url': url,
+			'etag': resp.headers.get('ETag'),
+			'last-modified': resp.headers.get('Last-Modified'),
+		}
+		with open(meta_path, "w") as f:
+			json.dump(meta, f)
+
+		return path
 
 # For now, a very trivial uploader.
 class Uploader(Object):
@@ -628,8 +1183,11 @@ class BuildInfo(Object):
 			self.include_git_repos = set()
 		self.include_git_repos.add(line.strip())
 
-	def parse_source(self, line):
-		return self.add_source(line.strip())
+	def parse_source(self, path, line):
+		arg = line.strip()
+		if not (arg.startswith("git:") or arg.startswith("http:") or arg.startswith("https:")):
+			arg = os.path.join(os.path.dirname(path), arg)
+		return self.add_source(arg)
 
 	def add_source(self, arg):
 		build_engine = self.context_engine()
@@ -641,8 +1199,7 @@ class BuildInfo(Object):
 					package_name = self.context_name(),
 					version = self.version)
 		else:
-			filename = os.path.join(os.path.dirname(path), arg)
-			filename = os.path.realpath(filename)
+			filename = os.path.realpath(arg)
 			sdist = build_engine.create_artefact_from_local_file(filename)
 
 		self.sources.append(sdist)
@@ -957,7 +1514,7 @@ class BuildSpec(Object):
 					elif kwd == 'git-tag':
 						version.parse_git_tag(l)
 					elif kwd == 'source':
-						version.parse_source(l)
+						version.parse_source(path, l)
 					elif kwd == 'build':
 						version.parse_build_script(path, l)
 					elif kwd == 'build-strategy':
@@ -1177,6 +1734,11 @@ class BuildStrategy(Object):
 	def build_used(self, build_directory):
 		return []
 
+	# Anything the build uses that is neither in the source archive nor
+	# in the build-spec, as lines of text for BuildCache.make_key()
+	def cache_inputs(self):
+		return []
+
 	def resolve_source(self, source):
 		for value in source.spec.get_build_configs(self._type):
 			self.apply_config(value)
@@ -1287,6 +1849,10 @@ class BuildStrategy_FromScript(BuildStrategy):
 
 		self.full_path = os.path.join(source.path, self.path)
 
+	# The script lives next to the build-spec, not in the source archive
+	def cache_inputs(self):
+		return ["script %s %s" % (os.path.basename(self.path), BuildCache.file_digest(self.full_path))]
+
 	def next_command(self, build_directory):
 		build_script = self.full_path
 		if not build_script:
@@ -1712,7 +2278,7 @@ class BuildState(Object):
 
 		# And copy our data over it
 		print("Committing build state to %s:" % self.savedir, end = ' ')
-		for file in glob.glob(os.path.join(self.tmpdir.name, "*")):
+		for file in self.new_files():
 			print(os.path.basename(file), end = ' ')
 			shutil.copy(file, self.savedir)
 		print("")
@@ -1725,6 +2291,10 @@ class BuildState(Object):
 	def get_old_path(self, name):
 		return os.path.join(self.savedir, name)
 
+	# All files we have written so far, and are about to commit
+	def new_files(self):
+		return glob.glob(os.path.join(self.tmpdir.name, "*"))
+
 	def get_new_path(self, name):
 		return os.path.join(self.tmpdir.name, name)
 
@@ -1826,6 +2396,188 @@ class BuildState(Object):
 
 		print("Build requirement did not change")
 
+# Results of previous builds, keyed on everything that goes into a build:
+# the source archives, the build-spec and patches, the build strategy, the
+# image of the build environment, and the exact versions of all the
+# dependencies we would install. If none of these changed, building again
+# would just give us the same artefacts, so we pick up the build-info and
+# artefacts from the cache instead.
+#
+# There is always a local cache; in addition, a shared store can be
+# configured, either as a directory (eg on NFS) or as an http(s) URL that
+# supports GET and PUT.
+class BuildCache(Object):
+	# Bump this when changing what goes into the key
+	KEY_VERSION = 1
+
+	class Directory(object):
+		def __init__(self, path):
+			self.path = path
+
+		def describe(self):
+			return self.path
+
+		def _entry_path(self, key):
+			return os.path.join(self.path, key[:2], key)
+
+		def fetch(self, key, destdir):
+			path = self._entry_path(key)
+			if not os.path.isdir(path):
+				return False
+
+			for file in glob.glob(os.path.join(path, "*")):
+				shutil.copy(file, destdir)
+			return True
+
+		def store(self, key, files):
+			path = self._entry_path(key)
+			if os.path.isdir(path):
+				return
+
+			# Populate a temporary directory and rename it, so that other
+			# builds never see a partially written entry
+			os.makedirs(os.path.dirname(path), exist_ok = True)
+			tmpdir = tempfile.mkdtemp(dir = os.path.dirname(path), prefix = ".new-")
+			for file in files:
+				shutil.copy(file, tmpdir)
+			os.chmod(tmpdir, 0o755)
+
+			try:
+				os.rename(tmpdir, path)
+			except OSError:
+				# Someone else stored the same build in the meantime
+				shutil.rmtree(tmpdir)
+
+	class HTTP(object):
+		def __init__(self, url, user = None, password = None):
+			self.url = url.rstrip('/')
+			self.user = user
+			self.password = password
+
+		def describe(self):
+			return self.url
+
+		def _request(self, key, method = 'GET', data = None):
+			import urllib.request
+			import base64
+
+			req = urllib.request.Request("%s/%s/%s.tar.gz" % (self.url, key[:2], key), data = data, method = method)
+			if self.user:
+				auth = base64.b64encode(("%s:%s" % (self.user, self.password)).encode('utf-8'))
+				req.add_header('Authorization', 'Basic ' + auth.decode('ascii'))
+			return urllib.request.urlopen(req)
+
+		def fetch(self, key, destdir):
+			import tarfile
+			from urllib.error import HTTPError
+
+			try:
+				resp = self._request(key)
+			except HTTPError as e:
+				if e.code == 404:
+					return False
+				raise ValueError("Unable to query build cache at %s: HTTP response %s (%s)" % (self.url, e.code, e.reason))
+
+			with tempfile.TemporaryFile() as f:
+				shutil.copyfileobj(resp, f)
+				f.seek(0)
+
+				with tarfile.open(fileobj = f, mode = "r:gz") as tar:
+					for member in tar.getmembers():
+						# We only ever store plain files at the top level
+						if not member.isfile() or os.path.basename(member.name) != member.name:
+							raise ValueError("Build cache entry %s contains unexpected member %s" % (key, member.name))
+					tar.extractall(destdir)
+			return True
+
+		def store(self, key, files):
+			import tarfile
+
+			with tempfile.TemporaryFile() as f:
+				with tarfile.open(fileobj = f, mode = "w:gz") as tar:
+					for file in files:
+						tar.add(file, arcname = os.path.basename(file))
+				f.seek(0)
+
+				self._request(key, method = 'PUT', data = f.read())
+
+	def __init__(self, config):
+		cfg = config.globals
+
+		path = cfg.build_cache
+		if path is None:
+			path = os.environ.get("XDG_CACHE_HOME") or os.path.expanduser("~/.cache")
+			path = os.path.join(path, "minibuild", "builds")
+		self.local = BuildCache.Directory(path)
+
+		self.remote = None
+		url = cfg.build_cache_remote
+		if url is None:
+			pass
+		elif url.startswith("http:") or url.startswith("https:"):
+			user = password = None
+			if cfg.build_cache_credentials:
+				creds = config._get_credentials(cfg.build_cache_credentials)
+				if creds is None:
+					raise ValueError("build_cache_remote references unknown credentials \"%s\"" % cfg.build_cache_credentials)
+				user, password = creds.user, creds.password
+			self.remote = BuildCache.HTTP(url, user, password)
+		else:
+			self.remote = BuildCache.Directory(url)
+
+	# Hash the build inputs. Each input is a line of text; the caller takes
+	# care of turning files into their digests.
+	@staticmethod
+	def make_key(inputs):
+		import hashlib
+
+		m = hashlib.sha256()
+		m.update(("minibuild-build-cache %d\n" % BuildCache.KEY_VERSION).encode('utf-8'))
+		for line in inputs:
+			m.update(line.encode('utf-8'))
+			m.update(b"\n")
+		return m.hexdigest()
+
+	@staticmethod
+	def file_digest(path):
+		import hashlib
+
+		m = hashlib.sha256()
+		with open(path, "rb") as f:
+			for chunk in iter(lambda: f.read(65536), b""):
+				m.update(chunk)
+		return m.hexdigest()
+
+	# Copy the files of a cached build to destdir. Returns False on a miss
+	def fetch(self, key, destdir):
+		if self.local.fetch(key, destdir):
+			print("Found build %s in local cache %s" % (key, self.local.describe()))
+			return True
+
+		if self.remote is None:
+			return False
+
+		try:
+			if not self.remote.fetch(key, destdir):
+				return False
+		except Exception as e:
+			print("Unable to fetch build %s from %s: %s" % (key, self.remote.describe(), e))
+			return False
+
+		print("Found build %s in shared cache %s" % (key, self.remote.describe()))
+		self.local.store(key, glob.glob(os.path.join(destdir, "*")))
+		return True
+
+	def store(self, key, files):
+		print("Storing build %s in cache" % key)
+		self.local.store(key, files)
+
+		if self.remote is not None:
+			try:
+				self.remote.store(key, files)
+			except Exception as e:
+				print("Unable to store build %s in %s: %s" % (key, self.remote.describe(), e))
+
 class Publisher(Object):
 	def __init__(self, type, repconfig):
 		self.type = type
@@ -2059,6 +2811,20 @@ class Compute(Object):
 	def spawn(self, config, flavor):
 		self.mni()
 
+	# Backends that keep ready-to-use workers hand one to the scheduler
+	# before it forks off a build, which then picks it up in spawn().
+	# Others return None.
+	def reserve(self, flavor):
+		return None
+
+	def adopt(self, worker):
+		pass
+
+	# A digest identifying the build environment for this flavor, or None
+	# if the backend cannot tell.
+	def image_digest(self, flavor):
+		return None
+
 	@staticmethod
 	def factory(name, config):
 		print("Create %s compute backend" % name)
@@ -2096,7 +2862,8 @@ class Config(object):
 			return ", ".join(["%s=%s" % (f, getattr(self, f)) for f in self._fields])
 
 	class Globals(ConfigItem):
-		_fields = ('binary_root_dir', 'source_root_dir', 'binary_extra_dir', 'certificates', 'http_proxy')
+		_fields = ('binary_root_dir', 'source_root_dir', 'binary_extra_dir', 'certificates', 'http_proxy',
+			   'build_cache', 'build_cache_remote', 'build_cache_credentials')
 
 		def __init__(self, config, d):
 			super(Config.Globals, self).__init__(config, d)
@@ -2166,7 +2933,7 @@ class Config(object):
 			super(Config.Pod, self).__init__(config, d)
 
 	class Environment(ConfigItem):
-		_fields = ('name', 'type', 'build_dir', 'images', 'network', 'pod')
+		_fields = ('name', 'type', 'build_dir', 'images', 'network', 'pod', 'pool')
 
 		def __init__(self, config, d):
 			super(Config.Environment, self).__init__(config, d)
@@ -2456,7 +3223,8 @@ class Engine(Object):
 				raise ValueError("Invalid environment setting in build-spec: %s" % item)
 			environment.append((name, value))
 
-		compute = compute_backend.spawn(self.engine_config.name)
+		with profiler.phase("compute.spawn"):
+			compute = compute_backend.spawn(self.engine_config.name)
 
 		if self.use_proxy and self.config.globals.http_proxy:
 			proxy = self.config.globals.http_proxy
@@ -2569,8 +3337,9 @@ class Engine(Object):
 
 		fileset = publisher.create_fileset()
 
-		publisher.rescan_state_dir(fileset, self.binary_extra_dir)
-		publisher.rescan_state_dir(fileset, self.state_dir)
+		with profiler.phase("publish.rescan"):
+			publisher.rescan_state_dir(fileset, self.binary_extra_dir)
+			publisher.rescan_state_dir(fileset, self.state_dir)
 
 		if prune_extras and fileset.dupes:
 			print("Found %d duplicates" % len(fileset.dupes))
@@ -2580,11 +3349,13 @@ class Engine(Object):
 			for p in fileset.dupes:
 				os.remove(p)
 
-		for path in fileset.artefacts:
-			publisher.publish_artefact(path)
+		with profiler.phase("publish.artefacts"):
+			for path in fileset.artefacts:
+				publisher.publish_artefact(path)
 
-		publisher.finish()
-		publisher.commit()
+		with profiler.phase("publish.commit"):
+			publisher.finish()
+			publisher.commit()
 
 		if self.index:
 			self.index.zap_cache()
@@ -2602,6 +3373,7 @@ class Engine(Object):
 		raise ValueError("%s: unknown build strategy \"%s\"" % (self.name, name))
 
 	def finalize_build_depdendencies(self, build):
+		incomplete = []
 		for req in build.build_info.requires:
 			missing = []
 			for algo in self.REQUIRED_HASHES:
@@ -2625,8 +3397,11 @@ class Engine(Object):
 			# always attach a cache object
 			assert(resolved_req.cache)
 
-			self.downloader.download(resolved_req)
+			incomplete.append((req, resolved_req, missing))
+
+		self.downloader.download_many([resolved_req for req, resolved_req, missing in incomplete])
 
+		for req, resolved_req, missing in incomplete:
 			for algo in missing:
 				resolved_req.update_hash(algo)
 				req.add_hash(algo, resolved_req.hash[algo])
@@ -2653,6 +3428,12 @@ class Engine(Object):
 		self.downloader.download(artefact, quiet = True)
 		return artefact.get_install_requirements()
 
+	# Engines that can resolve a list of requirements, plus everything they
+	# pull in, in one go return (resolved, missing) here. Engines that
+	# return None get their requirements resolved one at a time.
+	def resolve_build_closure(self, requirements):
+		return None
+
 	# Given a list of build requirements, check our index to see whether they
 	# can be satisified. Return a list of unsatisfied dependencies
 	def resolve_build_requirement_list(self, requirements, recursive = False, resolved = None):
@@ -2663,40 +3444,68 @@ class Engine(Object):
 		if type(requirements) != set:
 			requirements = set(requirements)
 
+		if recursive:
+			closure = self.resolve_build_closure(requirements)
+			if closure is not None:
+				found, missing = closure
+				if resolved is not None:
+					resolved += found
+
+				# Our callers expect us to consume the requirements
+				requirements.clear()
+				return set(missing)
+
 		missing = set()
 
+		# Go breadth first, so that we can fetch the artefacts of each
+		# round in one go before looking at their dependencies
 		seen = set()
 		while requirements:
-			req = requirements.pop()
+			batch = []
+			while requirements:
+				req = requirements.pop()
 
-			if req.format() in seen:
-				continue
-			seen.add(req.format())
+				if req.format() in seen:
+					continue
+				seen.add(req.format())
 
-			try:
-				found = self.resolve_build_requirement(req, verbose = False)
-				assert(found)
-			except:
-				missing.add(req)
-				continue
+				try:
+					found = self.resolve_build_requirement(req, verbose = False)
+					assert(found)
+				except:
+					missing.add(req)
+					continue
 
-			if resolved is not None:
-				resolved.append(found)
+				if resolved is not None:
+					resolved.append(found)
+				batch.append((req, found))
 
-			transitive = []
-			if recursive:
-				transitive = self.resolve_install_requirements(found)
+			if recursive and self.downloader:
+				self.prefetch([found for req, found in batch])
 
-			if transitive:
-				print("  %s resolved to %s, which requires %s" % (req.format(), found.id(),
-							"|".join([req.format() for req in transitive])))
-			else:
-				print("  %s resolved to %s" % (req.format(), found.id()))
+			for req, found in batch:
+				transitive = []
+				if recursive:
+					transitive = self.resolve_install_requirements(found)
+
+				if transitive:
+					print("  %s resolved to %s, which requires %s" % (req.format(), found.id(),
+								"|".join([req.format() for req in transitive])))
+				else:
+					print("  %s resolved to %s" % (req.format(), found.id()))
 
-			requirements.update(transitive)
+				requirements.update(transitive)
 
 		return missing
 
+	# Download a batch of artefacts we are about to look at. Failures are
+	# not fatal here; whoever needs the artefact will try again and report.
+	def prefetch(self, artefacts):
+		try:
+			self.downloader.download_many([a for a in artefacts if a.cache], quiet = True)
+		except Exception as e:
+			print("Prefetching failed: %s" % e)
+
 	# Given a list of build requirements, check our index to see whether they
 	# can be satisified. Return a list of unsatisfied dependencies
 	def validate_build_requirements(self, requirements, merge_from_upstream = True, recursive = False):
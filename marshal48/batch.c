@@ -0,0 +1,275 @@
+/*
+Ruby marshal48 - decode many buffers on a pool of worker threads
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "extension.h"
+#include "ruby_utils.h"
+#include "stats.h"
+
+/*
+ * unmarshal_many() inflates and parses each buffer on a worker thread,
+ * without the GIL. Every buffer gets a ruby context (and arena) of its
+ * own, created by the worker that decodes it. The calling thread converts
+ * the results to python in order, as soon as each one is ready, using one
+ * converter for all of them so that the constructor lookups and string
+ * intern table are shared.
+ */
+#define MARSHAL48_BATCH_MAX_THREADS	64
+
+struct marshal48_batch_item {
+	Py_buffer		view;
+	bool			have_view;
+
+	ruby_context_t *	ruby;
+	ruby_instance_t *	result;
+	bool			done;
+};
+
+typedef struct {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+
+	int			compression;
+	bool			cancelled;
+
+	unsigned int		next;
+	unsigned int		nitems;
+	struct marshal48_batch_item *items;
+} marshal48_batch_t;
+
+static void
+__batch_decode(marshal48_batch_t *batch, struct marshal48_batch_item *item)
+{
+	item->ruby = ruby_context_new();
+
+	/* Tracing uses static buffers; keep the workers quiet */
+	item->result = marshal48_unmarshal_memory(item->ruby, item->view.buf, item->view.len,
+			batch->compression, true);
+}
+
+/*
+ * Pick the next buffer nobody has started on, and decode it.
+ * Must be called with the mutex held; returns false if there is no
+ * work left.
+ */
+static bool
+__batch_run_one(marshal48_batch_t *batch)
+{
+	struct marshal48_batch_item *item;
+
+	if (batch->cancelled || batch->next >= batch->nitems)
+		return false;
+
+	item = &batch->items[batch->next++];
+	pthread_mutex_unlock(&batch->mutex);
+
+	__batch_decode(batch, item);
+
+	pthread_mutex_lock(&batch->mutex);
+	item->done = true;
+	pthread_cond_broadcast(&batch->cond);
+	return true;
+}
+
+static void *
+__batch_worker(void *arg)
+{
+	marshal48_batch_t *batch = arg;
+
+	pthread_mutex_lock(&batch->mutex);
+	while (__batch_run_one(batch))
+		;
+	pthread_mutex_unlock(&batch->mutex);
+
+	return NULL;
+}
+
+/*
+ * Wait for the item to be decoded. Rather than sitting idle, the calling
+ * thread helps out with buffers that no worker has picked up yet.
+ */
+static void
+__batch_wait(marshal48_batch_t *batch, struct marshal48_batch_item *item)
+{
+	bool done;
+
+	pthread_mutex_lock(&batch->mutex);
+	done = item->done;
+	pthread_mutex_unlock(&batch->mutex);
+
+	if (done)
+		return;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&batch->mutex);
+	while (!item->done) {
+		if (!__batch_run_one(batch))
+			pthread_cond_wait(&batch->cond, &batch->mutex);
+	}
+	pthread_mutex_unlock(&batch->mutex);
+	Py_END_ALLOW_THREADS
+}
+
+static void
+__batch_release_item(struct marshal48_batch_item *item)
+{
+	if (item->ruby) {
+		ruby_context_free(item->ruby);
+		item->ruby = NULL;
+	}
+	item->result = NULL;
+
+	if (item->have_view) {
+		PyBuffer_Release(&item->view);
+		item->have_view = false;
+	}
+}
+
+static unsigned int
+__batch_default_threads(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpus < 1)
+		return 1;
+	if (ncpus > MARSHAL48_BATCH_MAX_THREADS)
+		return MARSHAL48_BATCH_MAX_THREADS;
+	return ncpus;
+}
+
+/*
+ * unmarshal_many(buffers, factory, quiet=1, constructors=None, threads=0, compression=None) -> list
+ *
+ * buffers is a sequence of bytes-like objects. threads=0 uses one thread
+ * per CPU. compression may be "zlib" (as used by quick/Marshal.4.8/ *.rz)
+ * or "gzip".
+ */
+PyObject *
+marshal48_UnmarshalMany(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"buffers",
+		"factory",
+		"quiet",
+		"constructors",
+		"threads",
+		"compression",
+		NULL
+	};
+	PyObject *buffers, *factory, *constructors = NULL, *seq, *result = NULL;
+	const char *compression = NULL;
+	unsigned int threads = 0, nthreads = 0, i;
+	pthread_t workers[MARSHAL48_BATCH_MAX_THREADS];
+	ruby_converter_t *converter = NULL;
+	marshal48_batch_t batch;
+	int quiet = 1;
+	double t0 = marshal48_stats_now();
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iO!Iz", kwlist, &buffers, &factory, &quiet,
+				&PyDict_Type, &constructors, &threads, &compression))
+		return NULL;
+
+	memset(&batch, 0, sizeof(batch));
+	if (!marshal48_parse_compression(compression, &batch.compression))
+		return NULL;
+
+	if (!(seq = PySequence_Fast(buffers, "marshal48: buffers must be a sequence of bytes-like objects")))
+		return NULL;
+
+	batch.nitems = PySequence_Fast_GET_SIZE(seq);
+	batch.items = calloc(batch.nitems + 1, sizeof(batch.items[0]));
+	for (i = 0; i < batch.nitems; ++i) {
+		struct marshal48_batch_item *item = &batch.items[i];
+
+		if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &item->view, PyBUF_SIMPLE) < 0)
+			goto out;
+		item->have_view = true;
+	}
+
+	if (!(result = PyList_New(batch.nitems)))
+		goto out;
+
+	nthreads = threads? threads : __batch_default_threads();
+	if (nthreads > MARSHAL48_BATCH_MAX_THREADS)
+		nthreads = MARSHAL48_BATCH_MAX_THREADS;
+	if (nthreads > batch.nitems)
+		nthreads = batch.nitems;
+
+	pthread_mutex_init(&batch.mutex, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+
+	/* The calling thread decodes buffers, too, so we need one worker less */
+	for (i = 0; i + 1 < nthreads; ++i) {
+		if (pthread_create(&workers[i], NULL, __batch_worker, &batch) != 0) {
+			/* Make do with what we have */
+			break;
+		}
+	}
+	nthreads = i;
+
+	converter = ruby_converter_new(NULL, factory);
+	if (constructors)
+		ruby_converter_set_constructors(converter, constructors);
+
+	for (i = 0; i < batch.nitems; ++i) {
+		struct marshal48_batch_item *item = &batch.items[i];
+		PyObject *obj = NULL;
+
+		__batch_wait(&batch, item);
+		if (item->result != NULL)
+			obj = ruby_instance_to_python(item->result, converter);
+		__batch_release_item(item);
+
+		if (obj == NULL) {
+			if (!PyErr_Occurred())
+				PyErr_Format(PyExc_RuntimeError, "marshal48: unable to unmarshal buffer %u", i);
+			drop_object(&result);
+			break;
+		}
+
+		PyList_SET_ITEM(result, i, obj);
+	}
+
+	if (result != NULL && !quiet)
+		ruby_converter_report(converter);
+	ruby_converter_free(converter);
+
+	/* If we bailed out early, tell the workers to stop picking up new buffers */
+	pthread_mutex_lock(&batch.mutex);
+	batch.cancelled = true;
+	pthread_mutex_unlock(&batch.mutex);
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(workers[i], NULL);
+	Py_END_ALLOW_THREADS
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.mutex);
+
+out:
+	for (i = 0; i < batch.nitems; ++i)
+		__batch_release_item(&batch.items[i]);
+	free(batch.items);
+	Py_DECREF(seq);
+	marshal48_stats_add_phase("unmarshal_many", marshal48_stats_now() - t0);
+	return result;
+}
@@ -0,0 +1,324 @@
+#!/usr/bin/python3
+#
+# Benchmark driver for marshal48
+#
+# Runs marshal48 over the files in marshal48/bench/corpus (see make-corpus.rb)
+# and reports, for each phase:
+#
+#   decode	parse marshal data into ruby instances
+#   to_python	convert ruby instances to python objects
+#   from_python	convert python objects to ruby instances
+#   encode	write ruby instances as marshal data
+#   direct	decode straight to python objects (unmarshal(direct = True))
+#
+# throughput in objects/s and MB/s, the number of allocations (ruby instances
+# for decode and from_python, python memory blocks for to_python and direct;
+# encode allocates nothing worth counting), the memory taken from marshal48's
+# arena, and the peak RSS of the process at the end of the phase. Each corpus is
+# benchmarked in a separate process, so that the RSS figures are not skewed
+# by the ones that ran before.
+#
+# With --threads N, it instead unmarshals each corpus from 1, 2, 4, ... N
+# threads at the same time, and reports how the wall clock time scales.
+# Parsing an in-memory buffer releases the GIL, so decode should scale with
+# the number of cores; to_python always runs under the GIL.
+#
+# With --check, it does not benchmark anything, but checks that
+# iter_unmarshal() returns the same elements as unmarshal(), both for the
+# corpus files that hold an array, and for a few inputs whose elements
+# refer back to objects of earlier elements.
+#
+# Usage: bench.py [--repeat N] [--threads N] [--check] [--json] [corpus-file ...]
+#
+import sys
+import os
+import gc
+import glob
+import json
+import subprocess
+import importlib
+import types
+import time
+import resource
+
+benchdir = os.path.dirname(os.path.abspath(__file__))
+topdir = os.path.dirname(os.path.dirname(benchdir))
+
+# Load marshal48.so and ruby_utils.py from the source tree, without
+# pulling in all of minibuild
+def load_minibuild():
+	pkg = types.ModuleType('minibuild')
+	pkg.__path__ = [topdir]
+	sys.modules['minibuild'] = pkg
+
+	for name in ('marshal48', 'ruby_utils'):
+		setattr(pkg, name, importlib.import_module('minibuild.' + name))
+
+	return pkg
+
+# For encoding, we need classes that can give back what they were
+# loaded from; Ruby.GemVersion and friends cannot.
+class Opaque:
+	def __init__(self, classname):
+		self.ruby_classname = classname
+		self.data = None
+
+	def load(self, data):
+		self.data = data
+
+	def marshal_load(self, data):
+		self.data = data
+
+	def marshal_dump(self):
+		return self.data
+
+def opaque_factory(name, *args):
+	return Opaque(name)
+
+def read_corpus(path):
+	import gzip
+	import zlib
+
+	with open(path, "rb") as f:
+		data = f.read()
+
+	if path.endswith(".gz"):
+		return gzip.decompress(data)
+	if path.endswith(".rz"):
+		return zlib.decompress(data)
+	return data
+
+def count_objects(data):
+	return data.get("objects", 0) + data.get("symbols", 0) + data.get("ephemerals", 0)
+
+def bench_one(name, paths, repeat):
+	minibuild = load_minibuild()
+	marshal48 = minibuild.marshal48
+	Ruby = minibuild.ruby_utils.Ruby
+	import io
+
+	inputs = [read_corpus(path) for path in paths]
+	nbytes = sum(len(data) for data in inputs) * repeat
+
+	phases = {}
+	def account(phase, stats, allocs, nobjects):
+		p = phases.setdefault(phase, { 'time': 0.0, 'allocs': 0, 'objects': 0, 'bytes': nbytes })
+		p['time'] += stats[phase + '_time']
+		p['maxrss'] = stats[phase + '_maxrss']
+		p['arena'] = stats['arena_bytes']
+		if allocs is None:
+			p['allocs'] = None
+		else:
+			p['allocs'] += allocs
+		p['objects'] += nobjects
+
+	# Keep the collector from kicking in at random points
+	gc.disable()
+
+	for i in range(repeat):
+		for data in inputs:
+			blocks = sys.getallocatedblocks()
+			result, stats = marshal48._profile_unmarshal(data, Ruby.factory, constructors = Ruby.classes)
+			allocs = sys.getallocatedblocks() - blocks
+			nobjects = count_objects(stats)
+
+			account('decode', stats, stats['instances'], nobjects)
+			account('to_python', stats, allocs, nobjects)
+			del result
+
+			blocks = sys.getallocatedblocks()
+			t0 = time.perf_counter()
+			result = marshal48.unmarshal(data, Ruby.factory, constructors = Ruby.classes, direct = True)
+			t1 = time.perf_counter()
+			allocs = sys.getallocatedblocks() - blocks
+			stats = {
+				'direct_time': t1 - t0,
+				'direct_maxrss': resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+				'arena_bytes': 0,
+			}
+			account('direct', stats, allocs, nobjects)
+			del result
+
+			# Marshal48 cannot (yet) write UserDefined objects such as
+			# Gem::Specification, so encoding is skipped for those.
+			opaque = marshal48.unmarshal(data, opaque_factory)
+			out = io.BytesIO()
+			try:
+				stats = marshal48._profile_marshal(opaque, out)
+			except TypeError:
+				continue
+
+			nobjects = count_objects(stats)
+			account('from_python', stats, stats['instances'], nobjects)
+			account('encode', stats, None, nobjects)
+			del opaque, out
+
+	gc.enable()
+	return { 'corpus': name, 'phases': phases }
+
+def bench_threads(name, paths, repeat, maxthreads):
+	from concurrent.futures import ThreadPoolExecutor
+
+	minibuild = load_minibuild()
+	marshal48 = minibuild.marshal48
+	Ruby = minibuild.ruby_utils.Ruby
+
+	inputs = [read_corpus(path) for path in paths]
+
+	def work(data):
+		result, stats = marshal48._profile_unmarshal(data, Ruby.factory, constructors = Ruby.classes)
+		return stats['decode_time'], stats['to_python_time']
+
+	counts = []
+	n = 1
+	while n < maxthreads:
+		counts.append(n)
+		n *= 2
+	counts.append(maxthreads)
+
+	runs = []
+	for nthreads in counts:
+		jobs = [data for i in range(repeat * nthreads) for data in inputs]
+		with ThreadPoolExecutor(max_workers = nthreads) as pool:
+			t0 = time.perf_counter()
+			times = list(pool.map(work, jobs))
+			t1 = time.perf_counter()
+
+		runs.append({
+			'threads': nthreads,
+			'jobs': len(jobs),
+			'time': t1 - t0,
+			'decode': sum(t[0] for t in times) / len(jobs),
+			'to_python': sum(t[1] for t in times) / len(jobs),
+		})
+
+	return { 'corpus': name, 'threads': runs }
+
+# Elements that refer back to objects of an earlier element, which
+# iter_unmarshal() has released by then
+backref_inputs = [
+	# ["a", "a"]
+	b'\x04\x08[\x07"\x06a@\x06',
+	# [[1], [1]], with the second element being the first one
+	b'\x04\x08[\x07[\x06i\x06@\x06',
+	# [{1 => 2}, [{1 => 2}], {1 => 2}], all the same hash
+	b'\x04\x08[\x08{\x06i\x06i\x07[\x06@\x06@\x06',
+]
+
+def check_iter(paths):
+	minibuild = load_minibuild()
+	marshal48 = minibuild.marshal48
+	Ruby = minibuild.ruby_utils.Ruby
+
+	inputs = [(repr(data), data) for data in backref_inputs]
+	inputs += [(path, read_corpus(path)) for path in paths]
+
+	failed = 0
+	for name, data in inputs:
+		expect = marshal48.unmarshal(data, Ruby.factory, constructors = Ruby.classes)
+		if type(expect) != list:
+			continue
+
+		try:
+			result = list(marshal48.iter_unmarshal(data, Ruby.factory, constructors = Ruby.classes))
+		except Exception as e:
+			result = e
+
+		if result != expect:
+			print("FAIL %s: iter_unmarshal() returned %s" % (name, repr(result)[:200]))
+			failed += 1
+		else:
+			print("ok   %s (%d elements)" % (name, len(expect)))
+
+	return failed and 1 or 0
+
+def default_corpora():
+	corpusdir = os.path.join(benchdir, "corpus")
+	return [
+		("specs.4.8", [os.path.join(corpusdir, "specs.4.8.gz")]),
+		("latest_specs.4.8", [os.path.join(corpusdir, "latest_specs.4.8.gz")]),
+		("gemspec.rz", sorted(glob.glob(os.path.join(corpusdir, "*.gemspec.rz")))),
+	]
+
+def run_child(name, paths, repeat, threads):
+	cmd = [sys.executable, __file__, "--child", name, "--repeat", str(repeat)]
+	if threads:
+		cmd += ["--threads", str(threads)]
+	cmd += paths
+	output = subprocess.check_output(cmd)
+	return json.loads(output.decode('utf-8'))
+
+def report(results):
+	print("%-18s %-12s %10s %12s %8s %12s %10s %11s" % (
+		"corpus", "phase", "time", "objects/s", "MB/s", "allocations", "arena", "peak RSS"))
+
+	for res in results:
+		for phase in ('decode', 'to_python', 'direct', 'from_python', 'encode'):
+			p = res['phases'].get(phase)
+			if p is None:
+				print("%-18s %-12s %10s" % (res['corpus'], phase, "-"))
+				continue
+
+			t = max(p['time'], 1e-9)
+			allocs = "-" if p['allocs'] is None else str(p['allocs'])
+			print("%-18s %-12s %9.3fs %12.0f %8.1f %12s %7d kB %8d kB" % (
+				res['corpus'], phase, p['time'],
+				p['objects'] / t, p['bytes'] / t / (1024 * 1024),
+				allocs, p['arena'] / 1024, p['maxrss']))
+
+def report_threads(results):
+	print("%-18s %7s %6s %10s %9s %12s %12s" % (
+		"corpus", "threads", "jobs", "time", "speedup", "decode/job", "to_python/job"))
+
+	for res in results:
+		runs = res['threads']
+		base = runs[0]['time'] / runs[0]['jobs']
+		for run in runs:
+			speedup = base / (run['time'] / run['jobs'])
+			print("%-18s %7d %6d %9.3fs %8.2fx %11.4fs %12.4fs" % (
+				res['corpus'], run['threads'], run['jobs'], run['time'],
+				speedup, run['decode'], run['to_python']))
+
+def main(argv):
+	import argparse
+
+	parser = argparse.ArgumentParser(description = "Benchmark marshal48")
+	parser.add_argument('--repeat', type = int, default = 5)
+	parser.add_argument('--threads', type = int, default = 0)
+	parser.add_argument('--check', action = 'store_true')
+	parser.add_argument('--json', action = 'store_true')
+	parser.add_argument('--child', metavar = 'NAME', help = argparse.SUPPRESS)
+	parser.add_argument('files', nargs = '*')
+	opts = parser.parse_args(argv)
+
+	if opts.child:
+		if opts.threads:
+			result = bench_threads(opts.child, opts.files, opts.repeat, opts.threads)
+		else:
+			result = bench_one(opts.child, opts.files, opts.repeat)
+		json.dump(result, sys.stdout)
+		return 0
+
+	if opts.check:
+		paths = opts.files
+		if not paths:
+			paths = [path for name, corpus in default_corpora() for path in corpus]
+		return check_iter(paths)
+
+	if opts.files:
+		corpora = [(os.path.basename(path), [path]) for path in opts.files]
+	else:
+		corpora = default_corpora()
+
+	results = [run_child(name, paths, opts.repeat, opts.threads) for name, paths in corpora]
+	if opts.json:
+		json.dump(results, sys.stdout, indent = 1)
+		print()
+	elif opts.threads:
+		report_threads(results)
+	else:
+		report(results)
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,73 @@
+#!/usr/bin/ruby
+#
+# Generate the benchmark corpus for marshal48.
+#
+#  specs.4.8.gz		a trimmed, synthetic gem spec index
+#  latest_specs.4.8.gz	the latest version of each gem in specs.4.8
+#  *.gemspec.rz		quick/Marshal.4.8 specs of some locally installed gems
+#
+# The spec index is made up, but mimics the shape of the real one:
+# a few thousand gems with a handful of versions each, mostly for
+# platform "ruby". The output is deterministic, so that numbers from
+# different runs can be compared.
+#
+# Usage: make-corpus.rb [outdir]
+
+require 'rubygems'
+require 'zlib'
+
+outdir = ARGV[0] || File.join(File.dirname(__FILE__), "corpus")
+
+NUM_GEMS = 3000
+GEMSPECS = %w(abbrev ansi base64 benchmark bigdecimal builder bundler cgi csv date
+	      debug delegate did_you_mean digest drb english erb error_highlight syntax_suggest)
+
+rng = Random.new(4848)
+syllables = %w(ra ke rs pec ac tive sup port json net http ba se rails ti me zo ne co de
+	       ray mini test fa ker nok gi ri thor pu ma sass li quid tz info)
+platforms = [ "ruby" ] * 17 + [ "java", "x86_64-linux", "x64-mingw32" ]
+
+names = {}
+while names.size < NUM_GEMS
+	name = (1 + rng.rand(3)).times.map { syllables[rng.rand(syllables.size)] }.join
+	name += [ "", "", "-rails", "_ext", "-core" ][rng.rand(5)]
+	names[name] = true
+end
+
+specs = []
+names.keys.sort.each do |name|
+	major, minor, patch = rng.rand(4), rng.rand(10), 0
+	(1 + rng.rand(12)).times do
+		case rng.rand(10)
+		when 0 then major += 1; minor = 0; patch = 0
+		when 1..3 then minor += 1; patch = 0
+		else patch += 1
+		end
+
+		version = Gem::Version.new("#{major}.#{minor}.#{patch}")
+		specs << [ name, version, "ruby" ]
+
+		platform = platforms[rng.rand(platforms.size)]
+		specs << [ name, version, platform ] if platform != "ruby"
+	end
+end
+
+latest = {}
+specs.each { |spec| latest[[spec[0], spec[2]]] = spec }
+
+def write_gzip(path, data)
+	Zlib::GzipWriter.open(path) do |gz|
+		gz.mtime = 0
+		gz.write(data)
+	end
+end
+
+write_gzip(File.join(outdir, "specs.4.8.gz"), Marshal.dump(specs))
+write_gzip(File.join(outdir, "latest_specs.4.8.gz"), Marshal.dump(latest.values))
+
+GEMSPECS.each do |name|
+	Gem::Specification.find_all_by_name(name).each do |spec|
+		path = File.join(outdir, "#{spec.full_name}.gemspec.rz")
+		File.binwrite(path, Zlib::Deflate.deflate(Marshal.dump(spec)))
+	end
+end
@@ -19,19 +19,32 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 
 #include "extension.h"
+#include "ruby_utils.h"
+#include "stats.h"
 
 
 static PyObject	*	theModule = NULL;
 
 static PyObject *	marshal48_Marshal(PyObject *self, PyObject *args, PyObject *kwds);
 static PyObject *	marshal48_Unmarshal(PyObject *, PyObject *, PyObject *);
+static PyObject *	marshal48_IterUnmarshal(PyObject *, PyObject *, PyObject *);
+static PyObject *	marshal48_Dumps(PyObject *, PyObject *, PyObject *);
 
 /*
  * Methods belonging to the module itself.
  */
 static PyMethodDef marshal48_methods[] = {
 	{ "marshal", (PyCFunction) marshal48_Marshal, METH_VARARGS | METH_KEYWORDS, "Marshal ruby data"},
+	{ "dumps", (PyCFunction) marshal48_Dumps, METH_VARARGS | METH_KEYWORDS, "Marshal ruby data, returning bytes"},
 	{ "unmarshal", (PyCFunction) marshal48_Unmarshal, METH_VARARGS | METH_KEYWORDS, "Unmarshal ruby data"},
+	{ "iter_unmarshal", (PyCFunction) marshal48_IterUnmarshal, METH_VARARGS | METH_KEYWORDS, "Iterate over the elements of a marshaled array"},
+	{ "unmarshal_many", (PyCFunction) marshal48_UnmarshalMany, METH_VARARGS | METH_KEYWORDS, "Unmarshal a list of buffers on worker threads"},
+	{ "unmarshal_specs", (PyCFunction) marshal48_UnmarshalSpecs, METH_VARARGS | METH_KEYWORDS, "Unmarshal a spec index into columns"},
+	{ "stats", (PyCFunction) marshal48_Stats, METH_VARARGS | METH_KEYWORDS, "Return (and optionally reset) the counters of this module"},
+
+	/* Used by the benchmark harness */
+	{ "_profile_unmarshal", (PyCFunction) marshal48_ProfileUnmarshal, METH_VARARGS | METH_KEYWORDS, "Unmarshal, timing each phase"},
+	{ "_profile_marshal", (PyCFunction) marshal48_ProfileMarshal, METH_VARARGS | METH_KEYWORDS, "Marshal, timing each phase"},
 
 	{ NULL }
 };
@@ -73,6 +86,31 @@ marshal48_setDebugLevel(PyObject *self, PyObject *args, PyObject *kwds)
 }
 #endif
 
+bool
+marshal48_check_bufsize(unsigned int bufsize)
+{
+	/* bufsize=0 means adaptive */
+	if (bufsize != 0 && (bufsize < RUBY_IOBUF_MIN_SIZE || bufsize > RUBY_IOBUF_MAX_SIZE)) {
+		PyErr_Format(PyExc_ValueError, "marshal48: bufsize must be between %u and %u",
+				RUBY_IOBUF_MIN_SIZE, RUBY_IOBUF_MAX_SIZE);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Map the compression= argument to RUBY_COMPRESSION_*
+ */
+bool
+marshal48_parse_compression(const char *name, int *compressionp)
+{
+	if ((*compressionp = ruby_compression_by_name(name)) < 0) {
+		PyErr_Format(PyExc_ValueError, "marshal48: unknown compression \"%s\"", name);
+		return false;
+	}
+	return true;
+}
+
 static PyObject *
 marshal48_Unmarshal(PyObject *self, PyObject *args, PyObject *kwds)
 {
@@ -81,31 +119,113 @@ marshal48_Unmarshal(PyObject *self, PyObject *args, PyObject *kwds)
 		"io",
 		"factory",
 		"quiet",
+		"bufsize",
+		"constructors",
+		"direct",
+		"compression",
 		NULL
 	};
 	ruby_instance_t *unmarshaled;
-	PyObject *io, *factory, *result = NULL;
-	int quiet = 1;
+	ruby_converter_t *converter;
+	PyObject *io, *factory, *constructors = NULL, *result = NULL;
+	const char *compression_name = NULL;
+	unsigned int bufsize = 0;
+	int quiet = 1, direct = 0, compression;
+	double t0, t1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iIO!pz", kwlist, &io, &factory, &quiet, &bufsize,
+				&PyDict_Type, &constructors, &direct, &compression_name))
+		return NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i", kwlist, &io, &factory, &quiet))
+	if (!marshal48_check_bufsize(bufsize)
+	 || !marshal48_parse_compression(compression_name, &compression))
 		return NULL;
 
 	ruby = ruby_context_new();
 
-	unmarshaled = marshal48_unmarshal_io(ruby, io, quiet);
-	if (unmarshaled != NULL) {
-		ruby_converter_t *converter;
+	converter = ruby_converter_new(ruby, factory);
+	if (constructors)
+		ruby_converter_set_constructors(converter, constructors);
+
+	t0 = marshal48_stats_now();
+	if (direct) {
+		/* Build python objects while parsing */
+		result = marshal48_unmarshal_direct(ruby, io, bufsize, compression, converter, quiet);
+		marshal48_stats_add_phase("direct", marshal48_stats_now() - t0);
+	} else {
+		unmarshaled = marshal48_unmarshal_io(ruby, io, bufsize, compression, quiet);
+		t1 = marshal48_stats_now();
+		marshal48_stats_add_phase("decode", t1 - t0);
 
 		/* now convert it */
-		converter = ruby_converter_new(ruby, factory);
-		result = ruby_instance_to_python(unmarshaled, converter);
-		ruby_converter_free(converter);
+		if (unmarshaled != NULL) {
+			result = ruby_instance_to_python(unmarshaled, converter);
+			marshal48_stats_add_phase("convert", marshal48_stats_now() - t1);
+		}
 	}
 
+	if (result == NULL && !PyErr_Occurred())
+		PyErr_SetString(PyExc_RuntimeError, "marshal48: unable to unmarshal data");
+	if (result != NULL && !quiet)
+		ruby_converter_report(converter);
+	ruby_converter_free(converter);
+
 	ruby_context_free(ruby);
 	return result;
 }
 
+/*
+ * Unmarshal a top-level array one element at a time. The ruby instances
+ * of each element are released as soon as it has been converted.
+ */
+static PyObject *
+marshal48_IterUnmarshal(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	ruby_context_t *ruby;
+	static char *kwlist[] = {
+		"io",
+		"factory",
+		"quiet",
+		"bufsize",
+		"constructors",
+		"compression",
+		NULL
+	};
+	struct ruby_marshal *marshal;
+	ruby_converter_t *converter;
+	PyObject *io, *factory, *constructors = NULL;
+	const char *compression_name = NULL;
+	unsigned int bufsize = 0;
+	int quiet = 1, compression;
+	long count;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iIO!z", kwlist, &io, &factory, &quiet, &bufsize,
+				&PyDict_Type, &constructors, &compression_name))
+		return NULL;
+
+	if (!marshal48_check_bufsize(bufsize)
+	 || !marshal48_parse_compression(compression_name, &compression))
+		return NULL;
+
+	ruby = ruby_context_new();
+
+	marshal = marshal48_unmarshal_open(ruby, io, bufsize, compression, quiet);
+	if (marshal == NULL || !marshal48_unmarshal_array_begin(marshal, &count)) {
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_ValueError, "marshal48: data does not contain a marshaled array");
+		if (marshal)
+			ruby_unmarshal_free(marshal);
+		ruby_context_free(ruby);
+		return NULL;
+	}
+
+	converter = ruby_converter_new(ruby, factory);
+	if (constructors)
+		ruby_converter_set_constructors(converter, constructors);
+
+	return marshal48_iterator_new(ruby, marshal, converter, count);
+}
+
 static PyObject *
 marshal48_Marshal(PyObject *self, PyObject *args, PyObject *kwds)
 {
@@ -120,15 +240,19 @@ marshal48_Marshal(PyObject *self, PyObject *args, PyObject *kwds)
 	ruby_converter_t *converter;
 	ruby_instance_t *instance;
 	int quiet = 1;
+	double t0, t1;
 
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i", kwlist, &object, &io, &quiet))
 		return NULL;
 
 	ruby = ruby_context_new();
 
+	t0 = marshal48_stats_now();
 	converter = ruby_converter_new(ruby, NULL);
 	instance = ruby_instance_from_python(object, converter);
 	ruby_converter_free(converter);
+	t1 = marshal48_stats_now();
+	marshal48_stats_add_phase("from_python", t1 - t0);
 
 	if (instance == NULL)
 		goto out;
@@ -137,6 +261,7 @@ marshal48_Marshal(PyObject *self, PyObject *args, PyObject *kwds)
 		PyErr_SetString(PyExc_RuntimeError, "Unable to marshal objects to file");
 		goto out;
 	}
+	marshal48_stats_add_phase("encode", marshal48_stats_now() - t1);
 
 	Py_INCREF(Py_None);
 	result = Py_None;
@@ -146,6 +271,48 @@ out:
 	return result;
 }
 
+/*
+ * Same as marshal(), but build the marshaled data in memory and return it
+ * as a bytes object.
+ */
+static PyObject *
+marshal48_Dumps(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	ruby_context_t *ruby;
+	static char *kwlist[] = {
+		"object",
+		"quiet",
+		NULL
+	};
+	PyObject *object, *result = NULL;
+	ruby_converter_t *converter;
+	ruby_instance_t *instance;
+	int quiet = 1;
+	double t0, t1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &object, &quiet))
+		return NULL;
+
+	ruby = ruby_context_new();
+
+	t0 = marshal48_stats_now();
+	converter = ruby_converter_new(ruby, NULL);
+	instance = ruby_instance_from_python(object, converter);
+	ruby_converter_free(converter);
+	t1 = marshal48_stats_now();
+	marshal48_stats_add_phase("from_python", t1 - t0);
+
+	if (instance != NULL) {
+		result = marshal48_marshal_bytes(ruby, instance, quiet);
+		marshal48_stats_add_phase("encode", marshal48_stats_now() - t1);
+		if (result == NULL && !PyErr_Occurred())
+			PyErr_SetString(PyExc_RuntimeError, "Unable to marshal objects");
+	}
+
+	ruby_context_free(ruby);
+	return result;
+}
+
 void
 marshal48_registerType(PyObject *m, const char *name, PyTypeObject *type)
 {
@@ -193,29 +360,46 @@ ruby_get_module(void)
 	return module;
 }
 
+/*
+ * Call func(*argv). Use vectorcall where available, which saves us from
+ * building an argument tuple for every single object.
+ */
+static PyObject *
+marshal48_call_vector(PyObject *func, PyObject **argv, unsigned int argc)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	return PyObject_Vectorcall(func, argv, argc, NULL);
+#else
+	PyObject *args, *result;
+	unsigned int i;
+
+	args = PyTuple_New(argc);
+	for (i = 0; i < argc; ++i) {
+		Py_INCREF(argv[i]);
+		PyTuple_SET_ITEM(args, i, argv[i]);
+	}
+
+	result = PyObject_CallObject(func, args);
+	Py_DECREF(args);
+	return result;
+#endif
+}
+
 PyObject *
 marshal48_instantiate_ruby_type_with_arg(const char *name, PyObject *arg, ruby_converter_t *converter)
 {
-	PyObject *module, *func, *args, *result;
+	PyObject *module, *func, *argv[2], *result;
+	unsigned int argc = 0;
 
 	if (converter) {
-		PyObject *name_obj;
+		const struct ruby_converter_class *cls;
 
-		func = converter->factory;
-		if (!PyCallable_Check(func)) {
-			PyErr_SetString(PyExc_TypeError, "ruby: factory argument must be callable");
+		if (!(cls = ruby_converter_find_class(converter, name)))
 			return NULL;
-		}
 
-		args = PyTuple_New(1 + (arg? 1 : 0));
-
-		name_obj = PyUnicode_FromString(name);
-		PyTuple_SetItem(args, 0, name_obj);
-
-		if (arg != NULL) {
-			PyTuple_SetItem(args, 1, arg);
-			Py_INCREF(arg);
-		}
+		func = cls->callable;
+		if (cls->name_obj)
+			argv[argc++] = cls->name_obj;
 	} else {
 #if 1
 		module = theModule;
@@ -228,21 +412,18 @@ marshal48_instantiate_ruby_type_with_arg(const char *name, PyObject *arg, ruby_c
 			return NULL;
 
 		func = PyDict_GetItemString(PyModule_GetDict(module), name);
-		if (!PyCallable_Check(func)) {
+		if (func == NULL || !PyCallable_Check(func)) {
 			PyErr_Format(PyExc_TypeError, "ruby: cannot instantiate %s", name);
 			return NULL;
 		}
-
-		if (arg != NULL) {
-			args = PyTuple_New(1);
-			PyTuple_SetItem(args, 0, arg);
-		} else {
-			args = PyTuple_New(0);
-		}
 	}
 
-	result = PyObject_CallObject(func, args);
-	Py_DECREF(args);
+	if (arg != NULL)
+		argv[argc++] = arg;
+
+	if (converter)
+		converter->factory_calls++;
+	result = marshal48_call_vector(func, argv, argc);
 
 	/* Returning None is just like throwing an exception */
 	if (result == Py_None) {
@@ -256,6 +437,14 @@ marshal48_instantiate_ruby_type_with_arg(const char *name, PyObject *arg, ruby_c
 PyObject *
 marshal48_instantiate_ruby_type(const char *name, ruby_converter_t *converter)
 {
+	PyObject *result;
+
+	/* Gem::Version objects do not need their constructor called */
+	if (converter && (result = marshal48_version_instantiate(name, converter)) != NULL)
+		return result;
+	if (PyErr_Occurred())
+		return NULL;
+
 	return marshal48_instantiate_ruby_type_with_arg(name, NULL, converter);
 }
 
@@ -276,6 +465,11 @@ PyInit_marshal48(void)
 	if (m == NULL)
 		return NULL;
 
+	marshal48_registerType(m, "Iterator", &marshal48_IteratorType);
+	marshal48_registerType(m, "Version", &marshal48_VersionType);
+	marshal48_registerType(m, "Requirement", &marshal48_RequirementType);
+	marshal48_registerType(m, "Resolver", &marshal48_ResolverType);
+
 	theModule = m;
 	return m;
 }
@@ -26,10 +26,40 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "ruby.h"
 
-extern ruby_instance_t *marshal48_unmarshal_io(ruby_context_t *ruby, PyObject *io, bool quiet);
+extern ruby_instance_t *marshal48_unmarshal_io(ruby_context_t *ruby, PyObject *io, unsigned int bufsize,
+				int compression, bool quiet);
+extern PyObject *	marshal48_unmarshal_direct(ruby_context_t *ruby, PyObject *io, unsigned int bufsize,
+				int compression, ruby_converter_t *converter, bool quiet);
+extern ruby_instance_t *marshal48_unmarshal_memory(ruby_context_t *ruby, const void *data, unsigned long len,
+				int compression, bool quiet);
+extern struct ruby_marshal *marshal48_unmarshal_open(ruby_context_t *ruby, PyObject *io, unsigned int bufsize,
+				int compression, bool quiet);
+extern bool		marshal48_parse_compression(const char *name, int *compressionp);
+extern bool		marshal48_check_bufsize(unsigned int bufsize);
+extern bool		marshal48_unmarshal_array_begin(struct ruby_marshal *, long *count);
+extern PyTypeObject	marshal48_IteratorType;
+
+extern PyObject *	marshal48_iterator_new(ruby_context_t *ruby, struct ruby_marshal *, ruby_converter_t *, long count);
 extern bool		marshal48_marshal_io(ruby_context_t *ruby, ruby_instance_t *, PyObject *io, bool quiet);
+extern PyObject *	marshal48_marshal_bytes(ruby_context_t *ruby, ruby_instance_t *, bool quiet);
 extern PyObject *	marshal48_instantiate_ruby_type(const char *name, ruby_converter_t *);
 extern PyObject *	marshal48_instantiate_ruby_type_with_arg(const char *name, PyObject *, ruby_converter_t *);
+extern PyObject *	marshal48_version_instantiate(const char *classname, ruby_converter_t *);
+extern bool		marshal48_version_check(PyObject *);
+extern bool		marshal48_version_set(PyObject *, PyObject *string);
+extern PyTypeObject	marshal48_VersionType;
+extern PyTypeObject	marshal48_RequirementType;
+extern PyObject *	marshal48_version_from_object(PyObject *);
+extern int		marshal48_version_compare(PyObject *, PyObject *);
+extern bool		marshal48_version_is_prerelease(PyObject *);
+extern PyObject *	marshal48_requirement_from_object(PyObject *);
+extern bool		marshal48_requirement_match(PyObject *req, PyObject *version);
+extern PyTypeObject	marshal48_ResolverType;
+extern PyObject *	marshal48_UnmarshalMany(PyObject *, PyObject *, PyObject *);
+extern PyObject *	marshal48_UnmarshalSpecs(PyObject *, PyObject *, PyObject *);
+extern PyObject *	marshal48_Stats(PyObject *, PyObject *, PyObject *);
+extern PyObject *	marshal48_ProfileUnmarshal(PyObject *, PyObject *, PyObject *);
+extern PyObject *	marshal48_ProfileMarshal(PyObject *, PyObject *, PyObject *);
 
 static inline void
 assign_string(char **var, const char *str)
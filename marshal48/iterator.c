@@ -0,0 +1,157 @@
+/*
+Ruby marshal48 - iterate over top-level arrays
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+#include "ruby_utils.h"
+#include "ruby_marshal.h"
+#include "stats.h"
+
+typedef struct {
+	PyObject_HEAD
+
+	ruby_context_t *	ruby;
+	ruby_marshal_t *	marshal;
+	ruby_converter_t *	converter;
+	long			remaining;
+
+	/* Time spent in next(), for marshal48.stats() */
+	double			elapsed;
+} marshal48_Iterator;
+
+static void		Iterator_dealloc(marshal48_Iterator *self);
+static PyObject *	Iterator_next(marshal48_Iterator *self);
+
+/*
+ * Define the python bindings of class "Iterator"
+ *
+ * Objects are created using
+ *   for item in marshal48.iter_unmarshal(io, factory):
+ *	...
+ */
+PyTypeObject marshal48_IteratorType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+
+	.tp_name	= "marshal48.Iterator",
+	.tp_basicsize	= sizeof(marshal48_Iterator),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Iterate over the elements of a marshaled array",
+
+	.tp_iter	= PyObject_SelfIter,
+	.tp_iternext	= (iternextfunc) Iterator_next,
+	.tp_dealloc	= (destructor) Iterator_dealloc,
+};
+
+/*
+ * Release all the unmarshal state as soon as we're done, rather than waiting
+ * for the iterator object to be garbage collected.
+ */
+static void
+Iterator_close(marshal48_Iterator *self)
+{
+	if (self->ruby)
+		marshal48_stats_add_phase("iterate", self->elapsed);
+	if (self->marshal) {
+		ruby_unmarshal_free(self->marshal);
+		self->marshal = NULL;
+	}
+	if (self->converter) {
+		ruby_converter_free(self->converter);
+		self->converter = NULL;
+	}
+	if (self->ruby) {
+		ruby_context_free(self->ruby);
+		self->ruby = NULL;
+	}
+	self->remaining = 0;
+}
+
+static void
+Iterator_dealloc(marshal48_Iterator *self)
+{
+	Iterator_close(self);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/*
+ * Every element is unmarshaled in a transient scope and released right
+ * after conversion.
+ */
+static PyObject *
+Iterator_next(marshal48_Iterator *self)
+{
+	ruby_instance_t *instance;
+	PyObject *result = NULL;
+	double t0;
+
+	if (self->remaining <= 0) {
+		Iterator_close(self);
+		return NULL;
+	}
+
+	t0 = marshal48_stats_now();
+
+	ruby_context_begin_transient(self->ruby);
+	instance = ruby_unmarshal_next_instance(self->marshal);
+	self->remaining -= 1;
+
+	if (instance != NULL)
+		result = ruby_instance_to_python(instance, self->converter);
+	if (!ruby_context_end_transient(self->ruby, self->converter))
+		drop_object(&result);
+
+	self->elapsed += marshal48_stats_now() - t0;
+
+	/* This may have been the last element; it's an error all the same */
+	if (result == NULL) {
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_RuntimeError, "marshal48: unable to unmarshal array element");
+		Iterator_close(self);
+		return NULL;
+	}
+
+	if (self->remaining == 0)
+		Iterator_close(self);
+	return result;
+}
+
+/*
+ * Takes ownership of ruby context, unmarshal state and converter.
+ */
+PyObject *
+marshal48_iterator_new(ruby_context_t *ruby, ruby_marshal_t *marshal, ruby_converter_t *converter, long count)
+{
+	marshal48_Iterator *self;
+
+	self = PyObject_New(marshal48_Iterator, &marshal48_IteratorType);
+	if (self == NULL) {
+		ruby_unmarshal_free(marshal);
+		ruby_converter_free(converter);
+		ruby_context_free(ruby);
+		return NULL;
+	}
+
+	self->ruby = ruby;
+	self->marshal = marshal;
+	self->converter = converter;
+	self->remaining = count;
+	self->elapsed = 0;
+
+	return (PyObject *) self;
+}
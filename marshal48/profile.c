@@ -0,0 +1,196 @@
+/*
+Ruby marshal48 - per-phase profiling for the benchmark harness
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <time.h>
+
+#include "extension.h"
+#include "ruby_utils.h"
+
+/*
+ * These do exactly what marshal48.unmarshal() and marshal48.marshal() do,
+ * but take the time and peak RSS after each phase. From python, the two
+ * phases cannot be told apart, so marshal48/bench/bench.py uses these.
+ */
+static double
+__profile_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static bool
+__profile_set(PyObject *dict, const char *key, PyObject *value)
+{
+	int rv;
+
+	if (value == NULL)
+		return false;
+	rv = PyDict_SetItemString(dict, key, value);
+	Py_DECREF(value);
+	return rv >= 0;
+}
+
+static bool
+__profile_phase(PyObject *dict, const char *phase, double t0, double t1)
+{
+	char key[64];
+
+	snprintf(key, sizeof(key), "%s_time", phase);
+	if (!__profile_set(dict, key, PyFloat_FromDouble(t1 - t0)))
+		return false;
+
+	snprintf(key, sizeof(key), "%s_maxrss", phase);
+	return __profile_set(dict, key, PyLong_FromUnsignedLong(__report_memory_rss()));
+}
+
+static bool
+__profile_context(PyObject *dict, ruby_context_t *ruby)
+{
+	unsigned int nsymbols, nobjects, nephemerals;
+	unsigned long ninstances, arena_bytes;
+
+	ruby_context_stats(ruby, &nsymbols, &nobjects, &nephemerals, &ninstances, &arena_bytes);
+	return __profile_set(dict, "symbols", PyLong_FromUnsignedLong(nsymbols))
+	    && __profile_set(dict, "objects", PyLong_FromUnsignedLong(nobjects))
+	    && __profile_set(dict, "ephemerals", PyLong_FromUnsignedLong(nephemerals))
+	    && __profile_set(dict, "instances", PyLong_FromUnsignedLong(ninstances))
+	    && __profile_set(dict, "arena_bytes", PyLong_FromUnsignedLong(arena_bytes));
+}
+
+/*
+ * _profile_unmarshal(io, factory, constructors=None) -> (object, stats)
+ */
+PyObject *
+marshal48_ProfileUnmarshal(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"io",
+		"factory",
+		"constructors",
+		NULL
+	};
+	PyObject *io, *factory, *constructors = NULL;
+	PyObject *stats = NULL, *converted = NULL, *result = NULL;
+	ruby_converter_t *converter;
+	ruby_instance_t *unmarshaled;
+	ruby_context_t *ruby;
+	double t0, t1, t2;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|O!", kwlist, &io, &factory,
+				&PyDict_Type, &constructors))
+		return NULL;
+
+	if (!(stats = PyDict_New()))
+		return NULL;
+
+	ruby = ruby_context_new();
+
+	t0 = __profile_now();
+	unmarshaled = marshal48_unmarshal_io(ruby, io, 0, RUBY_COMPRESSION_NONE, true);
+	t1 = __profile_now();
+
+	if (unmarshaled == NULL) {
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_RuntimeError, "marshal48: unable to unmarshal data");
+		goto out;
+	}
+
+	if (!__profile_phase(stats, "decode", t0, t1)
+	 || !__profile_context(stats, ruby))
+		goto out;
+
+	converter = ruby_converter_new(ruby, factory);
+	if (constructors)
+		ruby_converter_set_constructors(converter, constructors);
+	converted = ruby_instance_to_python(unmarshaled, converter);
+	t2 = __profile_now();
+	ruby_converter_free(converter);
+
+	if (converted == NULL || !__profile_phase(stats, "to_python", t1, t2))
+		goto out;
+
+	result = PyTuple_Pack(2, converted, stats);
+
+out:
+	ruby_context_free(ruby);
+	Py_XDECREF(converted);
+	Py_DECREF(stats);
+	return result;
+}
+
+/*
+ * _profile_marshal(object, io) -> stats
+ */
+PyObject *
+marshal48_ProfileMarshal(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"object",
+		"io",
+		NULL
+	};
+	PyObject *object, *io, *stats, *result = NULL;
+	ruby_converter_t *converter;
+	ruby_instance_t *instance;
+	ruby_context_t *ruby;
+	double t0, t1, t2;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO", kwlist, &object, &io))
+		return NULL;
+
+	if (!(stats = PyDict_New()))
+		return NULL;
+
+	ruby = ruby_context_new();
+
+	t0 = __profile_now();
+	converter = ruby_converter_new(ruby, NULL);
+	instance = ruby_instance_from_python(object, converter);
+	ruby_converter_free(converter);
+	t1 = __profile_now();
+
+	if (instance == NULL) {
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_RuntimeError, "marshal48: unable to convert object");
+		goto out;
+	}
+
+	if (!__profile_phase(stats, "from_python", t0, t1))
+		goto out;
+
+	if (!marshal48_marshal_io(ruby, instance, io, true)) {
+		PyErr_SetString(PyExc_RuntimeError, "Unable to marshal objects to file");
+		goto out;
+	}
+	t2 = __profile_now();
+
+	if (!__profile_phase(stats, "encode", t1, t2)
+	 || !__profile_context(stats, ruby))
+		goto out;
+
+	result = stats;
+	Py_INCREF(result);
+
+out:
+	ruby_context_free(ruby);
+	Py_DECREF(stats);
+	return result;
+}
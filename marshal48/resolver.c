@@ -0,0 +1,935 @@
+/*
+Ruby marshal48 - dependency resolver
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdint.h>
+
+#include "extension.h"
+
+/*
+ * Resolver(candidates, dependencies)
+ *
+ * candidates(name) returns the (version, item) pairs available for a
+ * package, or None if there are none. dependencies(item) returns the
+ * requirements of one candidate as (name, requirement[, prerelease[, tag]])
+ * tuples, or None if the candidate cannot be used at all.
+ *
+ * Both callbacks are called at most once per package and candidate, and
+ * the results are kept across calls to resolve(). Candidate versions are
+ * sorted once, highest first, and requirements are compiled once, so that
+ * the search itself never calls into python except to fetch data it has
+ * not seen yet.
+ *
+ * resolve() decides one package at a time, trying the highest acceptable
+ * version first, and backtracks when a choice leads to a conflict. The
+ * outcome of a subtree depends only on the set of decisions made so far,
+ * so the sets that were shown to fail are remembered and never searched
+ * again. If there is no solution, or the search takes too long, resolve()
+ * falls back to picking the best version for each package without
+ * backtracking, and reports whatever it could not satisfy.
+ */
+#define RESOLVER_UNDECIDED	-1
+#define RESOLVER_MISSING	-2
+
+#define RESOLVER_DEFAULT_MAX_STEPS	100000
+
+struct resolver_dep {
+	unsigned int		pkg;
+	PyObject *		requirement;
+	bool			prerelease;
+	PyObject *		tag;
+};
+
+typedef struct {
+	PyObject *		version;
+	PyObject *		item;
+	bool			prerelease;
+	unsigned int		seq;		/* position in the candidates() result */
+
+	bool			loaded;
+	bool			unusable;
+	unsigned int		ndeps;
+	struct resolver_dep *	deps;
+} resolver_candidate_t;
+
+typedef struct {
+	PyObject *		name;
+
+	bool			loaded;
+	unsigned int		ncandidates;
+	resolver_candidate_t *	candidates;
+
+	/* State of the current resolve() call */
+	int			chosen;
+	bool			queued;
+	int			last_constraint;
+	unsigned int		nconstraints;
+	unsigned int		nprerelease;
+} resolver_package_t;
+
+typedef struct {
+	unsigned int		pkg;
+	int			prev;		/* previous constraint on the same package */
+	PyObject *		requirement;	/* borrowed from the dep or root */
+	bool			prerelease;
+	PyObject *		tag;		/* borrowed, too */
+} resolver_constraint_t;
+
+typedef struct {
+	PyObject_HEAD
+
+	PyObject *		candidates_fn;
+	PyObject *		dependencies_fn;
+
+	/* Maps package names to indices into packages */
+	PyObject *		names;
+
+	unsigned int		npackages, packages_size;
+	resolver_package_t *	packages;
+
+	/* State of the current resolve() call */
+	bool			busy;
+	bool			lenient;
+	bool			exhausted;
+
+	unsigned int		nconstraints, constraints_size;
+	resolver_constraint_t *	constraints;
+
+	unsigned int		nqueue, queue_size;
+	unsigned int *		queue;
+
+	unsigned int		ndecisions, decisions_size;
+	unsigned int *		decisions;
+
+	/* Sets of decisions known to fail, by signature */
+	uint64_t		signature;
+	unsigned int		nfailed, failed_size;
+	uint64_t *		failed;
+
+	PyObject *		conflicts;
+
+	unsigned long		max_steps;
+	unsigned long		steps;
+	unsigned long		backtracks;
+	unsigned long		memo_hits;
+} marshal48_Resolver;
+
+static void *
+__resolver_tailroom(void *values, unsigned int *size, unsigned int count, size_t elem_size)
+{
+	if (count >= *size) {
+		*size = *size? 2 * *size : 16;
+		values = realloc(values, *size * elem_size);
+	}
+	return values;
+}
+
+#define resolver_tailroom(self, what) \
+	((self)->what = __resolver_tailroom((self)->what, &(self)->what ## _size, (self)->n ## what, sizeof((self)->what[0])))
+
+/*
+ * Each decision contributes one hash to the signature of the decision
+ * set. They are combined with xor, so that the order in which they were
+ * made does not matter.
+ */
+static inline uint64_t
+__resolver_mix(unsigned int pkg, int chosen)
+{
+	uint64_t x = ((uint64_t) pkg << 32) | (uint32_t) chosen;
+
+	/* splitmix64 */
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static bool
+__resolver_failed_contains(const marshal48_Resolver *self, uint64_t sig)
+{
+	unsigned int slot;
+
+	if (self->failed_size == 0)
+		return false;
+
+	slot = sig & (self->failed_size - 1);
+	while (self->failed[slot]) {
+		if (self->failed[slot] == sig)
+			return true;
+		slot = (slot + 1) & (self->failed_size - 1);
+	}
+	return false;
+}
+
+static void
+__resolver_failed_insert(marshal48_Resolver *self, uint64_t sig)
+{
+	unsigned int slot;
+
+	/* Zero marks empty slots. It is also the signature of the empty
+	 * decision set, and there is no point in remembering that one. */
+	if (sig == 0)
+		return;
+
+	if (2 * (self->nfailed + 1) > self->failed_size) {
+		uint64_t *old = self->failed;
+		unsigned int i, old_size = self->failed_size;
+
+		self->failed_size = old_size? 2 * old_size : 256;
+		self->failed = calloc(self->failed_size, sizeof(self->failed[0]));
+		self->nfailed = 0;
+
+		for (i = 0; i < old_size; ++i) {
+			if (old[i])
+				__resolver_failed_insert(self, old[i]);
+		}
+		free(old);
+	}
+
+	slot = sig & (self->failed_size - 1);
+	while (self->failed[slot]) {
+		if (self->failed[slot] == sig)
+			return;
+		slot = (slot + 1) & (self->failed_size - 1);
+	}
+	self->failed[slot] = sig;
+	self->nfailed++;
+}
+
+/*
+ * Returns the index of the package, creating it if needed; -1 on error
+ */
+static int
+__resolver_package_index(marshal48_Resolver *self, PyObject *name)
+{
+	resolver_package_t *pkg;
+	PyObject *index;
+
+	if (!PyUnicode_Check(name)) {
+		PyErr_Format(PyExc_TypeError, "Resolver: package name must be a string, not %s", Py_TYPE(name)->tp_name);
+		return -1;
+	}
+
+	if ((index = PyDict_GetItem(self->names, name)) != NULL)
+		return PyLong_AsLong(index);
+
+	if (!(index = PyLong_FromUnsignedLong(self->npackages)))
+		return -1;
+	if (PyDict_SetItem(self->names, name, index) < 0) {
+		Py_DECREF(index);
+		return -1;
+	}
+	Py_DECREF(index);
+
+	resolver_tailroom(self, packages);
+	pkg = &self->packages[self->npackages];
+	memset(pkg, 0, sizeof(*pkg));
+	pkg->name = name;
+	Py_INCREF(name);
+	pkg->chosen = RESOLVER_UNDECIDED;
+	pkg->last_constraint = -1;
+
+	return self->npackages++;
+}
+
+static int
+__resolver_candidate_compare(const void *a, const void *b)
+{
+	const resolver_candidate_t *ca = a, *cb = b;
+	int r;
+
+	/* Highest version first; keep the caller's order for equal versions */
+	if ((r = marshal48_version_compare(cb->version, ca->version)) != 0)
+		return r;
+	return ca->seq < cb->seq? -1 : 1;
+}
+
+static bool
+__resolver_load_candidates(marshal48_Resolver *self, unsigned int index)
+{
+	resolver_candidate_t *candidates;
+	PyObject *result, *seq;
+	Py_ssize_t i, count;
+	bool ok = false;
+
+	if (self->packages[index].loaded)
+		return true;
+
+	if (!(result = PyObject_CallFunctionObjArgs(self->candidates_fn, self->packages[index].name, NULL)))
+		return false;
+
+	if (result == Py_None) {
+		self->packages[index].loaded = true;
+		Py_DECREF(result);
+		return true;
+	}
+
+	seq = PySequence_Fast(result, "Resolver: candidates() must return a sequence of (version, item) pairs");
+	Py_DECREF(result);
+	if (seq == NULL)
+		return false;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	candidates = calloc(count + 1, sizeof(candidates[0]));
+	for (i = 0; i < count; ++i) {
+		resolver_candidate_t *cand = &candidates[i];
+		PyObject *version, *item;
+
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "OO", &version, &item))
+			goto out;
+
+		if (!(cand->version = marshal48_version_from_object(version)))
+			goto out;
+		cand->item = item;
+		Py_INCREF(item);
+		cand->prerelease = marshal48_version_is_prerelease(cand->version);
+		cand->seq = i;
+	}
+
+	qsort(candidates, count, sizeof(candidates[0]), __resolver_candidate_compare);
+	ok = true;
+
+out:
+	if (!ok) {
+		for (i = 0; i < count; ++i) {
+			Py_XDECREF(candidates[i].version);
+			Py_XDECREF(candidates[i].item);
+		}
+		free(candidates);
+	} else {
+		/* The callback may have added packages, so look it up again */
+		resolver_package_t *pkg = &self->packages[index];
+
+		pkg->candidates = candidates;
+		pkg->ncandidates = count;
+		pkg->loaded = true;
+	}
+
+	Py_DECREF(seq);
+	return ok;
+}
+
+static bool
+__resolver_parse_dep(marshal48_Resolver *self, PyObject *obj, struct resolver_dep *dep)
+{
+	PyObject *name, *requirement, *tag = NULL;
+	int prerelease = 0, index;
+
+	if (!PyArg_ParseTuple(obj, "OO|pO", &name, &requirement, &prerelease, &tag))
+		return false;
+
+	if ((index = __resolver_package_index(self, name)) < 0)
+		return false;
+
+	if (!(dep->requirement = marshal48_requirement_from_object(requirement)))
+		return false;
+
+	if (tag == NULL || tag == Py_None)
+		tag = name;
+
+	dep->pkg = index;
+	dep->prerelease = prerelease;
+	dep->tag = tag;
+	Py_INCREF(tag);
+	return true;
+}
+
+static void
+__resolver_free_deps(struct resolver_dep *deps, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		Py_XDECREF(deps[i].requirement);
+		Py_XDECREF(deps[i].tag);
+	}
+	free(deps);
+}
+
+static bool
+__resolver_load_dependencies(marshal48_Resolver *self, resolver_candidate_t *cand)
+{
+	struct resolver_dep *deps;
+	PyObject *result, *seq;
+	Py_ssize_t i, count;
+
+	if (cand->loaded)
+		return true;
+
+	if (!(result = PyObject_CallFunctionObjArgs(self->dependencies_fn, cand->item, NULL)))
+		return false;
+
+	if (result == Py_None) {
+		cand->unusable = true;
+		cand->loaded = true;
+		Py_DECREF(result);
+		return true;
+	}
+
+	seq = PySequence_Fast(result, "Resolver: dependencies() must return a sequence of tuples");
+	Py_DECREF(result);
+	if (seq == NULL)
+		return false;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	deps = calloc(count + 1, sizeof(deps[0]));
+	for (i = 0; i < count; ++i) {
+		if (!__resolver_parse_dep(self, PySequence_Fast_GET_ITEM(seq, i), &deps[i])) {
+			__resolver_free_deps(deps, count);
+			Py_DECREF(seq);
+			return false;
+		}
+	}
+	Py_DECREF(seq);
+
+	cand->deps = deps;
+	cand->ndeps = count;
+	cand->loaded = true;
+	return true;
+}
+
+static bool
+__resolver_acceptable(const marshal48_Resolver *self, const resolver_package_t *pkg, const resolver_candidate_t *cand)
+{
+	int c;
+
+	if (cand->unusable)
+		return false;
+
+	/* Like rubygems, consider prereleases only if someone asked for them */
+	if (cand->prerelease && pkg->nprerelease == 0)
+		return false;
+
+	for (c = pkg->last_constraint; c >= 0; c = self->constraints[c].prev) {
+		if (!marshal48_requirement_match(self->constraints[c].requirement, cand->version))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Add a constraint on a package. Returns 1 if it can still be satisfied,
+ * 0 if it conflicts with what we have decided so far, and -1 on error.
+ */
+static int
+__resolver_constrain(marshal48_Resolver *self, unsigned int index, PyObject *requirement, bool prerelease, PyObject *tag)
+{
+	resolver_constraint_t *c;
+	resolver_package_t *pkg;
+	unsigned int i;
+
+	resolver_tailroom(self, constraints);
+	c = &self->constraints[self->nconstraints];
+	c->pkg = index;
+	c->requirement = requirement;
+	c->prerelease = prerelease;
+	c->tag = tag;
+
+	pkg = &self->packages[index];
+	c->prev = pkg->last_constraint;
+	pkg->last_constraint = self->nconstraints++;
+	pkg->nconstraints++;
+	if (prerelease)
+		pkg->nprerelease++;
+
+	if (!pkg->queued) {
+		resolver_tailroom(self, queue);
+		self->queue[self->nqueue++] = index;
+		pkg->queued = true;
+	}
+
+	if (pkg->chosen == RESOLVER_MISSING)
+		return 1;
+
+	if (pkg->chosen >= 0) {
+		if (marshal48_requirement_match(requirement, pkg->candidates[pkg->chosen].version))
+			return 1;
+	} else {
+		if (self->lenient)
+			return 1;
+
+		/* Check early whether any candidate is left; this saves us from
+		 * finding out only after deciding lots of other packages. */
+		if (!__resolver_load_candidates(self, index))
+			return -1;
+
+		pkg = &self->packages[index];
+		if (pkg->ncandidates == 0)
+			return 1;
+
+		for (i = 0; i < pkg->ncandidates; ++i) {
+			if (__resolver_acceptable(self, pkg, &pkg->candidates[i]))
+				return 1;
+		}
+	}
+
+	if (self->lenient) {
+		if (PyList_Append(self->conflicts, tag) < 0)
+			return -1;
+		return 1;
+	}
+	return 0;
+}
+
+static void
+__resolver_unconstrain(marshal48_Resolver *self, unsigned int mark)
+{
+	while (self->nconstraints > mark) {
+		resolver_constraint_t *c = &self->constraints[--(self->nconstraints)];
+		resolver_package_t *pkg = &self->packages[c->pkg];
+
+		pkg->last_constraint = c->prev;
+		pkg->nconstraints--;
+		if (c->prerelease)
+			pkg->nprerelease--;
+	}
+}
+
+static void
+__resolver_decide(marshal48_Resolver *self, unsigned int index, int chosen)
+{
+	self->packages[index].chosen = chosen;
+	self->signature ^= __resolver_mix(index, chosen);
+
+	resolver_tailroom(self, decisions);
+	self->decisions[self->ndecisions++] = index;
+}
+
+static void
+__resolver_undo(marshal48_Resolver *self, unsigned int index, unsigned int mark)
+{
+	resolver_package_t *pkg = &self->packages[index];
+
+	__resolver_unconstrain(self, mark);
+
+	self->signature ^= __resolver_mix(index, pkg->chosen);
+	pkg->chosen = RESOLVER_UNDECIDED;
+	self->ndecisions--;
+}
+
+/*
+ * The next package to decide is the first one we heard of that is still
+ * required by anyone. After backtracking, the queue may hold packages
+ * that nobody requires anymore; these are skipped.
+ */
+static int
+__resolver_next(const marshal48_Resolver *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->nqueue; ++i) {
+		const resolver_package_t *pkg = &self->packages[self->queue[i]];
+
+		if (pkg->chosen == RESOLVER_UNDECIDED && pkg->nconstraints)
+			return self->queue[i];
+	}
+	return -1;
+}
+
+static int
+__resolver_search(marshal48_Resolver *self);
+
+/*
+ * Decide the package and search on. If that fails, the decision is undone.
+ */
+static int
+__resolver_try(marshal48_Resolver *self, unsigned int index, int chosen)
+{
+	unsigned int i, mark = self->nconstraints;
+	int r = 1;
+
+	__resolver_decide(self, index, chosen);
+
+	if (chosen >= 0) {
+		resolver_candidate_t *cand = &self->packages[index].candidates[chosen];
+
+		for (i = 0; i < cand->ndeps && r > 0; ++i) {
+			struct resolver_dep *dep = &cand->deps[i];
+
+			r = __resolver_constrain(self, dep->pkg, dep->requirement, dep->prerelease, dep->tag);
+		}
+	}
+
+	if (r > 0)
+		r = __resolver_search(self);
+
+	/* On success, we keep the state for the caller to collect. When we
+	 * ran out of steps, resolve() starts over anyway. */
+	if (r == 0 && !self->exhausted)
+		__resolver_undo(self, index, mark);
+	return r;
+}
+
+/*
+ * Returns 1 if all remaining packages could be decided, 0 if not, and
+ * -1 on error
+ */
+static int
+__resolver_search(marshal48_Resolver *self)
+{
+	resolver_package_t *pkg;
+	uint64_t signature;
+	unsigned int i;
+	int index, r;
+
+	if (!self->lenient && __resolver_failed_contains(self, self->signature)) {
+		self->memo_hits++;
+		return 0;
+	}
+
+	if ((index = __resolver_next(self)) < 0)
+		return 1;
+
+	if (!__resolver_load_candidates(self, index))
+		return -1;
+
+	signature = self->signature;
+	for (i = 0; i < self->packages[index].ncandidates; ++i) {
+		resolver_candidate_t *cand = &self->packages[index].candidates[i];
+
+		if (!self->lenient && ++(self->steps) > self->max_steps) {
+			self->exhausted = true;
+			return 0;
+		}
+
+		if (!__resolver_acceptable(self, &self->packages[index], cand))
+			continue;
+
+		if (!__resolver_load_dependencies(self, cand))
+			return -1;
+		if (cand->unusable)
+			continue;
+
+		if ((r = __resolver_try(self, index, i)) != 0 || self->exhausted)
+			return r;
+		self->backtracks++;
+	}
+
+	/* A package that is not in the index at all is simply missing; there
+	 * is no point in backtracking over it. In lenient mode, the same goes
+	 * for packages that have no acceptable version. */
+	pkg = &self->packages[index];
+	if (self->lenient || pkg->ncandidates == 0) {
+		if ((r = __resolver_try(self, index, RESOLVER_MISSING)) != 0 || self->exhausted)
+			return r;
+	}
+
+	__resolver_failed_insert(self, signature);
+	return 0;
+}
+
+struct resolver_root {
+	unsigned int		pkg;
+	PyObject *		requirement;
+	bool			prerelease;
+	PyObject *		tag;
+};
+
+static void
+__resolver_reset(marshal48_Resolver *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->npackages; ++i) {
+		resolver_package_t *pkg = &self->packages[i];
+
+		pkg->chosen = RESOLVER_UNDECIDED;
+		pkg->queued = false;
+		pkg->last_constraint = -1;
+		pkg->nconstraints = 0;
+		pkg->nprerelease = 0;
+	}
+
+	self->nconstraints = 0;
+	self->nqueue = 0;
+	self->ndecisions = 0;
+	self->signature = 0;
+	self->exhausted = false;
+
+	if (self->failed)
+		memset(self->failed, 0, self->failed_size * sizeof(self->failed[0]));
+	self->nfailed = 0;
+}
+
+static int
+__resolver_run(marshal48_Resolver *self, struct resolver_root *roots, unsigned int nroots, bool lenient)
+{
+	unsigned int i;
+	int r;
+
+	__resolver_reset(self);
+	self->lenient = lenient;
+
+	for (i = 0; i < nroots; ++i) {
+		struct resolver_root *root = &roots[i];
+
+		r = __resolver_constrain(self, root->pkg, root->requirement, root->prerelease, root->tag);
+		if (r <= 0)
+			return r;
+	}
+
+	return __resolver_search(self);
+}
+
+/*
+ * Returns the items chosen, in the order they were decided, and the tags
+ * of the requirements that could not be satisfied
+ */
+static PyObject *
+__resolver_result(marshal48_Resolver *self)
+{
+	PyObject *items, *missing, *result = NULL;
+	unsigned int i;
+
+	if (!(items = PyList_New(0)))
+		return NULL;
+	if (!(missing = PyList_New(0)))
+		goto out;
+
+	for (i = 0; i < self->ndecisions; ++i) {
+		resolver_package_t *pkg = &self->packages[self->decisions[i]];
+		int c;
+
+		if (pkg->chosen >= 0) {
+			if (PyList_Append(items, pkg->candidates[pkg->chosen].item) < 0)
+				goto out;
+			continue;
+		}
+
+		for (c = pkg->last_constraint; c >= 0; c = self->constraints[c].prev) {
+			if (PyList_Append(missing, self->constraints[c].tag) < 0)
+				goto out;
+		}
+	}
+
+	for (i = 0; i < PyList_GET_SIZE(self->conflicts); ++i) {
+		if (PyList_Append(missing, PyList_GET_ITEM(self->conflicts, i)) < 0)
+			goto out;
+	}
+
+	result = PyTuple_Pack(2, items, missing);
+
+out:
+	Py_DECREF(items);
+	Py_XDECREF(missing);
+	return result;
+}
+
+static bool
+__resolver_parse_root(marshal48_Resolver *self, PyObject *obj, struct resolver_root *root)
+{
+	struct resolver_dep dep;
+
+	if (!__resolver_parse_dep(self, obj, &dep))
+		return false;
+
+	root->pkg = dep.pkg;
+	root->requirement = dep.requirement;
+	root->prerelease = dep.prerelease;
+	root->tag = dep.tag;
+	return true;
+}
+
+/*
+ * resolve(requirements, max_steps=100000) -> (items, missing)
+ *
+ * requirements are (name, requirement[, prerelease[, tag]]) tuples, like
+ * the ones returned by dependencies(). missing holds the tags (or names)
+ * of the requirements that could not be satisfied.
+ */
+static PyObject *
+Resolver_resolve(marshal48_Resolver *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"requirements",
+		"max_steps",
+		NULL
+	};
+	PyObject *requirements, *seq, *result = NULL;
+	unsigned long max_steps = RESOLVER_DEFAULT_MAX_STEPS;
+	struct resolver_root *roots;
+	Py_ssize_t i, nroots = 0, count;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|k", kwlist, &requirements, &max_steps))
+		return NULL;
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "Resolver: resolve() cannot be called from a callback");
+		return NULL;
+	}
+
+	if (!(seq = PySequence_Fast(requirements, "Resolver: requirements must be a sequence of tuples")))
+		return NULL;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	roots = calloc(count + 1, sizeof(roots[0]));
+	for (nroots = 0; nroots < count; ++nroots) {
+		if (!__resolver_parse_root(self, PySequence_Fast_GET_ITEM(seq, nroots), &roots[nroots]))
+			goto out;
+	}
+
+	if (!(self->conflicts = PyList_New(0)))
+		goto out;
+
+	self->busy = true;
+	self->max_steps = max_steps;
+	self->steps = self->backtracks = self->memo_hits = 0;
+
+	r = __resolver_run(self, roots, nroots, false);
+	if (r == 0)
+		r = __resolver_run(self, roots, nroots, true);
+	if (r > 0)
+		result = __resolver_result(self);
+	else if (r == 0)
+		PyErr_SetString(PyExc_RuntimeError, "Resolver: lenient search failed");
+
+	self->busy = false;
+	drop_object(&self->conflicts);
+
+out:
+	for (i = 0; i < nroots; ++i) {
+		Py_DECREF(roots[i].requirement);
+		Py_DECREF(roots[i].tag);
+	}
+	free(roots);
+	Py_DECREF(seq);
+	return result;
+}
+
+static int
+Resolver_init(marshal48_Resolver *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"candidates",
+		"dependencies",
+		NULL
+	};
+	PyObject *candidates_fn, *dependencies_fn;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO", kwlist, &candidates_fn, &dependencies_fn))
+		return -1;
+
+	if (!PyCallable_Check(candidates_fn) || !PyCallable_Check(dependencies_fn)) {
+		PyErr_SetString(PyExc_TypeError, "Resolver: candidates and dependencies must be callable");
+		return -1;
+	}
+
+	if (self->names != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Resolver: already initialized");
+		return -1;
+	}
+
+	if (!(self->names = PyDict_New()))
+		return -1;
+
+	assign_object(&self->candidates_fn, candidates_fn);
+	assign_object(&self->dependencies_fn, dependencies_fn);
+	return 0;
+}
+
+static void
+Resolver_dealloc(marshal48_Resolver *self)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < self->npackages; ++i) {
+		resolver_package_t *pkg = &self->packages[i];
+
+		for (j = 0; j < pkg->ncandidates; ++j) {
+			resolver_candidate_t *cand = &pkg->candidates[j];
+
+			Py_DECREF(cand->version);
+			Py_DECREF(cand->item);
+			__resolver_free_deps(cand->deps, cand->ndeps);
+		}
+		free(pkg->candidates);
+		Py_DECREF(pkg->name);
+	}
+	free(self->packages);
+
+	free(self->constraints);
+	free(self->queue);
+	free(self->decisions);
+	free(self->failed);
+
+	drop_object(&self->names);
+	drop_object(&self->candidates_fn);
+	drop_object(&self->dependencies_fn);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static bool
+__resolver_stat(PyObject *dict, const char *key, unsigned long value)
+{
+	PyObject *obj;
+	int rv;
+
+	if (!(obj = PyLong_FromUnsignedLong(value)))
+		return false;
+	rv = PyDict_SetItemString(dict, key, obj);
+	Py_DECREF(obj);
+	return rv >= 0;
+}
+
+/*
+ * Some numbers about the last call to resolve()
+ */
+static PyObject *
+Resolver_get_stats(marshal48_Resolver *self, void *closure)
+{
+	PyObject *dict;
+
+	if (!(dict = PyDict_New()))
+		return NULL;
+
+	if (!__resolver_stat(dict, "packages", self->npackages)
+	 || !__resolver_stat(dict, "steps", self->steps)
+	 || !__resolver_stat(dict, "backtracks", self->backtracks)
+	 || !__resolver_stat(dict, "memo_hits", self->memo_hits)
+	 || PyDict_SetItemString(dict, "lenient", self->lenient? Py_True : Py_False) < 0) {
+		Py_DECREF(dict);
+		return NULL;
+	}
+	return dict;
+}
+
+static PyMethodDef Resolver_methods[] = {
+	{ "resolve", (PyCFunction) Resolver_resolve, METH_VARARGS | METH_KEYWORDS, "Resolve a list of requirements, including all dependencies" },
+	{ NULL }
+};
+
+static PyGetSetDef Resolver_getset[] = {
+	{ "stats", (getter) Resolver_get_stats, NULL, "Statistics of the last resolve() call" },
+	{ NULL }
+};
+
+PyTypeObject marshal48_ResolverType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+
+	.tp_name	= "marshal48.Resolver",
+	.tp_basicsize	= sizeof(marshal48_Resolver),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Dependency resolver over an index of versions",
+
+	.tp_new		= PyType_GenericNew,
+	.tp_init	= (initproc) Resolver_init,
+	.tp_dealloc	= (destructor) Resolver_dealloc,
+	.tp_methods	= Resolver_methods,
+	.tp_getset	= Resolver_getset,
+};
@@ -28,6 +28,7 @@ typedef struct ruby_instance	ruby_instance_t;
 typedef struct ruby_type	ruby_type_t;
 typedef struct ruby_marshal	ruby_marshal_t;
 typedef struct ruby_converter	ruby_converter_t;
+typedef struct ruby_unmarshal_frame ruby_unmarshal_frame_t;
 
 /* anonymous decls for some structs */
 struct ruby_byteseq;
@@ -48,6 +49,11 @@ struct ruby_type {
 	bool		(*marshal)(ruby_instance_t *, ruby_marshal_t *);
 	ruby_instance_t *(*unmarshal)(ruby_marshal_t *);
 
+	/* Types that contain other instances are unmarshaled iteratively,
+	 * see ruby_unmarshal_next_instance() */
+	bool		(*unmarshal_begin)(ruby_marshal_t *, ruby_unmarshal_frame_t *);
+	bool		(*unmarshal_child)(ruby_marshal_t *, ruby_unmarshal_frame_t *, ruby_instance_t *);
+
 	void		(*del)(ruby_instance_t *);
 	const char *	(*repr)(ruby_instance_t *, ruby_repr_context_t *);
 	bool		(*set_var)(ruby_instance_t *self, ruby_instance_t *key, ruby_instance_t *value);
@@ -75,7 +81,27 @@ struct ruby_instance {
 struct ruby_converter {
 	ruby_context_t *context;
 	PyObject *	factory;
+	PyObject *	constructors;
 	struct ruby_instancedict *strings;
+
+	/* Shared python strings, see ruby_converter_intern() */
+	struct ruby_intern_table *interned;
+
+	/* Python objects converted so far, by identity and (for some
+	 * types) by value; see ruby_instance_from_python() */
+	struct ruby_objcache *seen;
+	PyObject *	values;
+
+	/* Calls into python to create objects, for marshal48.stats() */
+	unsigned long	factory_calls;
+
+	/* Cache of resolved constructors */
+	unsigned int	nclasses;
+	struct ruby_converter_class {
+		char *		classname;
+		PyObject *	name_obj;
+		PyObject *	callable;
+	} *		classes;
 };
 
 static inline void
@@ -115,10 +141,26 @@ extern void		ruby_context_free(ruby_context_t *);
 extern ruby_instance_t *ruby_context_get_symbol(ruby_context_t *, unsigned int);
 extern ruby_instance_t *ruby_context_get_object(ruby_context_t *, unsigned int);
 extern ruby_instance_t *ruby_context_find_symbol(ruby_context_t *, const char *);
+extern void		ruby_context_begin_transient(ruby_context_t *);
+extern bool		ruby_context_end_transient(ruby_context_t *, ruby_converter_t *);
+extern void		ruby_context_end_transient_keep(ruby_context_t *, const char *(*keep)(const ruby_instance_t *));
+extern void		ruby_context_add_symbol(ruby_context_t *, ruby_instance_t *);
+extern void		ruby_context_symbol_stats(ruby_context_t *,
+				unsigned long *lookups, unsigned long *hits,
+				unsigned int *avg_depth, unsigned int *avg_leaf_size);
+extern void		ruby_context_stats(ruby_context_t *,
+				unsigned int *nsymbols, unsigned int *nobjects,
+				unsigned int *nephemerals, unsigned long *ninstances,
+				unsigned long *arena_bytes);
 
 
 extern ruby_converter_t *ruby_converter_new(ruby_context_t *, PyObject *factory);
+extern void		ruby_converter_set_constructors(ruby_converter_t *, PyObject *constructors);
 extern void		ruby_converter_free(ruby_converter_t *);
+extern const struct ruby_converter_class *ruby_converter_find_class(ruby_converter_t *, const char *classname);
+extern PyObject *	ruby_converter_intern(ruby_converter_t *, const char *value);
+extern PyObject *	ruby_converter_intern_len(ruby_converter_t *, const char *value, size_t len);
+extern void		ruby_converter_report(ruby_converter_t *);
 
 extern PyObject *	ruby_instance_to_python(ruby_instance_t *self, ruby_converter_t *converter);
 extern ruby_instance_t *ruby_instance_from_python(PyObject *self, ruby_converter_t *converter);
@@ -138,19 +180,24 @@ extern bool		ruby_Int_check(const ruby_instance_t *self);
 extern long		ruby_Int_get_value(const ruby_instance_t *self);
 
 extern ruby_instance_t *ruby_String_new(ruby_context_t *, const char *);
+extern ruby_instance_t *ruby_String_new_len(ruby_context_t *, const char *, size_t);
 extern bool		ruby_String_check(const ruby_instance_t *self);
 extern const char *	ruby_String_get_value(const ruby_instance_t *self);
+extern const char *	ruby_String_get_bytes(const ruby_instance_t *self, size_t *lenp);
 
 extern ruby_instance_t *ruby_Array_new(ruby_context_t *);
 extern bool		ruby_Array_check(const ruby_instance_t *self);
 extern bool		ruby_Array_append(const ruby_instance_t *self, ruby_instance_t *item);
+extern ruby_instance_t *ruby_Array_get_item(const ruby_instance_t *self, unsigned int index);
 
 extern ruby_instance_t *ruby_Hash_new(ruby_context_t *);
 extern bool		ruby_Hash_check(const ruby_instance_t *self);
 extern bool		ruby_Hash_add(const ruby_instance_t *self, ruby_instance_t *key, ruby_instance_t *value);
+extern bool		ruby_Hash_set(const ruby_instance_t *self, ruby_instance_t *key, ruby_instance_t *value);
 
 extern ruby_instance_t *ruby_GenericObject_new(ruby_context_t *, const char *classname);
 extern bool		ruby_GenericObject_check(const ruby_instance_t *self);
+extern const char *	ruby_GenericObject_get_classname(const ruby_instance_t *self);
 extern ruby_instance_t *__ruby_GenericObject_new(ruby_context_t *, const char *classname, const ruby_type_t *type);
 extern bool		__ruby_GenericObject_apply_vars(ruby_instance_t *self, PyObject *result, ruby_converter_t *);
 
@@ -162,6 +209,7 @@ extern struct ruby_byteseq *__ruby_UserDefined_get_data_rw(ruby_instance_t *self
 extern ruby_instance_t *ruby_UserMarshal_new(ruby_context_t *ctx, const char *classname);
 extern bool		ruby_UserMarshal_check(const ruby_instance_t *self);
 extern bool		ruby_UserMarshal_set_data(ruby_instance_t *self, ruby_instance_t *data);
+extern ruby_instance_t *ruby_UserMarshal_get_data(const ruby_instance_t *self);
 
 extern char *		ruby_instance_as_string(ruby_instance_t *self);
 
@@ -45,33 +45,25 @@ ruby_Array_marshal(ruby_Array *self, ruby_marshal_t *marshal)
 	return true;
 }
 
-static ruby_instance_t *
-ruby_Array_unmarshal(ruby_marshal_t *marshal)
+static bool
+ruby_Array_unmarshal_begin(ruby_marshal_t *marshal, ruby_unmarshal_frame_t *frame)
 {
-	ruby_instance_t *array;
-	long i, count;
+	long count;
 
 	if (!ruby_unmarshal_next_fixnum(marshal, &count))
-		return NULL;
+		return false;
 
 	ruby_marshal_trace(marshal, "Decoding array with %ld objects", count);
 
-	array = ruby_Array_new(marshal->ruby);
-	if (array == NULL)
-		return NULL;
-
-	for (i = 0; i < count; ++i) {
-		ruby_instance_t *item;
-
-		item = ruby_unmarshal_next_instance(marshal);
-		if (item == NULL)
-			return NULL;
-
-		if (!ruby_Array_append(array, item))
-			return NULL;
-	}
+	frame->object = ruby_Array_new(marshal->ruby);
+	frame->remaining = count;
+	return frame->object != NULL;
+}
 
-	return array;
+static bool
+ruby_Array_unmarshal_child(ruby_marshal_t *marshal, ruby_unmarshal_frame_t *frame, ruby_instance_t *item)
+{
+	return ruby_Array_append(frame->object, item);
 }
 
 static void
@@ -134,6 +126,10 @@ ruby_Array_to_python(ruby_Array *self, ruby_converter_t *converter)
 
 		py_item = ruby_instance_to_python(ruby_item, converter);
 		if (py_item == NULL) {
+			/* Do not try to repr data that is nested too deeply */
+			if (PyErr_ExceptionMatches(PyExc_RecursionError))
+				goto failed;
+
 			fprintf(stderr, "Array item %u(%s): python conversion failed\n", i, ruby_item->op->name);
 			fprintf(stderr, "  item=%s\n", ruby_instance_repr(ruby_item));
 			// PyErr_Format(PyExc_RuntimeError, "Conversion of %s instance failed", ruby_item->op->name);
@@ -181,7 +177,8 @@ ruby_type_t ruby_Array_type = {
 	.registration	= RUBY_REG_OBJECT,
 
 	.marshal	= (ruby_instance_marshal_fn_t) ruby_Array_marshal,
-	.unmarshal	= (ruby_instance_unmarshal_fn_t) ruby_Array_unmarshal,
+	.unmarshal_begin= (ruby_instance_unmarshal_begin_fn_t) ruby_Array_unmarshal_begin,
+	.unmarshal_child= (ruby_instance_unmarshal_child_fn_t) ruby_Array_unmarshal_child,
 	.del		= (ruby_instance_del_fn_t) ruby_Array_del,
 	.repr		= (ruby_instance_repr_fn_t) ruby_Array_repr,
 	.to_python	= (ruby_instance_to_python_fn_t) ruby_Array_to_python,
@@ -213,3 +210,11 @@ ruby_Array_append(const ruby_instance_t *self, ruby_instance_t *item)
 	ruby_array_append(&((ruby_Array *) self)->arr_items, item);
 	return true;
 }
+
+ruby_instance_t *
+ruby_Array_get_item(const ruby_instance_t *self, unsigned int index)
+{
+	if (!ruby_Array_check(self))
+		return NULL;
+	return ruby_array_get(&((ruby_Array *) self)->arr_items, index);
+}
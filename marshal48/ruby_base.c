@@ -20,6 +20,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "extension.h"
 #include "ruby_impl.h"
+#include "stats.h"
+
+#undef RUBY_CONTEXT_SYMBOL_STATS
 
 /*
  * ruby context management
@@ -28,6 +31,30 @@ struct ruby_context {
 	ruby_array_t		symbols;
 	ruby_array_t		objects;
 	ruby_array_t		emphemerals;
+
+	/* Hashed index of symbols by name */
+	ruby_instancedict_t *	symdict;
+
+	/* All instances, their strings and byteseq payloads live here */
+	ruby_arena_t *		arena;
+
+	/* While a transient scope is active, everything except symbols
+	 * is allocated from a separate arena that is thrown away when
+	 * the scope ends. */
+	struct {
+		bool		active;
+		ruby_arena_t *	arena;
+		unsigned int	first_object;
+		unsigned int	first_ephemeral;
+	} transient;
+
+	/* Python objects of instances released by a transient scope,
+	 * indexed by object id, so that back references still work */
+	PyObject **		released;
+	unsigned int		nreleased;
+
+	/* For marshal48.stats() */
+	marshal48_type_counts_t	instance_counts;
 };
 
 ruby_context_t *
@@ -36,19 +63,171 @@ ruby_context_new(void)
 	ruby_context_t *ctx;
 
 	ctx = calloc(1, sizeof(*ctx));
+	ctx->arena = ruby_arena_new();
+	ctx->symdict = ruby_string_instancedict_new(ruby_Symbol_get_name);
 	return ctx;
 }
 
 void
 ruby_context_free(ruby_context_t *ctx)
 {
+	/* This only drops python references and container arrays;
+	 * the instances themselves go away with the arena. */
 	ruby_array_destroy(&ctx->symbols);
 	ruby_array_destroy(&ctx->objects);
 	ruby_array_destroy(&ctx->emphemerals);
 
+	{
+		unsigned long lookups, hits;
+
+		ruby_instancedict_hit_stats(ctx->symdict, &lookups, &hits);
+		marshal48_stats_add_instancedict(lookups, hits);
+		marshal48_stats_add_types(&ctx->instance_counts);
+	}
+
+#ifdef RUBY_CONTEXT_SYMBOL_STATS
+	{
+		unsigned long lookups, hits;
+		unsigned int avg_depth, avg_leaf_size;
+
+		ruby_context_symbol_stats(ctx, &lookups, &hits, &avg_depth, &avg_leaf_size);
+		if (lookups)
+			fprintf(stderr, "symbols: %lu lookups, %.2f%% hits (avg_depth=%u, avg_leaf_size=%u)\n",
+					lookups, 100.0 * hits / lookups,
+					avg_depth, avg_leaf_size);
+	}
+#endif
+	ruby_instancedict_free(ctx->symdict);
+
+	if (ctx->transient.arena)
+		ruby_arena_free(ctx->transient.arena);
+	if (ctx->released) {
+		unsigned int i;
+
+		for (i = 0; i < ctx->nreleased; ++i)
+			Py_XDECREF(ctx->released[i]);
+		free(ctx->released);
+	}
+
+	ruby_arena_free(ctx->arena);
 	free(ctx);
 }
 
+ruby_arena_t *
+ruby_context_arena(ruby_context_t *ctx)
+{
+	if (ctx->transient.active)
+		return ctx->transient.arena;
+	return ctx->arena;
+}
+
+/* Symbols must survive transient scopes */
+ruby_arena_t *
+ruby_context_symbol_arena(ruby_context_t *ctx)
+{
+	return ctx->arena;
+}
+
+char *
+ruby_context_strdup(ruby_context_t *ctx, const char *s)
+{
+	return ruby_arena_strdup(ruby_context_arena(ctx), s);
+}
+
+/*
+ * Transient scopes are used when iterating over a large top-level array.
+ * Every element is unmarshaled inside its own scope, converted to python,
+ * and then all ruby instances created for it are released again. Object
+ * ids are never reused; a released object is remembered by its python
+ * object only, so that later elements can still refer back to it.
+ */
+void
+ruby_context_begin_transient(ruby_context_t *ctx)
+{
+	assert(!ctx->transient.active);
+
+	if (ctx->transient.arena == NULL)
+		ctx->transient.arena = ruby_arena_new();
+	ctx->transient.active = true;
+	ctx->transient.first_object = ctx->objects.count;
+	ctx->transient.first_ephemeral = ctx->emphemerals.count;
+}
+
+static void
+__ruby_context_release_transient(ruby_context_t *ctx)
+{
+	unsigned int i;
+
+	for (i = ctx->transient.first_ephemeral; i < ctx->emphemerals.count; ++i)
+		ruby_instance_del(ctx->emphemerals.items[i]);
+	ctx->emphemerals.count = ctx->transient.first_ephemeral;
+
+	ruby_arena_reset(ctx->transient.arena);
+	ctx->transient.active = false;
+}
+
+bool
+ruby_context_end_transient(ruby_context_t *ctx, ruby_converter_t *converter)
+{
+	unsigned int i, count = ctx->objects.count;
+	bool ok = true;
+
+	assert(ctx->transient.active);
+
+	if (count > ctx->nreleased) {
+		ctx->released = realloc(ctx->released, count * sizeof(ctx->released[0]));
+		memset(ctx->released + ctx->nreleased, 0, (count - ctx->nreleased) * sizeof(ctx->released[0]));
+		ctx->nreleased = count;
+	}
+
+	for (i = ctx->transient.first_object; i < count; ++i) {
+		ruby_instance_t *instance = ctx->objects.items[i];
+
+		/* Objects that were never converted (or that do not cache
+		 * their python object) are converted here, so that a later
+		 * back reference can find them */
+		if (ok) {
+			ctx->released[i] = ruby_instance_to_python(instance, converter);
+			if (ctx->released[i] == NULL)
+				ok = false;
+		}
+
+		ruby_instance_del(instance);
+		ctx->objects.items[i] = NULL;
+	}
+
+	__ruby_context_release_transient(ctx);
+	return ok;
+}
+
+/*
+ * End a transient scope without converting anything to python.
+ * Callers that do not need python objects can still allow later elements
+ * to refer back to this one: any instance for which keep() returns a
+ * string is remembered as a ruby String with that value. Everything else
+ * is gone for good, and a later reference to it is an error.
+ */
+void
+ruby_context_end_transient_keep(ruby_context_t *ctx, const char *(*keep)(const ruby_instance_t *))
+{
+	unsigned int i;
+
+	assert(ctx->transient.active);
+
+	for (i = ctx->transient.first_object; i < ctx->objects.count; ++i) {
+		ruby_instance_t *instance = ctx->objects.items[i];
+		const char *value;
+
+		if ((value = keep(instance)) != NULL)
+			ctx->objects.items[i] = __ruby_String_remember(ctx->arena, instance, value);
+		else
+			ctx->objects.items[i] = NULL;
+		ruby_instance_del(instance);
+	}
+
+	__ruby_context_release_transient(ctx);
+}
+
 ruby_instance_t *
 ruby_context_get_symbol(ruby_context_t *ctx, unsigned int ref)
 {
@@ -58,30 +237,69 @@ ruby_context_get_symbol(ruby_context_t *ctx, unsigned int ref)
 ruby_instance_t *
 ruby_context_get_object(ruby_context_t *ctx, unsigned int ref)
 {
-	return ruby_array_get(&ctx->objects, ref);
+	ruby_instance_t *instance;
+
+	instance = ruby_array_get(&ctx->objects, ref);
+	if (instance == NULL && ref < ctx->nreleased && ctx->released[ref] != NULL)
+		instance = ruby_Released_new(ctx, ctx->released[ref]);
+	return instance;
 }
 
 ruby_instance_t *
 ruby_context_find_symbol(ruby_context_t *ctx, const char *value)
 {
+	return ruby_string_instancedict_lookup(ctx->symdict, value);
+}
+
+void
+ruby_context_add_symbol(ruby_context_t *ctx, ruby_instance_t *sym)
+{
+	ruby_string_instancedict_insert(ctx->symdict, sym);
+}
+
+void
+ruby_context_symbol_stats(ruby_context_t *ctx,
+		unsigned long *lookups, unsigned long *hits,
+		unsigned int *avg_depth, unsigned int *avg_leaf_size)
+{
+	ruby_instancedict_hit_stats(ctx->symdict, lookups, hits);
+	ruby_instancedict_stats(ctx->symdict, avg_depth, avg_leaf_size);
+}
+
+/*
+ * Number of registered instances, and the memory held by the arena(s)
+ */
+void
+ruby_context_stats(ruby_context_t *ctx,
+		unsigned int *nsymbols, unsigned int *nobjects,
+		unsigned int *nephemerals, unsigned long *ninstances,
+		unsigned long *arena_bytes)
+{
+	unsigned long nchunks, used, allocated;
 	unsigned int i;
 
-	for (i = 0; i < ctx->symbols.count; ++i) {
-		ruby_instance_t *sym = ctx->symbols.items[i];
-		const char *sym_name;
+	*nsymbols = ctx->symbols.count;
+	*nobjects = ctx->objects.count;
+	*nephemerals = ctx->emphemerals.count;
 
-		sym_name = ruby_Symbol_get_name(sym);
-		if (sym_name && !strcmp(sym_name, value))
-			return sym;
-	}
+	/* Every instance ever created, including those of transient scopes */
+	*ninstances = 0;
+	for (i = 0; i < ctx->instance_counts.count; ++i)
+		*ninstances += ctx->instance_counts.entry[i].count;
 
-	return NULL;
+	ruby_arena_stats(ctx->arena, &nchunks, &used, &allocated);
+	*arena_bytes = allocated;
+	if (ctx->transient.arena) {
+		ruby_arena_stats(ctx->transient.arena, &nchunks, &used, &allocated);
+		*arena_bytes += allocated;
+	}
 }
 
 /*
  * Converter
- * For now, this is just a thin wrapper object containing nothing but
- * a callback to a python factory function
+ * This wraps the python side of things: either a factory function that is
+ * called as factory(classname, *args), or a dict of constructors indexed by
+ * classname, or both. In the latter case, the dict is consulted first.
  */
 ruby_converter_t *
 ruby_converter_new(ruby_context_t *ctx, PyObject *factory)
@@ -89,7 +307,9 @@ ruby_converter_new(ruby_context_t *ctx, PyObject *factory)
 	ruby_converter_t *converter = calloc(1, sizeof(*converter));
 
 	converter->context = ctx;
-	if (factory) {
+	if (factory && PyDict_Check(factory)) {
+		ruby_converter_set_constructors(converter, factory);
+	} else if (factory) {
 		converter->factory = factory;
 		Py_INCREF(factory);
 	}
@@ -97,13 +317,143 @@ ruby_converter_new(ruby_context_t *ctx, PyObject *factory)
 	return converter;
 }
 
+void
+ruby_converter_set_constructors(ruby_converter_t *converter, PyObject *constructors)
+{
+	assign_object(&converter->constructors, constructors);
+}
+
+static void		__ruby_objcache_free(struct ruby_objcache *);
+
 void
 ruby_converter_free(ruby_converter_t *converter)
 {
+	unsigned int i;
+
+	for (i = 0; i < converter->nclasses; ++i) {
+		struct ruby_converter_class *cls = &converter->classes[i];
+
+		free(cls->classname);
+		drop_object(&cls->name_obj);
+		drop_object(&cls->callable);
+	}
+	free(converter->classes);
+
+	drop_object(&converter->constructors);
 	drop_object(&converter->factory);
+
+	marshal48_stats_add_factory_calls(converter->factory_calls);
+	if (converter->strings) {
+		unsigned long lookups, hits;
+
+		ruby_instancedict_hit_stats(converter->strings, &lookups, &hits);
+		marshal48_stats_add_instancedict(lookups, hits);
+		ruby_instancedict_free(converter->strings);
+	}
+	if (converter->interned) {
+		unsigned long lookups, hits, bytes_saved;
+
+		ruby_intern_table_stats(converter->interned, &lookups, &hits, &bytes_saved);
+		marshal48_stats_add_intern(lookups, hits);
+		ruby_intern_table_free(converter->interned);
+	}
+	if (converter->seen)
+		__ruby_objcache_free(converter->seen);
+	drop_object(&converter->values);
 	free(converter);
 }
 
+/*
+ * Return a python string for value, sharing one object between
+ * all equal strings this converter has seen.
+ */
+PyObject *
+ruby_converter_intern(ruby_converter_t *converter, const char *value)
+{
+	if (converter->interned == NULL)
+		converter->interned = ruby_intern_table_new();
+
+	return ruby_intern_table_get(converter->interned, value);
+}
+
+/*
+ * Strings with NUL bytes in them are rare; they are not shared.
+ */
+PyObject *
+ruby_converter_intern_len(ruby_converter_t *converter, const char *value, size_t len)
+{
+	if (strlen(value) != len)
+		return PyUnicode_FromStringAndSize(value, len);
+	return ruby_converter_intern(converter, value);
+}
+
+void
+ruby_converter_report(ruby_converter_t *converter)
+{
+	unsigned long lookups, hits, bytes_saved;
+
+	if (converter->interned == NULL)
+		return;
+
+	ruby_intern_table_stats(converter->interned, &lookups, &hits, &bytes_saved);
+	if (lookups)
+		fprintf(stderr, "strings: %lu converted, %lu shared (%.2f%%), %lu kB saved\n",
+				lookups, hits, 100.0 * hits / lookups,
+				bytes_saved / 1024);
+}
+
+/*
+ * Find out how to construct instances of a ruby class. The result is
+ * cached, because there are usually just a handful of distinct classes,
+ * but thousands of objects.
+ *
+ * If name_obj is set on return, the callable is the generic
+ * factory and expects the classname as its first argument.
+ */
+const struct ruby_converter_class *
+ruby_converter_find_class(ruby_converter_t *converter, const char *classname)
+{
+	struct ruby_converter_class *cls;
+	PyObject *callable = NULL, *name_obj = NULL;
+	unsigned int i;
+
+	for (i = 0; i < converter->nclasses; ++i) {
+		cls = &converter->classes[i];
+		if (!strcmp(cls->classname, classname))
+			return cls;
+	}
+
+	if (converter->constructors)
+		callable = PyDict_GetItemString(converter->constructors, classname);
+
+	if (callable != NULL) {
+		Py_INCREF(callable);
+	} else if (converter->factory != NULL) {
+		callable = converter->factory;
+		Py_INCREF(callable);
+
+		name_obj = PyUnicode_InternFromString(classname);
+	} else {
+		PyErr_Format(PyExc_NotImplementedError, "ruby: no constructor for class %s", classname);
+		return NULL;
+	}
+
+	if (!PyCallable_Check(callable)) {
+		PyErr_Format(PyExc_TypeError, "ruby: constructor for class %s is not callable", classname);
+		Py_DECREF(callable);
+		Py_XDECREF(name_obj);
+		return NULL;
+	}
+
+	converter->classes = realloc(converter->classes, (converter->nclasses + 1) * sizeof(converter->classes[0]));
+	cls = &converter->classes[converter->nclasses++];
+	cls->classname = strdup(classname);
+	cls->callable = callable;
+	cls->name_obj = name_obj;
+
+	return cls;
+}
+
 /*
  * Generic instance functions
  */
@@ -168,7 +518,10 @@ __ruby_instance_new(ruby_context_t *ctx, const ruby_type_t *type)
 	ruby_instance_t *instance;
 
 	assert(type->size >= sizeof(*instance));
-	instance = calloc(1, type->size);
+	if (type->registration == RUBY_REG_SYMBOL)
+		instance = ruby_arena_alloc(ruby_context_symbol_arena(ctx), type->size);
+	else
+		instance = ruby_arena_alloc(ruby_context_arena(ctx), type->size);
 
 	instance->op = type;
 	instance->reg.kind = -1;
@@ -179,16 +532,36 @@ __ruby_instance_new(ruby_context_t *ctx, const ruby_type_t *type)
 	__ruby_instance_register(ctx, instance);
 	assert(ctx);
 
+	marshal48_type_counts_add(&ctx->instance_counts, type);
+
 	return instance;
 }
 
+/*
+ * The instance memory is owned by the context's arena, so all we
+ * need to do here is release the python object.
+ */
 void
 __ruby_instance_del(ruby_instance_t *self)
 {
-	if (self->native)
-		Py_DECREF(self->native);
-	memset(self, 0, sizeof(*self));
-	free(self);
+	drop_object(&self->native);
+}
+
+/*
+ * Conversion recurses into arrays, hashes and objects. Unmarshaling does
+ * not, so guard against deeply nested data blowing the C stack here.
+ */
+static PyObject *
+__ruby_instance_to_python(ruby_instance_t *self, ruby_converter_t *converter)
+{
+	PyObject *result;
+
+	if (Py_EnterRecursiveCall(" while converting ruby data"))
+		return NULL;
+	result = self->op->to_python(self, converter);
+	Py_LeaveRecursiveCall();
+
+	return result;
 }
 
 PyObject *
@@ -198,7 +571,7 @@ ruby_instance_to_python(ruby_instance_t *self, ruby_converter_t *converter)
 		return self->op->to_python(self, converter);
 
 	if (self->native == NULL) {
-		self->native = self->op->to_python(self, converter);
+		self->native = __ruby_instance_to_python(self, converter);
 		if (self->native == NULL)
 			return NULL;
 	}
@@ -230,11 +603,137 @@ ruby_symbol_from_python(PyObject *self, ruby_converter_t *converter)
 	return instance;
 }
 
+/*
+ * When marshaling, an object that occurs more than once should be
+ * written once, and referenced with @ afterwards. The objcache maps the
+ * address of each python object we have converted to its ruby instance.
+ * The instances hold a reference to their python object, so an address
+ * cannot be reused while the converter is alive.
+ */
+#define RUBY_OBJCACHE_MIN_SIZE	256
+
+struct ruby_objcache {
+	unsigned int		size;
+	unsigned int		count;
+	struct ruby_objcache_entry {
+		PyObject *	key;
+		ruby_instance_t *instance;
+	} *			entries;
+};
+
+static void
+__ruby_objcache_free(struct ruby_objcache *cache)
+{
+	free(cache->entries);
+	free(cache);
+}
+
+static inline unsigned int
+__ruby_objcache_slot(const struct ruby_objcache *cache, const PyObject *key)
+{
+	unsigned long addr = (unsigned long) key;
+
+	/* objects are at least 16 byte aligned */
+	addr = (addr >> 4) * 0x9e3779b97f4a7c15UL;
+	return (addr >> 32) & (cache->size - 1);
+}
+
+static ruby_instance_t *
+__ruby_objcache_get(const struct ruby_objcache *cache, const PyObject *key)
+{
+	const struct ruby_objcache_entry *e;
+	unsigned int slot;
+
+	if (cache == NULL)
+		return NULL;
+
+	slot = __ruby_objcache_slot(cache, key);
+	while ((e = &cache->entries[slot])->key != NULL) {
+		if (e->key == key)
+			return e->instance;
+		slot = (slot + 1) & (cache->size - 1);
+	}
+	return NULL;
+}
+
+static void
+__ruby_objcache_insert(struct ruby_objcache *cache, PyObject *key, ruby_instance_t *instance)
+{
+	unsigned int slot;
+
+	slot = __ruby_objcache_slot(cache, key);
+	while (cache->entries[slot].key != NULL)
+		slot = (slot + 1) & (cache->size - 1);
+	cache->entries[slot].key = key;
+	cache->entries[slot].instance = instance;
+	cache->count++;
+}
+
+static void
+__ruby_converter_remember(ruby_converter_t *converter, PyObject *key, ruby_instance_t *instance)
+{
+	struct ruby_objcache *cache = converter->seen;
+
+	if (cache == NULL) {
+		cache = converter->seen = calloc(1, sizeof(*cache));
+		cache->size = RUBY_OBJCACHE_MIN_SIZE;
+		cache->entries = calloc(cache->size, sizeof(cache->entries[0]));
+	}
+
+	/* keep the load factor below 1/2 */
+	if (2 * (cache->count + 1) > cache->size) {
+		struct ruby_objcache_entry *old_entries = cache->entries;
+		unsigned int i, old_size = cache->size;
+
+		cache->size *= 2;
+		cache->count = 0;
+		cache->entries = calloc(cache->size, sizeof(cache->entries[0]));
+		for (i = 0; i < old_size; ++i) {
+			if (old_entries[i].key)
+				__ruby_objcache_insert(cache, old_entries[i].key, old_entries[i].instance);
+		}
+		free(old_entries);
+	}
+
+	__ruby_objcache_insert(cache, key, instance);
+}
+
+/*
+ * Objects that are written via dump() or marshal_dump() can also be shared
+ * when they are merely equal. For marshal48.Version, the key is the
+ * version string; other classes can opt in by providing a
+ * ruby_marshal_key() method that returns something hashable.
+ * Returns a new reference, or NULL (without an exception) if the object
+ * cannot be shared by value.
+ */
+static PyObject *
+__ruby_converter_value_key(PyObject *self)
+{
+	PyObject *key, *result;
+
+	if (marshal48_version_check(self)) {
+		key = PyObject_Str(self);
+	} else if (PyObject_HasAttrString(self, "ruby_marshal_key")) {
+		key = PyObject_CallMethod(self, "ruby_marshal_key", NULL);
+	} else {
+		return NULL;
+	}
+
+	if (key == NULL)
+		return NULL;
+
+	/* Objects of different classes never share */
+	result = PyTuple_Pack(2, (PyObject *) Py_TYPE(self), key);
+	Py_DECREF(key);
+	return result;
+}
+
 ruby_instance_t *
 ruby_instance_from_python(PyObject *self, ruby_converter_t *converter)
 {
 	const ruby_type_t *type = NULL;
 	ruby_instance_t *instance;
+	PyObject *value_key = NULL;
 
 	// printf("%s(%s)\n", __func__, self->ob_type->tp_name);
 	if (self == Py_True)
@@ -244,6 +743,9 @@ ruby_instance_from_python(PyObject *self, ruby_converter_t *converter)
 	if (self == Py_None)
 		return (ruby_instance_t *) &ruby_None;
 
+	if ((instance = __ruby_objcache_get(converter->seen, self)) != NULL)
+		return instance;
+
 	if (PyList_Check(self)) {
 		type = &ruby_Array_type;
 	} else if (PyLong_Check(self)) {
@@ -260,24 +762,60 @@ ruby_instance_from_python(PyObject *self, ruby_converter_t *converter)
 		type = &ruby_GenericObject_type;
 	}
 
-	if (type->get_cached && (instance = type->get_cached(converter, self)) != NULL)
-		return instance;
-
 	if (type == NULL || type->from_python == NULL) {
 		PyErr_Format(PyExc_TypeError, "Python type %s has no corresponding ruby type", self->ob_type->tp_name);
 		return NULL;
 	}
 
+	if (type->get_cached && (instance = type->get_cached(converter, self)) != NULL)
+		return instance;
+
+	if (type == &ruby_UserDefined_type || type == &ruby_UserMarshal_type) {
+		value_key = __ruby_converter_value_key(self);
+		if (value_key == NULL && PyErr_Occurred())
+			return NULL;
+
+		if (value_key != NULL && converter->values != NULL) {
+			PyObject *found = PyDict_GetItem(converter->values, value_key);
+
+			if (found != NULL) {
+				Py_DECREF(value_key);
+				return PyLong_AsVoidPtr(found);
+			}
+		}
+	}
+
 	// printf("Trying to convert to %s\n", type->name);
 	instance = __ruby_instance_new(converter->context, type);
 	if (instance == NULL) {
 		PyErr_Format(PyExc_RuntimeError, "Unable to instantiate ruby %s", type->name);
+		Py_XDECREF(value_key);
 		return NULL;
 	}
 
 	instance->native = self;
 	Py_INCREF(self);
 
+	/* Remember the object before converting its members, so that
+	 * an object containing itself becomes a reference */
+	if (instance->reg.kind == RUBY_REG_OBJECT)
+		__ruby_converter_remember(converter, self, instance);
+
+	if (value_key != NULL) {
+		PyObject *addr = PyLong_FromVoidPtr(instance);
+
+		if (converter->values == NULL)
+			converter->values = PyDict_New();
+		if (addr == NULL || converter->values == NULL
+		 || PyDict_SetItem(converter->values, value_key, addr) < 0) {
+			Py_XDECREF(addr);
+			Py_DECREF(value_key);
+			return NULL;
+		}
+		Py_DECREF(addr);
+		Py_DECREF(value_key);
+	}
+
 	if (!type->from_python(instance, self, converter)) {
 		if (!PyErr_Occurred())
 			PyErr_Format(PyExc_RuntimeError, "Python conversion failed for ruby %s", type->name);
@@ -419,3 +957,41 @@ ruby_None_check(const ruby_instance_t *self)
 	/* You cannot subclass None */
 	return self->op == &ruby_None_methods;
 }
+
+/*
+ * Placeholder for an object that has been released by a transient scope.
+ * All we have left is its python object.
+ */
+static const char *
+ruby_Released_repr(ruby_instance_t *self, ruby_repr_context_t *ctx)
+{
+	return "<released>";
+}
+
+static PyObject *
+ruby_Released_to_python(ruby_instance_t *self, ruby_converter_t *converter)
+{
+	/* Not reached; native is always set */
+	PyErr_SetString(PyExc_RuntimeError, "marshal48: released object has no python object");
+	return NULL;
+}
+
+static ruby_type_t ruby_Released_type = {
+	.name		= "Released",
+	.size		= sizeof(ruby_instance_t),
+	.registration	= RUBY_REG_EPHEMERAL,
+
+	.del		= __ruby_instance_del,
+	.repr		= ruby_Released_repr,
+	.to_python	= ruby_Released_to_python,
+};
+
+ruby_instance_t *
+ruby_Released_new(ruby_context_t *ctx, PyObject *native)
+{
+	ruby_instance_t *instance;
+
+	instance = __ruby_instance_new(ctx, &ruby_Released_type);
+	assign_object(&instance->native, native);
+	return instance;
+}
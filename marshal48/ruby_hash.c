@@ -27,35 +27,54 @@ typedef struct {
 } ruby_Hash;
 
 
-static ruby_instance_t *
-ruby_Hash_unmarshal(ruby_marshal_t *marshal)
+static bool
+ruby_Hash_marshal(ruby_Hash *self, ruby_marshal_t *marshal)
 {
-	ruby_instance_t *hash;
-	long i, count;
+	const ruby_array_t *keys = &self->hash_dict.dict_keys;
+	const ruby_array_t *values = &self->hash_dict.dict_values;
+	unsigned int i;
 
-	if (!ruby_unmarshal_next_fixnum(marshal, &count))
-		return NULL;
+	if (!ruby_marshal_hash_begin(marshal, keys->count, &self->hash_base.marshal_id))
+		return false;
 
-	ruby_marshal_trace(marshal, "Decoding hash with %ld objects", count);
+	for (i = 0; i < keys->count; ++i) {
+		if (!ruby_marshal_next_instance(marshal, keys->items[i])
+		 || !ruby_marshal_next_instance(marshal, values->items[i]))
+			return false;
+	}
+
+	return true;
+}
 
-	hash = ruby_Hash_new(marshal->ruby);
+static bool
+ruby_Hash_unmarshal_begin(ruby_marshal_t *marshal, ruby_unmarshal_frame_t *frame)
+{
+	long count;
 
-	for (i = 0; i < count; ++i) {
-		ruby_instance_t *key, *value;
+	if (!ruby_unmarshal_next_fixnum(marshal, &count))
+		return false;
 
-		key = ruby_unmarshal_next_instance(marshal);
-		if (key == NULL)
-			return NULL;
+	ruby_marshal_trace(marshal, "Decoding hash with %ld objects", count);
 
-		value = ruby_unmarshal_next_instance(marshal);
-		if (value == NULL)
-			return NULL;
+	frame->object = ruby_Hash_new(marshal->ruby);
+	frame->remaining = 2 * count;
+	return frame->object != NULL;
+}
+
+/* Children come in key, value order */
+static bool
+ruby_Hash_unmarshal_child(ruby_marshal_t *marshal, ruby_unmarshal_frame_t *frame, ruby_instance_t *child)
+{
+	ruby_instance_t *key;
 
-		if (!ruby_Hash_add(hash, key, value))
-			return NULL;
+	if (frame->key == NULL) {
+		frame->key = child;
+		return true;
 	}
 
-	return hash;
+	key = frame->key;
+	frame->key = NULL;
+	return ruby_Hash_set(frame->object, key, child);
 }
 
 static void
@@ -192,9 +211,30 @@ ruby_Hash_to_python(ruby_Hash *self, ruby_converter_t *converter)
 }
 
 static bool
-ruby_Hash_from_python(ruby_Hash *self, PyObject *py_obj, ruby_converter_t *converter)
+ruby_Hash_from_python(ruby_instance_t *self, PyObject *py_obj, ruby_converter_t *converter)
 {
-	return false; /* not yet */
+	PyObject *py_key, *py_value;
+	Py_ssize_t pos = 0;
+
+	if (!PyDict_Check(py_obj))
+		return false;
+
+	while (PyDict_Next(py_obj, &pos, &py_key, &py_value)) {
+		ruby_instance_t *key, *value;
+
+		if (!(key = ruby_instance_from_python(py_key, converter))
+		 || !(value = ruby_instance_from_python(py_value, converter))) {
+			fprintf(stderr, "%s: dict item conversion failed\n", __func__);
+			return false;
+		}
+
+		/* Equal ruby keys can come from python keys that are not
+		 * equal in python (eg str subclasses); keep the last one */
+		if (!ruby_Hash_set(self, key, value))
+			return false;
+	}
+
+	return true;
 }
 
 ruby_type_t ruby_Hash_type = {
@@ -202,7 +242,9 @@ ruby_type_t ruby_Hash_type = {
 	.size		= sizeof(ruby_Hash),
 	.registration	= RUBY_REG_OBJECT,
 
-	.unmarshal	= (ruby_instance_unmarshal_fn_t) ruby_Hash_unmarshal,
+	.marshal	= (ruby_instance_marshal_fn_t) ruby_Hash_marshal,
+	.unmarshal_begin= (ruby_instance_unmarshal_begin_fn_t) ruby_Hash_unmarshal_begin,
+	.unmarshal_child= (ruby_instance_unmarshal_child_fn_t) ruby_Hash_unmarshal_child,
 	.del		= (ruby_instance_del_fn_t) ruby_Hash_del,
 	.repr		= (ruby_instance_repr_fn_t) ruby_Hash_repr,
 	.to_python	= (ruby_instance_to_python_fn_t) ruby_Hash_to_python,
@@ -234,3 +276,15 @@ ruby_Hash_add(const ruby_instance_t *self, ruby_instance_t *key, ruby_instance_t
 	ruby_dict_add(&((ruby_Hash *) self)->hash_dict, key, value);
 	return true;
 }
+
+/*
+ * Like ruby_Hash_add, but replaces the value if the key is already present
+ */
+bool
+ruby_Hash_set(const ruby_instance_t *self, ruby_instance_t *key, ruby_instance_t *value)
+{
+	if (!ruby_Hash_check(self))
+		return false;
+	ruby_dict_set(&((ruby_Hash *) self)->hash_dict, key, value);
+	return true;
+}
@@ -35,6 +35,8 @@ typedef struct ruby_type ruby_type_t;
 typedef void		(*ruby_instance_del_fn_t)(ruby_instance_t *);
 typedef bool		(*ruby_instance_marshal_fn_t)(ruby_instance_t *, ruby_marshal_t *);
 typedef ruby_instance_t *(*ruby_instance_unmarshal_fn_t)(ruby_marshal_t *);
+typedef bool		(*ruby_instance_unmarshal_begin_fn_t)(ruby_marshal_t *, ruby_unmarshal_frame_t *);
+typedef bool		(*ruby_instance_unmarshal_child_fn_t)(ruby_marshal_t *, ruby_unmarshal_frame_t *, ruby_instance_t *);
 typedef const char *	(*ruby_instance_repr_fn_t)(ruby_instance_t *, ruby_repr_context_t *);
 typedef bool		(*ruby_instance_set_var_fn_t)(ruby_instance_t *, ruby_instance_t *, ruby_instance_t *);
 typedef ruby_instance_t *(*ruby_type_get_cached_fn_t)(ruby_converter_t *, PyObject *);
@@ -48,6 +50,12 @@ extern bool		__ruby_instance_check_type(const ruby_instance_t *self, const ruby_
 extern ruby_instance_t *__ruby_instance_new(ruby_context_t *, const ruby_type_t *);
 extern void		__ruby_instance_del(ruby_instance_t *self);
 
+extern ruby_arena_t *	ruby_context_arena(ruby_context_t *);
+extern ruby_arena_t *	ruby_context_symbol_arena(ruby_context_t *);
+extern char *		ruby_context_strdup(ruby_context_t *, const char *);
+extern ruby_instance_t *ruby_Released_new(ruby_context_t *, PyObject *native);
+extern ruby_instance_t *__ruby_String_remember(ruby_arena_t *, const ruby_instance_t *, const char *value);
+
 extern unsigned int	ruby_context_register_symbol(ruby_context_t *, ruby_instance_t *);
 extern unsigned int	ruby_context_register_object(ruby_context_t *, ruby_instance_t *);
 extern unsigned int	ruby_context_register_ephemeral(ruby_context_t *, ruby_instance_t *);
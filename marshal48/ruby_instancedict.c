@@ -56,6 +56,10 @@ struct ruby_instancedict {
 	ruby_id_bucket_t	root;
 
 	const char *		(*keyfunc)(const ruby_instance_t *);
+
+	/* lookup statistics */
+	unsigned long		lookups;
+	unsigned long		hits;
 };
 
 struct ruby_id_search_key {
@@ -65,6 +69,7 @@ struct ruby_id_search_key {
 
 static void			ruby_instancedict_make_key(ruby_instancedict_t *, const char *, struct ruby_id_search_key *);
 static ruby_id_bucket_t *	ruby_id_bucket_new(int type);
+static void			ruby_id_bucket_free(ruby_id_bucket_t *);
 static ruby_id_bucket_t *	ruby_id_bucket_split(ruby_id_bucket_t *, unsigned int);
 static void			ruby_id_bucket_insert(ruby_id_bucket_t *b, ruby_instance_t *item);
 static ruby_instance_t *	__ruby_string_instancedict_lookup(ruby_instancedict_t *id, const struct ruby_id_search_key *search_key);
@@ -82,6 +87,20 @@ ruby_string_instancedict_new(const char *(*keyfunc)(const ruby_instance_t *))
 	return id;
 }
 
+void
+ruby_instancedict_free(ruby_instancedict_t *id)
+{
+	unsigned int i;
+
+	if (id->root.type == RUBY_ID_BUCKET_TYPE_INTERNAL) {
+		for (i = 0; i < RUBY_ID_INSTANCES_PER_BUCKET; ++i) {
+			if (id->root.internal.children[i])
+				ruby_id_bucket_free(id->root.internal.children[i]);
+		}
+	}
+	free(id);
+}
+
 void
 ruby_instancedict_dump(ruby_instancedict_t *id)
 {
@@ -147,6 +166,13 @@ ruby_instancedict_stats(ruby_instancedict_t *id, unsigned int *avg_depth, unsign
 	}
 }
 
+void
+ruby_instancedict_hit_stats(ruby_instancedict_t *id, unsigned long *lookups, unsigned long *hits)
+{
+	*lookups = id->lookups;
+	*hits = id->hits;
+}
+
 static ruby_id_bucket_t *
 __ruby_instancedict_find_leaf(ruby_id_bucket_t *b, unsigned int search_hash, bool create)
 {
@@ -205,9 +231,15 @@ ruby_instance_t *
 ruby_string_instancedict_lookup(ruby_instancedict_t *id, const char *string)
 {
 	struct ruby_id_search_key search_key;
+	ruby_instance_t *found;
 
 	ruby_instancedict_make_key(id, string, &search_key);
-	return __ruby_string_instancedict_lookup(id, &search_key);
+	found = __ruby_string_instancedict_lookup(id, &search_key);
+
+	id->lookups++;
+	if (found != NULL)
+		id->hits++;
+	return found;
 }
 
 void
@@ -226,8 +258,12 @@ ruby_string_instancedict_insert(ruby_instancedict_t *id, ruby_instance_t *instan
 	ruby_id_bucket_insert(b, instance);
 }
 
-static inline unsigned int
-__djb2_hash(const char *str)
+/*
+ * This is also what ruby_dict uses for String and Symbol keys, so that
+ * the hash_value of an instance means the same thing everywhere.
+ */
+unsigned int
+ruby_string_hash(const char *str)
 {
 	unsigned long hash = 5381;
 	int c;
@@ -242,7 +278,7 @@ __djb2_hash(const char *str)
 static void
 ruby_instancedict_make_key(ruby_instancedict_t *id, const char *string, struct ruby_id_search_key *key)
 {
-	key->hash = __djb2_hash(string);
+	key->hash = ruby_string_hash(string);
 	key->value = (long) string;
 }
 
@@ -259,9 +295,17 @@ ruby_id_bucket_new(int type)
 	return b;
 }
 
-static inline void
+static void
 ruby_id_bucket_free(ruby_id_bucket_t *b)
 {
+	unsigned int i;
+
+	if (b->type == RUBY_ID_BUCKET_TYPE_INTERNAL) {
+		for (i = 0; i < RUBY_ID_INSTANCES_PER_BUCKET; ++i) {
+			if (b->internal.children[i])
+				ruby_id_bucket_free(b->internal.children[i]);
+		}
+	}
 	free(b);
 }
 
@@ -0,0 +1,167 @@
+/*
+Ruby string intern table
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "extension.h"
+#include "ruby_impl.h"
+
+/*
+ * Spec indices contain the same handful of strings ("ruby", "= 1.0", ...)
+ * hundreds of thousands of times. When converting to python, we map equal
+ * strings to one shared python object. This is a simple open addressing
+ * hash table; the keys are the UTF-8 representation of the python
+ * strings, so we do not need to keep a copy. Slots hold nothing but the
+ * object pointer; most strings in an index are unique, and for those the
+ * table is pure overhead.
+ */
+#define RUBY_INTERN_MIN_SIZE	1024
+
+struct ruby_intern_table {
+	unsigned int		size;
+	unsigned int		count;
+	PyObject **		entries;
+
+	unsigned long		lookups;
+	unsigned long		hits;
+	unsigned long		bytes_saved;
+};
+
+static inline unsigned int
+__ruby_intern_hash(const char *str)
+{
+	unsigned int hash = 5381;
+	int c;
+
+	while ((c = *str++) != '\0')
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+	/* djb2 leaves similar strings in neighbouring slots, which
+	 * hurts linear probing. Mix the bits (murmur3 finalizer) */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+/*
+ * Approximately what sys.getsizeof() would report
+ */
+static unsigned long
+__ruby_intern_object_size(PyObject *str)
+{
+	Py_ssize_t len = PyUnicode_GET_LENGTH(str);
+
+	if (PyUnicode_IS_COMPACT_ASCII(str))
+		return sizeof(PyASCIIObject) + len + 1;
+	return sizeof(PyCompactUnicodeObject) + (len + 1) * PyUnicode_KIND(str);
+}
+
+ruby_intern_table_t *
+ruby_intern_table_new(void)
+{
+	ruby_intern_table_t *tab;
+
+	tab = calloc(1, sizeof(*tab));
+	tab->size = RUBY_INTERN_MIN_SIZE;
+	tab->entries = calloc(tab->size, sizeof(tab->entries[0]));
+	return tab;
+}
+
+void
+ruby_intern_table_free(ruby_intern_table_t *tab)
+{
+	unsigned int i;
+
+	for (i = 0; i < tab->size; ++i)
+		Py_XDECREF(tab->entries[i]);
+	free(tab->entries);
+	free(tab);
+}
+
+static void
+__ruby_intern_table_grow(ruby_intern_table_t *tab)
+{
+	PyObject **old_entries = tab->entries;
+	unsigned int i, old_size = tab->size;
+
+	tab->size *= 2;
+	tab->entries = calloc(tab->size, sizeof(tab->entries[0]));
+
+	for (i = 0; i < old_size; ++i) {
+		PyObject *value = old_entries[i];
+		unsigned int slot;
+
+		if (value == NULL)
+			continue;
+
+		slot = __ruby_intern_hash(PyUnicode_AsUTF8(value)) & (tab->size - 1);
+		while (tab->entries[slot] != NULL)
+			slot = (slot + 1) & (tab->size - 1);
+		tab->entries[slot] = value;
+	}
+
+	free(old_entries);
+}
+
+/*
+ * Returns a new reference to a python string with the given value
+ */
+PyObject *
+ruby_intern_table_get(ruby_intern_table_t *tab, const char *value)
+{
+	unsigned int slot;
+	PyObject *result;
+
+	tab->lookups++;
+
+	slot = __ruby_intern_hash(value) & (tab->size - 1);
+	while ((result = tab->entries[slot]) != NULL) {
+		if (!strcmp(PyUnicode_AsUTF8(result), value)) {
+			tab->hits++;
+			tab->bytes_saved += __ruby_intern_object_size(result);
+
+			Py_INCREF(result);
+			return result;
+		}
+		slot = (slot + 1) & (tab->size - 1);
+	}
+
+	if (!(result = PyUnicode_FromString(value)))
+		return NULL;
+
+	tab->entries[slot] = result;
+
+	/* keep the load factor below 2/3 */
+	if (++(tab->count) * 3 > tab->size * 2)
+		__ruby_intern_table_grow(tab);
+
+	Py_INCREF(result);
+	return result;
+}
+
+void
+ruby_intern_table_stats(const ruby_intern_table_t *tab,
+		unsigned long *lookups, unsigned long *hits, unsigned long *bytes_saved)
+{
+	*lookups = tab->lookups;
+	*hits = tab->hits;
+	*bytes_saved = tab->bytes_saved;
+}
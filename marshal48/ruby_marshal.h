@@ -29,6 +29,22 @@ struct ruby_byteseq;
 
 typedef struct ruby_marshal	ruby_marshal_t;
 
+/*
+ * An instance that is waiting for its children to be unmarshaled.
+ * unmarshal_begin() says how many children to expect by setting
+ * remaining; each one is handed to unmarshal_child(), which may ask
+ * for more (eg after reading the number of instance variables).
+ * When remaining drops to zero, object is complete.
+ */
+struct ruby_unmarshal_frame {
+	const char *		name;
+	bool			(*child)(ruby_marshal_t *, ruby_unmarshal_frame_t *, ruby_instance_t *);
+
+	ruby_instance_t *	object;
+	ruby_instance_t *	key;
+	long			remaining;
+};
+
 struct ruby_marshal {
 	ruby_context_t *	ruby;
 	struct ruby_io *	ioctx;
@@ -36,28 +52,44 @@ struct ruby_marshal {
 	unsigned int		next_obj_id;
 	unsigned int		next_sym_id;
 
+	/* Stack of incomplete instances */
+	unsigned int		nframes;
+	unsigned int		frames_size;
+	ruby_unmarshal_frame_t *frames;
+
+	/* Symbol id of :E, once it has been written */
+	int			e_sym_id;
+
+	/* Scratch buffer for ruby_unmarshal_next_string() */
+	struct ruby_byteseq *	strbuf;
+
 	ruby_trace_state_t *	tracing;
 };
 
-extern ruby_marshal_t *ruby_unmarshal_new(ruby_context_t *ctx, PyObject *io);
+extern ruby_marshal_t *ruby_unmarshal_new(ruby_context_t *ctx, struct ruby_io *ioctx);
+extern void		ruby_unmarshal_free(ruby_marshal_t *);
 extern bool		ruby_unmarshal_next_fixnum(ruby_marshal_t *, long *);
 extern const char *	ruby_unmarshal_next_string(ruby_marshal_t *marshal, const char *encoding);
+extern const char *	ruby_unmarshal_next_string_len(ruby_marshal_t *marshal, const char *encoding, size_t *lenp);
 extern bool		ruby_unmarshal_next_byteseq(ruby_marshal_t *s, struct ruby_byteseq *seq);
 extern ruby_instance_t *ruby_unmarshal_next_instance(ruby_marshal_t *);
-extern bool		ruby_unmarshal_object_instance_vars(ruby_marshal_t *s, ruby_instance_t *object);
 
 extern bool		ruby_marshal_true(ruby_marshal_t *);
 extern bool		ruby_marshal_false(ruby_marshal_t *);
 extern bool		ruby_marshal_none(ruby_marshal_t *);
 extern bool		ruby_marshal_fixnum(ruby_marshal_t *, long);
 extern bool		ruby_marshal_array_begin(ruby_marshal_t *, unsigned int, int *);
+extern bool		ruby_marshal_hash_begin(ruby_marshal_t *, unsigned int, int *);
 extern bool		ruby_marshal_user_marshal_begin(ruby_marshal_t *, const char *, int *);
 extern bool		ruby_marshal_symbol(ruby_marshal_t *, const char *, int *);
 extern bool		ruby_marshal_string(ruby_marshal_t *, const char *, int *);
 extern bool		ruby_marshal_next_instance(ruby_marshal_t *, ruby_instance_t *);
 
 typedef ruby_instance_t *(*ruby_object_factory_fn_t)(ruby_context_t *, const char *);
-extern ruby_instance_t *ruby_unmarshal_object_instance(ruby_marshal_t *s, ruby_object_factory_fn_t factory);
+extern bool		ruby_unmarshal_object_begin(ruby_marshal_t *, ruby_unmarshal_frame_t *);
+extern ruby_instance_t *ruby_unmarshal_object_new(ruby_marshal_t *, ruby_instance_t *name, ruby_object_factory_fn_t factory);
+extern bool		ruby_unmarshal_object_vars_begin(ruby_marshal_t *, ruby_unmarshal_frame_t *);
+extern bool		ruby_unmarshal_object_var(ruby_marshal_t *, ruby_unmarshal_frame_t *, ruby_instance_t *);
 
 #define ruby_marshal_trace(s, fmt ...) ruby_trace((s)->tracing, ##fmt)
 
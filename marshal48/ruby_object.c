@@ -22,33 +22,29 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "ruby_impl.h"
 
 
-typedef ruby_instance_t *(*ruby_object_factory_fn_t)(ruby_context_t *, const char *);
-
 /*
  * Generic object, which is constructed as Classname + instance variables
  */
-static ruby_instance_t *
-ruby_GenericObject_unmarshal(ruby_marshal_t *marshal)
+static bool
+ruby_GenericObject_unmarshal_child(ruby_marshal_t *marshal, ruby_unmarshal_frame_t *frame, ruby_instance_t *child)
 {
-	ruby_instance_t *object;
+	if (frame->object != NULL)
+		return ruby_unmarshal_object_var(marshal, frame, child);
 
-	/* Create the object instance */
-	object = ruby_unmarshal_object_instance(marshal, ruby_GenericObject_new);
-	if (object == NULL)
-		return NULL;
+	/* The first child is the classname; create the object instance */
+	frame->object = ruby_unmarshal_object_new(marshal, child, ruby_GenericObject_new);
+	if (frame->object == NULL)
+		return false;
 
 	/* Apply instance variables that follow */
-	if (!ruby_unmarshal_object_instance_vars(marshal, object))
-		return NULL;
-
-	return object;
+	return ruby_unmarshal_object_vars_begin(marshal, frame);
 }
 
 
 static void
 ruby_GenericObject_del(ruby_GenericObject *self)
 {
-	drop_string(&self->obj_classname);
+	/* obj_classname lives in the context arena */
 	ruby_dict_zap(&self->obj_vars);
 	__ruby_instance_del((ruby_instance_t *) self);
 }
@@ -72,8 +68,9 @@ ruby_GenericObject_repr(ruby_GenericObject *self, ruby_repr_context_t *ctx)
 bool
 ruby_GenericObject_set_var(ruby_GenericObject *self, ruby_instance_t *key, ruby_instance_t *value)
 {
-	/* We don't strip @ off the attribute name; this happens later in __ruby_dict_to_python. */
-	ruby_dict_add(&self->obj_vars, key, value);
+	/* We don't strip @ off the attribute name; this happens later in __ruby_dict_to_python.
+	 * Setting a variable twice replaces its value, as in ruby. */
+	ruby_dict_set(&self->obj_vars, key, value);
 	return true;
 }
 
@@ -124,7 +121,8 @@ ruby_type_t ruby_GenericObject_type = {
 	.size		= sizeof(ruby_GenericObject),
 	.registration	= RUBY_REG_OBJECT,
 
-	.unmarshal	= (ruby_instance_unmarshal_fn_t) ruby_GenericObject_unmarshal,
+	.unmarshal_begin= (ruby_instance_unmarshal_begin_fn_t) ruby_unmarshal_object_begin,
+	.unmarshal_child= (ruby_instance_unmarshal_child_fn_t) ruby_GenericObject_unmarshal_child,
 	.del		= (ruby_instance_del_fn_t) ruby_GenericObject_del,
 	.repr		= (ruby_instance_repr_fn_t) ruby_GenericObject_repr,
 	.set_var	= (ruby_instance_set_var_fn_t) ruby_GenericObject_set_var,
@@ -137,7 +135,7 @@ __ruby_GenericObject_new(ruby_context_t *ctx, const char *classname, const ruby_
 	ruby_GenericObject *self;
 
 	self = (ruby_GenericObject *) __ruby_instance_new(ctx, type);
-	self->obj_classname = strdup(classname);
+	self->obj_classname = ruby_context_strdup(ctx, classname);
 	ruby_dict_init(&self->obj_vars);
 
 	return (ruby_instance_t *) self;
@@ -154,3 +152,12 @@ ruby_GenericObject_check(const ruby_instance_t *self)
 {
 	return __ruby_instance_check_type(self, &ruby_GenericObject_type);
 }
+
+const char *
+ruby_GenericObject_get_classname(const ruby_instance_t *self)
+{
+	if (!ruby_GenericObject_check(self))
+		return NULL;
+
+	return ((ruby_GenericObject *) self)->obj_classname;
+}
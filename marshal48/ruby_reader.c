@@ -21,9 +21,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <stdarg.h>
 #include <Python.h>
 #include <structmember.h>
+#include <zlib.h>
 
 #include "extension.h"
 #include "ruby_impl.h"
+#include "stats.h"
 
 enum {
 	RUBY_READER_OKAY = 0,
@@ -34,34 +36,295 @@ enum {
 
 struct ruby_iobuf;
 extern void			ruby_iobuf_init(struct ruby_iobuf *bp);
+extern void			ruby_iobuf_resize(struct ruby_iobuf *bp, unsigned int size);
 extern void			ruby_iobuf_clear(struct ruby_iobuf *bp);
 extern void			ruby_iobuf_destroy(struct ruby_iobuf *bp);
 
 struct ruby_io {
 	PyObject *		io;
 
+	/* Bound io.readinto method, or NULL if we have to fall back to io.read() */
+	PyObject *		readinto;
+
+	/* If set, the buffer starts out at RUBY_IOBUF_MIN_SIZE and doubles
+	 * every time a refill comes back full */
+	bool			adaptive;
+
+	/* When reading from an object that supports the buffer protocol,
+	 * we parse straight out of its memory and never refill. */
+	bool			have_view;
+	Py_buffer		view;
+
+	/* Set for all readers that parse a buffer in memory, whether it
+	 * is a python object's or the caller's. */
+	bool			in_memory;
+
+	/* For compressed input, the zlib stream and the buffer that
+	 * compressed data is read into (unless it all lives in memory) */
+	z_stream *		zstream;
+	unsigned char *		zbuf;
+	unsigned int		zbuf_size;
+	bool			zdone;
+
+	/* When writing to memory, the buffer is the body of this bytes
+	 * object, and grows as needed instead of being flushed. */
+	PyObject *		membuf;
+
+	/* For marshal48.stats() */
+	unsigned long		nread;
+	unsigned long		ninflated;
+	unsigned long		nrefills;
+
 	struct ruby_iobuf {
 		unsigned int	pos;
 		unsigned int	count;
-		unsigned char	_data[1024];
+		const unsigned char *data;
+
+		unsigned int	size;
+		unsigned char *	_data;
 	} buffer;
 };
 
 
 ruby_io_t *
-ruby_io_new(PyObject *io)
+ruby_io_new(PyObject *io, unsigned int bufsize)
 {
 	ruby_io_t *reader = calloc(1, sizeof(*reader));
 
 	Py_INCREF(io);
 	reader->io = io;
 
+	if (bufsize == 0) {
+		reader->adaptive = true;
+		bufsize = RUBY_IOBUF_MIN_SIZE;
+	}
+
+	assert(RUBY_IOBUF_MIN_SIZE <= bufsize && bufsize <= RUBY_IOBUF_MAX_SIZE);
+	ruby_iobuf_init(&reader->buffer);
+	ruby_iobuf_resize(&reader->buffer, bufsize);
+
+	return reader;
+}
+
+/*
+ * Create a reader for bytes, bytearray, memoryview, mmap etc.
+ * The buffer is held until ruby_io_free(), so the underlying
+ * object cannot be resized or closed while we're parsing it.
+ */
+ruby_io_t *
+ruby_io_new_from_buffer(PyObject *obj)
+{
+	ruby_io_t *reader = calloc(1, sizeof(*reader));
+	struct ruby_iobuf *bp = &reader->buffer;
+
+	if (PyObject_GetBuffer(obj, &reader->view, PyBUF_SIMPLE) < 0) {
+		free(reader);
+		return NULL;
+	}
+
+	if (reader->view.len > UINT_MAX) {
+		PyErr_SetString(PyExc_ValueError, "marshal48: input buffer too large");
+		PyBuffer_Release(&reader->view);
+		free(reader);
+		return NULL;
+	}
+
+	reader->have_view = true;
+	reader->in_memory = true;
+
+	bp->pos = 0;
+	bp->count = reader->view.len;
+	bp->data = reader->view.buf;
+
 	return reader;
 }
 
+/*
+ * Create a reader for raw memory. The caller must keep the memory around
+ * until ruby_io_free(). This does not use any python API, so it can be
+ * called without holding the GIL.
+ */
+ruby_io_t *
+ruby_io_new_from_memory(const void *data, unsigned int len)
+{
+	ruby_io_t *reader = calloc(1, sizeof(*reader));
+	struct ruby_iobuf *bp = &reader->buffer;
+
+	reader->in_memory = true;
+
+	bp->pos = 0;
+	bp->count = len;
+	bp->data = data;
+
+	return reader;
+}
+
+int
+ruby_compression_by_name(const char *name)
+{
+	if (name == NULL || !strcmp(name, "none"))
+		return RUBY_COMPRESSION_NONE;
+	if (!strcmp(name, "zlib"))
+		return RUBY_COMPRESSION_ZLIB;
+	if (!strcmp(name, "gzip"))
+		return RUBY_COMPRESSION_GZIP;
+	return -1;
+}
+
+/*
+ * Switch a reader to inflating zlib or gzip compressed data. The
+ * compressed bytes are either the reader's in-memory buffer, or are read
+ * from the python io object in large chunks; either way, they are
+ * inflated straight into the parse buffer.
+ * For in-memory readers, this does not use any python API.
+ */
+bool
+ruby_io_set_compression(ruby_io_t *reader, int compression)
+{
+	struct ruby_iobuf *bp = &reader->buffer;
+	z_stream *zs;
+
+	if (compression == RUBY_COMPRESSION_NONE)
+		return true;
+
+	assert(reader->zstream == NULL);
+
+	zs = calloc(1, sizeof(*zs));
+	if (inflateInit2(zs, compression == RUBY_COMPRESSION_GZIP? 16 + MAX_WBITS : MAX_WBITS) != Z_OK) {
+		fprintf(stderr, "marshal48: inflateInit failed: %s\n", zs->msg? zs->msg : "unknown error");
+		free(zs);
+		return false;
+	}
+	reader->zstream = zs;
+
+	if (reader->in_memory) {
+		/* Whatever the buffer holds is our compressed input */
+		zs->next_in = (Bytef *) bp->data + bp->pos;
+		zs->avail_in = bp->count - bp->pos;
+		reader->in_memory = false;
+		reader->nread += zs->avail_in;
+
+		/* The buffer belongs to the view or the caller */
+		ruby_iobuf_init(bp);
+		ruby_iobuf_resize(bp, RUBY_IOBUF_INFLATE_SIZE);
+	} else {
+		reader->zbuf_size = RUBY_IOBUF_INFLATE_SIZE;
+		reader->zbuf = malloc(reader->zbuf_size);
+
+		/* Grow the output buffer right away; the input chunks
+		 * expand by a factor of 4 or so */
+		if (reader->adaptive && bp->size < RUBY_IOBUF_INFLATE_SIZE) {
+			ruby_iobuf_clear(bp);
+			ruby_iobuf_resize(bp, RUBY_IOBUF_INFLATE_SIZE);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Create a reader for zlib or gzip compressed data in memory. Like
+ * ruby_io_new_from_memory(), this can be called without holding the GIL.
+ */
+ruby_io_t *
+ruby_io_new_inflate(const void *data, unsigned long len, int compression)
+{
+	ruby_io_t *reader;
+
+	if (len > UINT_MAX) {
+		fprintf(stderr, "marshal48: input buffer too large\n");
+		return NULL;
+	}
+
+	reader = ruby_io_new_from_memory(data, len);
+	if (!ruby_io_set_compression(reader, compression)) {
+		ruby_io_free(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+/*
+ * Create a writer that collects everything in memory. The result is
+ * retrieved using ruby_io_take_bytes().
+ */
+ruby_io_t *
+ruby_io_new_memory(void)
+{
+	ruby_io_t *writer = calloc(1, sizeof(*writer));
+	struct ruby_iobuf *bp = &writer->buffer;
+
+	writer->membuf = PyBytes_FromStringAndSize(NULL, RUBY_IOBUF_MIN_SIZE);
+	if (writer->membuf == NULL) {
+		free(writer);
+		return NULL;
+	}
+
+	bp->size = RUBY_IOBUF_MIN_SIZE;
+	bp->_data = (unsigned char *) PyBytes_AS_STRING(writer->membuf);
+	bp->data = bp->_data;
+
+	return writer;
+}
+
+/*
+ * Hand the data written to a memory writer to the caller, without copying.
+ * Returns a new reference; the writer is empty afterwards.
+ */
+PyObject *
+ruby_io_take_bytes(ruby_io_t *writer)
+{
+	struct ruby_iobuf *bp = &writer->buffer;
+	unsigned int count = bp->count;
+	PyObject *result;
+
+	if (writer->membuf == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "marshal48: not a memory writer");
+		return NULL;
+	}
+
+	result = writer->membuf;
+	writer->membuf = NULL;
+	memset(bp, 0, sizeof(*bp));
+
+	if (_PyBytes_Resize(&result, count) < 0)
+		return NULL;
+	return result;
+}
+
+/*
+ * True if all input is in memory (possibly compressed), so that reading
+ * does not call into python.
+ */
+bool
+ruby_io_in_memory(const ruby_io_t *reader)
+{
+	return reader->io == NULL;
+}
+
 void
 ruby_io_free(ruby_io_t *reader)
 {
+	if (reader->in_memory)
+		reader->nread += reader->buffer.count;
+	if (reader->nread || reader->nrefills)
+		marshal48_stats_add_io(reader->nread, reader->ninflated, reader->nrefills);
+
+	if (reader->have_view)
+		PyBuffer_Release(&reader->view);
+	if (reader->membuf) {
+		/* the buffer belongs to the bytes object */
+		memset(&reader->buffer, 0, sizeof(reader->buffer));
+		drop_object(&reader->membuf);
+	}
+	ruby_iobuf_destroy(&reader->buffer);
+	if (reader->zstream) {
+		inflateEnd(reader->zstream);
+		free(reader->zstream);
+	}
+	free(reader->zbuf);
+	drop_object(&reader->readinto);
 	drop_object(&reader->io);
 	free(reader);
 }
@@ -75,45 +338,193 @@ ruby_iobuf_init(struct ruby_iobuf *bp)
 	memset(bp, 0, sizeof(*bp));
 }
 
+void
+ruby_iobuf_resize(struct ruby_iobuf *bp, unsigned int size)
+{
+	assert(bp->count <= size);
+
+	bp->_data = realloc(bp->_data, size);
+	bp->size = size;
+	bp->data = bp->_data;
+}
+
 void
 ruby_iobuf_clear(struct ruby_iobuf *bp)
 {
 	bp->pos = bp->count = 0;
-	memset(bp->_data, 0, sizeof(bp->_data));
+	bp->data = bp->_data;
 }
 
 void
 ruby_iobuf_destroy(struct ruby_iobuf *bp)
 {
+	if (bp->_data)
+		free(bp->_data);
 	ruby_iobuf_init(bp);
 }
 
-int
-ruby_io_fillbuf(ruby_io_t *reader)
+/*
+ * Read up to size bytes from the python io object into mem.
+ * We prefer readinto(), which does not allocate a new bytes object
+ * for every chunk. Returns the number of bytes read, 0 on EOF and
+ * -1 on error.
+ */
+static long
+__ruby_io_read(ruby_io_t *reader, void *mem, unsigned int size)
 {
-	struct ruby_iobuf *bp = &reader->buffer;
 	PyObject *b;
+	long count;
 
-	memset(bp, 0, sizeof(*bp));
+	if (reader->readinto == NULL && reader->io != NULL) {
+		reader->readinto = PyObject_GetAttrString(reader->io, "readinto");
+		if (reader->readinto == NULL) {
+			PyErr_Clear();
+
+			/* Do not try again */
+			reader->readinto = Py_None;
+			Py_INCREF(Py_None);
+		}
+	}
+
+	if (reader->readinto != Py_None) {
+		PyObject *view, *r;
+
+		view = PyMemoryView_FromMemory(mem, size, PyBUF_WRITE);
+		if (view == NULL)
+			return -1;
+
+		r = PyObject_CallFunctionObjArgs(reader->readinto, view, NULL);
+		Py_DECREF(view);
+
+		if (r == NULL)
+			return -1;
+
+		/* None means "no data available right now" on a non-blocking
+		 * stream; we cannot do anything useful with that. */
+		if (r == Py_None) {
+			Py_DECREF(r);
+			PyErr_SetString(PyExc_IOError, "marshal48: cannot read from non-blocking stream");
+			return -1;
+		}
+
+		count = PyLong_AsLong(r);
+		Py_DECREF(r);
 
-	b = PyObject_CallMethod(reader->io, "read", "i", sizeof(bp->_data));
+		if (count < 0 || count > size) {
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_IOError, "marshal48: readinto() returned bogus count");
+			return -1;
+		}
+		reader->nread += count;
+		return count;
+	}
+
+	b = PyObject_CallMethod(reader->io, "read", "I", size);
 	if (b == NULL)
-		return RUBY_READER_ERROR;
+		return -1;
 
-	bp->pos = 0;
 	if (PyBytes_Check(b)) {
-		bp->count = PyBytes_GET_SIZE(b);
+		count = PyBytes_GET_SIZE(b);
 
-		assert(bp->count <= sizeof(bp->_data));
-		memcpy(bp->_data, PyBytes_AS_STRING(b), bp->count);
-	} else {
-		bp->count = PyByteArray_GET_SIZE(b);
+		assert(count <= size);
+		memcpy(mem, PyBytes_AS_STRING(b), count);
+	} else if (PyByteArray_Check(b)) {
+		count = PyByteArray_GET_SIZE(b);
 
-		assert(bp->count <= sizeof(bp->_data));
-		memcpy(bp->_data, PyByteArray_AS_STRING(b), bp->count);
+		assert(count <= size);
+		memcpy(mem, PyByteArray_AS_STRING(b), count);
+	} else {
+		PyErr_Format(PyExc_TypeError, "marshal48: read() returned %s object rather than bytes",
+				b->ob_type->tp_name);
+		count = -1;
 	}
 
 	Py_DECREF(b);
+	if (count > 0)
+		reader->nread += count;
+	return count;
+}
+
+/*
+ * Refill the buffer with inflated data
+ */
+static int
+__ruby_io_inflate(ruby_io_t *reader)
+{
+	struct ruby_iobuf *bp = &reader->buffer;
+	z_stream *zs = reader->zstream;
+	int rv;
+
+	ruby_iobuf_clear(bp);
+	while (bp->count == 0) {
+		if (reader->zdone)
+			return RUBY_READER_EOF;
+
+		if (zs->avail_in == 0) {
+			long count = 0;
+
+			if (reader->io != NULL) {
+				count = __ruby_io_read(reader, reader->zbuf, reader->zbuf_size);
+				if (count < 0)
+					return RUBY_READER_ERROR;
+			}
+
+			if (count == 0) {
+				fprintf(stderr, "marshal48: compressed data is truncated\n");
+				return RUBY_READER_ERROR;
+			}
+
+			zs->next_in = reader->zbuf;
+			zs->avail_in = count;
+		}
+
+		zs->next_out = bp->_data;
+		zs->avail_out = bp->size;
+
+		rv = inflate(zs, Z_NO_FLUSH);
+		bp->count = bp->size - zs->avail_out;
+		reader->ninflated += bp->count;
+
+		if (rv == Z_STREAM_END) {
+			reader->zdone = true;
+		} else if (rv != Z_OK) {
+			fprintf(stderr, "marshal48: unable to inflate data: %s\n", zs->msg? zs->msg : "data error");
+			return RUBY_READER_ERROR;
+		}
+	}
+
+	return RUBY_READER_OKAY;
+}
+
+int
+ruby_io_fillbuf(ruby_io_t *reader)
+{
+	struct ruby_iobuf *bp = &reader->buffer;
+	long count;
+
+	/* In-memory buffers are consumed in one go; there is nothing to refill */
+	if (reader->in_memory) {
+		bp->pos = bp->count;
+		return RUBY_READER_EOF;
+	}
+
+	reader->nrefills++;
+	if (reader->zstream)
+		return __ruby_io_inflate(reader);
+
+	/* If the previous refill filled the buffer completely, there's
+	 * plenty of data coming; make the buffer bigger so that we do
+	 * fewer calls into python. */
+	if (reader->adaptive && bp->count == bp->size && bp->size < RUBY_IOBUF_MAX_SIZE)
+		ruby_iobuf_resize(bp, 2 * bp->size);
+
+	ruby_iobuf_clear(bp);
+
+	count = __ruby_io_read(reader, bp->_data, bp->size);
+	if (count < 0)
+		return RUBY_READER_ERROR;
+
+	bp->count = count;
 	return RUBY_READER_OKAY;
 }
 
@@ -123,13 +534,15 @@ __ruby_io_nextc(ruby_io_t *reader)
 	struct ruby_iobuf *bp = &reader->buffer;
 
 	if (bp->pos >= bp->count) {
-		if (ruby_io_fillbuf(reader) < 0)
-			return RUBY_READER_ERROR;
+		int rv;
+
+		if ((rv = ruby_io_fillbuf(reader)) < 0)
+			return rv;
 		if (bp->count == 0)
 			return RUBY_READER_EOF;
 	}
 
-	return bp->_data[bp->pos++];
+	return bp->data[bp->pos++];
 }
 
 inline bool
@@ -158,7 +571,7 @@ ruby_io_nextw(ruby_io_t *reader, unsigned int count, long *resultp)
 		if (!ruby_io_nextc(reader, &cc))
 			return false;
 
-		*resultp += (cc << shift);
+		*resultp += ((long) cc << shift);
 	}
 
 	return true;
@@ -168,38 +581,84 @@ bool
 ruby_io_next_byteseq(ruby_io_t *reader, unsigned int count, ruby_byteseq_t *seq)
 {
 	struct ruby_iobuf *bp = &reader->buffer;
+	unsigned char *tail = NULL;
+	unsigned int room = 0;
 
 	assert(seq->count == 0);
 
-	while (seq->count < count) {
+	/* The count comes from the input, so do not take it on trust. In
+	 * memory, we can check that the data is all there and size the
+	 * byteseq once. When reading a stream, the byteseq grows as data
+	 * actually arrives: up to RUBY_IOBUF_MAX_SIZE at first, then doubling. */
+	if (reader->in_memory && count > bp->count - bp->pos) {
+		fprintf(stderr, "Unexpected end of marshal data\n");
+		return false;
+	}
+
+	while (count) {
 		long copy;
 
+		if (room == 0) {
+			room = count;
+			if (!reader->in_memory && room > RUBY_IOBUF_MAX_SIZE && room > seq->count)
+				room = seq->count > RUBY_IOBUF_MAX_SIZE? seq->count : RUBY_IOBUF_MAX_SIZE;
+
+			if (!(tail = ruby_byteseq_extend(seq, room)))
+				return false;
+		}
+
+		/* Large strings bypass the buffer. Drain whatever is left in
+		 * the buffer, then read the rest straight into the byteseq. */
+		if (bp->pos >= bp->count && room >= bp->size && !reader->in_memory && !reader->zstream) {
+			copy = __ruby_io_read(reader, tail, room);
+			if (copy < 0) {
+				fprintf(stderr, "Read error\n");
+				return false;
+			}
+			if (copy == 0) {
+				fprintf(stderr, "Unexpected end of marshal data\n");
+				return false;
+			}
+			tail += copy;
+			room -= copy;
+			count -= copy;
+			continue;
+		}
+
 		/* refill buffer if empty */
 		if (bp->pos >= bp->count) {
-			if (ruby_io_fillbuf(reader) < 0) {
-				fprintf(stderr, "Read error");
+			if (ruby_io_fillbuf(reader) == RUBY_READER_ERROR) {
+				fprintf(stderr, "Read error\n");
+				return false;
+			}
+			if (bp->pos >= bp->count) {
+				fprintf(stderr, "Unexpected end of marshal data\n");
 				return false;
 			}
 		}
 
-		copy = count - seq->count;
+		copy = room;
 		if (bp->pos + copy > bp->count)
 			copy = bp->count - bp->pos;
 
-		ruby_byteseq_append(seq, bp->_data + bp->pos, copy);
+		memcpy(tail, bp->data + bp->pos, copy);
 		bp->pos += copy;
+		tail += copy;
+		room -= copy;
+		count -= copy;
 	}
 
 	return true;
 }
 
-bool
-ruby_io_flushbuf(ruby_io_t *writer)
+static bool
+__ruby_io_write(ruby_io_t *writer, const void *mem, unsigned int count)
 {
-	struct ruby_iobuf *bp = &writer->buffer;
 	PyObject *b, *r;
 
-	b = PyBytes_FromStringAndSize((const char *) bp->_data, bp->count);
+	b = PyBytes_FromStringAndSize((const char *) mem, count);
+	if (b == NULL)
+		return false;
 
 	r = PyObject_CallMethod(writer->io, "write", "O", b);
 	Py_DECREF(b);
@@ -210,8 +669,51 @@ ruby_io_flushbuf(ruby_io_t *writer)
 	}
 
 	Py_DECREF(r);
+	return true;
+}
 
-	memset(bp, 0, sizeof(*bp));
+bool
+ruby_io_flushbuf(ruby_io_t *writer)
+{
+	struct ruby_iobuf *bp = &writer->buffer;
+	bool full;
+
+	/* Memory writers never flush */
+	if (writer->membuf != NULL || bp->count == 0)
+		return true;
+
+	full = (bp->count == bp->size);
+	if (!__ruby_io_write(writer, bp->_data, bp->count))
+		return false;
+
+	ruby_iobuf_clear(bp);
+
+	/* Same as when reading: if we keep filling the buffer, make
+	 * it bigger so that we call io.write() less often */
+	if (writer->adaptive && full && bp->size < RUBY_IOBUF_MAX_SIZE)
+		ruby_iobuf_resize(bp, 2 * bp->size);
+	return true;
+}
+
+static bool
+__ruby_io_grow_membuf(ruby_io_t *writer, unsigned int count)
+{
+	struct ruby_iobuf *bp = &writer->buffer;
+	unsigned long size = bp->size;
+
+	while (size < (unsigned long) bp->count + count)
+		size *= 2;
+	if (size > UINT_MAX) {
+		PyErr_SetString(PyExc_ValueError, "marshal48: output too large");
+		return false;
+	}
+
+	if (_PyBytes_Resize(&writer->membuf, size) < 0)
+		return false;
+
+	bp->size = size;
+	bp->_data = (unsigned char *) PyBytes_AS_STRING(writer->membuf);
+	bp->data = bp->_data;
 	return true;
 }
 
@@ -220,8 +722,11 @@ ruby_io_putc(ruby_io_t *writer, int cc)
 {
 	struct ruby_iobuf *bp = &writer->buffer;
 
-	if (bp->count >= sizeof(bp->_data)) {
-		if (!ruby_io_flushbuf(writer))
+	if (bp->count >= bp->size) {
+		if (writer->membuf != NULL) {
+			if (!__ruby_io_grow_membuf(writer, 1))
+				return false;
+		} else if (!ruby_io_flushbuf(writer))
 			return false;
 	}
 
@@ -232,11 +737,24 @@ ruby_io_putc(ruby_io_t *writer, int cc)
 bool
 ruby_io_put_bytes(ruby_io_t *writer, const void *mem, unsigned int count)
 {
-	unsigned char *bytes = (unsigned char *) mem;
+	struct ruby_iobuf *bp = &writer->buffer;
 
-	while (count--) {
-		if (!ruby_io_putc(writer, *bytes++))
-			return false;
+	if (bp->count + count > bp->size) {
+		if (writer->membuf != NULL) {
+			if (!__ruby_io_grow_membuf(writer, count))
+				return false;
+		} else {
+			if (!ruby_io_flushbuf(writer))
+				return false;
+
+			/* Anything that does not fit into an empty buffer
+			 * goes straight out */
+			if (count > bp->size)
+				return __ruby_io_write(writer, mem, count);
+		}
 	}
+
+	memcpy(bp->_data + bp->count, mem, count);
+	bp->count += count;
 	return true;
 }
@@ -25,6 +25,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 typedef struct {
 	ruby_instance_t	str_base;
 	char *		str_value;
+
+	/* Ruby strings may contain NUL bytes */
+	size_t		str_len;
 } ruby_String;
 
 
@@ -52,13 +55,14 @@ ruby_String_unmarshal(ruby_marshal_t *marshal)
 {
 	const char *raw_string;
 	ruby_instance_t *string = NULL;
+	size_t len;
 
-	if (!(raw_string = ruby_unmarshal_next_string(marshal, "latin1")))
+	if (!(raw_string = ruby_unmarshal_next_string_len(marshal, "latin1", &len)))
 		return NULL;
 
 	ruby_marshal_trace(marshal, "decoded string \"%s\"", raw_string);
 
-	string = ruby_String_new(marshal->ruby, raw_string);
+	string = ruby_String_new_len(marshal->ruby, raw_string, len);
 	if (string == NULL)
 		return NULL;
 
@@ -68,7 +72,7 @@ ruby_String_unmarshal(ruby_marshal_t *marshal)
 static void
 ruby_String_del(ruby_String *self)
 {
-	drop_string(&self->str_value);
+	/* str_value lives in the context arena */
 	__ruby_instance_del((ruby_instance_t *) self);
 }
 
@@ -90,20 +94,22 @@ ruby_String_to_python(ruby_String *self, ruby_converter_t *converter)
 	if (self->str_value == NULL) {
 		Py_RETURN_NONE;
 	}
-	return PyUnicode_FromString(self->str_value);
+	return ruby_converter_intern_len(converter, self->str_value, self->str_len);
 }
 
 static bool
 ruby_String_from_python(ruby_String *self, PyObject *py_obj, ruby_converter_t *converter)
 {
         const char *value;
+	Py_ssize_t len;
 
-        if ((value = PyUnicode_AsUTF8(py_obj)) == NULL) {
+        if ((value = PyUnicode_AsUTF8AndSize(py_obj, &len)) == NULL) {
                 PyErr_SetString(PyExc_TypeError, "object does not seem to be a string");
                 return false;
         }
 
-	assign_string(&self->str_value, value);
+	self->str_value = ruby_arena_memdup(ruby_context_arena(converter->context), value, len + 1);
+	self->str_len = len;
 	return true;
 }
 
@@ -114,37 +120,15 @@ ruby_String_from_python(ruby_String *self, PyObject *py_obj, ruby_converter_t *c
 static ruby_instance_t *
 ruby_String_get_cached(ruby_converter_t *converter, PyObject *py_obj)
 {
-	static unsigned long item_count, hit_count;
-	ruby_instance_t *instance;
-	char *raw_string;
-
-	item_count++;
+	const char *raw_string;
 
 	raw_string = PyUnicode_AsUTF8(py_obj);
 
 	if (!converter->strings)
 		converter->strings = ruby_string_instancedict_new(ruby_String_get_value);
 
-	instance = ruby_string_instancedict_lookup(converter->strings, raw_string);
-	if (instance != NULL)
-		hit_count ++;
-
-#if 0
-	if (item_count && 0 == (item_count % 10000)) {
-		unsigned int avg_depth, avg_leaf_size;
-
-		ruby_instancedict_stats(converter->strings, &avg_depth, &avg_leaf_size);
-		fprintf(stderr, "reused %.2f%% of %lu strings (avg_depth=%u, avg_leaf_size=%u)\n",
-				100.0 * hit_count / item_count, item_count,
-				avg_depth, avg_leaf_size);
-
-		/* If you really want to know what's going on, you could also call:
-		   ruby_instancedict_dump(converter->strings);
-		 */
-	}
-#endif
-
-	return instance;
+	/* The hit rate of this is reported by marshal48.stats() */
+	return ruby_string_instancedict_lookup(converter->strings, raw_string);
 }
 
 static void
@@ -204,17 +188,52 @@ ruby_type_t ruby_String_type = {
 
 ruby_instance_t *
 ruby_String_new(ruby_context_t *ctx, const char *name)
+{
+	return ruby_String_new_len(ctx, name, strlen(name));
+}
+
+/*
+ * value must be NUL terminated, but may contain NUL bytes before that
+ */
+ruby_instance_t *
+ruby_String_new_len(ruby_context_t *ctx, const char *value, size_t len)
 {
 	ruby_String *self;
 
 	self = (ruby_String *) __ruby_instance_new(ctx, &ruby_String_type);
-	self->str_value = strdup(name);
+	self->str_value = ruby_arena_memdup(ruby_context_arena(ctx), value, len + 1);
+	self->str_len = len;
 
 	assert(self->str_base.reg.id >= 0 && self->str_base.reg.kind == RUBY_REG_OBJECT);
 
 	return (ruby_instance_t *) self;
 }
 
+/*
+ * Create a string that takes the place of an instance released by a
+ * transient scope. It keeps the object id of the original, but nothing
+ * else.
+ */
+ruby_instance_t *
+__ruby_String_remember(ruby_arena_t *arena, const ruby_instance_t *orig, const char *value)
+{
+	ruby_String *self;
+
+	self = ruby_arena_alloc(arena, sizeof(*self));
+	memset(self, 0, sizeof(*self));
+	self->str_base.op = &ruby_String_type;
+	self->str_base.reg = orig->reg;
+	self->str_base.marshal_id = -1;
+
+	if (ruby_String_check(orig) && value == ((ruby_String *) orig)->str_value)
+		self->str_len = ((ruby_String *) orig)->str_len;
+	else
+		self->str_len = strlen(value);
+	self->str_value = ruby_arena_memdup(arena, value, self->str_len + 1);
+
+	return (ruby_instance_t *) self;
+}
+
 bool
 ruby_String_check(const ruby_instance_t *self)
 {
@@ -228,3 +247,15 @@ ruby_String_get_value(const ruby_instance_t *self)
 		return NULL;
 	return ((ruby_String *) self)->str_value;
 }
+
+/*
+ * The value and its length, including any NUL bytes it contains
+ */
+const char *
+ruby_String_get_bytes(const ruby_instance_t *self, size_t *lenp)
+{
+	if (!ruby_String_check(self))
+		return NULL;
+	*lenp = ((ruby_String *) self)->str_len;
+	return ((ruby_String *) self)->str_value;
+}
@@ -53,7 +53,7 @@ ruby_Symbol_unmarshal(ruby_marshal_t *marshal)
 static void
 ruby_Symbol_del(ruby_Symbol *self)
 {
-	drop_string(&self->sym_name);
+	/* sym_name lives in the context arena */
 	__ruby_instance_del((ruby_instance_t *) self);
 }
 
@@ -75,7 +75,7 @@ ruby_Symbol_to_python(ruby_Symbol *self, ruby_converter_t *converter)
 	if (self->sym_name == NULL) {
 		Py_RETURN_NONE;
 	}
-	return PyUnicode_FromString(self->sym_name);
+	return ruby_converter_intern(converter, self->sym_name);
 }
 
 static bool
@@ -104,7 +104,8 @@ ruby_Symbol_new(ruby_context_t *ctx, const char *name)
 	ruby_Symbol *sym;
 
 	sym = (ruby_Symbol *) __ruby_instance_new(ctx, &ruby_Symbol_type);
-	sym->sym_name = strdup(name);
+	sym->sym_name = ruby_arena_strdup(ruby_context_symbol_arena(ctx), name);
+	ruby_context_add_symbol(ctx, (ruby_instance_t *) sym);
 
 	return (ruby_instance_t *) sym;
 }
@@ -26,30 +26,34 @@ typedef struct {
 	ruby_byteseq_t	udef_data;
 } ruby_UserDefined;
 
-static ruby_instance_t *
-ruby_UserDefined_unmarshal(ruby_marshal_t *marshal)
+/*
+ * The only child is the classname; the data that follows is a plain byteseq
+ */
+static bool
+ruby_UserDefined_unmarshal_child(ruby_marshal_t *marshal, ruby_unmarshal_frame_t *frame, ruby_instance_t *child)
 {
 	ruby_instance_t *object;
 	ruby_byteseq_t *data;
 
-	object = ruby_unmarshal_object_instance(marshal, ruby_UserDefined_new);
+	object = ruby_unmarshal_object_new(marshal, child, ruby_UserDefined_new);
 	if (object == NULL)
-		return NULL;
+		return false;
 
 	/* Get a pointer to the object's internal byteseq buffer */
 	if (!(data = __ruby_UserDefined_get_data_rw(object))) {
 		/* complain */
-		return NULL;
+		return false;
 	}
 
 	/* Clear the byteseq object; read from stream */
 	ruby_byteseq_destroy(data);
 	if (!ruby_unmarshal_next_byteseq(marshal, data)) {
 		/* complain */
-		return NULL;
+		return false;
 	}
 
-	return object;
+	frame->object = object;
+	return true;
 }
 
 
@@ -137,7 +141,8 @@ ruby_type_t ruby_UserDefined_type = {
 	.size		= sizeof(ruby_UserDefined),
 	.base_type	= &ruby_GenericObject_type,
 
-	.unmarshal	= (ruby_instance_unmarshal_fn_t) ruby_UserDefined_unmarshal,
+	.unmarshal_begin= (ruby_instance_unmarshal_begin_fn_t) ruby_unmarshal_object_begin,
+	.unmarshal_child= (ruby_instance_unmarshal_child_fn_t) ruby_UserDefined_unmarshal_child,
 	.del		= (ruby_instance_del_fn_t) ruby_UserDefined_del,
 	.repr		= (ruby_instance_repr_fn_t) ruby_UserDefined_repr,
 	.to_python	= (ruby_instance_to_python_fn_t) ruby_UserDefined_to_python,
@@ -149,7 +154,7 @@ ruby_UserDefined_new(ruby_context_t *ctx, const char *classname)
 	ruby_UserDefined *self;
 
 	self = (ruby_UserDefined *) __ruby_GenericObject_new(ctx, classname, &ruby_UserDefined_type);
-	ruby_byteseq_init(&self->udef_data);
+	ruby_byteseq_init_arena(&self->udef_data, ruby_context_arena(ctx));
 
 	return (ruby_instance_t *) self;
 }
@@ -166,8 +171,7 @@ ruby_UserDefined_set_data(ruby_instance_t *self, const void *data, unsigned int
 	if (!ruby_UserDefined_check(self))
 		return false;
 
-	ruby_byteseq_set(&((ruby_UserDefined *) self)->udef_data, data, count);
-	return true;
+	return ruby_byteseq_set(&((ruby_UserDefined *) self)->udef_data, data, count);
 }
 
 ruby_byteseq_t *
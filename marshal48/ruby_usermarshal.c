@@ -43,23 +43,16 @@ ruby_UserMarshal_marshal(ruby_UserMarshal *self, ruby_marshal_t *marshal)
  * Marshaled object, which is constructed by instantiating Classname() and calling
  * marshal_load() with an unmarshaled ruby object
  */
-static ruby_instance_t *
-ruby_UserMarshal_unmarshal(ruby_marshal_t *marshal)
+static bool
+ruby_UserMarshal_unmarshal_child(ruby_marshal_t *marshal, ruby_unmarshal_frame_t *frame, ruby_instance_t *child)
 {
-	ruby_instance_t *object, *data;
-
-	object = ruby_unmarshal_object_instance(marshal, ruby_UserMarshal_new);
-	if (object == NULL)
-		return NULL;
-
-	data = ruby_unmarshal_next_instance(marshal);
-	if (data == NULL)
-		return NULL;
+	if (frame->object != NULL)
+		return ruby_UserMarshal_set_data(frame->object, child);
 
-	if (!ruby_UserMarshal_set_data(object, data))
-		return NULL;
-
-	return object;
+	/* The first child is the classname, the second one the data */
+	frame->object = ruby_unmarshal_object_new(marshal, child, ruby_UserMarshal_new);
+	frame->remaining += 1;
+	return frame->object != NULL;
 }
 
 static void
@@ -109,6 +102,25 @@ ruby_UserMarshal_to_python(ruby_UserMarshal *self, ruby_converter_t *converter)
 		return NULL;
 	}
 
+	/* Gem::Version is marshaled as [version_string]; set the string
+	 * directly rather than building a list and calling marshal_load() */
+	if (marshal48_version_check(result) && self->marsh_data != NULL
+	 && ruby_Array_check(self->marsh_data) && ruby_Array_get_item(self->marsh_data, 1) == NULL) {
+		ruby_instance_t *item = ruby_Array_get_item(self->marsh_data, 0);
+
+		if (item != NULL && ruby_String_check(item)) {
+			bool ok;
+
+			if (!(data = ruby_converter_intern(converter, ruby_String_get_value(item))))
+				goto failed;
+			ok = marshal48_version_set(result, data);
+			Py_DECREF(data);
+			if (!ok)
+				goto failed;
+			goto apply_vars;
+		}
+	}
+
 	if (self->marsh_data == NULL) {
 		data = Py_None;
 		Py_INCREF(data);
@@ -129,6 +141,7 @@ ruby_UserMarshal_to_python(ruby_UserMarshal *self, ruby_converter_t *converter)
 	}
 	Py_DECREF(r);
 
+apply_vars:
 	if (!__ruby_GenericObject_apply_vars(&self->marsh_base.obj_base, result, converter)) {
 		fprintf(stderr, "UserMarshal: %s: failed to apply instance vars\n", self->marsh_base.obj_classname);
 		PyErr_Format(PyExc_RuntimeError, "%s: failed to apply instance vars", self->marsh_base.obj_classname);
@@ -167,7 +180,7 @@ ruby_UserMarshal_from_python(ruby_UserMarshal *self, PyObject *py_obj, ruby_conv
 			return false;
 		}
 
-		assign_string(&self->marsh_base.obj_classname, ruby_classname);
+		self->marsh_base.obj_classname = ruby_context_strdup(converter->context, ruby_classname);
 	}
 
 	/* Call the marshal_dump() method of the new instance and pass it the data object */
@@ -192,7 +205,8 @@ ruby_type_t ruby_UserMarshal_type = {
 	.base_type	= &ruby_GenericObject_type,
 
 	.marshal	= (ruby_instance_marshal_fn_t) ruby_UserMarshal_marshal,
-	.unmarshal	= (ruby_instance_unmarshal_fn_t) ruby_UserMarshal_unmarshal,
+	.unmarshal_begin= (ruby_instance_unmarshal_begin_fn_t) ruby_unmarshal_object_begin,
+	.unmarshal_child= (ruby_instance_unmarshal_child_fn_t) ruby_UserMarshal_unmarshal_child,
 	.del		= (ruby_instance_del_fn_t) ruby_UserMarshal_del,
 	.repr		= (ruby_instance_repr_fn_t) ruby_UserMarshal_repr,
 	.to_python	= (ruby_instance_to_python_fn_t) ruby_UserMarshal_to_python,
@@ -225,3 +239,12 @@ ruby_UserMarshal_set_data(ruby_instance_t *self, ruby_instance_t *data)
 	((ruby_UserMarshal *) self)->marsh_data = data;
 	return true;
 }
+
+ruby_instance_t *
+ruby_UserMarshal_get_data(const ruby_instance_t *self)
+{
+	if (!ruby_UserMarshal_check(self))
+		return NULL;
+
+	return ((ruby_UserMarshal *) self)->marsh_data;
+}
@@ -95,25 +95,207 @@ ruby_array_destroy(ruby_array_t *array)
 {
 	unsigned int i;
 
-	for (i = 0; i < array->count; ++i)
-		ruby_instance_del(array->items[i]);
+	/* Entries may have been released already */
+	for (i = 0; i < array->count; ++i) {
+		if (array->items[i])
+			ruby_instance_del(array->items[i]);
+	}
 	ruby_array_zap(array);
 }
 
 /*
  * Dict functions
+ *
+ * A dict keeps its keys and values in insertion order, in two arrays.
+ * Most dicts hold a few instance variables, and for those a linear scan
+ * is fastest. Once a dict grows past RUBY_DICT_INDEX_MIN entries, we add
+ * an open addressing index over the keys. Keys are hashed by value
+ * for Symbol, String and Int, and by address for everything else; the
+ * hash is cached in the key's hash_value.
  */
+#define RUBY_DICT_INDEX_MIN	8
+
+static unsigned int
+__ruby_dict_key_hash(ruby_instance_t *key)
+{
+	unsigned long value;
+	const char *s;
+
+	if (key->hash_value != 0)
+		return key->hash_value;
+
+	if (ruby_Symbol_check(key)) {
+		s = ruby_Symbol_get_name(key);
+		key->hash_value = ruby_string_hash(s? s : "");
+	} else if (ruby_String_check(key)) {
+		s = ruby_String_get_value(key);
+		key->hash_value = ruby_string_hash(s? s : "");
+	} else if (ruby_Int_check(key)) {
+		value = ruby_Int_get_value(key);
+		key->hash_value = value ^ (value >> 32);
+	} else {
+		/* Not cached; True, False and None are const */
+		value = (unsigned long) key;
+		return (value >> 4) ^ (value >> 32);
+	}
+
+	return key->hash_value;
+}
+
+static bool
+__ruby_dict_key_equal(const ruby_instance_t *a, const ruby_instance_t *b)
+{
+	const char *sa, *sb;
+	size_t la, lb;
+
+	if (a == b)
+		return true;
+	if (a->op != b->op)
+		return false;
+
+	if (ruby_Symbol_check(a)) {
+		sa = ruby_Symbol_get_name(a);
+		sb = ruby_Symbol_get_name(b);
+		return !strcmp(sa? sa : "", sb? sb : "");
+	}
+
+	if (ruby_String_check(a)) {
+		/* "a\0b" and "a\0c" are different keys */
+		sa = ruby_String_get_bytes(a, &la);
+		sb = ruby_String_get_bytes(b, &lb);
+		return la == lb && (la == 0 || !memcmp(sa, sb, la));
+	}
+
+	if (ruby_Int_check(a))
+		return ruby_Int_get_value(a) == ruby_Int_get_value(b);
+
+	return false;
+}
+
+/* djb2 leaves similar strings in neighbouring slots; mix the bits */
+static inline unsigned int
+__ruby_dict_slot(const ruby_dict_t *dict, unsigned int hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	return hash & (dict->index_size - 1);
+}
+
+static void
+__ruby_dict_index_insert(ruby_dict_t *dict, unsigned int hash, unsigned int pos)
+{
+	unsigned int slot;
+
+	slot = __ruby_dict_slot(dict, hash);
+	while (dict->index[slot] != 0)
+		slot = (slot + 1) & (dict->index_size - 1);
+	dict->index[slot] = pos + 1;
+}
+
+/*
+ * (Re)build the index so that it stays at most half full
+ */
+static void
+__ruby_dict_index_rebuild(ruby_dict_t *dict)
+{
+	const ruby_array_t *keys = &dict->dict_keys;
+	unsigned int i, size = 4 * RUBY_DICT_INDEX_MIN;
+
+	while (size < 2 * keys->count)
+		size *= 2;
+
+	free(dict->index);
+	dict->index_size = size;
+	dict->index = calloc(size, sizeof(dict->index[0]));
+
+	for (i = 0; i < keys->count; ++i)
+		__ruby_dict_index_insert(dict, __ruby_dict_key_hash(keys->items[i]), i);
+}
+
+static int
+__ruby_dict_find(const ruby_dict_t *dict, ruby_instance_t *key, unsigned int hash)
+{
+	const ruby_array_t *keys = &dict->dict_keys;
+	unsigned int i, slot, pos;
+
+	if (dict->index == NULL) {
+		for (i = 0; i < keys->count; ++i) {
+			ruby_instance_t *other = keys->items[i];
+
+			if (other == key
+			 || (__ruby_dict_key_hash(other) == hash && __ruby_dict_key_equal(other, key)))
+				return i;
+		}
+		return -1;
+	}
+
+	slot = __ruby_dict_slot(dict, hash);
+	while ((pos = dict->index[slot]) != 0) {
+		ruby_instance_t *other = keys->items[pos - 1];
+
+		if (other == key
+		 || (__ruby_dict_key_hash(other) == hash && __ruby_dict_key_equal(other, key)))
+			return pos - 1;
+		slot = (slot + 1) & (dict->index_size - 1);
+	}
+	return -1;
+}
+
+static void
+__ruby_dict_append(ruby_dict_t *dict, ruby_instance_t *key, ruby_instance_t *value, unsigned int hash)
+{
+	unsigned int pos = dict->dict_keys.count;
+
+	ruby_array_append(&dict->dict_keys, key);
+	ruby_array_append(&dict->dict_values, value);
+
+	if (dict->index != NULL && 2 * (pos + 1) <= dict->index_size)
+		__ruby_dict_index_insert(dict, hash, pos);
+	else if (pos + 1 > RUBY_DICT_INDEX_MIN)
+		__ruby_dict_index_rebuild(dict);
+}
+
 void
 ruby_dict_init(ruby_dict_t *dict)
 {
 	memset(dict, 0, sizeof(*dict));
 }
 
+/*
+ * Append a key/value pair without checking whether the key is already
+ * present.
+ */
 void
 ruby_dict_add(ruby_dict_t *dict, ruby_instance_t *key, ruby_instance_t *value)
 {
-	ruby_array_append(&dict->dict_keys, key);
-	ruby_array_append(&dict->dict_values, value);
+	__ruby_dict_append(dict, key, value, __ruby_dict_key_hash(key));
+}
+
+/*
+ * Set the value for key, replacing the previous one if there is one.
+ * The key keeps its original position.
+ */
+void
+ruby_dict_set(ruby_dict_t *dict, ruby_instance_t *key, ruby_instance_t *value)
+{
+	unsigned int hash = __ruby_dict_key_hash(key);
+	int pos;
+
+	if ((pos = __ruby_dict_find(dict, key, hash)) >= 0)
+		dict->dict_values.items[pos] = value;
+	else
+		__ruby_dict_append(dict, key, value, hash);
+}
+
+ruby_instance_t *
+ruby_dict_get(const ruby_dict_t *dict, ruby_instance_t *key)
+{
+	int pos;
+
+	if ((pos = __ruby_dict_find(dict, key, __ruby_dict_key_hash(key))) < 0)
+		return NULL;
+	return dict->dict_values.items[pos];
 }
 
 /*
@@ -124,6 +306,9 @@ ruby_dict_zap(ruby_dict_t *dict)
 {
 	ruby_array_zap(&dict->dict_keys);
 	ruby_array_zap(&dict->dict_values);
+	free(dict->index);
+	dict->index = NULL;
+	dict->index_size = 0;
 }
 
 void
@@ -131,6 +316,195 @@ ruby_dict_destroy(ruby_dict_t *dict)
 {
 	ruby_array_destroy(&dict->dict_keys);
 	ruby_array_destroy(&dict->dict_values);
+	free(dict->index);
+	dict->index = NULL;
+	dict->index_size = 0;
+}
+
+/*
+ * Arena functions
+ *
+ * Memory is handed out from a list of chunks. Requests that are larger
+ * than a quarter of the chunk size get a chunk of their own, so that we
+ * do not waste the tail end of the current chunk.
+ */
+#define RUBY_ARENA_CHUNK_SIZE	(64 * 1024)
+#define RUBY_ARENA_ALIGN	(sizeof(void *))
+
+struct ruby_arena_chunk {
+	struct ruby_arena_chunk *next;
+	size_t			size;
+	size_t			used;
+	unsigned char		data[];
+};
+
+struct ruby_arena {
+	struct ruby_arena_chunk *current;
+	struct ruby_arena_chunk *big;
+
+	unsigned long		nchunks;
+	unsigned long		bytes_used;
+	unsigned long		bytes_allocated;
+};
+
+ruby_arena_t *
+ruby_arena_new(void)
+{
+	return calloc(1, sizeof(ruby_arena_t));
+}
+
+static void
+__ruby_arena_free_chunks(struct ruby_arena_chunk *chunk)
+{
+	struct ruby_arena_chunk *next;
+
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+void
+ruby_arena_free(ruby_arena_t *arena)
+{
+	__ruby_arena_free_chunks(arena->current);
+	__ruby_arena_free_chunks(arena->big);
+	free(arena);
+}
+
+/*
+ * Drop everything that was allocated, but hang on to one chunk so that
+ * an arena that is reset frequently does not keep going back to malloc.
+ */
+void
+ruby_arena_reset(ruby_arena_t *arena)
+{
+	struct ruby_arena_chunk *chunk = arena->current;
+
+	__ruby_arena_free_chunks(arena->big);
+	arena->big = NULL;
+
+	arena->nchunks = 0;
+	arena->bytes_allocated = 0;
+	arena->bytes_used = 0;
+
+	if (chunk != NULL) {
+		__ruby_arena_free_chunks(chunk->next);
+		chunk->next = NULL;
+
+		memset(chunk->data, 0, chunk->used);
+		chunk->used = 0;
+
+		arena->nchunks = 1;
+		arena->bytes_allocated = chunk->size;
+	}
+}
+
+static struct ruby_arena_chunk *
+__ruby_arena_chunk_new(ruby_arena_t *arena, size_t size, struct ruby_arena_chunk **list)
+{
+	struct ruby_arena_chunk *chunk;
+
+	/* calloc, so that all memory handed out is zeroed */
+	chunk = calloc(1, sizeof(*chunk) + size);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk->size = size;
+	chunk->next = *list;
+	*list = chunk;
+
+	arena->nchunks += 1;
+	arena->bytes_allocated += size;
+	return chunk;
+}
+
+static void *
+__ruby_arena_alloc(ruby_arena_t *arena, size_t size, size_t align)
+{
+	struct ruby_arena_chunk *chunk;
+	size_t offset;
+
+	if (size > RUBY_ARENA_CHUNK_SIZE / 4) {
+		chunk = __ruby_arena_chunk_new(arena, size, &arena->big);
+		if (chunk == NULL)
+			return NULL;
+		chunk->used = size;
+		arena->bytes_used += size;
+		return chunk->data;
+	}
+
+	chunk = arena->current;
+	if (chunk != NULL)
+		offset = (chunk->used + align - 1) & ~(align - 1);
+
+	if (chunk == NULL || offset + size > chunk->size) {
+		chunk = __ruby_arena_chunk_new(arena, RUBY_ARENA_CHUNK_SIZE, &arena->current);
+		if (chunk == NULL)
+			return NULL;
+		offset = 0;
+	}
+
+	chunk->used = offset + size;
+	arena->bytes_used += size;
+	return chunk->data + offset;
+}
+
+/*
+ * Most callers have no way to recover from running out of memory
+ */
+static void *
+__ruby_arena_alloc_or_die(ruby_arena_t *arena, size_t size, size_t align)
+{
+	void *p;
+
+	p = __ruby_arena_alloc(arena, size, align);
+	if (p == NULL) {
+		fprintf(stderr, "ruby arena: out of memory\n");
+		abort();
+	}
+	return p;
+}
+
+void *
+ruby_arena_alloc(ruby_arena_t *arena, size_t size)
+{
+	return __ruby_arena_alloc_or_die(arena, size, RUBY_ARENA_ALIGN);
+}
+
+/*
+ * Same, but return NULL if we are out of memory
+ */
+void *
+ruby_arena_try_alloc(ruby_arena_t *arena, size_t size)
+{
+	return __ruby_arena_alloc(arena, size, RUBY_ARENA_ALIGN);
+}
+
+void *
+ruby_arena_memdup(ruby_arena_t *arena, const void *data, size_t size)
+{
+	void *copy;
+
+	copy = __ruby_arena_alloc_or_die(arena, size, 1);
+	memcpy(copy, data, size);
+	return copy;
+}
+
+char *
+ruby_arena_strdup(ruby_arena_t *arena, const char *s)
+{
+	if (s == NULL)
+		return NULL;
+	return ruby_arena_memdup(arena, s, strlen(s) + 1);
+}
+
+void
+ruby_arena_stats(const ruby_arena_t *arena, unsigned long *nchunks, unsigned long *bytes_used, unsigned long *bytes_allocated)
+{
+	*nchunks = arena->nchunks;
+	*bytes_used = arena->bytes_used;
+	*bytes_allocated = arena->bytes_allocated;
 }
 
 /*
@@ -142,12 +516,23 @@ ruby_byteseq_init(ruby_byteseq_t *seq)
 	memset(seq, 0, sizeof(*seq));
 }
 
+void
+ruby_byteseq_init_arena(ruby_byteseq_t *seq, ruby_arena_t *arena)
+{
+	memset(seq, 0, sizeof(*seq));
+	seq->arena = arena;
+}
+
 void
 ruby_byteseq_destroy(ruby_byteseq_t *seq)
 {
-	if (seq->data)
+	ruby_arena_t *arena = seq->arena;
+
+	/* Arena memory is released along with the arena */
+	if (seq->data && arena == NULL)
 		free(seq->data);
 	memset(seq, 0, sizeof(*seq));
+	seq->arena = arena;
 }
 
 bool
@@ -156,26 +541,65 @@ ruby_byteseq_is_empty(const ruby_byteseq_t *seq)
 	return seq->count == 0;
 }
 
-void
+bool
 ruby_byteseq_set(ruby_byteseq_t *seq, const void *data, unsigned int count)
 {
 	ruby_byteseq_destroy(seq);
 
-	seq->data = malloc(count);
-	memcpy(seq->data, data, count);
-	seq->count = count;
+	return ruby_byteseq_append(seq, data, count);
 }
 
-void
+bool
 ruby_byteseq_append(ruby_byteseq_t *seq, const void *data, unsigned int count)
 {
-	if (seq->count == 0) {
-		ruby_byteseq_set(seq, data, count);
+	unsigned char *tail;
+
+	if (count == 0)
+		return true;
+
+	if (!(tail = ruby_byteseq_extend(seq, count)))
+		return false;
+
+	memcpy(tail, data, count);
+	return true;
+}
+
+/*
+ * Make room for count more bytes at the end of the byteseq and return
+ * a pointer to them. The caller must fill in all of them.
+ * Returns NULL if we cannot allocate that much; the byteseq is left as
+ * it was.
+ */
+unsigned char *
+ruby_byteseq_extend(ruby_byteseq_t *seq, unsigned int count)
+{
+	unsigned char *data, *tail;
+
+	if (count > UINT_MAX - seq->count) {
+		fprintf(stderr, "marshal48: byte sequence too long\n");
+		return NULL;
+	}
+
+	if (seq->arena == NULL) {
+		data = realloc(seq->data, seq->count + count);
 	} else {
-		seq->data = realloc(seq->data, seq->count + count);
-		memcpy(seq->data + seq->count, data, count);
-		seq->count += count;
+		/* No realloc for arena memory. Callers should extend a byteseq
+		 * in one go, so that nothing is wasted here */
+		data = ruby_arena_try_alloc(seq->arena, seq->count + count);
+		if (data != NULL && seq->count)
+			memcpy(data, seq->data, seq->count);
 	}
+
+	if (data == NULL) {
+		fprintf(stderr, "marshal48: unable to allocate %u bytes\n", seq->count + count);
+		return NULL;
+	}
+
+	seq->data = data;
+	tail = seq->data + seq->count;
+	seq->count += count;
+
+	return tail;
 }
 
 bool
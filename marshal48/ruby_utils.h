@@ -28,6 +28,7 @@ typedef struct ruby_array	ruby_array_t;
 typedef struct ruby_byteseq	ruby_byteseq_t;
 typedef struct ruby_dict	ruby_dict_t;
 typedef struct ruby_io		ruby_io_t;
+typedef struct ruby_arena	ruby_arena_t;
 
 
 struct ruby_array {
@@ -39,11 +40,19 @@ struct ruby_array {
 struct ruby_byteseq {
 	unsigned int		count;
 	unsigned char *		data;
+
+	/* If set, data is allocated from (and owned by) this arena */
+	ruby_arena_t *		arena;
 };
 
 struct ruby_dict {
 	ruby_array_t		dict_keys;
 	ruby_array_t		dict_values;
+
+	/* Hash index into dict_keys; slots hold position + 1, or 0 if unused.
+	 * Built only once the dict grows past a handful of entries. */
+	unsigned int		index_size;
+	unsigned int *		index;
 };
 
 extern void		ruby_array_init(ruby_array_t *);
@@ -63,13 +72,33 @@ typedef struct ruby_instancedict ruby_instancedict_t;
 extern ruby_instancedict_t *ruby_string_instancedict_new(const char *(*keyfunc)(const ruby_instance_t *));
 extern ruby_instance_t *ruby_string_instancedict_lookup(ruby_instancedict_t *, const char *);
 extern void		ruby_string_instancedict_insert(ruby_instancedict_t *, ruby_instance_t *);
+extern void		ruby_instancedict_free(ruby_instancedict_t *);
+extern unsigned int	ruby_string_hash(const char *);
 extern void		ruby_instancedict_dump(ruby_instancedict_t *);
 extern void		ruby_instancedict_stats(ruby_instancedict_t *,
 				unsigned int *avg_depth,
 				unsigned int *avg_leaf_size);
+extern void		ruby_instancedict_hit_stats(ruby_instancedict_t *,
+				unsigned long *lookups,
+				unsigned long *hits);
+
+/*
+ * The intern table maps equal strings to one shared python object
+ */
+typedef struct ruby_intern_table ruby_intern_table_t;
+
+extern ruby_intern_table_t *ruby_intern_table_new(void);
+extern void		ruby_intern_table_free(ruby_intern_table_t *);
+extern PyObject *	ruby_intern_table_get(ruby_intern_table_t *, const char *);
+extern void		ruby_intern_table_stats(const ruby_intern_table_t *,
+				unsigned long *lookups,
+				unsigned long *hits,
+				unsigned long *bytes_saved);
 
 extern void		ruby_dict_init(ruby_dict_t *);
 extern void		ruby_dict_add(ruby_dict_t *, ruby_instance_t *key, ruby_instance_t *value);
+extern void		ruby_dict_set(ruby_dict_t *, ruby_instance_t *key, ruby_instance_t *value);
+extern ruby_instance_t *ruby_dict_get(const ruby_dict_t *, ruby_instance_t *key);
 /* This just zaps the dict, but does not destroy its dict members */
 extern void		ruby_dict_zap(ruby_dict_t *);
 extern bool		__ruby_dict_repr(const ruby_dict_t *dict, ruby_repr_context_t *, ruby_repr_buf *rbuf);
@@ -78,11 +107,30 @@ extern bool		__ruby_dict_to_python(const ruby_dict_t *dict,
 				bool (*apply_fn)(PyObject *target, PyObject *key, PyObject *value),
 				ruby_converter_t *converter);
 
+/*
+ * Bump allocator. Everything allocated from an arena is released in
+ * one go by ruby_arena_free() or ruby_arena_reset(); there is no way to
+ * free individual items.
+ */
+extern ruby_arena_t *	ruby_arena_new(void);
+extern void		ruby_arena_free(ruby_arena_t *);
+extern void		ruby_arena_reset(ruby_arena_t *);
+extern void *		ruby_arena_alloc(ruby_arena_t *, size_t size);
+extern void *		ruby_arena_try_alloc(ruby_arena_t *, size_t size);
+extern char *		ruby_arena_strdup(ruby_arena_t *, const char *);
+extern void *		ruby_arena_memdup(ruby_arena_t *, const void *, size_t size);
+extern void		ruby_arena_stats(const ruby_arena_t *,
+				unsigned long *nchunks,
+				unsigned long *bytes_used,
+				unsigned long *bytes_allocated);
+
 extern void		ruby_byteseq_init(ruby_byteseq_t *);
+extern void		ruby_byteseq_init_arena(ruby_byteseq_t *, ruby_arena_t *);
 extern void		ruby_byteseq_destroy(ruby_byteseq_t *);
 extern bool		ruby_byteseq_is_empty(const ruby_byteseq_t *);
-extern void		ruby_byteseq_append(ruby_byteseq_t *, const void *, unsigned int);
-extern void		ruby_byteseq_set(ruby_byteseq_t *, const void *, unsigned int);
+extern bool		ruby_byteseq_append(ruby_byteseq_t *, const void *, unsigned int);
+extern unsigned char *	ruby_byteseq_extend(ruby_byteseq_t *, unsigned int);
+extern bool		ruby_byteseq_set(ruby_byteseq_t *, const void *, unsigned int);
 extern bool		__ruby_byteseq_repr(const ruby_byteseq_t *, ruby_repr_buf *rbuf);
 
 /*
@@ -101,8 +149,33 @@ extern const char *	__ruby_repr_finish(ruby_repr_buf *);
 extern const char *	__ruby_repr_abort(ruby_repr_buf *);
 
 
-extern ruby_io_t *	ruby_io_new(PyObject *io);
+/*
+ * Stream readers use a buffer between these two sizes. A bufsize of 0
+ * selects an adaptive buffer that starts small and grows as needed.
+ */
+#define RUBY_IOBUF_MIN_SIZE	(64 * 1024)
+#define RUBY_IOBUF_MAX_SIZE	(1024 * 1024)
+
+/* Chunk size for reading and inflating compressed input */
+#define RUBY_IOBUF_INFLATE_SIZE	(256 * 1024)
+
+enum {
+	RUBY_COMPRESSION_NONE = 0,
+	RUBY_COMPRESSION_ZLIB,
+	RUBY_COMPRESSION_GZIP,
+};
+
+extern int		ruby_compression_by_name(const char *name);
+
+extern ruby_io_t *	ruby_io_new(PyObject *io, unsigned int bufsize);
+extern ruby_io_t *	ruby_io_new_from_buffer(PyObject *obj);
+extern ruby_io_t *	ruby_io_new_from_memory(const void *data, unsigned int len);
+extern ruby_io_t *	ruby_io_new_inflate(const void *data, unsigned long len, int compression);
+extern bool		ruby_io_set_compression(ruby_io_t *reader, int compression);
+extern ruby_io_t *	ruby_io_new_memory(void);
+extern PyObject *	ruby_io_take_bytes(ruby_io_t *writer);
 extern void		ruby_io_free(ruby_io_t *reader);
+extern bool		ruby_io_in_memory(const ruby_io_t *reader);
 extern int		ruby_io_fillbuf(ruby_io_t *reader);;
 extern bool		ruby_io_flushbuf(ruby_io_t *reader);;
 extern int		__ruby_io_nextc(ruby_io_t *reader);
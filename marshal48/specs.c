@@ -0,0 +1,425 @@
+/*
+Ruby marshal48 - columnar unmarshaling of spec indices
+
+latest_specs.4.8 and specs.4.8 are one big array of
+  [name, Gem::Version, platform]
+tuples. Converting these to python the usual way gives us a list, a
+GemVersion object and three strings per entry. Here, we look at the
+ruby instances directly, and only collect the strings into a few
+flat columns.
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+#include "ruby_utils.h"
+#include "ruby_marshal.h"
+#include "stats.h"
+
+typedef struct {
+	unsigned char *		data;
+	unsigned long		len;
+	unsigned long		size;
+} specs_buffer_t;
+
+typedef struct {
+	PyObject *		names;
+	PyObject *		index;
+	ruby_intern_table_t *	intern;
+
+	specs_buffer_t		versions;
+	specs_buffer_t		version_offsets;
+	specs_buffer_t		platform_ids;
+
+	char **			platforms;
+	unsigned int		nplatforms;
+	uint32_t		last_platform_id;
+
+	/* The run of rows that share the current name */
+	PyObject *		run_name;
+	unsigned long		run_start;
+	unsigned long		nrows;
+} specs_table_t;
+
+static void *
+specs_buffer_extend(specs_buffer_t *buf, unsigned long count)
+{
+	void *tail;
+
+	if (buf->len + count > buf->size) {
+		while (buf->len + count > buf->size)
+			buf->size = buf->size? 2 * buf->size : 4096;
+		buf->data = realloc(buf->data, buf->size);
+	}
+
+	tail = buf->data + buf->len;
+	buf->len += count;
+	return tail;
+}
+
+static void
+specs_buffer_append_u32(specs_buffer_t *buf, uint32_t value)
+{
+	memcpy(specs_buffer_extend(buf, sizeof(value)), &value, sizeof(value));
+}
+
+static PyObject *
+specs_buffer_to_bytes(specs_buffer_t *buf)
+{
+	return PyBytes_FromStringAndSize((const char *) buf->data, buf->len);
+}
+
+static void
+specs_table_destroy(specs_table_t *table)
+{
+	unsigned int i;
+
+	Py_XDECREF(table->names);
+	Py_XDECREF(table->index);
+	Py_XDECREF(table->run_name);
+	if (table->intern) {
+		unsigned long lookups, hits, bytes_saved;
+
+		ruby_intern_table_stats(table->intern, &lookups, &hits, &bytes_saved);
+		marshal48_stats_add_intern(lookups, hits);
+		ruby_intern_table_free(table->intern);
+	}
+
+	free(table->versions.data);
+	free(table->version_offsets.data);
+	free(table->platform_ids.data);
+
+	for (i = 0; i < table->nplatforms; ++i)
+		free(table->platforms[i]);
+	free(table->platforms);
+}
+
+/*
+ * The version may come as a Gem::Version (which is what nexus gives us), or
+ * as an array of those (which is what rubygems.org does). A Gem::Version
+ * is marshaled as a user object wrapping a one-element array.
+ *
+ * rubygems shares Gem::Version objects, so many entries refer back to
+ * the version of an earlier one. By then, the transient scope of that
+ * entry is gone, and the version is remembered as a plain string.
+ */
+static const char *
+specs_get_version(const ruby_instance_t *instance)
+{
+	ruby_instance_t *data;
+
+	if (ruby_Array_check(instance))
+		instance = ruby_Array_get_item(instance, 0);
+
+	if (instance == NULL)
+		return NULL;
+	if (ruby_String_check(instance))
+		return ruby_String_get_value(instance);
+
+	if (!ruby_UserMarshal_check(instance)
+	 || strcmp(ruby_GenericObject_get_classname(instance), "Gem::Version"))
+		return NULL;
+
+	if (!(data = ruby_UserMarshal_get_data(instance)))
+		return NULL;
+	if (ruby_Array_check(data))
+		data = ruby_Array_get_item(data, 0);
+	if (data == NULL)
+		return NULL;
+	return ruby_String_get_value(data);
+}
+
+/*
+ * Which instances later entries may want to refer to: strings (mostly the
+ * platform), and versions.
+ */
+static const char *
+specs_keep_instance(const ruby_instance_t *instance)
+{
+	if (ruby_String_check(instance))
+		return ruby_String_get_value(instance);
+	if (ruby_UserMarshal_check(instance))
+		return specs_get_version(instance);
+	return NULL;
+}
+
+static bool
+specs_get_platform_id(specs_table_t *table, const ruby_instance_t *instance, uint32_t *id)
+{
+	const char *value;
+	unsigned int i;
+
+	if (!(value = ruby_String_get_value(instance)))
+		return false;
+
+	/* Platforms are few; usually "ruby", "java" and a handful of others.
+	 * And most of the time, it's the same platform as in the entry before. */
+	i = table->last_platform_id;
+	if (i >= table->nplatforms || strcmp(table->platforms[i], value)) {
+		for (i = 0; i < table->nplatforms; ++i) {
+			if (!strcmp(table->platforms[i], value))
+				break;
+		}
+
+		if (i == table->nplatforms) {
+			table->platforms = realloc(table->platforms, (i + 1) * sizeof(table->platforms[0]));
+			table->platforms[table->nplatforms++] = strdup(value);
+		}
+	}
+
+	table->last_platform_id = *id = i;
+	return true;
+}
+
+/*
+ * Record the row range of the name we've been looking at in the index.
+ * Indices are usually sorted by name, but we do not rely on it; a name
+ * that shows up in several places gets several ranges.
+ */
+static bool
+specs_table_close_run(specs_table_t *table)
+{
+	PyObject *ranges, *range;
+	bool ok = false;
+
+	if (table->run_name == NULL || table->index == NULL)
+		return true;
+
+	if (!(range = Py_BuildValue("(kk)", table->run_start, table->nrows - table->run_start)))
+		return false;
+
+	if ((ranges = PyDict_GetItem(table->index, table->run_name)) != NULL) {
+		ok = PyList_Append(ranges, range) == 0;
+	} else if ((ranges = PyList_New(0)) != NULL) {
+		ok = PyList_Append(ranges, range) == 0
+		  && PyDict_SetItem(table->index, table->run_name, ranges) == 0;
+		Py_DECREF(ranges);
+	}
+
+	Py_DECREF(range);
+	return ok;
+}
+
+static bool
+specs_table_add(specs_table_t *table, ruby_instance_t *instance)
+{
+	ruby_instance_t *item;
+	const char *name, *version;
+	PyObject *pyname;
+	uint32_t platform_id;
+	unsigned int len;
+
+	if (!ruby_Array_check(instance)
+	 || !(item = ruby_Array_get_item(instance, 0))
+	 || !(name = ruby_String_get_value(item))
+	 || !(item = ruby_Array_get_item(instance, 1))
+	 || !(version = specs_get_version(item))
+	 || !(item = ruby_Array_get_item(instance, 2))
+	 || ruby_Array_get_item(instance, 3) != NULL) {
+		PyErr_Format(PyExc_ValueError, "marshal48: entry %lu of spec index is not a [name, Gem::Version, platform] tuple",
+				table->nrows);
+		return false;
+	}
+
+	if (!specs_get_platform_id(table, item, &platform_id)) {
+		if (!PyErr_Occurred())
+			PyErr_Format(PyExc_ValueError, "marshal48: entry %lu of spec index has a bad platform", table->nrows);
+		return false;
+	}
+
+	if (!(pyname = ruby_intern_table_get(table->intern, name)))
+		return false;
+
+	if (PyList_Append(table->names, pyname) < 0) {
+		Py_DECREF(pyname);
+		return false;
+	}
+
+	/* Names are interned, so comparing the objects is enough */
+	if (pyname != table->run_name) {
+		if (!specs_table_close_run(table)) {
+			Py_DECREF(pyname);
+			return false;
+		}
+		Py_XDECREF(table->run_name);
+		table->run_name = pyname;
+		table->run_start = table->nrows;
+	} else {
+		Py_DECREF(pyname);
+	}
+
+	/* Versions are stored NUL terminated; the offset we record is
+	 * where the next one starts */
+	len = strlen(version) + 1;
+	memcpy(specs_buffer_extend(&table->versions, len), version, len);
+	specs_buffer_append_u32(&table->version_offsets, table->versions.len);
+
+	specs_buffer_append_u32(&table->platform_ids, platform_id);
+
+	table->nrows += 1;
+	return true;
+}
+
+static PyObject *
+specs_table_result(specs_table_t *table)
+{
+	PyObject *result, *value;
+	unsigned int i;
+
+	if (!specs_table_close_run(table))
+		return NULL;
+
+	if (!(result = PyDict_New()))
+		return NULL;
+
+	if (PyDict_SetItemString(result, "names", table->names) < 0)
+		goto failed;
+
+	if (!(value = specs_buffer_to_bytes(&table->versions))
+	 || PyDict_SetItemString(result, "versions", value) < 0)
+		goto failed_value;
+	Py_DECREF(value);
+
+	if (!(value = specs_buffer_to_bytes(&table->version_offsets))
+	 || PyDict_SetItemString(result, "version_offsets", value) < 0)
+		goto failed_value;
+	Py_DECREF(value);
+
+	if (!(value = specs_buffer_to_bytes(&table->platform_ids))
+	 || PyDict_SetItemString(result, "platform_ids", value) < 0)
+		goto failed_value;
+	Py_DECREF(value);
+
+	if (!(value = PyList_New(table->nplatforms)))
+		goto failed;
+	for (i = 0; i < table->nplatforms; ++i) {
+		PyObject *platform;
+
+		if (!(platform = PyUnicode_FromString(table->platforms[i])))
+			goto failed_value;
+		PyList_SET_ITEM(value, i, platform);
+	}
+	if (PyDict_SetItemString(result, "platforms", value) < 0)
+		goto failed_value;
+	Py_DECREF(value);
+
+	if (table->index && PyDict_SetItemString(result, "index", table->index) < 0)
+		goto failed;
+
+	return result;
+
+failed_value:
+	Py_XDECREF(value);
+failed:
+	Py_DECREF(result);
+	return NULL;
+}
+
+/*
+ * marshal48.unmarshal_specs(io, index = False, quiet = True, bufsize = 0, compression = None)
+ *
+ * Returns a dict with these columns, one row per entry of the index:
+ *   names		list of str (interned, so repeated names cost a pointer each)
+ *   versions		bytes; all version strings, each terminated by a NUL byte
+ *   version_offsets	bytes; uint32 offset into versions just past the NUL
+ *			of each row. Row i is versions[offsets[i-1]:offsets[i] - 1],
+ *			where row 0 starts at offset 0
+ *   platform_ids	bytes; uint32 index into platforms for each row
+ *   platforms		list of str
+ * and, if index is true,
+ *   index		dict mapping each name to a list of (first row, count)
+ *
+ * The uint32 columns are in native byte order, and can be accessed with
+ * memoryview(...).cast('I').
+ *
+ * Every entry is unmarshaled in a transient scope, like iter_unmarshal does.
+ * Nothing is converted to python, though; when the scope ends, we only keep
+ * the strings and versions around, as later entries may refer back to them.
+ */
+PyObject *
+marshal48_UnmarshalSpecs(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"io",
+		"index",
+		"quiet",
+		"bufsize",
+		"compression",
+		NULL
+	};
+	PyObject *io, *result = NULL;
+	const char *compression_name = NULL;
+	unsigned int bufsize = 0;
+	int want_index = 0, quiet = 1, compression;
+	struct ruby_marshal *marshal;
+	ruby_context_t *ruby;
+	specs_table_t table;
+	long count;
+	double t0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iiIz", kwlist, &io, &want_index, &quiet, &bufsize, &compression_name))
+		return NULL;
+
+	if (!marshal48_check_bufsize(bufsize)
+	 || !marshal48_parse_compression(compression_name, &compression))
+		return NULL;
+
+	t0 = marshal48_stats_now();
+	ruby = ruby_context_new();
+
+	marshal = marshal48_unmarshal_open(ruby, io, bufsize, compression, quiet);
+	if (marshal == NULL || !marshal48_unmarshal_array_begin(marshal, &count)) {
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_ValueError, "marshal48: data does not contain a marshaled array");
+		if (marshal)
+			ruby_unmarshal_free(marshal);
+		ruby_context_free(ruby);
+		return NULL;
+	}
+
+	memset(&table, 0, sizeof(table));
+	table.intern = ruby_intern_table_new();
+	if (!(table.names = PyList_New(0)))
+		goto out;
+	if (want_index && !(table.index = PyDict_New()))
+		goto out;
+
+	while (count-- > 0) {
+		ruby_instance_t *instance;
+		bool ok;
+
+		ruby_context_begin_transient(ruby);
+		instance = ruby_unmarshal_next_instance(marshal);
+		ok = instance && specs_table_add(&table, instance);
+		ruby_context_end_transient_keep(ruby, specs_keep_instance);
+
+		if (!ok) {
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_RuntimeError, "marshal48: unable to unmarshal array element");
+			goto out;
+		}
+	}
+
+	result = specs_table_result(&table);
+
+out:
+	specs_table_destroy(&table);
+	ruby_unmarshal_free(marshal);
+	ruby_context_free(ruby);
+	marshal48_stats_add_phase("specs", marshal48_stats_now() - t0);
+	return result;
+}
@@ -0,0 +1,260 @@
+/*
+Ruby marshal48 - process wide counters, exposed as marshal48.stats()
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#include "extension.h"
+#include "stats.h"
+
+#define MARSHAL48_STATS_MAX_PHASES	16
+
+static struct marshal48_stats {
+	struct {
+		const char *	name;
+		unsigned long	count;
+	} types[MARSHAL48_STATS_MAX_TYPES];
+	unsigned int		ntypes;
+
+	unsigned long		bytes_read;
+	unsigned long		bytes_inflated;
+	unsigned long		refills;
+
+	unsigned long		instancedict_lookups;
+	unsigned long		instancedict_hits;
+	unsigned long		intern_lookups;
+	unsigned long		intern_hits;
+
+	unsigned long		factory_calls;
+
+	struct {
+		const char *	name;
+		unsigned long	calls;
+		double		time;
+	} phases[MARSHAL48_STATS_MAX_PHASES];
+	unsigned int		nphases;
+} marshal48_stats;
+
+static pthread_mutex_t		marshal48_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double
+marshal48_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void
+marshal48_stats_add_types(const marshal48_type_counts_t *tc)
+{
+	struct marshal48_stats *st = &marshal48_stats;
+	unsigned int i, j;
+
+	if (tc->count == 0)
+		return;
+
+	pthread_mutex_lock(&marshal48_stats_lock);
+	for (i = 0; i < tc->count; ++i) {
+		const char *name = tc->entry[i].type->name;
+
+		for (j = 0; j < st->ntypes; ++j) {
+			if (!strcmp(st->types[j].name, name))
+				break;
+		}
+
+		if (j == st->ntypes) {
+			if (j >= MARSHAL48_STATS_MAX_TYPES)
+				continue;
+			st->types[st->ntypes++].name = name;
+		}
+		st->types[j].count += tc->entry[i].count;
+	}
+	pthread_mutex_unlock(&marshal48_stats_lock);
+}
+
+void
+marshal48_stats_add_io(unsigned long bytes_read, unsigned long bytes_inflated, unsigned long refills)
+{
+	pthread_mutex_lock(&marshal48_stats_lock);
+	marshal48_stats.bytes_read += bytes_read;
+	marshal48_stats.bytes_inflated += bytes_inflated;
+	marshal48_stats.refills += refills;
+	pthread_mutex_unlock(&marshal48_stats_lock);
+}
+
+void
+marshal48_stats_add_instancedict(unsigned long lookups, unsigned long hits)
+{
+	pthread_mutex_lock(&marshal48_stats_lock);
+	marshal48_stats.instancedict_lookups += lookups;
+	marshal48_stats.instancedict_hits += hits;
+	pthread_mutex_unlock(&marshal48_stats_lock);
+}
+
+void
+marshal48_stats_add_intern(unsigned long lookups, unsigned long hits)
+{
+	pthread_mutex_lock(&marshal48_stats_lock);
+	marshal48_stats.intern_lookups += lookups;
+	marshal48_stats.intern_hits += hits;
+	pthread_mutex_unlock(&marshal48_stats_lock);
+}
+
+void
+marshal48_stats_add_factory_calls(unsigned long calls)
+{
+	pthread_mutex_lock(&marshal48_stats_lock);
+	marshal48_stats.factory_calls += calls;
+	pthread_mutex_unlock(&marshal48_stats_lock);
+}
+
+/*
+ * phase must be a string constant
+ */
+void
+marshal48_stats_add_phase(const char *phase, double elapsed)
+{
+	struct marshal48_stats *st = &marshal48_stats;
+	unsigned int i;
+
+	pthread_mutex_lock(&marshal48_stats_lock);
+	for (i = 0; i < st->nphases; ++i) {
+		if (!strcmp(st->phases[i].name, phase))
+			break;
+	}
+
+	if (i == st->nphases && i < MARSHAL48_STATS_MAX_PHASES)
+		st->phases[st->nphases++].name = phase;
+
+	if (i < st->nphases) {
+		st->phases[i].calls++;
+		st->phases[i].time += elapsed;
+	}
+	pthread_mutex_unlock(&marshal48_stats_lock);
+}
+
+static bool
+__stats_set(PyObject *dict, const char *key, PyObject *value)
+{
+	int rv;
+
+	if (value == NULL)
+		return false;
+	rv = PyDict_SetItemString(dict, key, value);
+	Py_DECREF(value);
+	return rv >= 0;
+}
+
+static PyObject *
+__stats_hit_rate(unsigned long lookups, unsigned long hits)
+{
+	PyObject *dict;
+
+	if (!(dict = PyDict_New()))
+		return NULL;
+
+	if (!__stats_set(dict, "lookups", PyLong_FromUnsignedLong(lookups))
+	 || !__stats_set(dict, "hits", PyLong_FromUnsignedLong(hits))
+	 || !__stats_set(dict, "hit_rate", PyFloat_FromDouble(lookups? (double) hits / lookups : 0))) {
+		Py_DECREF(dict);
+		return NULL;
+	}
+	return dict;
+}
+
+static PyObject *
+__stats_to_python(const struct marshal48_stats *st)
+{
+	PyObject *result, *dict;
+	unsigned int i;
+
+	if (!(result = PyDict_New()))
+		return NULL;
+
+	if (!(dict = PyDict_New()) || !__stats_set(result, "objects", dict))
+		goto failed;
+	for (i = 0; i < st->ntypes; ++i) {
+		if (!__stats_set(dict, st->types[i].name, PyLong_FromUnsignedLong(st->types[i].count)))
+			goto failed;
+	}
+
+	if (!__stats_set(result, "bytes_read", PyLong_FromUnsignedLong(st->bytes_read))
+	 || !__stats_set(result, "bytes_inflated", PyLong_FromUnsignedLong(st->bytes_inflated))
+	 || !__stats_set(result, "refills", PyLong_FromUnsignedLong(st->refills))
+	 || !__stats_set(result, "instancedict", __stats_hit_rate(st->instancedict_lookups, st->instancedict_hits))
+	 || !__stats_set(result, "interned_strings", __stats_hit_rate(st->intern_lookups, st->intern_hits))
+	 || !__stats_set(result, "factory_calls", PyLong_FromUnsignedLong(st->factory_calls)))
+		goto failed;
+
+	if (!(dict = PyDict_New()) || !__stats_set(result, "phases", dict))
+		goto failed;
+	for (i = 0; i < st->nphases; ++i) {
+		PyObject *phase = Py_BuildValue("{s:k,s:d}", "calls", st->phases[i].calls, "time", st->phases[i].time);
+
+		if (!__stats_set(dict, st->phases[i].name, phase))
+			goto failed;
+	}
+
+	return result;
+
+failed:
+	Py_DECREF(result);
+	return NULL;
+}
+
+/*
+ * marshal48.stats(reset = False)
+ *
+ * Returns a dict with everything we counted since the module was loaded
+ * (or since the last reset):
+ *   objects		ruby instances created, by type
+ *   bytes_read		input consumed, compressed or not
+ *   bytes_inflated	output of zlib, for compressed input
+ *   refills		number of times we had to go back to the io object or zlib
+ *   instancedict	lookups/hits/hit_rate of the symbol and string dicts
+ *   interned_strings	lookups/hits/hit_rate of the python string intern tables
+ *   factory_calls	calls into python to instantiate ruby objects
+ *   phases		calls and time in seconds, by phase
+ *
+ * Counts are added when the objects doing the work go away, ie at the end
+ * of each unmarshal() call, or when an iterator is exhausted.
+ */
+PyObject *
+marshal48_Stats(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"reset",
+		NULL
+	};
+	struct marshal48_stats copy;
+	int reset = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &reset))
+		return NULL;
+
+	pthread_mutex_lock(&marshal48_stats_lock);
+	copy = marshal48_stats;
+	if (reset)
+		memset(&marshal48_stats, 0, sizeof(marshal48_stats));
+	pthread_mutex_unlock(&marshal48_stats_lock);
+
+	return __stats_to_python(&copy);
+}
@@ -0,0 +1,70 @@
+/*
+Ruby marshal48 - counters for marshal48.stats()
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MARSHAL48_STATS_H
+#define MARSHAL48_STATS_H
+
+#include "ruby.h"
+
+/*
+ * Counting is done in whatever object does the work (context, converter,
+ * reader), without any locking. The counts are added to the global ones
+ * when that object goes away, so the hot paths never touch shared memory,
+ * even when unmarshal_many() runs on several threads.
+ */
+#define MARSHAL48_STATS_MAX_TYPES	16
+
+typedef struct marshal48_type_counts {
+	unsigned int		count;
+	struct {
+		const ruby_type_t *type;
+		unsigned long	count;
+	} entry[MARSHAL48_STATS_MAX_TYPES];
+} marshal48_type_counts_t;
+
+/* There are only a handful of types, and the common ones come first */
+static inline void
+marshal48_type_counts_add(marshal48_type_counts_t *tc, const ruby_type_t *type)
+{
+	unsigned int i;
+
+	for (i = 0; i < tc->count; ++i) {
+		if (tc->entry[i].type == type) {
+			tc->entry[i].count++;
+			return;
+		}
+	}
+
+	if (i < MARSHAL48_STATS_MAX_TYPES) {
+		tc->entry[i].type = type;
+		tc->entry[i].count = 1;
+		tc->count++;
+	}
+}
+
+extern double		marshal48_stats_now(void);
+extern void		marshal48_stats_add_types(const marshal48_type_counts_t *);
+extern void		marshal48_stats_add_io(unsigned long bytes_read, unsigned long bytes_inflated, unsigned long refills);
+extern void		marshal48_stats_add_instancedict(unsigned long lookups, unsigned long hits);
+extern void		marshal48_stats_add_intern(unsigned long lookups, unsigned long hits);
+extern void		marshal48_stats_add_factory_calls(unsigned long calls);
+extern void		marshal48_stats_add_phase(const char *phase, double elapsed);
+
+#endif /* MARSHAL48_STATS_H */
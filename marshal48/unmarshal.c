@@ -24,29 +24,36 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "extension.h"
 #include "ruby_utils.h"
 #include "ruby_marshal.h"
+#include "stats.h"
 
 
 typedef struct unmarshal_processor {
 	const char *		name;
 	ruby_instance_t *	(*process)(ruby_marshal_t *s);
-} unmarshal_processor_t;
 
-extern ruby_instance_t *ruby_unmarshal_next_instance_quiet(ruby_marshal_t *s);
+	/* For instances that contain other instances */
+	bool			(*begin)(ruby_marshal_t *, ruby_unmarshal_frame_t *);
+	bool			(*child)(ruby_marshal_t *, ruby_unmarshal_frame_t *, ruby_instance_t *);
+} unmarshal_processor_t;
 
 /*
  * Manage the state object
  */
 ruby_marshal_t *
-ruby_unmarshal_new(ruby_context_t *ruby, PyObject *io)
+ruby_unmarshal_new(ruby_context_t *ruby, ruby_io_t *ioctx)
 {
 	ruby_marshal_t *marshal;
 
 	marshal = calloc(1, sizeof(*marshal));
 	marshal->ruby = ruby;
-	marshal->ioctx = ruby_io_new(io);
+	marshal->ioctx = ioctx;
 
 	marshal->next_obj_id = 0;
 	marshal->next_sym_id = 0;
+	marshal->e_sym_id = -1;
+
+	marshal->strbuf = malloc(sizeof(*marshal->strbuf));
+	ruby_byteseq_init(marshal->strbuf);
 
 	return marshal;
 }
@@ -62,9 +69,13 @@ ruby_unmarshal_free(ruby_marshal_t *marshal)
 {
 	/* We do not delete the ruby context; that is done by the caller */
 	ruby_io_free(marshal->ioctx);
+	free(marshal->frames);
+	ruby_byteseq_destroy(marshal->strbuf);
+	free(marshal->strbuf);
 
 	if (marshal->tracing)
 		ruby_trace_free(marshal->tracing);
+	free(marshal);
 }
 
 ruby_instance_t *
@@ -103,6 +114,7 @@ ruby_unmarshal_next_fixnum(ruby_marshal_t *s, long *fixnump)
 	case 1:
 	case 2:
 	case 3:
+	case 4:
 		return ruby_io_nextw(reader, cc, fixnump);
 
 	case 0xff:
@@ -137,7 +149,7 @@ ruby_marshal_fixnum(ruby_marshal_t *s, long fixnum)
 
 	if (fixnum >= 0) {
 		unsigned char bytes[8];
-		unsigned int i, len;
+		unsigned int len;
 
 		if (fixnum < 0x80 - 5)
 			return ruby_io_putc(writer, fixnum + 5);
@@ -154,14 +166,8 @@ ruby_marshal_fixnum(ruby_marshal_t *s, long fixnum)
 			return false;
 		}
 
-		if (!ruby_io_putc(writer, len))
-			return false;
-
-		for (i = 0; i < len; ++i)
-			if (!ruby_io_putc(writer, bytes[i]))
-				return false;
-
-		return true;
+		return ruby_io_putc(writer, len)
+		    && ruby_io_put_bytes(writer, bytes, len);
 	}
 
 	fprintf(stderr, "Unable to represent fixnum %ld\n", orig_value);
@@ -177,6 +183,11 @@ ruby_unmarshal_next_byteseq(ruby_marshal_t *s, ruby_byteseq_t *seq)
 	if (!ruby_unmarshal_next_fixnum(s, &count))
 		return false;
 
+	if (count < 0) {
+		fprintf(stderr, "Invalid byte sequence length %ld\n", count);
+		return false;
+	}
+
 	assert(seq->count == 0);
 	return ruby_io_next_byteseq(reader, count, seq);
 }
@@ -184,25 +195,39 @@ ruby_unmarshal_next_byteseq(ruby_marshal_t *s, ruby_byteseq_t *seq)
 const char *
 ruby_unmarshal_next_string(ruby_marshal_t *marshal, const char *encoding)
 {
-	/* This is a static byteseq object, so we can return its internal
-	 * data pointer and it will remain valid until the next call
+	/* The buffer belongs to the marshal state, so we can return its
+	 * internal data pointer and it will remain valid until the next call
 	 * to this function. */
-	static ruby_byteseq_t seq;
+	ruby_byteseq_t *seq = marshal->strbuf;
 
 	/* zap what's left over from the previous call */
-	ruby_byteseq_destroy(&seq);
+	ruby_byteseq_destroy(seq);
 
-	if (!ruby_unmarshal_next_byteseq(marshal, &seq))
+	if (!ruby_unmarshal_next_byteseq(marshal, seq))
 		return NULL;
 
 	/* NUL terminate */
-	ruby_byteseq_append(&seq, "", 1);
+	if (!ruby_byteseq_append(seq, "", 1))
+		return NULL;
 
 	assert(!strcmp(encoding, "latin1"));
-	return (const char *) seq.data;
+	return (const char *) seq->data;
 	/* return PyUnicode_Decode(data, count, encoding, NULL); */
 }
 
+/*
+ * Same, but also return the length, which may be more than strlen()
+ */
+const char *
+ruby_unmarshal_next_string_len(ruby_marshal_t *marshal, const char *encoding, size_t *lenp)
+{
+	const char *value;
+
+	if ((value = ruby_unmarshal_next_string(marshal, encoding)) != NULL)
+		*lenp = marshal->strbuf->count - 1;
+	return value;
+}
+
 /*
  * Processors are a convenience - they combine a name (debug string) with a function ptr
  *
@@ -293,94 +318,145 @@ ruby_ObjectReference_unmarshal(ruby_marshal_t *s)
 RUBY_UNMARSHAL_PROCESSOR(ObjectReference);
 
 /*
- * Common helper to create object instances that specify a Classname
+ * Common helpers for objects that specify a Classname (o, u and U).
+ * The classname is the first child instance; the type's unmarshal_child
+ * function creates the object once it has been unmarshaled.
  */
-ruby_instance_t *
-ruby_unmarshal_object_instance(ruby_marshal_t *s,
-               ruby_instance_t * (*constructor)(ruby_context_t *, const char *))
+bool
+ruby_unmarshal_object_begin(ruby_marshal_t *s, ruby_unmarshal_frame_t *frame)
 {
-	ruby_instance_t *name_instance, *object;
-	char *classname;
-
-	if (!(name_instance = ruby_unmarshal_next_instance(s)))
-	       return NULL;
+	frame->remaining = 1;
+	return true;
+}
 
-	classname = ruby_instance_as_string(name_instance);
-	if (classname == NULL)
-	       return NULL;
+ruby_instance_t *
+ruby_unmarshal_object_new(ruby_marshal_t *s, ruby_instance_t *name_instance,
+		ruby_object_factory_fn_t constructor)
+{
+	const char *classname;
 
-	object = constructor(s->ruby, classname);
-	free(classname);
+	/* No need to copy the name; the constructor copies it into the arena */
+	if (!(classname = ruby_Symbol_get_name(name_instance))
+	 && !(classname = ruby_String_get_value(name_instance))) {
+		fprintf(stderr, "Cannot get class name from %s object\n", name_instance->op->name);
+		return NULL;
+	}
 
-	return object;
+	return constructor(s->ruby, classname);
 }
 
 /*
- * Common helper function to process instance variables
+ * Common helpers to process instance variables: read their number, and
+ * expect that many key/value pairs as children.
  */
 bool
-ruby_unmarshal_object_instance_vars(ruby_marshal_t *s, ruby_instance_t *object)
+ruby_unmarshal_object_vars_begin(ruby_marshal_t *s, ruby_unmarshal_frame_t *frame)
 {
-	long i, count;
+	long count;
 
 	if (!ruby_unmarshal_next_fixnum(s, &count))
 		return false;
 
-	ruby_marshal_trace(s, "%s is followed by %ld instance variables", object->op->name, count);
+	ruby_marshal_trace(s, "%s is followed by %ld instance variables", frame->object->op->name, count);
 
-	for (i = 0; i < count; ++i) {
-		ruby_repr_context_t *repr_ctx;
-		ruby_instance_t *key, *value;
+	frame->remaining += 2 * count;
+	return true;
+}
 
-		key = ruby_unmarshal_next_instance_quiet(s);
-		if (key == NULL)
-			return false;
+bool
+ruby_unmarshal_object_var(ruby_marshal_t *s, ruby_unmarshal_frame_t *frame, ruby_instance_t *child)
+{
+	ruby_instance_t *key;
 
-		value = ruby_unmarshal_next_instance_quiet(s);
-		if (value == NULL)
-			return false;
+	if (frame->key == NULL) {
+		frame->key = child;
+		return true;
+	}
+
+	key = frame->key;
+	frame->key = NULL;
+
+	if (!s->tracing->quiet) {
+		ruby_repr_context_t *repr_ctx;
 
 		repr_ctx = ruby_repr_context_new();
-		ruby_marshal_trace(s, "  key=%s value=%s",
+		__ruby_trace(s->tracing, "  key=%s value=%s",
 					__ruby_instance_repr(key, repr_ctx),
-					__ruby_instance_repr(value, repr_ctx));
+					__ruby_instance_repr(child, repr_ctx));
 		ruby_repr_context_free(repr_ctx);
-
-		if (!ruby_instance_set_var(object, key, value))
-			return false;
 	}
 
-	return true;
+	return ruby_instance_set_var(frame->object, key, child);
 }
 
 
 /*
  * Arbitrary object, followed by a bunch of instance variables
  */
-static ruby_instance_t *
-ruby_ObjectWithInstanceVars_unmarshal(ruby_marshal_t *s)
+static bool
+ruby_ObjectWithInstanceVars_begin(ruby_marshal_t *s, ruby_unmarshal_frame_t *frame)
 {
-	ruby_instance_t *object;
+	frame->remaining = 1;
+	return true;
+}
 
-	if (!(object = ruby_unmarshal_next_instance(s)))
-		return NULL;
+static bool
+ruby_ObjectWithInstanceVars_child(ruby_marshal_t *s, ruby_unmarshal_frame_t *frame, ruby_instance_t *child)
+{
+	if (frame->object != NULL)
+		return ruby_unmarshal_object_var(s, frame, child);
 
 	/* Do not register the object here. If it *is* a proper object
 	 * (rather than say a symbol or fixnum) it has already been
-	 * registered inside the call to ruby_unmarshal_next_instance() above. */
+	 * registered when it was unmarshaled. */
+	frame->object = child;
+	return ruby_unmarshal_object_vars_begin(s, frame);
+}
 
-	if (!ruby_unmarshal_object_instance_vars(s, object)) {
-		Py_DECREF(object);
-		return NULL;
+static unmarshal_processor_t	ruby_ObjectWithInstanceVars_processor = {
+	.name	= "ObjectWithInstanceVars",
+	.begin	= ruby_ObjectWithInstanceVars_begin,
+	.child	= ruby_ObjectWithInstanceVars_child,
+};
+
+static ruby_unmarshal_frame_t *
+__ruby_unmarshal_push_frame(ruby_marshal_t *s, const char *name,
+		bool (*child)(ruby_marshal_t *, ruby_unmarshal_frame_t *, ruby_instance_t *))
+{
+	ruby_unmarshal_frame_t *frame;
+
+	if (s->nframes >= s->frames_size) {
+		s->frames_size = s->frames_size? 2 * s->frames_size : 16;
+		s->frames = realloc(s->frames, s->frames_size * sizeof(s->frames[0]));
 	}
 
-	return object;
+	frame = &s->frames[s->nframes++];
+	memset(frame, 0, sizeof(*frame));
+	frame->name = name;
+	frame->child = child;
+
+	if (!s->tracing->quiet)
+		s->tracing->indent = 2 * s->nframes;
+	return frame;
 }
 
-RUBY_UNMARSHAL_PROCESSOR(ObjectWithInstanceVars);
+static ruby_unmarshal_frame_t *
+__ruby_unmarshal_pop_frame(ruby_marshal_t *s)
+{
+	ruby_unmarshal_frame_t *frame = &s->frames[--(s->nframes)];
+
+	if (!s->tracing->quiet)
+		s->tracing->indent = 2 * s->nframes;
+	return frame;
+}
 
-static ruby_instance_t *
-__ruby_unmarshal_next_instance(ruby_marshal_t *s)
+/*
+ * Unmarshal the next instance. This does not recurse; instances that
+ * contain others (arrays, hashes, objects) are kept on a stack of frames
+ * until all their children have been unmarshaled.
+ */
+ruby_instance_t *
+ruby_unmarshal_next_instance(ruby_marshal_t *s)
 {
 	static const ruby_type_t *unmarshal_type_table[256] = {
 		['i'] = &ruby_Int_type,
@@ -400,72 +476,80 @@ __ruby_unmarshal_next_instance(ruby_marshal_t *s)
 		['@'] = &ruby_ObjectReference_processor,
 		['I'] = &ruby_ObjectWithInstanceVars_processor,
 	};
-	const unmarshal_processor_t *processor;
-	const ruby_type_t *type;
-	ruby_instance_t *result = NULL;
+	unsigned int base = s->nframes;
+	ruby_unmarshal_frame_t *frame;
+	ruby_instance_t *result;
 	int cc;
 
-	if (!ruby_io_nextc(s->ioctx, &cc))
-		return NULL;
-
-	assert(0 <= cc && cc < 256);
-
-	type = unmarshal_type_table[cc];
-	if (type != NULL) {
-		assert(type->unmarshal != NULL);
-
-		ruby_marshal_trace(s, "process(%c -> %s)", cc, type->name);
-		result = type->unmarshal(s);
-	} else {
-		processor = unmarshal_processor_table[cc];
-		if (processor != NULL) {
+	while (true) {
+		const unmarshal_processor_t *processor;
+		const ruby_type_t *type;
+
+		if (!ruby_io_nextc(s->ioctx, &cc))
+			goto failed;
+
+		assert(0 <= cc && cc < 256);
+
+		result = NULL;
+		frame = NULL;
+		if ((type = unmarshal_type_table[cc]) != NULL) {
+			ruby_marshal_trace(s, "process(%c -> %s)", cc, type->name);
+			if (type->unmarshal_begin != NULL) {
+				frame = __ruby_unmarshal_push_frame(s, type->name, type->unmarshal_child);
+				if (!type->unmarshal_begin(s, frame))
+					goto unmarshal_failed;
+			} else {
+				assert(type->unmarshal != NULL);
+				result = type->unmarshal(s);
+			}
+		} else if ((processor = unmarshal_processor_table[cc]) != NULL) {
 			ruby_marshal_trace(s, "process(%c -> %s)", cc, processor->name);
-			result = processor->process(s);
+			if (processor->begin != NULL) {
+				frame = __ruby_unmarshal_push_frame(s, processor->name, processor->child);
+				if (!processor->begin(s, frame))
+					goto unmarshal_failed;
+			} else {
+				result = processor->process(s);
+			}
 		}
-	}
-
-	if (result == NULL) {
-		fprintf(stderr, "Don't know how to handle marshal type %c(0x%02x)\n", cc, cc);
-		return NULL;
-	}
-
-	ruby_marshal_trace(s, "Returning %s: %s", result->op->name, ruby_instance_repr(result));
-
-	if (false) {
-		static unsigned int num;
 
-		if ((num % 100) == 0) {
-			printf("%6u: RSS %lu kB\n", num, __report_memory_rss());
-			fflush(stdout);
+		if (result == NULL && frame == NULL)
+			goto unmarshal_failed;
+
+		/* Hand completed instances to their parents */
+		while (true) {
+			if (result == NULL) {
+				frame = &s->frames[s->nframes - 1];
+				if (frame->remaining > 0)
+					break;
+
+				frame = __ruby_unmarshal_pop_frame(s);
+				if ((result = frame->object) == NULL) {
+					fprintf(stderr, "Incomplete %s object\n", frame->name);
+					goto failed;
+				}
+			}
+
+			ruby_marshal_trace(s, "Returning %s: %s", result->op->name, ruby_instance_repr(result));
+
+			if (s->nframes == base)
+				return result;
+
+			frame = &s->frames[s->nframes - 1];
+			frame->remaining -= 1;
+			if (!frame->child(s, frame, result)) {
+				fprintf(stderr, "Failed to unmarshal %s object\n", frame->name);
+				goto failed;
+			}
+			result = NULL;
 		}
-		num += 1;
 	}
-	return result;
-}
-
-static ruby_instance_t *
-__ruby_unmarshal_next_instance_logwrap(ruby_marshal_t *s, bool quiet)
-{
-	ruby_instance_t *result;
-	ruby_trace_id_t saved_id;
-
-	saved_id = ruby_trace_push(&s->tracing, quiet);
-	result = __ruby_unmarshal_next_instance(s);
-	ruby_trace_pop(&s->tracing, saved_id);
-
-	return result;
-}
-
-ruby_instance_t *
-ruby_unmarshal_next_instance(ruby_marshal_t *s)
-{
-	return __ruby_unmarshal_next_instance_logwrap(s, false);
-}
 
-ruby_instance_t *
-ruby_unmarshal_next_instance_quiet(ruby_marshal_t *s)
-{
-	return __ruby_unmarshal_next_instance_logwrap(s, true);
+unmarshal_failed:
+	fprintf(stderr, "Don't know how to handle marshal type %c(0x%02x)\n", cc, cc);
+failed:
+	s->nframes = base;
+	return NULL;
 }
 
 bool
@@ -512,7 +596,7 @@ ruby_marshal_object_reference(ruby_marshal_t *marshal, unsigned int id)
 static bool
 __ruby_marshal_maybe_object_reference(ruby_marshal_t *marshal, int *obj_id_ret)
 {
-	if (*obj_id_ret > 0)
+	if (*obj_id_ret >= 0)
 		return ruby_marshal_object_reference(marshal, *obj_id_ret);
 
 	*obj_id_ret = marshal->next_obj_id++;
@@ -542,7 +626,6 @@ ruby_marshal_symbol(ruby_marshal_t *marshal, const char *s, int *sym_id_ret)
 bool
 ruby_marshal_string(ruby_marshal_t *marshal, const char *s, int *obj_id_ret)
 {
-	static int e_sym_id = -1;
 	ruby_io_t *writer = marshal->ioctx;
 
 	/* If we've seen this object before, just insert a reference to it */
@@ -561,7 +644,7 @@ ruby_marshal_string(ruby_marshal_t *marshal, const char *s, int *obj_id_ret)
 	if (!ruby_marshal_fixnum(marshal, 1))
                 return false;
 
-        if (!ruby_marshal_symbol(marshal, "E", &e_sym_id)
+        if (!ruby_marshal_symbol(marshal, "E", &marshal->e_sym_id)
          || !ruby_marshal_true(marshal))
                 return false;
 
@@ -584,6 +667,22 @@ ruby_marshal_array_begin(ruby_marshal_t *marshal, unsigned int count, int *obj_i
 	return true;
 }
 
+bool
+ruby_marshal_hash_begin(ruby_marshal_t *marshal, unsigned int count, int *obj_id_ret)
+{
+	ruby_io_t *writer = marshal->ioctx;
+
+	/* If we've seen this object before, just insert a reference to it */
+	if (__ruby_marshal_maybe_object_reference(marshal, obj_id_ret))
+		return true;
+
+	if (!ruby_io_putc(writer, '{')
+	 || !ruby_marshal_fixnum(marshal, count))
+		return false;
+
+	return true;
+}
+
 bool
 ruby_marshal_user_marshal_begin(ruby_marshal_t *marshal, const char *classname, int *obj_id_ret)
 {
@@ -610,6 +709,11 @@ ruby_marshal_next_instance(ruby_marshal_t *s, ruby_instance_t *instance)
 
 	ruby_marshal_trace(s, "%s(%s = %s)", __func__, type->name, ruby_instance_repr(instance));
 
+	/* An object we have written before; the type's marshal function
+	 * would go on to write its contents again */
+	if (instance->reg.kind == RUBY_REG_OBJECT && instance->marshal_id >= 0)
+		return ruby_marshal_object_reference(s, instance->marshal_id);
+
 	if (type->marshal == NULL) {
 		fprintf(stderr, "Don't know how to marshal a %s object (not implemented)\n", type->name);
 		return false;
@@ -647,14 +751,7 @@ marshal48_check_signature(ruby_marshal_t *s)
 static bool
 marshal_write_signature(ruby_marshal_t *s, const unsigned char *sig, unsigned int sig_len)
 {
-	unsigned int i;
-
-	for (i = 0; i < sig_len; ++i) {
-		if (!ruby_io_putc(s->ioctx, sig[i]))
-			return false;
-	}
-
-	return true;
+	return ruby_io_put_bytes(s->ioctx, sig, sig_len);
 }
 
 static bool
@@ -665,11 +762,12 @@ marshal48_write_signature(ruby_marshal_t *s)
 	return marshal_write_signature(s, marshal48_sig, sizeof(marshal48_sig));
 }
 
-ruby_instance_t *
-marshal48_unmarshal_io(ruby_context_t *ruby, PyObject *io, bool quiet)
+static ruby_marshal_t *
+__marshal48_unmarshal_begin(ruby_context_t *ruby, ruby_io_t *reader, bool quiet)
 {
-	ruby_marshal_t *marshal = ruby_unmarshal_new(ruby, io);
-	ruby_instance_t *result;
+	ruby_marshal_t *marshal;
+
+	marshal = ruby_unmarshal_new(ruby, reader);
 
 	/* enable debug messages? */
 	marshal->tracing = ruby_trace_new(quiet);
@@ -680,31 +778,615 @@ marshal48_unmarshal_io(ruby_context_t *ruby, PyObject *io, bool quiet)
 		return NULL;
 	}
 
+	return marshal;
+}
+
+ruby_marshal_t *
+marshal48_unmarshal_open(ruby_context_t *ruby, PyObject *io, unsigned int bufsize, int compression, bool quiet)
+{
+	ruby_io_t *reader;
+
+	/* bytes, bytearray, memoryview, mmap etc are parsed in place;
+	 * everything else is treated as a file-like object */
+	if (PyObject_CheckBuffer(io))
+		reader = ruby_io_new_from_buffer(io);
+	else
+		reader = ruby_io_new(io, bufsize);
+	if (reader == NULL)
+		return NULL;
+
+	if (!ruby_io_set_compression(reader, compression)) {
+		ruby_io_free(reader);
+		return NULL;
+	}
+
+	return __marshal48_unmarshal_begin(ruby, reader, quiet);
+}
+
+/*
+ * Consume the header of a top-level array, so that the caller can
+ * unmarshal its elements one by one.
+ */
+bool
+marshal48_unmarshal_array_begin(ruby_marshal_t *marshal, long *count)
+{
+	int cc;
+
+	if (!ruby_io_nextc(marshal->ioctx, &cc))
+		return false;
+
+	if (cc != '[') {
+		fprintf(stderr, "Top-level object is not an array (type %c(0x%02x))\n", cc, cc);
+		return false;
+	}
+
+	if (!ruby_unmarshal_next_fixnum(marshal, count))
+		return false;
+
+	ruby_marshal_trace(marshal, "Iterating over array with %ld objects", *count);
+
+	/* The array itself occupies the first object id, even though
+	 * we never fill it */
+	return ruby_Array_new(marshal->ruby) != NULL;
+}
+
+ruby_instance_t *
+marshal48_unmarshal_io(ruby_context_t *ruby, PyObject *io, unsigned int bufsize, int compression, bool quiet)
+{
+	ruby_marshal_t *marshal;
+	ruby_instance_t *result;
+
+	if (!(marshal = marshal48_unmarshal_open(ruby, io, bufsize, compression, quiet)))
+		return NULL;
+
 	ruby_marshal_trace(marshal, "Unmarshaling data");
-	result = ruby_unmarshal_next_instance(marshal);
+
+	/* Parsing an in-memory buffer does not touch any python objects,
+	 * so other threads can run in the meantime */
+	if (ruby_io_in_memory(marshal->ioctx)) {
+		Py_BEGIN_ALLOW_THREADS
+		result = ruby_unmarshal_next_instance(marshal);
+		Py_END_ALLOW_THREADS
+	} else {
+		result = ruby_unmarshal_next_instance(marshal);
+	}
 
 	ruby_unmarshal_free(marshal);
 
 	return result;
 }
 
-bool
-marshal48_marshal_io(ruby_context_t *ruby, ruby_instance_t *instance, PyObject *io, bool quiet)
+/*
+ * Unmarshal a buffer that is (possibly compressed) marshal data. This does
+ * not use any python API and may be called without holding the GIL; errors
+ * are reported on stderr only.
+ */
+ruby_instance_t *
+marshal48_unmarshal_memory(ruby_context_t *ruby, const void *data, unsigned long len, int compression, bool quiet)
 {
-	ruby_marshal_t *marshal = ruby_unmarshal_new(ruby, io);
-	bool ok;
+	ruby_marshal_t *marshal;
+	ruby_instance_t *result;
+	ruby_io_t *reader;
 
+	if (!(reader = ruby_io_new_inflate(data, len, compression)))
+		return NULL;
+
+	if (!(marshal = __marshal48_unmarshal_begin(ruby, reader, quiet)))
+		return NULL;
+
+	result = ruby_unmarshal_next_instance(marshal);
+	ruby_unmarshal_free(marshal);
+
+	return result;
+}
+
+/*
+ * Direct decoding
+ *
+ * Rather than building a graph of ruby instances and converting it to
+ * python afterwards, create the python objects while parsing. Lists and
+ * dicts are allocated at their final size, and back references are
+ * resolved from a table of python objects indexed by object id.
+ *
+ * Objects that are restored via load() or marshal_load() are instantiated
+ * as soon as we see them, so that their object id refers to the right
+ * python object; the call to load()/marshal_load() happens once their
+ * data has been decoded, and instance variables are applied after that,
+ * just like in ruby_UserDefined_to_python() and friends.
+ */
+typedef struct {
+	unsigned int		count, size;
+	PyObject **		items;
+} ruby_pytable_t;
+
+typedef struct {
+	ruby_marshal_t *	marshal;
+	ruby_converter_t *	converter;
+
+	ruby_pytable_t		symbols;
+	ruby_pytable_t		objects;
+
+	/* What we would have created ruby instances for, for marshal48.stats() */
+	marshal48_type_counts_t	counts;
+} ruby_direct_t;
+
+static PyObject *	__ruby_direct_next(ruby_direct_t *, bool *is_symbol);
+
+static void
+ruby_pytable_add(ruby_pytable_t *table, PyObject *obj)
+{
+	if (table->count >= table->size) {
+		table->size = table->size? 2 * table->size : 256;
+		table->items = realloc(table->items, table->size * sizeof(table->items[0]));
+	}
+
+	Py_INCREF(obj);
+	table->items[table->count++] = obj;
+}
+
+static PyObject *
+ruby_pytable_get(const ruby_pytable_t *table, long id)
+{
+	PyObject *obj;
+
+	if (id < 0 || id >= table->count)
+		return NULL;
+
+	obj = table->items[id];
+	Py_INCREF(obj);
+	return obj;
+}
+
+static void
+ruby_pytable_destroy(ruby_pytable_t *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < table->count; ++i)
+		Py_DECREF(table->items[i]);
+	free(table->items);
+	memset(table, 0, sizeof(*table));
+}
+
+static PyObject *
+__ruby_direct_fail(const char *fmt, ...)
+{
+	char msgbuf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msgbuf, sizeof(msgbuf), fmt, ap);
+	va_end(ap);
+
+	fprintf(stderr, "%s\n", msgbuf);
+	if (!PyErr_Occurred())
+		PyErr_Format(PyExc_RuntimeError, "marshal48: %s", msgbuf);
+	return NULL;
+}
+
+/*
+ * Keys of instance variables are symbols like @name; like
+ * __ruby_dict_to_python(), we strip off the @ so that the result can be
+ * passed to setattr(). The same goes for hash keys.
+ */
+static PyObject *
+__ruby_direct_attr_name(ruby_direct_t *d, PyObject *key, bool is_symbol)
+{
+	const char *name;
+
+	if (!is_symbol || !(name = PyUnicode_AsUTF8(key)) || name[0] != '@') {
+		Py_INCREF(key);
+		return key;
+	}
+
+	return ruby_converter_intern(d->converter, name + 1);
+}
+
+static PyObject *
+__ruby_direct_new_object(ruby_direct_t *d)
+{
+	const char *classname;
+	PyObject *name, *result;
+
+	if (!(name = __ruby_direct_next(d, NULL)))
+		return NULL;
+
+	if (!PyUnicode_Check(name) || !(classname = PyUnicode_AsUTF8(name))) {
+		Py_DECREF(name);
+		return __ruby_direct_fail("Cannot get class name from %s object", Py_TYPE(name)->tp_name);
+	}
+
+	result = marshal48_instantiate_ruby_type(classname, d->converter);
+	if (result == NULL)
+		__ruby_direct_fail("unable to instantiate class %s", classname);
+	else
+		ruby_pytable_add(&d->objects, result);
+
+	Py_DECREF(name);
+	return result;
+}
+
+static bool
+__ruby_direct_instance_vars(ruby_direct_t *d, PyObject *object)
+{
+	long i, count;
+
+	if (!ruby_unmarshal_next_fixnum(d->marshal, &count))
+		return false;
+
+	for (i = 0; i < count; ++i) {
+		PyObject *key, *value, *attr_name;
+		bool is_symbol = false;
+		int rv = 0;
+
+		if (!(key = __ruby_direct_next(d, &is_symbol)))
+			return false;
+		if (!(value = __ruby_direct_next(d, NULL))) {
+			Py_DECREF(key);
+			return false;
+		}
+
+		if (PyUnicode_Check(object)) {
+			const char *name = PyUnicode_AsUTF8(key);
+
+			/* Strings only come with an encoding flag E=True/False,
+			 * which we ignore (see ruby_String_set_var) */
+			if (!is_symbol || name == NULL || strcmp(name, "E")
+			 || !PyBool_Check(value)) {
+				__ruby_direct_fail("unsupported instance variable %s on string", name? name : "?");
+				rv = -1;
+			}
+		} else if (!(attr_name = __ruby_direct_attr_name(d, key, is_symbol))) {
+			rv = -1;
+		} else {
+			rv = PyObject_SetAttr(object, attr_name, value);
+			Py_DECREF(attr_name);
+		}
+
+		Py_DECREF(key);
+		Py_DECREF(value);
+		if (rv < 0)
+			return false;
+	}
+
+	return true;
+}
+
+static PyObject *
+__ruby_direct_array(ruby_direct_t *d)
+{
+	PyObject *result;
+	long i, count;
+
+	if (!ruby_unmarshal_next_fixnum(d->marshal, &count))
+		return NULL;
+
+	if (count < 0 || !(result = PyList_New(count)))
+		return __ruby_direct_fail("bad array size %ld", count);
+	ruby_pytable_add(&d->objects, result);
+
+	for (i = 0; i < count; ++i) {
+		PyObject *item;
+
+		if (!(item = __ruby_direct_next(d, NULL))) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyList_SET_ITEM(result, i, item);
+	}
+
+	return result;
+}
+
+static PyObject *
+__ruby_direct_hash(ruby_direct_t *d)
+{
+	PyObject *result;
+	long i, count;
+
+	if (!ruby_unmarshal_next_fixnum(d->marshal, &count))
+		return NULL;
+
+#if PY_VERSION_HEX < 0x030d0000
+	result = _PyDict_NewPresized(count);
+#else
+	result = PyDict_New();
+#endif
+	if (result == NULL)
+		return NULL;
+	ruby_pytable_add(&d->objects, result);
+
+	for (i = 0; i < count; ++i) {
+		PyObject *key, *value, *attr_name = NULL;
+		bool is_symbol = false;
+		int rv = -1;
+
+		if (!(key = __ruby_direct_next(d, &is_symbol)))
+			goto failed;
+
+		if ((value = __ruby_direct_next(d, NULL)) != NULL
+		 && (attr_name = __ruby_direct_attr_name(d, key, is_symbol)) != NULL)
+			rv = PyDict_SetItem(result, attr_name, value);
+
+		Py_DECREF(key);
+		Py_XDECREF(value);
+		Py_XDECREF(attr_name);
+		if (rv < 0)
+			goto failed;
+	}
+
+	return result;
+
+failed:
+	Py_DECREF(result);
+	return NULL;
+}
+
+static PyObject *
+__ruby_direct_user_defined(ruby_direct_t *d)
+{
+	ruby_byteseq_t bytes;
+	PyObject *result, *data, *r;
+
+	if (!(result = __ruby_direct_new_object(d)))
+		return NULL;
+
+	ruby_byteseq_init(&bytes);
+	if (!ruby_unmarshal_next_byteseq(d->marshal, &bytes)) {
+		ruby_byteseq_destroy(&bytes);
+		goto failed;
+	}
+
+	if (ruby_byteseq_is_empty(&bytes)) {
+		data = Py_None;
+		Py_INCREF(data);
+	} else {
+		data = PyByteArray_FromStringAndSize((const char *) bytes.data, bytes.count);
+	}
+	ruby_byteseq_destroy(&bytes);
+
+	if (data == NULL)
+		goto failed;
+
+	r = PyObject_CallMethod(result, "load", "O", data);
+	Py_DECREF(data);
+	if (r == NULL) {
+		__ruby_direct_fail("%s.load() failed", Py_TYPE(result)->tp_name);
+		goto failed;
+	}
+	Py_DECREF(r);
+
+	return result;
+
+failed:
+	Py_DECREF(result);
+	return NULL;
+}
+
+static PyObject *
+__ruby_direct_user_marshal(ruby_direct_t *d)
+{
+	PyObject *result, *data, *r;
+
+	if (!(result = __ruby_direct_new_object(d)))
+		return NULL;
+
+	if (!(data = __ruby_direct_next(d, NULL)))
+		goto failed;
+
+	/* Gem::Version: skip the method call */
+	if (marshal48_version_check(result) && PyList_Check(data) && PyList_GET_SIZE(data) == 1) {
+		bool ok = marshal48_version_set(result, PyList_GET_ITEM(data, 0));
+
+		Py_DECREF(data);
+		if (!ok)
+			goto failed;
+		return result;
+	}
+
+	r = PyObject_CallMethod(result, "marshal_load", "O", data);
+	Py_DECREF(data);
+	if (r == NULL) {
+		__ruby_direct_fail("%s.marshal_load() failed", Py_TYPE(result)->tp_name);
+		goto failed;
+	}
+	Py_DECREF(r);
+
+	return result;
+
+failed:
+	Py_DECREF(result);
+	return NULL;
+}
+
+static PyObject *
+__ruby_direct_decode(ruby_direct_t *d, bool *is_symbol)
+{
+	static const ruby_type_t *direct_type_table[256] = {
+		['i'] = &ruby_Int_type,
+		[':'] = &ruby_Symbol_type,
+		['"'] = &ruby_String_type,
+		['['] = &ruby_Array_type,
+		['{'] = &ruby_Hash_type,
+		['o'] = &ruby_GenericObject_type,
+		['u'] = &ruby_UserDefined_type,
+		['U'] = &ruby_UserMarshal_type,
+	};
+	ruby_marshal_t *s = d->marshal;
+	PyObject *result = NULL;
+	const char *string;
+	size_t len;
+	long value;
+	int cc;
+
+	if (!ruby_io_nextc(s->ioctx, &cc))
+		return __ruby_direct_fail("unexpected end of data");
+
+	if (direct_type_table[cc] != NULL)
+		marshal48_type_counts_add(&d->counts, direct_type_table[cc]);
+
+	switch (cc) {
+	case '0':
+		Py_RETURN_NONE;
+
+	case 'T':
+		Py_RETURN_TRUE;
+
+	case 'F':
+		Py_RETURN_FALSE;
+
+	case 'i':
+		if (!ruby_unmarshal_next_fixnum(s, &value))
+			return NULL;
+		return PyLong_FromLong(value);
+
+	case ':':
+		if (!(string = ruby_unmarshal_next_string(s, "latin1")))
+			return NULL;
+		if ((result = ruby_converter_intern(d->converter, string)) != NULL)
+			ruby_pytable_add(&d->symbols, result);
+		if (is_symbol)
+			*is_symbol = true;
+		return result;
+
+	case ';':
+		if (!ruby_unmarshal_next_fixnum(s, &value))
+			return NULL;
+		if (!(result = ruby_pytable_get(&d->symbols, value)))
+			return __ruby_direct_fail("Invalid symbol reference %ld", value);
+		if (is_symbol)
+			*is_symbol = true;
+		return result;
+
+	case '@':
+		if (!ruby_unmarshal_next_fixnum(s, &value))
+			return NULL;
+		if (!(result = ruby_pytable_get(&d->objects, value)))
+			return __ruby_direct_fail("Invalid object reference %ld", value);
+		return result;
+
+	case '"':
+		if (!(string = ruby_unmarshal_next_string_len(s, "latin1", &len)))
+			return NULL;
+		if ((result = ruby_converter_intern_len(d->converter, string, len)) != NULL)
+			ruby_pytable_add(&d->objects, result);
+		return result;
+
+	case '[':
+		return __ruby_direct_array(d);
+
+	case '{':
+		return __ruby_direct_hash(d);
+
+	case 'o':
+		if (!(result = __ruby_direct_new_object(d)))
+			return NULL;
+		break;
+
+	case 'u':
+		return __ruby_direct_user_defined(d);
+
+	case 'U':
+		return __ruby_direct_user_marshal(d);
+
+	case 'I':
+		if (!(result = __ruby_direct_next(d, is_symbol)))
+			return NULL;
+		break;
+
+	default:
+		return __ruby_direct_fail("Don't know how to handle marshal type %c(0x%02x)", cc, cc);
+	}
+
+	/* 'I' and 'o' are followed by instance variables */
+	if (!__ruby_direct_instance_vars(d, result)) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+/* This recurses, so protect the C stack from deeply nested data */
+static PyObject *
+__ruby_direct_next(ruby_direct_t *d, bool *is_symbol)
+{
+	PyObject *result;
+
+	if (Py_EnterRecursiveCall(" while unmarshaling ruby data"))
+		return NULL;
+	result = __ruby_direct_decode(d, is_symbol);
+	Py_LeaveRecursiveCall();
+
+	return result;
+}
+
+PyObject *
+marshal48_unmarshal_direct(ruby_context_t *ruby, PyObject *io, unsigned int bufsize, int compression,
+		ruby_converter_t *converter, bool quiet)
+{
+	ruby_direct_t direct;
+	PyObject *result;
+
+	memset(&direct, 0, sizeof(direct));
+	direct.converter = converter;
+
+	if (!(direct.marshal = marshal48_unmarshal_open(ruby, io, bufsize, compression, quiet)))
+		return NULL;
+
+	ruby_marshal_trace(direct.marshal, "Unmarshaling data directly to python");
+	result = __ruby_direct_next(&direct, NULL);
+
+	marshal48_stats_add_types(&direct.counts);
+	ruby_pytable_destroy(&direct.symbols);
+	ruby_pytable_destroy(&direct.objects);
+	ruby_unmarshal_free(direct.marshal);
+	return result;
+}
+
+static bool
+__marshal48_marshal(ruby_marshal_t *marshal, ruby_instance_t *instance, bool quiet)
+{
 	marshal->tracing = ruby_trace_new(quiet);
 
 	if (!marshal48_write_signature(marshal)) {
 		fprintf(stderr, "Failed to write Marshal48 signature\n");
-		ruby_unmarshal_free(marshal);
 		return false;
 	}
 
-	ok = ruby_marshal_next_instance(marshal, instance);
+	return ruby_marshal_next_instance(marshal, instance);
+}
+
+bool
+marshal48_marshal_io(ruby_context_t *ruby, ruby_instance_t *instance, PyObject *io, bool quiet)
+{
+	ruby_marshal_t *marshal = ruby_unmarshal_new(ruby, ruby_io_new(io, 0));
+	bool ok;
+
+	ok = __marshal48_marshal(marshal, instance, quiet);
+	if (ok)
+		ok = ruby_io_flushbuf(marshal->ioctx);
 
-	ruby_unmarshal_flush(marshal);
 	ruby_unmarshal_free(marshal);
 	return ok;
 }
+
+/*
+ * Marshal to memory, and return the result as a bytes object
+ */
+PyObject *
+marshal48_marshal_bytes(ruby_context_t *ruby, ruby_instance_t *instance, bool quiet)
+{
+	ruby_marshal_t *marshal;
+	ruby_io_t *writer;
+	PyObject *result = NULL;
+
+	if (!(writer = ruby_io_new_memory()))
+		return NULL;
+
+	marshal = ruby_unmarshal_new(ruby, writer);
+	if (__marshal48_marshal(marshal, instance, quiet))
+		result = ruby_io_take_bytes(writer);
+
+	ruby_unmarshal_free(marshal);
+	return result;
+}
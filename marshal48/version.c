@@ -0,0 +1,1061 @@
+/*
+Ruby marshal48 - native Gem::Version and Gem::Requirement matching
+
+Copyright (C) 2020 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <ctype.h>
+
+#include "extension.h"
+#include "ruby_utils.h"
+
+/*
+ * A version string like "3.0.11" or "2.0.0.rc1-java" is split into
+ * segments the same way Ruby.ParsedVersion used to do it: runs of digits,
+ * runs of anything else, and the dots in between. Dots are segments, too,
+ * so "1.a" and "1a" do not compare equal.
+ *
+ * Numbers are compared numerically (on their digit strings, so there is no
+ * overflow), everything else as strings. A string segment sorts before a
+ * number, which makes "1.0.a" a prerelease of "1.0.1", like rubygems does.
+ *
+ * The segments are computed the first time they are needed; most versions
+ * in a spec index are never compared with anything.
+ */
+typedef struct {
+	const char *		text;	/* for numbers, leading zeros are skipped */
+	unsigned int		len;
+	bool			is_number;
+} marshal48_segment_t;
+
+typedef struct {
+	PyObject_HEAD
+
+	/* The version string as given, including the platform */
+	PyObject *		string;
+
+	bool			parsed;
+	bool			prerelease;
+	const char *		platform;
+	unsigned int		nsegs;
+
+	/* segs and the text they point to, in one allocation */
+	marshal48_segment_t *	segs;
+} marshal48_Version;
+
+enum {
+	MARSHAL48_OP_EQ,
+	MARSHAL48_OP_NE,
+	MARSHAL48_OP_GE,
+	MARSHAL48_OP_LE,
+	MARSHAL48_OP_GT,
+	MARSHAL48_OP_LT,
+	MARSHAL48_OP_TWIDDLE,
+};
+
+typedef struct {
+	int			op;
+	marshal48_Version *	version;
+
+	/* For "~> 3.0.3", this is 3.1 */
+	marshal48_Version *	upper;
+} marshal48_clause_t;
+
+typedef struct {
+	PyObject_HEAD
+
+	unsigned int		nclauses;
+	marshal48_clause_t *	clauses;
+} marshal48_Requirement;
+
+static marshal48_Version *__Version_from_object(PyObject *obj);
+
+static void
+__Version_clear(marshal48_Version *self)
+{
+	free(self->segs);
+	self->segs = NULL;
+	self->nsegs = 0;
+	self->platform = NULL;
+	self->prerelease = false;
+	self->parsed = false;
+	drop_object(&self->string);
+}
+
+static bool
+__Version_parse(marshal48_Version *self)
+{
+	const char *value, *s;
+	marshal48_segment_t *seg;
+	unsigned int len, nsegs = 0;
+	char *copy, *dash;
+
+	if (self->parsed)
+		return true;
+
+	if (self->string == NULL) {
+		/* Empty version object that has not been loaded yet */
+		self->parsed = true;
+		return true;
+	}
+
+	if (!(value = PyUnicode_AsUTF8(self->string)))
+		return false;
+
+	/* Every character starts at most one segment */
+	len = strlen(value);
+	self->segs = malloc(len * sizeof(self->segs[0]) + len + 1);
+	copy = (char *) (self->segs + len);
+	strcpy(copy, value);
+
+	/* If the version includes a platform like "1.2.3-java" or
+	 * "4.5.6-x86_64-linux", split it off */
+	if ((dash = strchr(copy, '-')) != NULL) {
+		*dash++ = '\0';
+		self->platform = dash;
+	}
+
+	for (s = copy; *s; ) {
+		seg = &self->segs[nsegs++];
+		seg->text = s;
+
+		if (*s == '.') {
+			seg->is_number = false;
+			s++;
+		} else if (isdigit((unsigned char) *s)) {
+			seg->is_number = true;
+			while (isdigit((unsigned char) *s))
+				s++;
+		} else {
+			seg->is_number = false;
+			while (*s && *s != '.' && !isdigit((unsigned char) *s))
+				s++;
+			if (isalpha((unsigned char) *seg->text))
+				self->prerelease = true;
+		}
+		seg->len = s - seg->text;
+
+		if (seg->is_number) {
+			while (seg->len && *seg->text == '0') {
+				seg->text++;
+				seg->len--;
+			}
+		}
+	}
+
+	if (nsegs == 0 || (self->segs[nsegs - 1].len == 1 && !self->segs[nsegs - 1].is_number
+				&& *self->segs[nsegs - 1].text == '.')) {
+		PyErr_Format(PyExc_ValueError, "Invalid version \"%s\"", value);
+		free(self->segs);
+		self->segs = NULL;
+		self->platform = NULL;
+		self->prerelease = false;
+		return false;
+	}
+
+	self->nsegs = nsegs;
+	self->parsed = true;
+	return true;
+}
+
+/*
+ * Set the version string. This is what marshal_load() does; the converter
+ * calls it directly for Gem::Version objects.
+ */
+bool
+marshal48_version_set(PyObject *obj, PyObject *string)
+{
+	marshal48_Version *self = (marshal48_Version *) obj;
+
+	if (!PyUnicode_Check(string)) {
+		PyErr_Format(PyExc_TypeError, "Cannot build version from %s object", Py_TYPE(string)->tp_name);
+		return false;
+	}
+
+	__Version_clear(self);
+	assign_object(&self->string, string);
+	return true;
+}
+
+bool
+marshal48_version_check(PyObject *obj)
+{
+	return PyObject_TypeCheck(obj, &marshal48_VersionType);
+}
+
+/*
+ * If the class registered for this ruby class is marshal48.Version or
+ * derived from it, allocate an instance without going through its
+ * constructor. Returns NULL without an exception if it is some other
+ * class.
+ */
+PyObject *
+marshal48_version_instantiate(const char *classname, ruby_converter_t *converter)
+{
+	const struct ruby_converter_class *cls;
+	PyTypeObject *type;
+
+	if (!(cls = ruby_converter_find_class(converter, classname)))
+		return NULL;
+
+	if (cls->name_obj != NULL || !PyType_Check(cls->callable))
+		return NULL;
+
+	type = (PyTypeObject *) cls->callable;
+	if (!PyType_IsSubtype(type, &marshal48_VersionType))
+		return NULL;
+
+	return type->tp_alloc(type, 0);
+}
+
+static int
+__Version_compare_segments(const marshal48_segment_t *a, const marshal48_segment_t *b)
+{
+	unsigned int len;
+	int r;
+
+	if (a->is_number != b->is_number)
+		return a->is_number? 1 : -1;
+
+	if (a->is_number && a->len != b->len)
+		return a->len < b->len? -1 : 1;
+
+	len = a->len < b->len? a->len : b->len;
+	if ((r = memcmp(a->text, b->text, len)) != 0)
+		return r < 0? -1 : 1;
+
+	if (a->len != b->len)
+		return a->len < b->len? -1 : 1;
+	return 0;
+}
+
+/*
+ * Both versions must have been parsed
+ */
+static int
+__Version_compare(const marshal48_Version *a, const marshal48_Version *b)
+{
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < a->nsegs && i < b->nsegs; ++i) {
+		if ((r = __Version_compare_segments(&a->segs[i], &b->segs[i])) != 0)
+			return r;
+	}
+
+	if (a->nsegs != b->nsegs)
+		return a->nsegs < b->nsegs? -1 : 1;
+	return 0;
+}
+
+/*
+ * Build a version object from a str, a list of segments like
+ * [3, '.', 0, '.', 1], or None (an empty version that marshal_load()
+ * fills in later)
+ */
+static int
+Version_init(marshal48_Version *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"version",
+		NULL
+	};
+	PyObject *arg = Py_None, *string;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &arg))
+		return -1;
+
+	if (arg == Py_None) {
+		__Version_clear(self);
+		return 0;
+	}
+
+	if (PyList_Check(arg) || PyTuple_Check(arg)) {
+		PyObject *empty, *strings;
+
+		if (!(strings = PyObject_CallFunction((PyObject *) &PyList_Type, "O", arg)))
+			return -1;
+		if (!(empty = PyUnicode_FromString(""))) {
+			Py_DECREF(strings);
+			return -1;
+		}
+
+		/* "".join(str(x) for x in arg) */
+		string = NULL;
+		if (PyList_GET_SIZE(strings) != 0) {
+			Py_ssize_t i;
+
+			for (i = 0; i < PyList_GET_SIZE(strings); ++i) {
+				PyObject *item = PyObject_Str(PyList_GET_ITEM(strings, i));
+
+				if (item == NULL)
+					break;
+				PyList_SetItem(strings, i, item);
+			}
+			if (i == PyList_GET_SIZE(strings))
+				string = PyUnicode_Join(empty, strings);
+		} else {
+			PyErr_SetString(PyExc_ValueError, "Cannot build version from empty list");
+		}
+		Py_DECREF(empty);
+		Py_DECREF(strings);
+
+		if (string == NULL)
+			return -1;
+	} else if (PyUnicode_Check(arg)) {
+		string = arg;
+		Py_INCREF(string);
+	} else {
+		PyErr_Format(PyExc_ValueError, "Cannot build version from %s object (%R)",
+				Py_TYPE(arg)->tp_name, arg);
+		return -1;
+	}
+
+	__Version_clear(self);
+	self->string = string;
+
+	/* Complain about bad version strings right away */
+	return __Version_parse(self)? 0 : -1;
+}
+
+static void
+Version_dealloc(marshal48_Version *self)
+{
+	__Version_clear(self);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+Version_str(marshal48_Version *self)
+{
+	if (self->string == NULL)
+		return PyUnicode_FromString("");
+
+	Py_INCREF(self->string);
+	return self->string;
+}
+
+static PyObject *
+Version_richcompare(PyObject *a, PyObject *b, int op)
+{
+	marshal48_Version *va, *vb;
+	int r;
+
+	if (!marshal48_version_check(a) || !marshal48_version_check(b))
+		Py_RETURN_NOTIMPLEMENTED;
+
+	va = (marshal48_Version *) a;
+	vb = (marshal48_Version *) b;
+	if (!__Version_parse(va) || !__Version_parse(vb))
+		return NULL;
+
+	r = __Version_compare(va, vb);
+
+	/* Py_RETURN_RICHCOMPARE is not available before 3.7 */
+	switch (op) {
+	case Py_EQ: return return_bool(r == 0);
+	case Py_NE: return return_bool(r != 0);
+	case Py_LT: return return_bool(r < 0);
+	case Py_GT: return return_bool(r > 0);
+	case Py_LE: return return_bool(r <= 0);
+	case Py_GE: return return_bool(r >= 0);
+	}
+	Py_RETURN_NOTIMPLEMENTED;
+}
+
+static Py_hash_t
+Version_hash(marshal48_Version *self)
+{
+	Py_uhash_t hash = 5381;
+	unsigned int i, k;
+
+	if (!__Version_parse(self))
+		return -1;
+
+	/* Versions that compare equal have the same segments */
+	for (i = 0; i < self->nsegs; ++i) {
+		const marshal48_segment_t *seg = &self->segs[i];
+
+		hash = (hash * 33) ^ seg->is_number;
+		for (k = 0; k < seg->len; ++k)
+			hash = (hash * 33) ^ (unsigned char) seg->text[k];
+	}
+
+	if (hash == (Py_uhash_t) -1)
+		hash = -2;
+	return hash;
+}
+
+static PyObject *
+Version_get_version(marshal48_Version *self, void *closure)
+{
+	return Version_str(self);
+}
+
+static PyObject *
+Version_get_platform(marshal48_Version *self, void *closure)
+{
+	if (!__Version_parse(self))
+		return NULL;
+	return return_string_or_none(self->platform);
+}
+
+static PyObject *
+Version_get_prerelease(marshal48_Version *self, void *closure)
+{
+	if (!__Version_parse(self))
+		return NULL;
+	return return_bool(self->prerelease);
+}
+
+/*
+ * The segments as a tuple, numbers as int, eg (3, '.', 0, '.', 'rc', 1)
+ */
+static PyObject *
+Version_get_segments(marshal48_Version *self, void *closure)
+{
+	PyObject *result;
+	unsigned int i;
+
+	if (!__Version_parse(self))
+		return NULL;
+
+	if (!(result = PyTuple_New(self->nsegs)))
+		return NULL;
+
+	for (i = 0; i < self->nsegs; ++i) {
+		const marshal48_segment_t *seg = &self->segs[i];
+		PyObject *item;
+
+		if (seg->is_number && seg->len == 0) {
+			item = PyLong_FromLong(0);
+		} else if (seg->is_number) {
+			char *digits = strndup(seg->text, seg->len);
+
+			item = PyLong_FromString(digits, NULL, 10);
+			free(digits);
+		} else {
+			item = PyUnicode_FromStringAndSize(seg->text, seg->len);
+		}
+
+		if (item == NULL) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(result, i, item);
+	}
+
+	return result;
+}
+
+/*
+ * Add one to a decimal number
+ */
+static bool
+__Version_append_incremented(ruby_byteseq_t *out, const marshal48_segment_t *seg)
+{
+	unsigned int i, len = seg->len;
+	unsigned char *digits;
+
+	if (!(digits = ruby_byteseq_extend(out, len + 1)))
+		return false;
+	digits[0] = '0';
+	memcpy(digits + 1, seg->text, len);
+
+	for (i = len + 1; i-- > 0; ) {
+		if (digits[i] != '9') {
+			digits[i]++;
+			break;
+		}
+		digits[i] = '0';
+	}
+
+	/* Drop the leading zero if we did not carry into it */
+	if (digits[0] == '0') {
+		memmove(digits, digits + 1, len);
+		out->count--;
+	}
+	return true;
+}
+
+/*
+ * This is here to support ~> comparison.
+ *   ~> 3.0.3 means ">= 3.0.3, < 3.1"
+ *   ~> 2 means ">= 2.0, < 3.0"
+ * The rules are the same as those of Ruby.ParsedVersion.next_bigger(): drop
+ * the last segment, and increment the number before it.
+ */
+static marshal48_Version *
+__Version_next_bigger(marshal48_Version *self)
+{
+	marshal48_Version *result = NULL;
+	const marshal48_segment_t *last;
+	unsigned int i, n = self->nsegs;
+	ruby_byteseq_t out;
+	PyObject *string;
+	bool ok;
+
+	if (!__Version_parse(self))
+		return NULL;
+
+	if (n == 1) {
+		last = &self->segs[0];
+		i = 0;
+	} else {
+		/* Drop everything after the last dot, and the dot */
+		while (n && !(self->segs[n - 1].len == 1 && *self->segs[n - 1].text == '.'))
+			n--;
+		if (n)
+			n--;
+
+		/* The number we increment may be preceded by a word,
+		 * as in "1.0.rc1" */
+		if (n == 0)
+			goto bad;
+		last = &self->segs[--n];
+		if (!last->is_number) {
+			if (n == 0)
+				goto bad;
+			last = &self->segs[--n];
+		}
+		i = n;
+	}
+
+	if (!last->is_number)
+		goto bad;
+
+	ruby_byteseq_init(&out);
+	ok = true;
+	for (n = 0; ok && n < i; ++n) {
+		const marshal48_segment_t *seg = &self->segs[n];
+
+		if (seg->is_number && seg->len == 0)
+			ok = ruby_byteseq_append(&out, "0", 1);
+		else
+			ok = ruby_byteseq_append(&out, seg->text, seg->len);
+	}
+	if (!ok || !__Version_append_incremented(&out, last)) {
+		ruby_byteseq_destroy(&out);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	string = PyUnicode_FromStringAndSize((const char *) out.data, out.count);
+	ruby_byteseq_destroy(&out);
+	if (string == NULL)
+		return NULL;
+
+	result = PyObject_New(marshal48_Version, &marshal48_VersionType);
+	if (result != NULL) {
+		result->string = NULL;
+		result->segs = NULL;
+		__Version_clear(result);
+		result->string = string;
+		if (!__Version_parse(result))
+			drop_object((PyObject **) &result);
+	} else {
+		Py_DECREF(string);
+	}
+	return result;
+
+bad:
+	PyErr_Format(PyExc_ValueError, "Cannot compute next bigger version of %S", self->string);
+	return NULL;
+}
+
+static PyObject *
+Version_next_bigger(marshal48_Version *self, PyObject *args)
+{
+	return (PyObject *) __Version_next_bigger(self);
+}
+
+/*
+ * Gem::Version is marshaled as [version_string]
+ */
+static PyObject *
+Version_marshal_load(marshal48_Version *self, PyObject *data)
+{
+	if (!PyList_Check(data) || PyList_GET_SIZE(data) != 1) {
+		PyErr_SetString(PyExc_ValueError, "Gem::Version: marshal data should be a list with one element");
+		return NULL;
+	}
+
+	if (!marshal48_version_set((PyObject *) self, PyList_GET_ITEM(data, 0)))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+Version_marshal_dump(marshal48_Version *self, PyObject *args)
+{
+	PyObject *string, *result;
+
+	if (!(string = Version_str(self)))
+		return NULL;
+	result = PyList_New(1);
+	if (result == NULL) {
+		Py_DECREF(string);
+		return NULL;
+	}
+	PyList_SET_ITEM(result, 0, string);
+	return result;
+}
+
+static PyMethodDef Version_methods[] = {
+	{ "next_bigger", (PyCFunction) Version_next_bigger, METH_NOARGS, "Upper bound for ~> comparisons" },
+	{ "marshal_load", (PyCFunction) Version_marshal_load, METH_O, "Load version from marshal data" },
+	{ "marshal_dump", (PyCFunction) Version_marshal_dump, METH_NOARGS, "Return marshal data" },
+	{ NULL }
+};
+
+static PyGetSetDef Version_getset[] = {
+	{ "version", (getter) Version_get_version, NULL, "The version string" },
+	{ "platform", (getter) Version_get_platform, NULL, "Platform suffix, or None" },
+	{ "is_prerelease", (getter) Version_get_prerelease, NULL, "True if the version contains letters" },
+	{ "segments", (getter) Version_get_segments, NULL, "Tuple of version segments" },
+	{ NULL }
+};
+
+PyTypeObject marshal48_VersionType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+
+	.tp_name	= "marshal48.Version",
+	.tp_basicsize	= sizeof(marshal48_Version),
+	.tp_flags	= Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc		= "Comparable ruby gem version",
+
+	.tp_new		= PyType_GenericNew,
+	.tp_init	= (initproc) Version_init,
+	.tp_dealloc	= (destructor) Version_dealloc,
+	.tp_str		= (reprfunc) Version_str,
+	.tp_repr	= (reprfunc) Version_str,
+	.tp_hash	= (hashfunc) Version_hash,
+	.tp_richcompare	= Version_richcompare,
+	.tp_methods	= Version_methods,
+	.tp_getset	= Version_getset,
+};
+
+/*
+ * Accept version objects and strings
+ */
+static marshal48_Version *
+__Version_from_object(PyObject *obj)
+{
+	marshal48_Version *result;
+
+	if (marshal48_version_check(obj)) {
+		result = (marshal48_Version *) obj;
+		if (!__Version_parse(result))
+			return NULL;
+		Py_INCREF(result);
+		return result;
+	}
+
+	return (marshal48_Version *) PyObject_CallFunctionObjArgs((PyObject *) &marshal48_VersionType, obj, NULL);
+}
+
+/*
+ * Requirement: a list of clauses like ">= 1.2", "~> 3.0" that a
+ * version must all satisfy.
+ */
+static int
+__Requirement_parse_op(const char *op)
+{
+	static const struct {
+		const char *	name;
+		int		op;
+	} ops[] = {
+		{ "=",	MARSHAL48_OP_EQ },
+		{ "==",	MARSHAL48_OP_EQ },
+		{ "!=",	MARSHAL48_OP_NE },
+		{ ">=",	MARSHAL48_OP_GE },
+		{ "<=",	MARSHAL48_OP_LE },
+		{ ">",	MARSHAL48_OP_GT },
+		{ "<",	MARSHAL48_OP_LT },
+		{ "~>",	MARSHAL48_OP_TWIDDLE },
+		{ NULL }
+	};
+	unsigned int i;
+
+	for (i = 0; ops[i].name; ++i) {
+		if (!strcmp(ops[i].name, op))
+			return ops[i].op;
+	}
+	return -1;
+}
+
+static void
+__Requirement_clear(marshal48_Requirement *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->nclauses; ++i) {
+		Py_XDECREF(self->clauses[i].version);
+		Py_XDECREF(self->clauses[i].upper);
+	}
+	free(self->clauses);
+	self->clauses = NULL;
+	self->nclauses = 0;
+}
+
+/*
+ * Each clause is either an (op, version) tuple, or an object with op and
+ * version attributes, such as Ruby.Clause
+ */
+static bool
+__Requirement_add_clause(marshal48_Requirement *self, PyObject *item)
+{
+	PyObject *op_obj, *version_obj;
+	marshal48_clause_t *clause;
+	const char *op_name;
+	bool ok = false;
+	int op;
+
+	if (PyTuple_Check(item)) {
+		if (!PyArg_ParseTuple(item, "OO", &op_obj, &version_obj))
+			return false;
+		Py_INCREF(op_obj);
+		Py_INCREF(version_obj);
+	} else {
+		if (!(op_obj = PyObject_GetAttrString(item, "op")))
+			return false;
+		if (!(version_obj = PyObject_GetAttrString(item, "version"))) {
+			Py_DECREF(op_obj);
+			return false;
+		}
+	}
+
+	if (!(op_name = PyUnicode_AsUTF8(op_obj)))
+		goto out;
+
+	if ((op = __Requirement_parse_op(op_name)) < 0) {
+		PyErr_Format(PyExc_ValueError, "Unknown version comparison operator \"%s\"", op_name);
+		goto out;
+	}
+
+	clause = &self->clauses[self->nclauses];
+	clause->op = op;
+	clause->upper = NULL;
+	if (!(clause->version = __Version_from_object(version_obj)))
+		goto out;
+	self->nclauses++;
+
+	if (op == MARSHAL48_OP_TWIDDLE && !(clause->upper = __Version_next_bigger(clause->version)))
+		goto out;
+
+	ok = true;
+
+out:
+	Py_DECREF(op_obj);
+	Py_DECREF(version_obj);
+	return ok;
+}
+
+static int
+Requirement_init(marshal48_Requirement *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"clauses",
+		NULL
+	};
+	PyObject *clauses = NULL, *seq;
+	Py_ssize_t i, count;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &clauses))
+		return -1;
+
+	__Requirement_clear(self);
+	if (clauses == NULL)
+		return 0;
+
+	if (!(seq = PySequence_Fast(clauses, "marshal48: clauses must be iterable")))
+		return -1;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	self->clauses = calloc(count + 1, sizeof(self->clauses[0]));
+	for (i = 0; i < count; ++i) {
+		if (!__Requirement_add_clause(self, PySequence_Fast_GET_ITEM(seq, i))) {
+			Py_DECREF(seq);
+			return -1;
+		}
+	}
+
+	Py_DECREF(seq);
+	return 0;
+}
+
+static void
+Requirement_dealloc(marshal48_Requirement *self)
+{
+	__Requirement_clear(self);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static bool
+__Requirement_match(const marshal48_Requirement *self, const marshal48_Version *version)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->nclauses; ++i) {
+		const marshal48_clause_t *clause = &self->clauses[i];
+		int r = __Version_compare(version, clause->version);
+		bool match = false;
+
+		switch (clause->op) {
+		case MARSHAL48_OP_EQ:
+			match = (r == 0);
+			break;
+		case MARSHAL48_OP_NE:
+			match = (r != 0);
+			break;
+		case MARSHAL48_OP_GE:
+			match = (r >= 0);
+			break;
+		case MARSHAL48_OP_LE:
+			match = (r <= 0);
+			break;
+		case MARSHAL48_OP_GT:
+			match = (r > 0);
+			break;
+		case MARSHAL48_OP_LT:
+			match = (r < 0);
+			break;
+		case MARSHAL48_OP_TWIDDLE:
+			match = (r >= 0 && __Version_compare(version, clause->upper) < 0);
+			break;
+		}
+
+		if (!match)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns 1 if the item (or key(item)) matches, 0 if it does not, -1 on error.
+ * If versionp is given, it receives a reference to the item's version.
+ */
+static int
+__Requirement_match_item(marshal48_Requirement *self, PyObject *item, PyObject *key, marshal48_Version **versionp)
+{
+	marshal48_Version *version;
+	PyObject *obj;
+	int r;
+
+	if (key != NULL && key != Py_None) {
+		if (!(obj = PyObject_CallFunctionObjArgs(key, item, NULL)))
+			return -1;
+		version = __Version_from_object(obj);
+		Py_DECREF(obj);
+	} else {
+		version = __Version_from_object(item);
+	}
+
+	if (version == NULL)
+		return -1;
+
+	r = __Requirement_match(self, version);
+	if (versionp && r)
+		*versionp = version;
+	else
+		Py_DECREF(version);
+	return r;
+}
+
+static int
+Requirement_contains(marshal48_Requirement *self, PyObject *item)
+{
+	return __Requirement_match_item(self, item, NULL, NULL);
+}
+
+static PyObject *
+Requirement_contains_method(marshal48_Requirement *self, PyObject *item)
+{
+	int r = Requirement_contains(self, item);
+
+	if (r < 0)
+		return NULL;
+	return return_bool(r);
+}
+
+/*
+ * filter(items, key=None) -> list of the items that match
+ */
+static PyObject *
+Requirement_filter(marshal48_Requirement *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"items",
+		"key",
+		NULL
+	};
+	PyObject *items, *key = NULL, *iter, *item, *result;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &items, &key))
+		return NULL;
+
+	if (!(iter = PyObject_GetIter(items)))
+		return NULL;
+
+	if (!(result = PyList_New(0))) {
+		Py_DECREF(iter);
+		return NULL;
+	}
+
+	while ((item = PyIter_Next(iter)) != NULL) {
+		int r = __Requirement_match_item(self, item, key, NULL);
+
+		if (r > 0 && PyList_Append(result, item) < 0)
+			r = -1;
+		Py_DECREF(item);
+
+		if (r < 0)
+			break;
+	}
+	Py_DECREF(iter);
+
+	if (PyErr_Occurred())
+		drop_object(&result);
+	return result;
+}
+
+/*
+ * best(items, key=None) -> the item with the highest matching version, or None
+ */
+static PyObject *
+Requirement_best(marshal48_Requirement *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"items",
+		"key",
+		NULL
+	};
+	PyObject *items, *key = NULL, *iter, *item, *best = NULL;
+	marshal48_Version *best_version = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &items, &key))
+		return NULL;
+
+	if (!(iter = PyObject_GetIter(items)))
+		return NULL;
+
+	while ((item = PyIter_Next(iter)) != NULL) {
+		marshal48_Version *version = NULL;
+		int r = __Requirement_match_item(self, item, key, &version);
+
+		if (r > 0) {
+			if (best_version == NULL || __Version_compare(version, best_version) > 0) {
+				Py_XDECREF(best_version);
+				Py_XDECREF(best);
+				best_version = version;
+				best = item;
+				Py_INCREF(best);
+			} else {
+				Py_DECREF(version);
+			}
+		}
+		Py_DECREF(item);
+
+		if (r < 0)
+			break;
+	}
+	Py_DECREF(iter);
+	Py_XDECREF(best_version);
+
+	if (PyErr_Occurred()) {
+		Py_XDECREF(best);
+		return NULL;
+	}
+
+	if (best == NULL)
+		Py_RETURN_NONE;
+	return best;
+}
+
+static PySequenceMethods Requirement_as_sequence = {
+	.sq_contains	= (objobjproc) Requirement_contains,
+};
+
+static PyMethodDef Requirement_methods[] = {
+	{ "contains", (PyCFunction) Requirement_contains_method, METH_O, "Check whether a version matches all clauses" },
+	{ "filter", (PyCFunction) Requirement_filter, METH_VARARGS | METH_KEYWORDS, "Return the items whose version matches" },
+	{ "best", (PyCFunction) Requirement_best, METH_VARARGS | METH_KEYWORDS, "Return the item with the highest matching version" },
+	{ NULL }
+};
+
+PyTypeObject marshal48_RequirementType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+
+	.tp_name	= "marshal48.Requirement",
+	.tp_basicsize	= sizeof(marshal48_Requirement),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Compiled list of version clauses",
+
+	.tp_new		= PyType_GenericNew,
+	.tp_init	= (initproc) Requirement_init,
+	.tp_dealloc	= (destructor) Requirement_dealloc,
+	.tp_as_sequence	= &Requirement_as_sequence,
+	.tp_methods	= Requirement_methods,
+};
+
+/*
+ * Helpers for the dependency resolver in resolver.c, which keeps
+ * versions and requirements in C arrays and never goes through python
+ * to compare them.
+ */
+PyObject *
+marshal48_version_from_object(PyObject *obj)
+{
+	return (PyObject *) __Version_from_object(obj);
+}
+
+/*
+ * Both must have been returned by marshal48_version_from_object()
+ */
+int
+marshal48_version_compare(PyObject *a, PyObject *b)
+{
+	return __Version_compare((marshal48_Version *) a, (marshal48_Version *) b);
+}
+
+bool
+marshal48_version_is_prerelease(PyObject *obj)
+{
+	return ((marshal48_Version *) obj)->prerelease;
+}
+
+/*
+ * Accept Requirement objects as they are, and compile anything else
+ * as a list of clauses
+ */
+PyObject *
+marshal48_requirement_from_object(PyObject *obj)
+{
+	if (PyObject_TypeCheck(obj, &marshal48_RequirementType)) {
+		Py_INCREF(obj);
+		return obj;
+	}
+
+	return PyObject_CallFunctionObjArgs((PyObject *) &marshal48_RequirementType, obj, NULL);
+}
+
+bool
+marshal48_requirement_match(PyObject *req, PyObject *version)
+{
+	return __Requirement_match((marshal48_Requirement *) req, (marshal48_Version *) version);
+}
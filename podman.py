@@ -73,23 +73,85 @@ class PodmanCmd(object):
 			cmd = "sudo -- " + cmd
 		return os.popen(cmd, mode = mode)
 
+	# Like popen(), but do not wait for the command to finish
+	def spawn(self):
+		import subprocess
+
+		cmd = self.cmd
+
+		print("podman: " + self.cmd + " &")
+		sys.stdout.flush()
+
+		if os.getuid() != 0:
+			cmd = "sudo -- " + cmd
+		return subprocess.Popen(cmd, shell = True, stdout = subprocess.PIPE, universal_newlines = True)
+
+# A container started ahead of time from the snapshot of its flavor, waiting
+# to be handed out. The podman run command may still be busy when we
+# get here; we only wait for it when the container is actually needed.
+class PodmanWarmContainer(object):
+	def __init__(self, flavor, cmd):
+		self.flavor = flavor
+		self._proc = cmd.spawn()
+		self._container_id = None
+
+	@property
+	def container_id(self):
+		if self._proc is not None:
+			output, _ = self._proc.communicate()
+			status = self._proc.returncode
+			self._proc = None
+
+			if status != 0 or not output.strip():
+				raise ValueError("podman: unable to start warm container for %s (exit status %d)" % (self.flavor, status))
+			self._container_id = output.strip()
+
+		return self._container_id
+
+	def stop(self):
+		try:
+			container_id = self.container_id
+		except ValueError:
+			return
+
+		PodmanCmd("stop", container_id).run()
+
+# If the environment sets "pool", we keep that many containers per flavor
+# running, ready to be used. The first time we need a flavor, we set up
+# a container the usual way (certificates and all), and commit it as a
+# snapshot image. All containers for that flavor are started from the
+# snapshot, so they do not need any setup. Each build gets a container of
+# its own, and the container is thrown away after the build; this resets
+# it to the clean snapshot. A replacement is started right away, while
+# the build is still running.
 class PodmanCompute(core.Compute):
 	def __init__(self, global_config, config):
 		super(PodmanCompute, self).__init__(global_config, config)
 		self.network_up = False
 
+		self.pool_size = config.pool or 0
+		self.snapshots = dict()
+		self.pool = dict()
+
+		# Set in a child process that was handed a container by the scheduler
+		self.reserved = None
+		self.is_worker = False
+
 	def spawn(self, flavor):
 		img_config = self.config.get_image(flavor)
 
+		self.prepare(flavor)
+
+		print("%s: using image %s to build %s package" % (self.config.name, img_config.image, flavor))
+		return PodmanComputeNode(img_config, self, self.take(flavor))
+
+	def prepare(self, flavor):
 		self.pod_name = self.config.pod.name
 
 		if not self.network_up:
 			self.setup_network()
 			self.network_up = True
 
-		print("%s: using image %s to build %s package" % (self.config.name, img_config.image, flavor))
-		return PodmanComputeNode(img_config, self)
-
 	def setup_network(self):
 		self.network_name = self.config.network.name
 		if self.network_name is None:
@@ -103,6 +165,111 @@ class PodmanCompute(core.Compute):
 		print("podman: setting up network \"%s\"" % self.network_name)
 		core.run_command("podman network create %s" % self.network_name)
 
+	def image_digest(self, flavor):
+		img_config = self.config.get_image(flavor)
+
+		f = PodmanCmd("image inspect --format '{{.Id}}'", img_config.image).popen()
+		digest = f.read().strip()
+		if f.close() or not digest:
+			raise ValueError("podman: unable to inspect image %s" % img_config.image)
+		return digest
+
+	def run_args(self, image, hosts = []):
+		network_name = self.network_name
+		pod_name = self.pod_name
+		assert(network_name is None or pod_name is None)
+
+		args = ["--rm", "-d"]
+		for host in hosts:
+			args.append("--add-host %s" % host)
+		if network_name:
+			args += ("--network", network_name)
+		if pod_name:
+			args += ("--pod", pod_name)
+
+		# For debugging
+		args += ('--cap-add', 'sys_ptrace')
+
+		args.append(image)
+		return args
+
+	# Returns a warm container, or None if we are not pooling
+	def take(self, flavor):
+		if self.reserved is not None and self.reserved.flavor == flavor:
+			container = self.reserved
+			self.reserved = None
+			return container
+
+		if self.pool_size == 0 or self.is_worker:
+			return None
+
+		idle = self.pool.setdefault(flavor, [])
+		if not idle:
+			self.replenish(flavor)
+
+		container = idle.pop(0)
+		self.replenish(flavor)
+		return container
+
+	def replenish(self, flavor):
+		snapshot = self.snapshots.get(flavor)
+		if snapshot is None:
+			snapshot = self.create_snapshot(flavor)
+
+		idle = self.pool.setdefault(flavor, [])
+		while len(idle) < self.pool_size:
+			cmd = PodmanCmd("run", " ".join(self.run_args(snapshot)))
+			idle.append(PodmanWarmContainer(flavor, cmd))
+
+	def create_snapshot(self, flavor):
+		import atexit
+
+		img_config = self.config.get_image(flavor)
+		snapshot = "minibuild-warm-%s-%d" % (flavor, os.getpid())
+
+		print("%s: creating snapshot %s of image %s" % (self.config.name, snapshot, img_config.image))
+		node = PodmanComputeNode(img_config, self)
+		if PodmanCmd("commit", node.container_id, snapshot).run() != 0:
+			raise ValueError("podman: unable to commit container %s as %s" % (node.container_id, snapshot))
+		del node
+
+		if not self.snapshots:
+			atexit.register(self.drain)
+		self.snapshots[flavor] = snapshot
+
+		return snapshot
+
+	# The scheduler calls these to hand a container to a build that runs in a
+	# child process. reserve() is called in the parent, adopt() in the child.
+	def reserve(self, flavor):
+		if self.pool_size == 0:
+			return None
+
+		self.prepare(flavor)
+		container = self.take(flavor)
+
+		# Wait for it to be up, so that the child does not have to deal
+		# with our podman run process
+		container.container_id
+		return container
+
+	def adopt(self, container):
+		# The rest of the pool belongs to our parent
+		self.pool = dict()
+		self.snapshots = dict()
+		self.is_worker = True
+		self.reserved = container
+
+	def drain(self):
+		for idle in self.pool.values():
+			for container in idle:
+				container.stop()
+		self.pool = dict()
+
+		for snapshot in self.snapshots.values():
+			PodmanCmd("rmi", snapshot).run()
+		self.snapshots = dict()
+
 class PodmanPathMixin:
 	def __init__(self, root):
 		self.root = root
@@ -179,7 +346,7 @@ class PodmanDirectory(PodmanPathMixin, core.ComputeResourceDirectory):
 		mkdir(path, mode)
 
 class PodmanComputeNode(core.ComputeNode):
-	def __init__(self, img_config, backend):
+	def __init__(self, img_config, backend, warm_container = None):
 		super(PodmanComputeNode, self).__init__(backend)
 
 		self.container_id = None
@@ -197,7 +364,10 @@ class PodmanComputeNode(core.ComputeNode):
 		# Kludge to make https://localhost URLs work in the container
 		self._mapped_hostname = None
 
-		self.start(img_config, backend.network_name, backend.pod_name)
+		if warm_container is not None:
+			self.adopt(warm_container)
+		else:
+			self.start(img_config)
 
 		print("Created container %s; root=%s" % (self.container_id, self.container_root))
 
@@ -210,38 +380,41 @@ class PodmanComputeNode(core.ComputeNode):
 		if self.container_id:
 			PodmanCmd("stop", self.container_id).run()
 
-	def start(self, img_config, network_name, pod_name):
+	def start(self, img_config):
 		assert(self.container_id is None)
-		assert(network_name is None or pod_name is None)
 
 		self.setup_localhost_mapping()
 
-		args = ["--rm", "-d"]
-		for host in self.hosts:
-			args.append("--add-host %s" % host)
-		if network_name:
-			args += ("--network", network_name)
-		if pod_name:
-			args += ("--pod", pod_name)
-
-		# For debugging
-		args += ('--cap-add', 'sys_ptrace')
-
-		args.append(img_config.image)
+		args = self.backend.run_args(img_config.image, self.hosts)
 
 		f = PodmanCmd("run", " ".join(args)).popen()
 		self.container_id = f.read().strip()
 		assert(self.container_id)
 
-		f = PodmanCmd("mount", self.container_id).popen()
-		self.container_root = f.read().strip()
-		assert(self.container_root)
+		self.mount()
 
 		ca_certificates = self.backend.global_config.globals.certificates
 		self.publish_system_certificates(ca_certificates)
 		self.publish_python_certificates(ca_certificates)
 		self.publish_ruby_certificates(ca_certificates)
 
+	# Use a container started from a snapshot. The certificates are part of
+	# the snapshot already.
+	def adopt(self, warm_container):
+		assert(self.container_id is None)
+
+		self.setup_localhost_mapping()
+
+		self.container_id = warm_container.container_id
+		assert(self.container_id)
+
+		self.mount()
+
+	def mount(self):
+		f = PodmanCmd("mount", self.container_id).popen()
+		self.container_root = f.read().strip()
+		assert(self.container_root)
+
 	def publish_system_certificates(self, ca_certificates):
 		for ca_path in ca_certificates:
 			shutil.copy(ca_path, self.container_root + "/usr/share/pki/trust/anchors")
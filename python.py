@@ -761,6 +761,10 @@ class BuildStrategy_Wheel(PythonBuildStrategy):
 	def describe(self):
 		return self._type
 
+	# The pip command comes from the engine config
+	def cache_inputs(self):
+		return ["pip %s" % self.pip_command]
+
 	def next_command(self, build_directory):
 		cmd = self.pip_command
 		cmd += " wheel --wheel-dir dist ."
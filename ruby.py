@@ -25,6 +25,7 @@ import io
 import glob
 import shutil
 import minibuild.ruby_utils
+import minibuild.marshal48
 
 import minibuild.core as core
 
@@ -109,6 +110,12 @@ class RubyBuildRequirement(core.BuildRequirement):
 	def valid_platform(self):
 		return self.cooked_requirement.valid_platform()
 
+	# Like rubygems, consider prereleases only if asked to, or if the
+	# requirement itself names one (as in "~> 2.0.0.rc1")
+	def allow_prereleases(self):
+		return self.cooked_requirement.prerelease or \
+				any(clause.version.is_prerelease for clause in self.cooked_requirement.requirement)
+
 class RubyArtefact(core.Artefact):
 	engine = ENGINE_NAME
 
@@ -283,6 +290,9 @@ class RubyReleaseInfo(core.PackageReleaseInfo):
 
 		self.parsed_version = parsed_version
 
+		# The sha256 of the gem, if the index told us
+		self.checksum = None
+
 	def id(self):
 		if self.platform != 'ruby':
 			return "%s-%s-%s" % (self.name, self.version, self.platform)
@@ -305,9 +315,10 @@ class RubyDownloadFinder(core.DownloadFinder):
 
 		self.requirement = req.cooked_requirement
 		self.name = req.name
-		self.allow_prereleases = False
 		self.platform = req.platform
 
+		self.allow_prereleases = req.allow_prereleases()
+
 		if self.verbose:
 			print("Looking for %s; platform=%s" % (req, req.platform))
 
@@ -324,6 +335,40 @@ class RubyDownloadFinder(core.DownloadFinder):
 
 		return True
 
+	# Given a release that matches the requirement, pick the build we want.
+	# Returns None if no build is usable with our ruby.
+	def match_release(self, index, release):
+		# Create an artefact for the binary gem (by downloading the gemspec
+		# from the index).
+		# If possible, also create a source artefact by guessing the source
+		# URL.
+		# The binary artefact will be attached to the cache representing this
+		# index; the source artefact will not be attached to any cache.
+		index.get_gemspec(release, verbose = self.verbose)
+
+		good_match = None
+		for build in release.builds:
+			# print("%s: inspecting build %s (type %s)" % (release.id(), build.filename, build.type))
+			if not build.verify_required_ruby_version():
+				if self.verbose:
+					print("ignoring build %s (requires ruby %s)" % (build.filename, build.required_ruby_version))
+				continue
+
+			if not build.verify_required_rubygems_version():
+				if self.verbose:
+					print("ignoring build %s (requires ruby gems %s)" % (build.filename, build.required_rubygems_version))
+				continue
+
+			good_match = build
+
+			if self.build_match(build):
+				return build
+
+		if good_match:
+			raise ValueError("%s: found release %s, but not the matching artefact type" % (self.name, release.version))
+
+		return None
+
 	def get_best_match(self, index):
 		info = index.get_package_info(self.name)
 
@@ -335,11 +380,14 @@ class RubyDownloadFinder(core.DownloadFinder):
 		if self.verbose:
 			print("%s versions: %s" % (self.name, ", ".join(info.versions())))
 
-		good_match = None
 		best_match = None
 		best_release = None
 
-		releases = sorted(info.releases, key = lambda r: r.parsed_version)
+		# Weed out the versions that do not match before looking at
+		# each release in turn
+		parsed_version = lambda r: r.parsed_version
+		releases = self.requirement.requirement.filter(info.releases, key = parsed_version)
+		releases.sort(key = parsed_version)
 		while releases and not best_match:
 			best_release = releases.pop()
 
@@ -351,36 +399,7 @@ class RubyDownloadFinder(core.DownloadFinder):
 			if self.verbose:
 				print("inspecting release %s" % best_release.id())
 
-			# Create an artefact for the binary gem (by downloading the gemspec
-			# from the index).
-			# If possible, also create a source artefact by guessing the source
-			# URL.
-			# The binary artefact will be attached to the cache representing this
-			# index; the source artefact will not be attached to any cache.
-			index.get_gemspec(best_release, verbose = self.verbose)
-
-			for build in best_release.builds:
-				# print("%s: inspecting build %s (type %s)" % (release.id(), build.filename, build.type))
-				if not build.verify_required_ruby_version():
-					if self.verbose:
-						print("ignoring build %s (requires ruby %s)" % (build.filename, build.required_ruby_version))
-					continue
-
-				if not build.verify_required_rubygems_version():
-					if self.verbose:
-						print("ignoring build %s (requires ruby gems %s)" % (build.filename, build.required_rubygems_version))
-					continue
-
-				good_match = build
-
-				if not self.build_match(build):
-					continue
-
-				best_match = build
-				break
-
-			if good_match and not best_match:
-				raise ValueError("%s: found release %s, but not the matching artefact type" % (self.name, best_release.version))
+			best_match = self.match_release(index, best_release)
 
 		if not best_match:
 			raise ValueError("%s: unable to find a matching release" % self.name)
@@ -418,6 +437,160 @@ class RubyBinaryDownloadFinder(RubyDownloadFinder):
 
 		return build.type == 'gem'
 
+# On-disk form of a specs.4.8 index, designed to be used via mmap.
+#
+#   header:	magic, number of names, offsets of name table, record table, strings
+#   names:	(name offset, name length, first record, record count), sorted by name
+#   records:	(version offset, version length, platform offset, platform length)
+#   strings:	all strings, deduplicated
+#
+# All integers are 32bit little endian.
+class RubySpecIndexFile(object):
+	MAGIC = b"MBSPEC01"
+	HEADER = "<8sIIII"
+	NAME = "<IIII"
+	RECORD = "<IIII"
+
+	def __init__(self, path):
+		import mmap
+		import struct
+
+		with open(path, "rb") as f:
+			self._map = mmap.mmap(f.fileno(), 0, access = mmap.ACCESS_READ)
+
+		magic, self._count, self._names_off, self._records_off, self._strings_off = \
+				struct.unpack_from(self.HEADER, self._map, 0)
+		if magic != self.MAGIC:
+			raise ValueError("%s: not a spec index file" % path)
+
+		self._name_size = struct.calcsize(self.NAME)
+		self._record_size = struct.calcsize(self.RECORD)
+
+	def __len__(self):
+		return self._count
+
+	def _string(self, offset, length):
+		offset += self._strings_off
+		return self._map[offset:offset + length]
+
+	# Returns a list of (version, platform) tuples
+	def lookup(self, name):
+		import struct
+
+		key = name.encode('utf-8')
+
+		lo, hi = 0, self._count
+		while lo < hi:
+			mid = (lo + hi) // 2
+			name_off, name_len, first, count = struct.unpack_from(self.NAME, self._map,
+						self._names_off + mid * self._name_size)
+
+			found = self._string(name_off, name_len)
+			if found < key:
+				lo = mid + 1
+			elif found > key:
+				hi = mid
+			else:
+				result = []
+				for i in range(first, first + count):
+					v_off, v_len, p_off, p_len = struct.unpack_from(self.RECORD, self._map,
+								self._records_off + i * self._record_size)
+					result.append((self._string(v_off, v_len).decode('utf-8'),
+							self._string(p_off, p_len).decode('utf-8')))
+				return result
+
+		return []
+
+	# entries is an iterable of (name, version, platform) strings
+	@classmethod
+	def write(klass, f, entries):
+		import struct
+
+		strings = bytearray()
+		string_offsets = dict()
+
+		def add_string(s):
+			s = s.encode('utf-8')
+			offset = string_offsets.get(s)
+			if offset is None:
+				offset = len(strings)
+				strings.extend(s)
+				string_offsets[s] = offset
+			return offset, len(s)
+
+		by_name = dict()
+		for name, version, platform in entries:
+			by_name.setdefault(name.encode('utf-8'), []).append((version, platform))
+
+		name_table = bytearray()
+		record_table = bytearray()
+		nrecords = 0
+		for key in sorted(by_name.keys()):
+			records = by_name[key]
+
+			name_off, name_len = add_string(key.decode('utf-8'))
+			name_table += struct.pack(klass.NAME, name_off, name_len, nrecords, len(records))
+
+			for version, platform in records:
+				record_table += struct.pack(klass.RECORD, *add_string(version), *add_string(platform))
+			nrecords += len(records)
+
+		klass._write_tables(f, len(by_name), name_table, record_table, strings)
+
+	# Same as write(), but from the columns returned by
+	# unmarshal_specs(..., index = True). Versions are not deduplicated;
+	# in exchange, we never create any python objects per entry.
+	@classmethod
+	def write_columns(klass, f, specs):
+		import struct
+
+		offsets = memoryview(specs['version_offsets']).cast('I')
+		platform_ids = memoryview(specs['platform_ids']).cast('I')
+
+		# The version strings go into the string table as they are,
+		# and everything else is appended
+		strings = bytearray(specs['versions'])
+
+		def add_string(s):
+			s = s.encode('utf-8')
+			offset = len(strings)
+			strings.extend(s)
+			return offset, len(s)
+
+		platforms = [add_string(platform) for platform in specs['platforms']]
+
+		index = specs['index']
+		name_table = bytearray()
+		record_table = bytearray()
+		nrecords = 0
+		for name in sorted(index.keys(), key = lambda name: name.encode('utf-8')):
+			ranges = index[name]
+			count = sum(n for first, n in ranges)
+
+			name_table += struct.pack(klass.NAME, *add_string(name), nrecords, count)
+
+			for first, n in ranges:
+				for i in range(first, first + n):
+					v_off = offsets[i - 1] if i else 0
+					record_table += struct.pack(klass.RECORD, v_off, offsets[i] - v_off - 1,
+								*platforms[platform_ids[i]])
+			nrecords += count
+
+		klass._write_tables(f, len(index), name_table, record_table, strings)
+
+	@classmethod
+	def _write_tables(klass, f, count, name_table, record_table, strings):
+		import struct
+
+		names_off = struct.calcsize(klass.HEADER)
+		records_off = names_off + len(name_table)
+		strings_off = records_off + len(record_table)
+
+		f.write(struct.pack(klass.HEADER, klass.MAGIC, count, names_off, records_off, strings_off))
+		f.write(name_table)
+		f.write(record_table)
+		f.write(strings)
+
 class RubySpecIndex(core.HTTPPackageIndex):
 	def __init__(self, url):
 		super(RubySpecIndex, self).__init__(url)
@@ -426,6 +599,7 @@ class RubySpecIndex(core.HTTPPackageIndex):
 		# formats, but the gemspec is only provided as zlib compressed file
 		self._pkg_url_template = "{index_url}/quick/Marshal.4.8/{pkg_name}-{pkg_version}.gemspec.rz"
 
+		self.index_cache = core.IndexCache()
 		self.zap_cache()
 
 	def zap_cache(self):
@@ -440,33 +614,18 @@ class RubySpecIndex(core.HTTPPackageIndex):
 		return pi
 
 	def locate_gem(self, name, latest_only = False, verbose = True):
-		# latest_specs.4.8 and specs.4.8 contain an array of info tuples.
-		# Each tuple represents the (latest known) version of a gem, and consists of 3 elements:
-		#  [name, Gem::Version(...), platform]
-		# platform is usually "ruby", but can also be "java-something"
 		if latest_only:
-			gem_list = self._latest_specs()
+			spec_index = self._latest_specs()
 		else:
-			gem_list = self._specs()
+			spec_index = self._specs()
 
 		if verbose:
 			print("Locating %s in %s" % (name, self.url))
 
 		pi = RubyPackageInfo(name)
-		for gem in gem_list:
-			if gem[0] == name:
-				version_list = gem[1]
-				# weird. rubygems.org always gives us an array of versions,
-				# but nexus seems to give us a single version object
-				if isinstance(version_list, minibuild.ruby_utils.Ruby.GemVersion):
-					version = str(version_list)
-				else:
-					version = version_list[0]
-
-				platform = gem[2]
-
-				release = RubyReleaseInfo(name, version, platform)
-				pi.add_release(release)
+		for version, platform in spec_index.lookup(name):
+			release = RubyReleaseInfo(name, version, platform)
+			pi.add_release(release)
 
 		if not pi.releases:
 			raise ValueError("Gem \"%s\" not found in index" % name)
@@ -475,30 +634,36 @@ class RubySpecIndex(core.HTTPPackageIndex):
 
 	def _latest_specs(self):
 		if self._cached_latest_specs is None:
-			self._cached_latest_specs = self._download_and_parse_specs("latest_specs.4.8.gz")
+			self._cached_latest_specs = self._load_specs("latest_specs.4.8.gz")
 		return self._cached_latest_specs
 
 	def _specs(self):
 		if self._cached_specs is None:
-			self._cached_specs = self._download_and_parse_specs("specs.4.8.gz")
+			self._cached_specs = self._load_specs("specs.4.8.gz")
 		return self._cached_specs
 
-	def _download_and_parse_specs(self, filename):
-		import urllib.request
-
+	# Returns a RubySpecIndexFile, which is converted from the upstream index
+	# only if that has changed since we last looked at it.
+	#
+	# latest_specs.4.8 and specs.4.8 contain an array of info tuples.
+	# Each tuple represents the (latest known) version of a gem, and consists of 3 elements:
+	#  [name, Gem::Version(...), platform]
+	# platform is usually "ruby", but can also be "java-something".
+	# rubygems.org wraps the version in an array, nexus does not; marshal48
+	# deals with both, and hands us plain columns of strings.
+	def _load_specs(self, filename):
 		url = os.path.join(self.url, filename)
 
-		print("Downloading index at %s" % url)
-		resp = urllib.request.urlopen(url)
-		if resp.status != 200:
-			raise ValueError("Unable to download index %s: HTTP response %s (%s)" % (
-					filename, resp.status, resp.reason))
+		def convert(resp, f):
+			from minibuild.ruby_utils import unmarshal_specs
 
-		from minibuild.ruby_utils import unmarshal
+			RubySpecIndexFile.write_columns(f, unmarshal_specs(filename, resp, index = True))
 
-		# This is fairly slow... need to speed this up!
-		return unmarshal(filename, resp)
+		with core.profiler.phase("specs.load"):
+			return RubySpecIndexFile(self.index_cache.get(url, convert))
 
+	# Gemspecs are fetched one at a time, as the resolver asks for them.
+	# Fetching a batch up front would mostly get releases nobody looks at.
 	def get_gemspec(self, release, verbose = False):
 		import urllib.request
 
@@ -522,8 +687,9 @@ class RubySpecIndex(core.HTTPPackageIndex):
 	def process_gemspec_response(self, resp, release):
 		from minibuild.ruby_utils import unmarshal
 
-		gemspec = unmarshal(resp.url, resp)
+		self.process_gemspec(unmarshal(resp.url, resp), release)
 
+	def process_gemspec(self, gemspec, release):
 		release.add_build(self.gemspec_to_binary(gemspec))
 
 		build = self.gemspec_to_source(gemspec)
@@ -624,6 +790,244 @@ class RubySpecIndex(core.HTTPPackageIndex):
 			print("URI %s does not exist" % url)
 			return False
 
+# The compact index protocol, as served by rubygems.org:
+#
+#   /versions		one line per gem: "name version,version,... md5"
+#			where md5 is the digest of the gem's info file. The
+#			file is append-only; a gem may show up on several lines.
+#   /info/<name>	one line per release:
+#			"version[-platform] dep:req&req,... |checksum:sha256,ruby:req"
+#
+# Both are kept in a local cache, and updated with a Range request for
+# whatever was appended since we last looked (plus If-None-Match, so that
+# an unchanged file costs us a 304). An info file is fetched only for the
+# gems we are asked about, and not at all if its digest in /versions
+# matches our copy.
+#
+# Mirrors that do not serve /versions (such as nexus) are handled by
+# falling back to the specs.4.8 dumps of RubySpecIndex, unless fallback
+# was disabled. The gemspecs themselves are always taken from the
+# Marshal.4.8 quick index.
+class RubyCompactIndex(RubySpecIndex):
+	def __init__(self, url, fallback = True):
+		import hashlib
+
+		self.fallback = fallback
+		self._compact = None
+
+		super(RubyCompactIndex, self).__init__(url)
+
+		path = os.environ.get("XDG_CACHE_HOME") or os.path.expanduser("~/.cache")
+		key = hashlib.sha256(url.encode('utf-8')).hexdigest()[:32]
+		self.cache_dir = os.path.join(path, "minibuild", "compact", key)
+
+	def zap_cache(self):
+		super(RubyCompactIndex, self).zap_cache()
+
+		self._info_digests = None
+		self._package_info = dict()
+
+	def get_package_info(self, name):
+		if not self._use_compact():
+			return super(RubyCompactIndex, self).get_package_info(name)
+
+		pi = self._package_info.get(name)
+		if pi is None:
+			pi = self._load_info(name)
+			self._package_info[name] = pi
+		return pi
+
+	def locate_gem(self, name, latest_only = False, verbose = True):
+		if latest_only or not self._use_compact():
+			return super(RubyCompactIndex, self).locate_gem(name, latest_only, verbose)
+
+		if verbose:
+			print("Locating %s in %s" % (name, self.url))
+		return self.get_package_info(name)
+
+	def process_gemspec(self, gemspec, release):
+		super(RubyCompactIndex, self).process_gemspec(gemspec, release)
+
+		# The info file tells us what the gem should hash to; the
+		# downloader checks it for us.
+		if release.checksum:
+			for build in release.builds:
+				if build.type == 'gem':
+					build.add_hash('sha256', release.checksum)
+
+	def _use_compact(self):
+		from urllib.error import URLError
+
+		if self._compact is None:
+			try:
+				self._info_digests = self._load_versions()
+				self._compact = True
+			except (URLError, ValueError) as e:
+				if not self.fallback:
+					raise
+				print("%s: no compact index (%s), using specs.4.8" % (self.url, e))
+				self._compact = False
+		elif self._compact and self._info_digests is None:
+			# The index was zapped after we published something
+			self._info_digests = self._load_versions()
+
+		return self._compact
+
+	def _load_versions(self):
+		digests = dict()
+		with open(self._update("versions"), "r") as f:
+			for line in self._body_lines(f):
+				name, rest = line.split(' ', 1)
+
+				# Later lines win
+				digests[name] = rest.rsplit(' ', 1)[-1]
+		return digests
+
+	def _load_info(self, name):
+		digest = self._info_digests.get(name)
+		if digest is None:
+			raise ValueError("Gem \"%s\" not found in index" % name)
+
+		pi = RubyPackageInfo(name)
+		with open(self._update("info/" + name, digest), "r") as f:
+			for line in self._body_lines(f):
+				version, rest = line.split(' ', 1)
+
+				platform = 'ruby'
+				if '-' in version:
+					version, platform = version.split('-', 1)
+
+				release = RubyReleaseInfo(name, version, platform)
+
+				_, attrs = rest.split('|', 1)
+				for attr in attrs.split(','):
+					key, _, value = attr.partition(':')
+					if key == 'checksum':
+						release.checksum = value
+
+				pi.add_release(release)
+
+		if not pi.releases:
+			raise ValueError("Gem \"%s\" not found in index" % name)
+
+		return pi
+
+	# Older files start with a "created_at" header, terminated by "---".
+	# The ones written by RubyPublisher do not have one.
+	@staticmethod
+	def _body_lines(f):
+		lines = [line.rstrip('\n') for line in f]
+		if '---' in lines:
+			lines = lines[lines.index('---') + 1:]
+		return [line for line in lines if line]
+
+	@staticmethod
+	def _md5(data):
+		import hashlib
+
+		return hashlib.md5(data).hexdigest()
+
+	# Check a complete file against what the server says it should be.
+	# rubygems.org sends a Repr-Digest (or the older Digest) header, and
+	# uses the MD5 of the file as ETag. Returns False if we cannot tell.
+	@classmethod
+	def _verify_full(klass, data, headers):
+		import hashlib
+		import base64
+		import binascii
+		import re
+
+		for header, pattern in (('Repr-Digest', r'sha-256=:([^:]*):'), ('Digest', r'sha-256=([^,\s]*)')):
+			m = re.search(pattern, headers.get(header) or "", re.IGNORECASE)
+			if m:
+				try:
+					return base64.b64decode(m.group(1)) == hashlib.sha256(data).digest()
+				except binascii.Error:
+					return False
+
+		etag = (headers.get('ETag') or "").strip()
+		if re.fullmatch(r'"[0-9a-f]{32}"', etag):
+			return etag.strip('"') == klass._md5(data)
+
+		return False
+
+	# Bring our copy of an index file up to date, and return its path.
+	# If we know the digest the file should have, and our copy has it
+	# already, we do not even ask.
+	def _update(self, name, digest = None, incremental = True):
+		import tempfile
+		import urllib.request
+		from urllib.error import HTTPError
+
+		path = os.path.join(self.cache_dir, name)
+		etag_path = path + ".etag"
+
+		data = None
+		if incremental and os.path.isfile(path):
+			with open(path, "rb") as f:
+				data = f.read()
+
+			if digest and self._md5(data) == digest:
+				return path
+
+		url = "%s/%s" % (self.url.rstrip('/'), name)
+		req = urllib.request.Request(url)
+		if data:
+			if os.path.isfile(etag_path):
+				with open(etag_path) as f:
+					req.add_header('If-None-Match', f.read().strip())
+
+			# Ask for one byte we have already, so that we can tell
+			# whether the file was rewritten rather than appended to
+			req.add_header('Range', 'bytes=%d-' % (len(data) - 1))
+
+		try:
+			with core.profiler.phase("compact.fetch"):
+				resp = urllib.request.urlopen(req)
+				body = resp.read()
+		except HTTPError as e:
+			if data is not None and e.code == 304:
+				return path
+			if data is not None and e.code == 416:
+				return self._update(name, digest, incremental = False)
+			raise ValueError("Unable to get %s: HTTP response %s (%s)" % (url, e.code, e.reason))
+		if resp.status == 206:
+			if body[:1] != data[-1:]:
+				return self._update(name, digest, incremental = False)
+			body = data + body[1:]
+
+			# Without a digest from the caller, the byte above is all we
+			# have checked so far; /versions is fetched like that.
+			if not digest and not self._verify_full(body, resp.headers):
+				print("Unable to verify update of %s, downloading it again" % url)
+				return self._update(name, digest, incremental = False)
+			print("Updated %s (%d new bytes)" % (url, len(body) - len(data)))
+		elif resp.status == 200:
+			print("Downloaded %s (%d bytes)" % (url, len(body)))
+		else:
+			raise ValueError("Unable to get %s: HTTP response %s (%s)" % (url, resp.status, resp.reason))
+
+		if digest and self._md5(body) != digest:
+			if data is not None:
+				return self._update(name, digest, incremental = False)
+			print("Warning: %s does not match its digest in %s/versions" % (url, self.url))
+
+		# Write to a temp file and rename, so that concurrent runs
+		# never see a partially written file
+		os.makedirs(os.path.dirname(path), exist_ok = True)
+		with tempfile.NamedTemporaryFile(dir = os.path.dirname(path), delete = False) as f:
+			f.write(body)
+		os.replace(f.name, path)
+
+		etag = resp.headers.get('ETag')
+		if etag:
+			with open(etag_path, "w") as f:
+				f.write(etag)
+		elif os.path.exists(etag_path):
+			os.remove(etag_path)
+
+		return path
+
 # Upload package using "gem nexus"
 # You need to have the nexus gem installed for this
 class RubyUploader(core.Uploader):
@@ -792,6 +1196,9 @@ class NestedRubyBuildStrategy(RubyBuildStrategy):
 	def implicit_build_dependencies(self, build_directory):
 		return self.inner_job.implicit_build_dependencies(build_directory)
 
+	def cache_inputs(self):
+		return self.inner_job.cache_inputs()
+
 	def resolve_source(self, source):
 		super(NestedRubyBuildStrategy, self).resolve_source(source)
 		self.inner_job.resolve_source(source)
@@ -1389,7 +1796,8 @@ class RubyPublisher(core.Publisher):
 			for version in sorted(pd.keys(), key = minibuild.ruby_utils.Ruby.ParsedVersion):
 				build = pd[version]
 
-				info_line = "%s |" % build.version
+				# Includes the platform, if it's not ruby
+				info_line = "%s |" % version
 
 				info_line += "checksum:" + self.hash_file(info_hash_algo, build.local_path)
 
@@ -1401,7 +1809,7 @@ class RubyPublisher(core.Publisher):
 
 				info.append(info_line)
 
-				versions.append(build.version)
+				versions.append(version)
 
 			info_file = os.path.join(info_path, name)
 			with open(info_file, "w") as f:
@@ -1447,7 +1855,15 @@ class RubyEngine(core.Engine):
 		super(RubyEngine, self).__init__(engine_config)
 
 	def create_index_from_repo(self, repo_config):
-		return RubySpecIndex(repo_config.url)
+		repotype = repo_config.repotype or "auto"
+		if repotype == 'auto':
+			return RubyCompactIndex(repo_config.url)
+		elif repotype == 'compact':
+			return RubyCompactIndex(repo_config.url, fallback = False)
+		elif repotype == 'specs':
+			return RubySpecIndex(repo_config.url)
+		else:
+			raise ValueError("Don't know how to create a %s index for url %s" % (repo_config.repotype, repo_config.url))
 
 	def create_uploader_from_repo(self, repo_config):
 		return RubyUploader(repo_config.url, user = repo_config.user, password = repo_config.password)
@@ -1461,6 +1877,57 @@ class RubyEngine(core.Engine):
 	def create_source_download_finder(self, req, verbose = False):
 		return RubySourceDownloadFinder(req, verbose)
 
+	# Resolve the requirements and their runtime dependencies in a single
+	# call to marshal48.Resolver. The dependencies of each release come
+	# from its gemspec, which we fetch from the index only for the releases
+	# the resolver actually looks at.
+	def resolve_build_closure(self, requirements):
+		index = self.default_index
+		builds = dict()
+
+		def candidates(name):
+			try:
+				info = index.get_package_info(name)
+			except ValueError:
+				return None
+
+			# Like RubyBuildRequirement, always require pure ruby
+			return [(release.parsed_version, release) for release in info.releases
+					if release.platform == 'ruby']
+
+		def dependencies(release):
+			finder = self.create_binary_download_finder(release.name)
+			try:
+				build = finder.match_release(index, release)
+			except:
+				build = None
+			if build is None:
+				return None
+
+			requires = build.get_install_requirements()
+			builds[release] = (build, requires)
+			return [self.resolver_requirement(req) for req in requires]
+
+		resolver = minibuild.marshal48.Resolver(candidates, dependencies)
+		resolved, missing = resolver.resolve([self.resolver_requirement(req) for req in requirements])
+
+		found = []
+		for release in resolved:
+			build, transitive = builds[release]
+			if transitive:
+				print("  %s resolved to %s, which requires %s" % (release.name, build.id(),
+							"|".join([req.format() for req in transitive])))
+			else:
+				print("  %s resolved to %s" % (release.name, build.id()))
+			found.append(build)
+
+		return found, missing
+
+	@staticmethod
+	def resolver_requirement(req):
+		native = req.cooked_requirement.requirement.native()
+		return (req.name, native, req.allow_prereleases(), req)
+
 	# Used by the build-requires parsing
 	def create_empty_requirement(self, name):
 		return RubyBuildRequirement(name)
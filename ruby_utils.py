@@ -2,162 +2,28 @@
 
 import minibuild.marshal48
 import io
-import copy
 
 class Ruby:
-	class ParsedVersion(object):
-		def __init__(self, s):
-			self._version = []
-			self.is_prerelease = False
-			self.platform = None
-
-			if type(s) == list or type(s) == tuple:
-				self._version = s
-				return
-
-			if type(s) != str:
-				raise ValueError("Cannot build ParsedVersion from %s object (%s)" % (
-						type(s), s))
-
-			# If the version includes a platform like "1.2.3-java" or "4.5.6-x86_64-linux", split
-			# it off and record it in self.platform
-			if "-" in s:
-				(s, self.platform) = s.split('-', 1)
-
-			word = None
-			isnumber = False
-			for cc in s:
-				if cc == '.':
-					if word is not None:
-						self._version.append(word)
-					self._version.append('.')
-					word = None
-					continue
-
-				if word is not None:
-					if isnumber == cc.isdigit():
-						word += cc;
-						continue
-
-					self._version.append(word)
-
-				isnumber = cc.isdigit()
-				word = cc
-
-			if word is not None:
-				self._version.append(word)
-
-			for i in range(len(self._version)):
-				try:
-					self._version[i] = int(self._version[i])
-				except:
-					pass
-
-			assert(self._version[-1] != '.')
-
-		def next_bigger(self):
-			# This is here to support ~> comparison.
-			# ~> 3.0.3 means ">= 3.0.3, <3.1"
-			# ~> 2 means '>= 2.0, < 3.0'
-			next_version = self._next_bigger()
-			# print("next_bigger(%s) => %s" % (self._version, next_version))
-			return Ruby.ParsedVersion(next_version)
-
-		def _next_bigger(self):
-			version = copy.copy(self._version)
-
-			if len(version) == 1:
-				return [version[0] + 1]
-
-			while version[-1] != '.':
-				version.pop()
-
-			while version:
-				last = version.pop()
-				if last == '.':
-					break
-
-			last = version.pop()
-			if type(last) != int:
-				last = version.pop()
-
-			version.append(last + 1)
-			return version
-
-		def __repr__(self):
-			result = "".join([str(x) for x in self._version])
-			if self.platform:
-				result += "-" + self.platform
-			return result
-
-		def __lt__(self, other):
-			return self.compare(other, lambda s, o: s < o)
-
-		def __gt__(self, other):
-			return self.compare(other, lambda s, o: s > o)
-
-		def __le__(self, other):
-			return self.compare(other, lambda s, o: s <= o)
+	# Version parsing and comparison are implemented in marshal48; see
+	# marshal48/version.c. Comparing two versions, and matching a version
+	# against a requirement, never leaves C.
+	ParsedVersion = minibuild.marshal48.Version
 
-		def __ge__(self, other):
-			return self.compare(other, lambda s, o: s >= o)
-
-		def __eq__(self, other):
-			if not isinstance(other, self.__class__):
-				return False
-
-			return self.compare(other, lambda s, o: s == o)
-
-		def __ne__(self, other):
-			if not isinstance(other, self.__class__):
-				return True
-
-			return self.compare(other, lambda s, o: s != o)
-
-		def compare(self, other, f):
-			for a, b in zip(self._version, other._version):
-				if a == b:
-					continue
-				return f(a, b)
-
-			return f(len(self._version), len(other._version))
-
-	class GemVersion(object):
+	class GemVersion(minibuild.marshal48.Version):
 		# Needed for marshaling
 		ruby_classname = 'Gem::Version'
 
+		# When loading marshal data, marshal48 creates these objects
+		# without calling __init__, and sets the version string directly
 		def __init__(self, yaml_data = None):
-			self.versions = []
-
 			if yaml_data:
-				self.versions.append(yaml_data['version'])
+				super().__init__(yaml_data['version'])
+			else:
+				super().__init__()
 
 		@property
-		def version(self):
-			return self.versions[0]
-
-		def marshal_load(self, array):
-			# print("GemVersion.marshal_load(%s)" % array)
-			assert(len(array) == 1)
-
-			for o in array:
-				self.versions.append(str(o))
-
-		def __str__(self):
-			if len(self.versions) == 1:
-				return str(self.versions[0])
-			return "[%s]" % ", ".join(self.versions)
-
-		def __repr__(self):
-			if len(self.versions) == 1:
-				return self.versions[0]
-			return "[%s]" % ", ".join(self.versions)
-
-		def __eq__(self, other):
-			if not isinstance(other, self.__class__):
-				return False
-
-			return self.versions == other.versions
+		def versions(self):
+			return [self.version]
 
 	class Clause:
 		def __init__(self, op, version):
@@ -167,6 +33,7 @@ class Ruby:
 
 			self.op = op
 			self.version = Ruby.ParsedVersion(str(version))
+			self._native = None
 
 		def __repr__(self):
 			return "%s %s" % (self.op, self.version)
@@ -175,23 +42,9 @@ class Ruby:
 			return self.contains(item)
 
 		def contains(self, item):
-			op = self.op
-			if op == '==' or op == '=':
-				return item == self.version
-			if op == '!=':
-				return item != self.version
-			if op == '>=':
-				return item >= self.version
-			if op == '<=':
-				return item <= self.version
-			if op == '>':
-				return item > self.version
-			if op == '<':
-				return item < self.version
-			if op == '~>':
-				return item >= self.version and item < self.version.next_bigger()
-
-			raise ValueError("Unknown version comparison operator \"%s\"" % self.op)
+			if self._native is None:
+				self._native = minibuild.marshal48.Requirement([self])
+			return item in self._native
 
 		def __eq__(self, other):
 			if not isinstance(other, self.__class__):
@@ -202,6 +55,11 @@ class Ruby:
 		# Needed for marshaling
 		ruby_classname = 'Gem::Requirement'
 
+		# Compiled marshal48.Requirement, and the clauses it was built from.
+		# merge() adds to self.req directly, so we check before using it.
+		_native = None
+		_native_key = None
+
 		def __init__(self, yaml_data = None):
 			self.req = []
 
@@ -252,11 +110,19 @@ class Ruby:
 		def __contains__(self, item):
 			return self.contains(item)
 
+		def native(self):
+			key = tuple(self.req)
+			if self._native is None or key != self._native_key:
+				self._native = minibuild.marshal48.Requirement(key)
+				self._native_key = key
+			return self._native
+
 		def contains(self, item):
-			if not isinstance(item, Ruby.ParsedVersion):
-				item = Ruby.ParsedVersion(item)
+			return item in self.native()
 
-			return all(s.contains(item) for s in self.req)
+		# Return the items whose version matches, in one call
+		def filter(self, items, key = None):
+			return self.native().filter(items, key)
 
 		def __iter__(self):
 			return iter(self.req)
@@ -834,140 +700,80 @@ class Ruby:
 			return ret.finalize()
 
 
+	# Gemfile.lock is parsed by bundler.Lockfile (see bundler/lockfile.c).
+	# Specs come back as (name, version, dependencies) tuples, and
+	# dependencies as (name, requirement) pairs.
 	class GemfileLock:
-		class Node:
-			def __init__(self, name = None, value = None):
-				self.name = name
-				self.value = value or ""
-				self.children = []
-
-			def find(self, name):
-				for node in self.children:
-					if node.name == name:
-						return node
-				return None
-
-			def dump(self, indent = ""):
-				print("%s%s %s" % (indent, self.name, self.value))
-				for node in self.children:
-					node.dump(indent + "  ")
-
-		def __init__(self, topNode):
-			self.node = topNode
+		def __init__(self, lockfile):
+			self.lockfile = lockfile
 
 		def dump(self):
-			return self.node.dump()
+			def show(indent, name, version):
+				if version is None:
+					print("%s%s" % (indent, name))
+				else:
+					print("%s%s (%s)" % (indent, name, version))
+
+			lock = self.lockfile
+			for section in lock.sections():
+				print(section)
+				for name, version, deps in lock.specs(section):
+					show("    ", name, version)
+					for dep in deps:
+						show("      ", *dep)
+				for entry in lock.entries(section):
+					show("  ", *entry)
 
 		@staticmethod
 		def parse(fsResource):
-			import re
+			import minibuild.bundler
 
-			top = Ruby.GemfileLock.Node()
-
-			current = top
-			prev = None
-			indent = ""
-			stack = []
-			with fsResource.open('r') as f:
-				for l in f.readlines():
-					while not l.startswith(indent):
-						(current, indent) = stack.pop()
-
-					l = l[len(indent):].rstrip()
-
-					# If indentation level increases, we're starting
-					# a nested group
-					if l.startswith(' '):
-						assert(prev)
-						stack.append((current, indent))
-						current = prev
-
-						# clumsy
-						while l.startswith(' '):
-							indent += ' '
-							l = l[1:]
-
-					# parse identifier
-					m = re.search('([^ :]*)[ :]*(.*)', l)
-					if not m:
-						raise ValueError(l)
-
-					id = m.group(1)
-					rest = m.group(2)
-					node = Ruby.GemfileLock.Node(id, rest)
-					current.children.append(node)
-					prev = node
-
-			return Ruby.GemfileLock(top)
-
-		def lookup(self, name):
-			node = self.node
-			for n in name.split('.'):
-				if node is None:
-					break
-				node = node.find(n)
-
-			return node
+			return Ruby.GemfileLock(minibuild.bundler.Lockfile(fsResource.hostpath()))
 
 		def requirements(self):
 			result = []
 
-			specs = self.lookup("GEM.specs")
-			if specs:
-				for child in specs.children:
-					result += self._requirements(child)
-
-			return result
-
-		def _requirements(self, node):
-			result = []
-
-			# A Gemlock GEM entry can take several forms
-			#  name!
-			#	Used to refer to the gem being built
-			#  name
-			#	No version info
-			#  name (>= 1.2.4)
-			#	Requirement in parentheses
-			#  name (1.2.4)
-			#	Exact version number in parentheses
-			if not node.name.endswith('!'):
-				req_name = node.name
-				req_version = node.value.strip("()")
-
-				if not req_version:
-					req_string = req_name
-				elif not req_version[0].isdigit():
-					req_string = "%s %s" % (req_name, req_version)
-				else:
-					req_string = "%s == %s" % (req_name, req_version)
-				req = Ruby.GemDependency.parse(req_string)
-				result.append(req)
-
-			for child in node.children:
-				result += self._requirements(child)
+			for name, version, deps in self.lockfile.specs("GEM"):
+				result.append(self._requirement(name, version))
+				for dep_name, dep_req in deps:
+					result.append(self._requirement(dep_name, dep_req))
+
+			return [req for req in result if req is not None]
+
+		# A Gemlock GEM entry can take several forms
+		#  name!
+		#	Used to refer to the gem being built
+		#  name
+		#	No version info
+		#  name (>= 1.2.4)
+		#	Requirement in parentheses
+		#  name (1.2.4)
+		#	Exact version number in parentheses
+		def _requirement(self, name, version):
+			if name.endswith('!'):
+				return None
 
-			return result
+			if not version:
+				req_string = name
+			elif not version[0].isdigit():
+				req_string = "%s %s" % (name, version)
+			else:
+				req_string = "%s == %s" % (name, version)
+			return Ruby.GemDependency.parse(req_string)
 
 		def build_targets(self):
 			result = []
 
-			specs = self.lookup("PATH.specs")
+			specs = self.lockfile.specs("PATH")
 			if specs:
 				print("  Build target(s):")
-				for node in specs.children:
-					print("    %s %s" % (node.name, node.value))
+				for name, version, deps in specs:
+					print("    %s (%s)" % (name, version))
 
 			return result
 
 		def bundler_version(self):
-			node = self.lookup('BUNDLED WITH')
-			if node is None:
-				node = self.lookup('BUNDLED')
-			if node is None or not node.children:
-				return None
-			node = node.children[0]
-			return node.name
+			return self.lockfile.bundler_version
 
 	# Process the output of "gem list", which contains lines like these:
 	#	equalizer (0.0.11)
@@ -1096,11 +902,15 @@ class Ruby:
 			return result
 
 class DecompressNone:
+	compression = None
+
 	@staticmethod
 	def open(fileobj):
 		return fileobj
 
 class DecompressGzip:
+	compression = "gzip"
+
 	@staticmethod
 	def open(fileobj):
 		import gzip
@@ -1108,6 +918,8 @@ class DecompressGzip:
 		return gzip.GzipFile(fileobj = fileobj, mode = 'rb')
 
 class DecompressZlib:
+	compression = "zlib"
+
 	@staticmethod
 	def open(fileobj):
 		import zlib
@@ -1123,15 +935,48 @@ def guess_compression(url_or_path):
 		return DecompressZlib
 	return DecompressNone
 
+# marshal48 inflates .gz and .rz data itself, reading the compressed
+# data straight from f
 def unmarshal(url_or_path, f = None, quiet = True):
-	decompressor = guess_compression(url_or_path)
+	compression = guess_compression(url_or_path).compression
 	if f is None:
 		f = open(url_or_path, mode = 'rb')
-	f = decompressor.open(f)
 
-	return minibuild.marshal48.unmarshal(f, Ruby.factory, quiet)
+	return minibuild.marshal48.unmarshal(f, Ruby.factory, quiet, constructors = Ruby.classes, direct = True,
+			compression = compression)
 
-def unmarshal_byteseq(data, quiet = True):
+# Yield the elements of a marshaled top-level array one at a time,
+# without building the whole object graph first.
+def iter_unmarshal(url_or_path, f = None, quiet = True):
+	compression = guess_compression(url_or_path).compression
+	if f is None:
+		f = open(url_or_path, mode = 'rb')
 
-	f = io.BytesIO(data)
-	return minibuild.marshal48.unmarshal(f, Ruby.factory, quiet)
+	return minibuild.marshal48.iter_unmarshal(f, Ruby.factory, quiet, constructors = Ruby.classes,
+			compression = compression)
+
+# Decode a specs.4.8 style index into flat columns rather than a list of
+# [name, GemVersion, platform] entries. See marshal48/specs.c for the
+# layout of the result.
+def unmarshal_specs(url_or_path, f = None, index = False, quiet = True):
+	compression = guess_compression(url_or_path).compression
+	if f is None:
+		f = open(url_or_path, mode = 'rb')
+
+	return minibuild.marshal48.unmarshal_specs(f, index, quiet, compression = compression)
+
+def iter_unmarshal_byteseq(data, quiet = True):
+	return minibuild.marshal48.iter_unmarshal(data, Ruby.factory, quiet, constructors = Ruby.classes)
+
+# Decode a list of buffers (such as the contents of several
+# quick/Marshal.4.8/*.gemspec.rz files) in one go. marshal48 inflates and
+# parses them on a pool of worker threads, and returns the list of results.
+# All buffers must use the same compression.
+def unmarshal_many(buffers, compression = None, threads = 0, quiet = True):
+	return minibuild.marshal48.unmarshal_many(buffers, Ruby.factory, quiet, constructors = Ruby.classes,
+			threads = threads, compression = compression)
+
+def unmarshal_byteseq(data, quiet = True):
+	# marshal48 parses bytes/bytearray objects in place, no need
+	# to wrap them in a BytesIO
+	return minibuild.marshal48.unmarshal(data, Ruby.factory, quiet, constructors = Ruby.classes, direct = True)
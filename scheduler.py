@@ -0,0 +1,259 @@
+#
+# Run several builds at once, in dependency order
+#
+#   Copyright (C) 2020 Olaf Kirch <okir@suse.de>
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+#
+
+import os
+import sys
+import time
+import tempfile
+import minibuild.core as core
+
+# One version of one package to build. run(task, compute_backend) does the
+# actual work, and returns an exit code.
+class BuildTask(core.Object):
+	def __init__(self, source, spec, run):
+		self.source = source
+		self.spec = spec
+		self.run = run
+
+		self.depends = set()
+		self.exit_code = None
+
+		self.pid = None
+		self.log_path = None
+
+	def id(self):
+		return self.spec.id()
+
+	# The (engine, name) other builds use to require us
+	def provides(self):
+		engine = core.Engine.factory(self.spec.engine)
+		return (self.spec.engine, engine.create_empty_requirement(self.spec.package_name).name)
+
+	# The compute flavor the build will ask for
+	def flavor(self):
+		return core.Engine.factory(self.spec.engine).engine_config.name
+
+	def requires(self):
+		return [(req.engine, req.name) for req in self.spec.dependencies]
+
+	@property
+	def done(self):
+		return self.exit_code is not None
+
+# With jobs == 1, tasks are run one after the other, in the order they were
+# added, just like we always did.
+#
+# Otherwise, every build runs in a child process, with its own copy of the
+# compute backend. If the backend keeps a pool of workers, we take one out
+# of the pool for each child before we fork. A task is started only once
+# all the tasks it depends on are finished, and their results have been
+# committed. If any of them failed, the task is not started at all, and
+# counts as failed itself. The output of each child goes to a log file of
+# its own, so that the builds do not end up interleaved on the terminal.
+class BuildScheduler(core.Object):
+	# How often we look for builds that have finished, in seconds
+	POLL_INTERVAL = 0.2
+
+	def __init__(self, jobs, compute_factory):
+		self.jobs = max(jobs, 1)
+		self.compute_factory = compute_factory
+		self.tasks = []
+		self.logdir = None
+		self.compute_backend = None
+
+	def add(self, task):
+		self.tasks.append(task)
+
+	def run(self):
+		if self.jobs == 1:
+			self.run_serial()
+		else:
+			self.run_parallel()
+
+		return [task.exit_code for task in self.tasks]
+
+	def run_serial(self):
+		compute_backend = None
+		for task in self.tasks:
+			if compute_backend is None:
+				compute_backend = self.compute_factory()
+
+			core.profiler.build_started(task.id())
+			task.exit_code = task.run(task, compute_backend)
+			core.profiler.build_finished(task.id(), task.exit_code)
+
+	# Builds of the same package do not depend on each other; and we
+	# do not care about requirements that none of our tasks provide.
+	def build_graph(self):
+		providers = dict()
+		for task in self.tasks:
+			providers.setdefault(task.provides(), []).append(task)
+
+		for task in self.tasks:
+			for key in task.requires():
+				if key == task.provides():
+					continue
+
+				for other in providers.get(key, []):
+					task.depends.add(other)
+
+		for task in self.tasks:
+			if task.depends:
+				print("%s must wait for %s" % (task.id(), ", ".join(sorted(t.id() for t in task.depends))))
+
+	def next_ready(self, pending):
+		for task in pending:
+			if all(dep.done for dep in task.depends):
+				return task
+		return None
+
+	def run_parallel(self):
+		self.build_graph()
+
+		self.logdir = tempfile.mkdtemp(prefix = "minibuild-jobs-")
+		print("=== Running up to %d builds at a time; logs are in %s ===" % (self.jobs, self.logdir))
+
+		pending = list(self.tasks)
+		running = dict()
+
+		while pending or running:
+			while pending and len(running) < self.jobs:
+				task = self.next_ready(pending)
+				if task is None:
+					break
+
+				pending.remove(task)
+				if self.skip_if_dependency_failed(task):
+					continue
+
+				if self.start(task):
+					running[task.pid] = task
+
+			if not running:
+				if not pending:
+					break
+
+				# Nothing is ready, and nothing is running that could change
+				# this. The remaining tasks depend on each other.
+				task = pending.pop(0)
+				print("WARNING: dependency loop involving %s; building it anyway" % task.id())
+				if self.skip_if_dependency_failed(task):
+					continue
+
+				if self.start(task):
+					running[task.pid] = task
+				continue
+
+			task, status = self.wait_any(running)
+			if os.WIFEXITED(status):
+				task.exit_code = os.WEXITSTATUS(status)
+			else:
+				task.exit_code = 1
+
+			core.profiler.build_finished(task.id(), task.exit_code)
+			core.profiler.merge_events(self.profile_path(task))
+
+			if task.exit_code == 0:
+				print("=== Finished %s (log in %s) ===" % (task.id(), task.log_path))
+			else:
+				print("=== FAILED to build %s (exit code %d, log in %s) ===" % (task.id(), task.exit_code, task.log_path))
+
+	# There is no point in building against an artefact that is not there
+	def skip_if_dependency_failed(self, task):
+		failed = sorted(dep.id() for dep in task.depends if dep.done and dep.exit_code)
+		if not failed:
+			return False
+
+		task.exit_code = 1
+		print("=== NOT building %s, because %s failed ===" % (task.id(), ", ".join(failed)))
+		return True
+
+	# Wait for one of our builds to finish, and return it along with its
+	# wait status. We cannot use waitpid(-1): the compute backend may have
+	# children of its own in this process, like the podman run commands
+	# that start the containers of its pool.
+	def wait_any(self, running):
+		while True:
+			for pid in list(running):
+				done, status = os.waitpid(pid, os.WNOHANG)
+				if done:
+					return running.pop(pid), status
+
+			time.sleep(self.POLL_INTERVAL)
+
+	# Returns False if the build could not be started; it then counts as failed
+	def start(self, task):
+		task.log_path = os.path.join(self.logdir, "%s.log" % task.id().replace('/', '_'))
+
+		try:
+			if self.compute_backend is None:
+				self.compute_backend = self.compute_factory()
+			with core.profiler.phase("compute.reserve"):
+				worker = self.compute_backend.reserve(task.flavor())
+		except Exception as e:
+			task.exit_code = 1
+			print("=== FAILED to start build of %s: %s ===" % (task.id(), e))
+			return False
+
+		# Do not hand any buffered output to the child
+		sys.stdout.flush()
+		sys.stderr.flush()
+
+		pid = os.fork()
+		if pid == 0:
+			self.child(task, worker)
+
+		task.pid = pid
+		core.profiler.build_started(task.id(), pid)
+		print("=== Started build of %s (pid %d) ===" % (task.id(), pid))
+		return True
+
+	# Where the child leaves its --profile events for us
+	def profile_path(self, task):
+		return task.log_path + ".profile"
+
+	# Runs in the child process, and never returns
+	def child(self, task, worker):
+		exit_code = 1
+
+		core.profiler.forked(task.id())
+
+		try:
+			fd = os.open(task.log_path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+			os.dup2(fd, 1)
+			os.dup2(fd, 2)
+			os.close(fd)
+
+			# Builds run unattended; nobody could answer them anyway
+			fd = os.open(os.devnull, os.O_RDONLY)
+			os.dup2(fd, 0)
+			os.close(fd)
+
+			self.compute_backend.adopt(worker)
+			exit_code = task.run(task, self.compute_backend)
+			core.profiler.save_events(self.profile_path(task))
+		except BaseException:
+			import traceback
+
+			traceback.print_exc()
+		finally:
+			sys.stdout.flush()
+			sys.stderr.flush()
+			os._exit(exit_code)